@@ -0,0 +1,95 @@
+#include "alloc_track.h"
+#include <cstdlib>
+#include <new>
+
+std::atomic<bool> alloc_track_enabled(false);
+
+// counts of a tag
+struct _AllocCounters {
+    std::atomic<long long>  allocations {0};
+    std::atomic<long long>  frees {0};
+    std::atomic<long long>  bytes {0};
+    std::atomic<long long>  live {0};
+    std::atomic<long long>  peak {0};
+};
+
+_AllocCounters _alloc_counters[alloc_tag_count];
+
+// every block starts with a header (16 bytes, keeping the alignment of malloc) with its size
+// and its tag, or 0xff if it was allocated while not counting
+struct _AllocHeader {
+    size_t          size;
+    unsigned char   tag;
+};
+const size_t _alloc_header_size = 16;
+const unsigned char _alloc_uncounted = 0xff;
+
+inline void* _alloc(size_t size) {
+    auto header = (_AllocHeader*)malloc(size + _alloc_header_size);
+    if(not header) return nullptr;
+    header->size = size;
+    header->tag = _alloc_uncounted;
+    if(alloc_track_enabled.load(std::memory_order_relaxed)) {
+        auto tag = alloc_current_tag();
+        auto& counters = _alloc_counters[tag];
+        counters.allocations.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes.fetch_add(size, std::memory_order_relaxed);
+        auto live = counters.live.fetch_add(size, std::memory_order_relaxed) + (long long)size;
+        auto peak = counters.peak.load(std::memory_order_relaxed);
+        while(live > peak and not counters.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+        header->tag = tag;
+    }
+    return (char*)header + _alloc_header_size;
+}
+
+inline void _free(void* p) {
+    if(not p) return;
+    auto header = (_AllocHeader*)((char*)p - _alloc_header_size);
+    if(header->tag != _alloc_uncounted) {
+        auto& counters = _alloc_counters[header->tag];
+        counters.frees.fetch_add(1, std::memory_order_relaxed);
+        counters.live.fetch_sub(header->size, std::memory_order_relaxed);
+    }
+    free(header);
+}
+
+void* operator new(size_t size) {
+    auto p = _alloc(size);
+    if(not p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    auto p = _alloc(size);
+    if(not p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return _alloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return _alloc(size); }
+void operator delete(void* p) noexcept { _free(p); }
+void operator delete[](void* p) noexcept { _free(p); }
+void operator delete(void* p, size_t) noexcept { _free(p); }
+void operator delete[](void* p, size_t) noexcept { _free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { _free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { _free(p); }
+
+AllocStats alloc_stats(AllocTag tag) {
+    auto& counters = _alloc_counters[tag];
+    auto stats = AllocStats();
+    stats.allocations = counters.allocations.load();
+    stats.frees = counters.frees.load();
+    stats.bytes = counters.bytes.load();
+    stats.live = counters.live.load();
+    stats.peak = counters.peak.load();
+    return stats;
+}
+
+void alloc_reset() {
+    for(auto& counters : _alloc_counters) {
+        counters.allocations = 0;
+        counters.frees = 0;
+        counters.bytes = 0;
+        counters.peak = counters.live.load();
+    }
+}
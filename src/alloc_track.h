@@ -0,0 +1,48 @@
+#ifndef _ALLOC_TRACK_H_
+#define _ALLOC_TRACK_H_
+
+#include "common.h"
+
+// Allocation tracking: programs linking alloc_track.cpp replace the global operator new/delete
+// with versions that, while alloc_track_enabled, count the allocations, bytes and live bytes of
+// the tag of the calling thread. Code tags its allocations with an AllocScope (the innermost
+// wins); in programs without alloc_track.cpp the scopes only set a thread local.
+
+// subsystems allocations are charged to
+enum AllocTag : unsigned char { alloc_other = 0, alloc_diff, alloc_apply, alloc_serialize, alloc_history,
+                                alloc_net, alloc_load, alloc_tag_count };
+
+// name of a tag
+inline const char* alloc_tag_name(AllocTag tag) {
+    static const char* names[] = { "other", "diff", "apply", "serialize", "history", "net", "load" };
+    return (tag < alloc_tag_count) ? names[tag] : "unknown";
+}
+
+// tag of the allocations of the calling thread
+inline AllocTag& alloc_current_tag() { static thread_local AllocTag tag = alloc_other; return tag; }
+
+// charges the allocations of the calling thread to tag until destruction
+struct AllocScope {
+    AllocTag    previous;
+    AllocScope(AllocTag tag) : previous(alloc_current_tag()) { alloc_current_tag() = tag; }
+    ~AllocScope() { alloc_current_tag() = previous; }
+};
+
+// counts of a tag (frees and live bytes are of the allocations counted, whatever the tag when freed)
+struct AllocStats {
+    long long   allocations = 0;    // allocations
+    long long   frees = 0;          // frees
+    long long   bytes = 0;          // bytes allocated
+    long long   live = 0;           // bytes allocated and not freed yet
+    long long   peak = 0;           // highest live bytes since the last reset
+};
+
+extern std::atomic<bool> alloc_track_enabled;   // allocations are counted when true (false by default)
+
+// counts of tag (alloc_track.cpp only)
+AllocStats alloc_stats(AllocTag tag);
+
+// clears the counts of all tags, keeping the live bytes (the peaks restart from them)
+void alloc_reset();
+
+#endif
@@ -0,0 +1,446 @@
+#include "animation.h"
+#include "intersect.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+int skinning_grain = 64;
+int simulation_grain = 1024;
+
+frame3f animation_frame(FrameAnimation* animation, int time) {
+    auto& keytimes = animation->keytimes;
+    if(keytimes.empty()) return animation->rest_frame;
+    // key frame interval and interpolation parameter
+    auto k = upper_bound(keytimes.begin(), keytimes.end(), time) - keytimes.begin();
+    auto a = max((int)k - 1, 0), b = min((int)k, (int)keytimes.size() - 1);
+    auto t = (a == b) ? 0.0f : float(time - keytimes[a]) / float(keytimes[b] - keytimes[a]);
+    auto translation = animation->translation[a] * (1 - t) + animation->translation[b] * t;
+    auto rotation = animation->rotation[a] * (1 - t) + animation->rotation[b] * t;
+    auto m = translation_matrix(translation) * rotation_matrix(rotation.z, z3f) * rotation_matrix(rotation.y, y3f) * rotation_matrix(rotation.x, x3f);
+    return transform_frame(m, animation->rest_frame);
+}
+
+void bake_frame_animation(FrameAnimation* animation, int length) {
+    auto& frames = animation->_frames;
+    if(frames.size() != length) {
+        auto baked = (int)frames.size();
+        frames.resize(length);
+        if(length > baked) animation->mark_stale(baked, length);
+    }
+    for(auto time = max(animation->_stale_from, 0); time < min(animation->_stale_to, length); time ++)
+        frames[time] = animation_frame(animation, time);
+    animation->clear_stale();
+}
+
+// times baked for animation: the scene animation length, or up to the last key frame without one
+int _baked_length(Scene* scene, FrameAnimation* animation) {
+    if(scene->animation->length > 0) return scene->animation->length;
+    return animation->keytimes.empty() ? 1 : animation->keytimes.back() + 1;
+}
+
+void animate_frames(Scene* scene) {
+    auto animated = vector<pair<FrameAnimation*,frame3f*>>();
+    for(auto mesh : scene->meshes) if(mesh->animation) animated.push_back(make_pair(mesh->animation, &mesh->frame));
+    for(auto surface : scene->surfaces) if(surface->animation) animated.push_back(make_pair(surface->animation, &surface->frame));
+    parallel_for(animated.size(), [&](int i) {
+        auto animation = animated[i].first;
+        auto length = _baked_length(scene, animation);
+        if(animation->_frames.size() != length or animation->_stale_from < animation->_stale_to) bake_frame_animation(animation, length);
+    }, 1);
+    auto time = scene->animation->time;
+    for(auto& object : animated) {
+        auto& frames = object.first->_frames;
+        *object.second = frames[clamp(time, 0, (int)frames.size() - 1)];
+    }
+}
+
+// values of the vertices of a block, one per lane
+struct _lanes {
+#if defined(__AVX2__)
+    __m256          v;
+#elif defined(__ARM_NEON)
+    float32x4_t     lo, hi;
+#else
+    float           v[skinning_block_size];
+#endif
+};
+
+#if defined(__AVX2__)
+inline _lanes _load(const float* p) { return { _mm256_loadu_ps(p) }; }
+inline void _store(float* p, const _lanes& a) { _mm256_storeu_ps(p, a.v); }
+inline _lanes _splat(float f) { return { _mm256_set1_ps(f) }; }
+inline _lanes operator+(const _lanes& a, const _lanes& b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline _lanes operator*(const _lanes& a, const _lanes& b) { return { _mm256_mul_ps(a.v, b.v) }; }
+// rows[offsets[i] + k] for each lane
+inline _lanes _gather(const float* rows, const int* offsets, int k) {
+    return { _mm256_i32gather_ps(rows + k, _mm256_loadu_si256((const __m256i*)offsets), 4) };
+}
+#elif defined(__ARM_NEON)
+inline _lanes _load(const float* p) { return { vld1q_f32(p), vld1q_f32(p+4) }; }
+inline void _store(float* p, const _lanes& a) { vst1q_f32(p, a.lo); vst1q_f32(p+4, a.hi); }
+inline _lanes _splat(float f) { return { vdupq_n_f32(f), vdupq_n_f32(f) }; }
+inline _lanes operator+(const _lanes& a, const _lanes& b) { return { vaddq_f32(a.lo, b.lo), vaddq_f32(a.hi, b.hi) }; }
+inline _lanes operator*(const _lanes& a, const _lanes& b) { return { vmulq_f32(a.lo, b.lo), vmulq_f32(a.hi, b.hi) }; }
+inline _lanes _gather(const float* rows, const int* offsets, int k) {
+    float v[skinning_block_size];
+    for(auto i = 0; i < skinning_block_size; i ++) v[i] = rows[offsets[i] + k];
+    return _load(v);
+}
+#else
+inline _lanes _load(const float* p) { _lanes a; for(auto i = 0; i < skinning_block_size; i ++) a.v[i] = p[i]; return a; }
+inline void _store(float* p, const _lanes& a) { for(auto i = 0; i < skinning_block_size; i ++) p[i] = a.v[i]; }
+inline _lanes _splat(float f) { _lanes a; for(auto i = 0; i < skinning_block_size; i ++) a.v[i] = f; return a; }
+inline _lanes operator+(const _lanes& a, const _lanes& b) { _lanes c; for(auto i = 0; i < skinning_block_size; i ++) c.v[i] = a.v[i] + b.v[i]; return c; }
+inline _lanes operator*(const _lanes& a, const _lanes& b) { _lanes c; for(auto i = 0; i < skinning_block_size; i ++) c.v[i] = a.v[i] * b.v[i]; return c; }
+inline _lanes _gather(const float* rows, const int* offsets, int k) { _lanes a; for(auto i = 0; i < skinning_block_size; i ++) a.v[i] = rows[offsets[i] + k]; return a; }
+#endif
+
+// copies the rest data of skinning into blocks; influences on missing bones get zero weight
+SkinningBlocks* _make_skinning_blocks(MeshSkinning* skinning, int vertices) {
+    auto blocks = new SkinningBlocks();
+    blocks->vertices = vertices;
+    auto padded = (vertices + skinning_block_size - 1) / skinning_block_size * skinning_block_size;
+    auto has_norm = skinning->rest_norm.size() >= vertices;
+    for(auto c : range(3)) {
+        blocks->pos[c].assign(padded, 0);
+        blocks->norm[c].assign(padded, 0);
+    }
+    for(auto j : range(4)) {
+        blocks->bone[j].assign(padded, 0);
+        blocks->weight[j].assign(padded, 0);
+    }
+    auto nbones = (int)skinning->bone_xforms.size();
+    for(auto i : range(vertices)) {
+        auto& p = skinning->rest_pos[i];
+        blocks->pos[0][i] = p.x; blocks->pos[1][i] = p.y; blocks->pos[2][i] = p.z;
+        if(has_norm) {
+            auto& n = skinning->rest_norm[i];
+            blocks->norm[0][i] = n.x; blocks->norm[1][i] = n.y; blocks->norm[2][i] = n.z;
+        }
+        auto bone = (i < skinning->bone_ids.size()) ? skinning->bone_ids[i] : vec4i(-1,-1,-1,-1);
+        auto weight = (i < skinning->bone_weights.size()) ? skinning->bone_weights[i] : zero4f;
+        for(auto j : range(4)) {
+            auto b = (&bone.x)[j];
+            if(b < 0 or b >= nbones) continue;
+            // offsets of the bone rows, so that the kernel gathers without multiplying
+            blocks->bone[j][i] = b * 12;
+            blocks->weight[j][i] = (&weight.x)[j];
+        }
+    }
+    return blocks;
+}
+
+vector<float> skinning_bone_rows(MeshSkinning* skinning, int frame) {
+    auto rows = vector<float>(skinning->bone_xforms.size() * 12);
+    for(auto b : range(skinning->bone_xforms.size())) {
+        auto& xforms = skinning->bone_xforms[b];
+        auto m = (xforms.empty()) ? mat4f() : xforms[((frame % (int)xforms.size()) + xforms.size()) % xforms.size()];
+        for(auto r : range(3)) {
+            auto& row = (&m.x)[r];
+            rows[b*12 + r*4 + 0] = row.x;
+            rows[b*12 + r*4 + 1] = row.y;
+            rows[b*12 + r*4 + 2] = row.z;
+            rows[b*12 + r*4 + 3] = row.w;
+        }
+    }
+    return rows;
+}
+
+// number of vertices skinned in mesh
+int _skinned_vertices(Mesh* mesh) {
+    return min(mesh->skinning->rest_pos.size(), mesh->pos.size());
+}
+
+// skins block b: the weighted sum of the bone transforms applied to the rest data
+void _skin_block(const SkinningBlocks* blocks, const float* rows, int b, Mesh* mesh, bool skin_norm) {
+    auto o = b * skinning_block_size;
+    auto px = _load(&blocks->pos[0][o]), py = _load(&blocks->pos[1][o]), pz = _load(&blocks->pos[2][o]);
+    auto nx = _load(&blocks->norm[0][o]), ny = _load(&blocks->norm[1][o]), nz = _load(&blocks->norm[2][o]);
+    auto ax = _splat(0), ay = _splat(0), az = _splat(0);
+    auto bx = _splat(0), by = _splat(0), bz = _splat(0);
+    for(auto j = 0; j < 4; j ++) {
+        // most vertices have fewer than four influences: skip the unused ones for the whole block
+        auto used = false;
+        for(auto l = 0; l < skinning_block_size; l ++) used = used or blocks->weight[j][o+l] != 0;
+        if(not used) continue;
+        auto w = _load(&blocks->weight[j][o]);
+        auto bone = &blocks->bone[j][o];
+        auto m00 = _gather(rows, bone, 0), m01 = _gather(rows, bone, 1), m02 = _gather(rows, bone, 2), m03 = _gather(rows, bone, 3);
+        auto m10 = _gather(rows, bone, 4), m11 = _gather(rows, bone, 5), m12 = _gather(rows, bone, 6), m13 = _gather(rows, bone, 7);
+        auto m20 = _gather(rows, bone, 8), m21 = _gather(rows, bone, 9), m22 = _gather(rows, bone, 10), m23 = _gather(rows, bone, 11);
+        ax = ax + w * (m00*px + m01*py + m02*pz + m03);
+        ay = ay + w * (m10*px + m11*py + m12*pz + m13);
+        az = az + w * (m20*px + m21*py + m22*pz + m23);
+        if(skin_norm) {
+            bx = bx + w * (m00*nx + m01*ny + m02*nz);
+            by = by + w * (m10*nx + m11*ny + m12*nz);
+            bz = bz + w * (m20*nx + m21*ny + m22*nz);
+        }
+    }
+    float x[skinning_block_size], y[skinning_block_size], z[skinning_block_size];
+    _store(x, ax); _store(y, ay); _store(z, az);
+    auto count = min(skinning_block_size, blocks->vertices - o);
+    for(auto l = 0; l < count; l ++) mesh->pos[o+l] = vec3f(x[l], y[l], z[l]);
+    if(not skin_norm) return;
+    _store(x, bx); _store(y, by); _store(z, bz);
+    for(auto l = 0; l < count; l ++) mesh->norm[o+l] = normalize(vec3f(x[l], y[l], z[l]));
+}
+
+// records the first vertices of mesh as changed
+void _animated(Mesh* mesh, int vertices) {
+    for(auto i : range(vertices)) mesh->dirty.mark_vertex(i);
+    if(mesh->bvh) refit_bvh(mesh, vector<int>());
+    invalidate_bounds(mesh);
+}
+
+void skin_mesh(Mesh* mesh, int frame) {
+    auto skinning = mesh->skinning;
+    if(not skinning) return;
+    auto vertices = _skinned_vertices(mesh);
+    if(not skinning->_blocks or skinning->_blocks->vertices != vertices) {
+        if(skinning->_blocks) delete skinning->_blocks;
+        skinning->_blocks = _make_skinning_blocks(skinning, vertices);
+    }
+    auto blocks = skinning->_blocks;
+    auto skin_norm = skinning->rest_norm.size() >= vertices and mesh->norm.size() >= vertices;
+    auto rows = skinning_bone_rows(skinning, frame);
+    if(rows.empty()) return;
+    auto nblocks = (vertices + skinning_block_size - 1) / skinning_block_size;
+    parallel_for(nblocks, [&](int b) { _skin_block(blocks, rows.data(), b, mesh, skin_norm); }, skinning_grain);
+    _animated(mesh, vertices);
+}
+
+void skin_mesh_reference(Mesh* mesh, int frame) {
+    auto skinning = mesh->skinning;
+    if(not skinning or skinning->bone_xforms.empty()) return;
+    auto vertices = _skinned_vertices(mesh);
+    auto skin_norm = skinning->rest_norm.size() >= vertices and mesh->norm.size() >= vertices;
+    auto nbones = (int)skinning->bone_xforms.size();
+    auto xform = [&](int b) {
+        auto& xforms = skinning->bone_xforms[b];
+        return (xforms.empty()) ? mat4f() : xforms[((frame % (int)xforms.size()) + xforms.size()) % xforms.size()];
+    };
+    for(auto i : range(vertices)) {
+        auto pos = zero3f, norm = zero3f;
+        auto bone = (i < skinning->bone_ids.size()) ? skinning->bone_ids[i] : vec4i(-1,-1,-1,-1);
+        auto weight = (i < skinning->bone_weights.size()) ? skinning->bone_weights[i] : zero4f;
+        for(auto j : range(4)) {
+            auto b = (&bone.x)[j];
+            auto w = (&weight.x)[j];
+            if(b < 0 or b >= nbones or w == 0) continue;
+            auto m = xform(b);
+            pos += w * transform_point(m, skinning->rest_pos[i]);
+            if(skin_norm) norm += w * transform_vector(m, skinning->rest_norm[i]);
+        }
+        mesh->pos[i] = pos;
+        if(skin_norm) mesh->norm[i] = normalize(norm);
+    }
+    _animated(mesh, vertices);
+}
+
+// copies the particles and springs of simulation into a new state
+SimulationState* _make_simulation_state(MeshSimulation* simulation, Mesh* mesh) {
+    auto state = new SimulationState();
+    auto particles = (int)min(simulation->init_pos.size(), mesh->pos.size());
+    state->particles = particles;
+    for(auto c : range(3)) {
+        state->pos[c].resize(particles);
+        state->vel[c].assign(particles, 0);
+        state->force[c].assign(particles, 0);
+    }
+    state->mass.assign(particles, 1);
+    state->inv_mass.assign(particles, 1);
+    for(auto i : range(particles)) {
+        auto& p = simulation->init_pos[i];
+        state->pos[0][i] = p.x; state->pos[1][i] = p.y; state->pos[2][i] = p.z;
+        if(i < simulation->init_vel.size()) {
+            auto& v = simulation->init_vel[i];
+            state->vel[0][i] = v.x; state->vel[1][i] = v.y; state->vel[2][i] = v.z;
+        }
+        if(i < simulation->mass.size()) state->mass[i] = simulation->mass[i];
+        auto pinned = i < simulation->pinned.size() and simulation->pinned[i];
+        state->inv_mass[i] = (pinned or state->mass[i] <= 0) ? 0 : 1 / state->mass[i];
+    }
+
+    // greedy coloring: each spring takes the first color free at both its particles
+    auto used = vector<unsigned long long>(particles, 0);
+    auto colors = vector<vector<int>>(simulation_max_colors + 1);
+    for(auto s : range(simulation->springs.size())) {
+        auto& ids = simulation->springs[s].ids;
+        if(ids.x < 0 or ids.y < 0 or ids.x >= particles or ids.y >= particles or ids.x == ids.y) continue;
+        auto free = ~(used[ids.x] | used[ids.y]);
+        auto c = 0;
+        while(c < simulation_max_colors and not (free & (1ull << c))) c ++;
+        if(c < simulation_max_colors) {
+            used[ids.x] |= 1ull << c;
+            used[ids.y] |= 1ull << c;
+        }
+        colors[c].push_back(s);
+    }
+    state->serial_last = not colors.back().empty();
+    if(not state->serial_last) colors.pop_back();
+    while(not colors.empty() and colors.back().empty()) colors.pop_back();
+    state->color_offsets.push_back(0);
+    for(auto& color : colors) {
+        for(auto s : color) {
+            auto& spring = simulation->springs[s];
+            state->spring_a.push_back(spring.ids.x);
+            state->spring_b.push_back(spring.ids.y);
+            state->spring_rest.push_back(spring.restlength);
+            state->spring_ks.push_back(spring.ks);
+            state->spring_kd.push_back(spring.kd);
+        }
+        state->color_offsets.push_back(state->spring_a.size());
+    }
+    return state;
+}
+
+// collision object in the frame of the simulated mesh
+struct _collider {
+    frame3f     frame;      // sphere center or quad frame
+    float       radius;     // sphere radius or quad half side
+    bool        isquad;     // quad or sphere
+};
+
+// adds the force of spring s to its particles
+inline void _spring_force(SimulationState* state, int s) {
+    auto a = state->spring_a[s], b = state->spring_b[s];
+    auto dx = state->pos[0][b] - state->pos[0][a], dy = state->pos[1][b] - state->pos[1][a], dz = state->pos[2][b] - state->pos[2][a];
+    auto length = sqrt(dx*dx + dy*dy + dz*dz);
+    if(length == 0) return;
+    dx /= length; dy /= length; dz /= length;
+    auto dv = (state->vel[0][b] - state->vel[0][a]) * dx + (state->vel[1][b] - state->vel[1][a]) * dy + (state->vel[2][b] - state->vel[2][a]) * dz;
+    auto f = state->spring_ks[s] * (length - state->spring_rest[s]) + state->spring_kd[s] * dv;
+    state->force[0][a] += f * dx; state->force[1][a] += f * dy; state->force[2][a] += f * dz;
+    state->force[0][b] -= f * dx; state->force[1][b] -= f * dy; state->force[2][b] -= f * dz;
+}
+
+// pushes a particle that moved from old to pos out of collider, damping its velocity vel
+inline void _collide(const _collider& collider, const vec3f& old, vec3f& pos, vec3f& vel, const vec2f& bounce_dump) {
+    auto normal = zero3f;
+    if(collider.isquad) {
+        auto local = transform_point_inverse(collider.frame, pos);
+        auto local_old = transform_point_inverse(collider.frame, old);
+        // quads are one sided: only particles crossing them from the front collide
+        if(local.z >= 0 or local_old.z < 0 or fabs(local.x) > collider.radius or fabs(local.y) > collider.radius) return;
+        pos = transform_point(collider.frame, vec3f(local.x, local.y, 0));
+        normal = collider.frame.z;
+    } else {
+        auto d = pos - collider.frame.o;
+        auto distance = length(d);
+        if(distance >= collider.radius or distance == 0) return;
+        normal = d / distance;
+        pos = collider.frame.o + normal * collider.radius;
+    }
+    auto vn = dot(vel, normal);
+    if(vn >= 0) return;
+    auto orthogonal = normal * vn;
+    vel = (vel - orthogonal) * (1 - bounce_dump.x) - orthogonal * (1 - bounce_dump.y);
+}
+
+// recomputes the vertex normals of mesh from its faces
+void _update_normals(Mesh* mesh) {
+    if(mesh->norm.size() != mesh->pos.size()) return;
+    for(auto& n : mesh->norm) n = zero3f;
+    for(auto& t : mesh->triangle_index) {
+        if(t.x < 0) continue;
+        auto n = cross(mesh->pos[t.y] - mesh->pos[t.x], mesh->pos[t.z] - mesh->pos[t.x]);
+        mesh->norm[t.x] += n; mesh->norm[t.y] += n; mesh->norm[t.z] += n;
+    }
+    for(auto& q : mesh->quad_index) {
+        if(q.x < 0) continue;
+        auto n = cross(mesh->pos[q.z] - mesh->pos[q.x], mesh->pos[q.w] - mesh->pos[q.y]);
+        mesh->norm[q.x] += n; mesh->norm[q.y] += n; mesh->norm[q.z] += n; mesh->norm[q.w] += n;
+    }
+    parallel_for(mesh->norm.size(), [&](int i) { mesh->norm[i] = normalize(mesh->norm[i]); }, simulation_grain);
+}
+
+void simulate_mesh(Scene* scene, Mesh* mesh) {
+    auto simulation = mesh->simulation;
+    if(not simulation) return;
+    if(not simulation->_state or simulation->_state->particles != min(simulation->init_pos.size(), mesh->pos.size())) reset_simulation(mesh);
+    auto state = simulation->_state;
+    auto animation = scene->animation;
+    auto particles = state->particles;
+    auto steps = max(animation->simsteps, 1);
+    auto dt = animation->dest / steps;
+    auto bounce_dump = animation->bounce_dump;
+    // gravity and colliders in the frame of the mesh
+    auto gravity = transform_vector_inverse(mesh->frame, animation->gravity);
+    auto colliders = vector<_collider>();
+    for(auto other : scene->meshes) {
+        if(other == mesh or not other->collision) continue;
+        auto collider = _collider();
+        collider.frame = transform_frame_inverse(mesh->frame, other->frame);
+        collider.radius = other->collision->radius;
+        collider.isquad = other->collision->isquad;
+        colliders.push_back(collider);
+    }
+
+    for(auto step = 0; step < steps; step ++) {
+        parallel_for(particles, [&](int i) {
+            state->force[0][i] = gravity.x * state->mass[i];
+            state->force[1][i] = gravity.y * state->mass[i];
+            state->force[2][i] = gravity.z * state->mass[i];
+        }, simulation_grain);
+        auto ncolors = (int)state->color_offsets.size() - 1;
+        for(auto c : range(ncolors)) {
+            auto begin = state->color_offsets[c], end = state->color_offsets[c+1];
+            if(state->serial_last and c == ncolors - 1) for(auto s = begin; s < end; s ++) _spring_force(state, s);
+            else parallel_for(end - begin, [&](int s) { _spring_force(state, begin + s); }, simulation_grain);
+        }
+        parallel_for(particles, [&](int i) {
+            auto inv_mass = state->inv_mass[i];
+            if(inv_mass == 0) return;
+            auto vel = vec3f(state->vel[0][i], state->vel[1][i], state->vel[2][i]);
+            auto old = vec3f(state->pos[0][i], state->pos[1][i], state->pos[2][i]);
+            vel += vec3f(state->force[0][i], state->force[1][i], state->force[2][i]) * (inv_mass * dt);
+            auto pos = old + vel * dt;
+            for(auto& collider : colliders) _collide(collider, old, pos, vel, bounce_dump);
+            state->pos[0][i] = pos.x; state->pos[1][i] = pos.y; state->pos[2][i] = pos.z;
+            state->vel[0][i] = vel.x; state->vel[1][i] = vel.y; state->vel[2][i] = vel.z;
+        }, simulation_grain);
+    }
+
+    parallel_for(particles, [&](int i) { mesh->pos[i] = vec3f(state->pos[0][i], state->pos[1][i], state->pos[2][i]); }, simulation_grain);
+    _update_normals(mesh);
+    _animated(mesh, particles);
+}
+
+void reset_simulation(Mesh* mesh) {
+    auto simulation = mesh->simulation;
+    if(not simulation) return;
+    if(simulation->_state) delete simulation->_state;
+    simulation->_state = _make_simulation_state(simulation, mesh);
+    auto state = simulation->_state;
+    for(auto i : range(state->particles)) mesh->pos[i] = simulation->init_pos[i];
+    _update_normals(mesh);
+    _animated(mesh, state->particles);
+}
+
+void animate_update(Scene* scene) {
+    auto animation = scene->animation;
+    animation->time = (animation->length > 0) ? (animation->time + 1) % animation->length : animation->time + 1;
+    timing_literal("animate[start]");
+    animate_frames(scene);
+    for(auto mesh : scene->meshes) if(mesh->skinning) skin_mesh(mesh, animation->time);
+    for(auto mesh : scene->meshes) if(mesh->simulation) simulate_mesh(scene, mesh);
+    timing_literal("animate[end]");
+}
+
+void animate_reset(Scene* scene) {
+    scene->animation->time = 0;
+    animate_frames(scene);
+    for(auto mesh : scene->meshes) if(mesh->skinning) skin_mesh(mesh, 0);
+    for(auto mesh : scene->meshes) if(mesh->simulation) reset_simulation(mesh);
+}
+
+void animate_seek(Scene* scene, int time) {
+    auto animation = scene->animation;
+    animation->time = (animation->length > 0) ? ((time % animation->length) + animation->length) % animation->length : max(time, 0);
+    animate_frames(scene);
+    for(auto mesh : scene->meshes) if(mesh->skinning) skin_mesh(mesh, animation->time);
+}
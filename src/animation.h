@@ -0,0 +1,96 @@
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include "scene_distributed.h"
+
+// scene animation on the CPU: the meshes are updated in place (pos and norm) and their changes
+// recorded in Mesh::dirty, so that the renderer uploads and re-subdivides only what moved.
+
+// Frame animations (FrameAnimation of meshes and surfaces) are baked into a table with the frame
+// of each animation time, so that playing or scrubbing the timeline looks one frame up per object.
+// Changing a key frame (see animation_set_key) marks stale only the times between its neighbor keys,
+// which are re-baked on the next lookup; the tables of all objects are baked in parallel.
+
+// frame of animation at time, interpolating its key frames (times out of the keys take the closest key)
+frame3f animation_frame(FrameAnimation* animation, int time);
+
+// bakes the stale frames of animation for the times in [0,length)
+void bake_frame_animation(FrameAnimation* animation, int length);
+
+// sets the frame of the animated meshes and surfaces to their baked frame at the scene time
+void animate_frames(Scene* scene);
+
+// Skinning is linear blend skinning of MeshSkinning data: rest positions and normals are copied
+// once into blocks of skinning_block_size vertices stored as structures of arrays, which are
+// skinned with AVX2 (8 lanes) or NEON (2x4 lanes) when the compiler targets them, and with a
+// scalar loop over the lanes otherwise. Blocks are distributed over the worker threads.
+
+const int skinning_block_size = 8;      // vertices skinned together (one AVX2 register)
+
+extern int skinning_grain;              // blocks per parallel_for chunk
+
+// rest data of a mesh in blocks of skinning_block_size vertices (the last block is padded
+// with zero weights); each array holds one value per vertex
+struct SkinningBlocks {
+    int             vertices = 0;       // skinned vertices
+    vector<float>   pos[3];             // rest positions
+    vector<float>   norm[3];            // rest normals
+    vector<int>     bone[4];            // bones of the influences
+    vector<float>   weight[4];          // weights of the influences
+};
+
+// bone transforms of a frame as the first three rows of each matrix (12 floats per bone)
+vector<float> skinning_bone_rows(MeshSkinning* skinning, int frame);
+
+// skins mesh at frame (wrapped to the frames of its bone transforms) into pos and norm
+void skin_mesh(Mesh* mesh, int frame);
+
+// reference implementation of skin_mesh, one vertex at a time with mat4f
+void skin_mesh_reference(Mesh* mesh, int frame);
+
+// Simulation integrates the mass-spring systems of MeshSimulation with semi-implicit Euler in
+// SceneAnimation::simsteps substeps per frame. Particles and springs are copied into arrays of
+// components; springs are grouped by a greedy coloring so that no two springs of a group share a
+// particle, and the forces of each group are accumulated in parallel without atomics. Particles
+// entering the sphere or quad of a mesh with MeshCollision data are pushed back to its surface
+// and their velocity is damped by SceneAnimation::bounce_dump (parallel, orthogonal).
+
+const int simulation_max_colors = 64;   // colors tracked per particle; later springs go to a serial group
+
+extern int simulation_grain;            // particles or springs per parallel_for chunk
+
+// simulation data of a mesh: each array holds one value per particle or per spring
+struct SimulationState {
+    int             particles = 0;      // simulated particles (the first pos entries of the mesh)
+    vector<float>   pos[3];             // positions
+    vector<float>   vel[3];             // velocities
+    vector<float>   force[3];           // forces of the current substep
+    vector<float>   mass;               // masses
+    vector<float>   inv_mass;           // inverse masses (zero for pinned particles)
+    vector<int>     spring_a;           // first particle of each spring, springs grouped by color
+    vector<int>     spring_b;           // second particle of each spring
+    vector<float>   spring_rest;        // rest lengths
+    vector<float>   spring_ks;          // static constants
+    vector<float>   spring_kd;          // dynamic constants
+    vector<int>     color_offsets;      // springs of color c are [color_offsets[c],color_offsets[c+1])
+    bool            serial_last = false;// whether the last group has shared particles (run serially)
+};
+
+// steps the simulation of mesh by one frame, colliding with the collision meshes of scene
+void simulate_mesh(Scene* scene, Mesh* mesh);
+
+// restarts the simulation of mesh from its initial positions and velocities
+void reset_simulation(Mesh* mesh);
+
+// advances the scene animation by one time step (wrapping at its length) and updates
+// the animated meshes
+void animate_update(Scene* scene);
+
+// brings the scene back to the first frame of its animation
+void animate_reset(Scene* scene);
+
+// moves the scene animation to time (wrapped at its length) looking up frames and skinning,
+// without stepping the simulations
+void animate_seek(Scene* scene, int time);
+
+#endif
@@ -18,6 +18,8 @@
 #include <deque>
 #include <iostream>
 #include <thread>
+#include <atomic>
+#include <functional>
 #include <boost/asio.hpp>
 #include "message.h"
 #include "scene_distributed.h"
@@ -98,31 +100,41 @@ public:
 //                             {
 //                                 // write on socket
 //                                 // need to unify do_write and do_write_mesh function!!!!
-//                                 timing("send_mesh[start]");
+//                                 timing_literal("send_mesh[start]");
 //                                 do_write_mesh();
 //                             }
 //                         });
 //    }
     
+    // edit_id tags the message with the id of the edit it carries and its origin time (trace_now clock)
     template <typename T>
-    void write(const T obj)
+    void write(const T obj, long long edit_id = 0, long long origin_time = 0)
     {
         io_service_.post(
-                         [this, obj]()
+                         [this, obj, edit_id, origin_time]()
                          {
                              
                              // build serialized mesh
                              // build header
                              auto m_msg = mesh_msg(obj);
+                             if (edit_id)
+                             {
+                                 static const int serialized_id = trace_id("edit.serialized");
+                                 m_msg.set_trace(edit_id, origin_time);
+                                 trace_event(serialized_id, trace_instant, edit_id);
+                             }
                              // check if write in progress
                              bool write_in_progress = !write_meshes_.empty();
                              // push into mesh to write
-                             write_meshes_.push_back(m_msg);
+                             {
+                                 AllocScope alloc_scope(alloc_net);
+                                 write_meshes_.push_back(m_msg);
+                             }
                              if (!write_in_progress)
                              {
                                  // write on socket
                                  // need to unify do_write and do_write_mesh function!!!!
-                                 timing("send_mesh[start]");
+                                 timing_literal("send_mesh[start]");
                                  do_write_mesh();
                              }
                          });
@@ -132,6 +144,10 @@ public:
         return !pending_meshes_.empty();
     }
     
+    int pending_count(){
+        return pending_meshes_.size();
+    }
+    
     Mesh* get_next_mesh(){
         if(!pending_meshes_.empty()){
             current_mesh = *pending_meshes_.front().as_mesh();
@@ -158,6 +174,19 @@ public:
         io_service_.post([this]() { socket_.close(); });
     }
     
+    // whether the connection to the server is established
+    bool connected() const
+    {
+        return connected_;
+    }
+    
+    // handler of the received messages, called on the io_service thread in place of queueing
+    // them as pending (headless clients); set it before the connection is established
+    void set_receive_handler(std::function<void(const mesh_msg&)> handler)
+    {
+        receive_handler_ = handler;
+    }
+    
 private:
     void do_connect(tcp::resolver::iterator endpoint_iterator)
     {
@@ -166,6 +195,7 @@ private:
                                    {
                                        if (!ec)
                                        {
+                                           connected_ = true;
                                            //do_read_header();
                                            // need to unify do_read_header and do_read_mesh_header function!!!!
                                            do_read_mesh_header();
@@ -198,7 +228,7 @@ private:
                                 {
                                     if (!ec && read_incoming_mesh_.decode_header())
                                     {
-                                        timing("recive_mesh[start]");
+                                        timing_literal("recive_mesh[start]");
                                         do_read_mesh_body();
                                     }
                                     else
@@ -239,8 +269,15 @@ private:
                                     if (!ec)
                                     {
                                         // ack?
-                                        timing("recive_mesh[end]");
+                                        timing_literal("recive_mesh[end]");
+                                        trace_received(read_incoming_mesh_);
                                         timing("mesh_size", (long long) read_incoming_mesh_.length() );
+                                        if (receive_handler_)
+                                        {
+                                            receive_handler_(read_incoming_mesh_);
+                                            do_read_mesh_header();
+                                            return;
+                                        }
                                         // print recived op
                                         switch (read_incoming_mesh_.type()) {
                                             case 0: // Message
@@ -261,7 +298,10 @@ private:
                                             default:
                                                 break;
                                         }
-                                        pending_meshes_.push_back(read_incoming_mesh_);
+                                        {
+                                            AllocScope alloc_scope(alloc_net);
+                                            pending_meshes_.push_back(read_incoming_mesh_);
+                                        }
                                         do_read_mesh_header();
                                     }
                                     else
@@ -296,6 +336,8 @@ private:
     // write on socket
     void do_write_mesh()
     {
+        static const int sent_id = trace_id("edit.sent");
+        trace_sent(write_meshes_.front(), sent_id);
         boost::asio::async_write(socket_,
                                  boost::asio::buffer(write_meshes_.front()[0],
                                                      write_meshes_.front().length()),
@@ -303,7 +345,7 @@ private:
                                  {
                                      if (!ec)
                                      {
-                                         timing("send_mesh[end]");
+                                         timing_literal("send_mesh[end]");
                                          timing("mesh_size", (long long) write_meshes_.front().length() );
                                          write_meshes_.pop_front();
                                          if (!write_meshes_.empty())
@@ -327,6 +369,8 @@ private:
     mesh_message_queue write_meshes_;
     mesh_message_queue pending_meshes_;
     Mesh current_mesh;
+    std::atomic<bool> connected_ {false};
+    std::function<void(const mesh_msg&)> receive_handler_;
 };
 
 #endif
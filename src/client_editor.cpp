@@ -15,6 +15,13 @@
 #include "serialization.hpp"
 #include "image.h"
 #include "id_reference.h"
+#include "mesh_buffers.h"
+#include "shade_state.h"
+#include "subdiv.h"
+#include "intersect.h"
+#include "animation.h"
+#include "trace.h"
+#include "frame_budget.h"
 #include "client.hpp"
 #include <boost/asio.hpp>
 #include <thread>
@@ -51,7 +58,7 @@ using boost::asio::ip::tcp;
 int gl_program_id = 0;          // OpenGL program handle
 int gl_vertex_shader_id = 0;    // OpenGL vertex shader handle
 int gl_fragment_shader_id = 0;  // OpenGL fragment shader handle
-map<image3f*,int> gl_texture_id;// OpenGL texture handles
+map<texture3*,int> gl_texture_id;// OpenGL texture handles
 
 // check_dir var
 map<string,pair<bool, bool>> file_upload;
@@ -160,33 +167,16 @@ void init_textures(Scene* scene) {
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
-        // load texture data
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+        // load texture data in its own compact format (no conversion to float)
+        auto internal = GL_RGB8; auto type = GL_UNSIGNED_BYTE;
+        if(texture->format() == texel_format::rgb16f) { internal = GL_RGB16F_ARB; type = GL_HALF_FLOAT_ARB; }
+        if(texture->format() == texel_format::rgb32f) { internal = GL_RGB32F_ARB; type = GL_FLOAT; }
+        // 8-bit rgb rows are not 4-byte aligned
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal,
                      texture->width(), texture->height(),
-                     0, GL_RGB, GL_FLOAT, texture->data());
-    }
-}
-
-// utility to bind texture parameters for shaders
-// uses texture name, texture_on name, texture pointer and texture unit position
-void _bind_texture(string name_map, string name_on, image3f* txt, int pos) {
-    // if txt is not null
-    if(txt) {
-        // set texture on boolean parameter to true
-        glUniform1i(glGetUniformLocation(gl_program_id,name_on.c_str()),GL_TRUE);
-        // activate a texture unit at position pos
-        glActiveTexture(GL_TEXTURE0+pos);
-        // bind texture object to it from gl_texture_id map
-        glBindTexture(GL_TEXTURE_2D, gl_texture_id[txt]);
-        // set texture parameter to the position pos
-        glUniform1i(glGetUniformLocation(gl_program_id, name_map.c_str()), pos);
-    } else {
-        // set texture on boolean parameter to false
-        glUniform1i(glGetUniformLocation(gl_program_id,name_on.c_str()),GL_FALSE);
-        // activate a texture unit at position pos
-        glActiveTexture(GL_TEXTURE0+pos);
-        // set zero as the texture id
-        glBindTexture(GL_TEXTURE_2D, 0);
+                     0, GL_RGB, type, texture->data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
     }
 }
 
@@ -210,86 +200,104 @@ void shade(Scene* scene, bool wireframe) {
     // enable program
     glUseProgram(gl_program_id);
     
-    // bind camera's position, inverse of frame and projection
-    // use frame_to_matrix_inverse and frustum_matrix
-    glUniform3fv(glGetUniformLocation(gl_program_id,"camera_pos"),
-                 1, &scene->camera->frame.o.x);
-    glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"camera_frame_inverse"),
-                       1, true, &frame_to_matrix_inverse(scene->camera->frame)[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"camera_projection"),
-                       1, true, &frustum_matrix(-scene->camera->dist*scene->camera->width/2, scene->camera->dist*scene->camera->width/2,
-                                                -scene->camera->dist*scene->camera->height/2, scene->camera->dist*scene->camera->height/2,
-                                                scene->camera->dist,10000)[0][0]);
+    // bind camera, ambient and lights once for the frame
+    auto& locations = shade_locations(gl_program_id);
+    shade_bind_frame(locations, scene);
     
-    // bind ambient and number of lights
-    glUniform3fv(glGetUniformLocation(gl_program_id,"ambient"),1,&scene->ambient.x);
-    glUniform1i(glGetUniformLocation(gl_program_id,"lights_num"),scene->lights.size());
+    // mesh arrays live in gpu buffers, uploaded again only where they changed
+    static auto frame = 0;
+    frame++;
     
-    // foreach light
-    auto count = 0;
-    for(auto light : scene->lights) {
-        // bind light position and internsity (create param name with tostring)
-        glUniform3fv(glGetUniformLocation(gl_program_id,tostring("light_pos[%d]",count).c_str()),
-                     1, &light->frame.o.x);
-        glUniform3fv(glGetUniformLocation(gl_program_id,tostring("light_intensity[%d]",count).c_str()),
-                     1, &light->intensity.x);
-        count++;
-    }
+    // meshes out of the view or too small on screen are skipped, and only the visible
+    // face clusters of the others are drawn
+    auto view = view_frustum(scene);
+    auto visible_triangles = vector<pair<int,int>>(), visible_quads = vector<pair<int,int>>();
     
-    // foreach mesh
-    for(auto mesh : scene->meshes) {
-        // bind material kd, ks, n
-        glUniform3fv(glGetUniformLocation(gl_program_id,"material_kd"),
-                     1,&mesh->mat->kd.x);
-        glUniform3fv(glGetUniformLocation(gl_program_id,"material_ks"),
-                     1,&mesh->mat->ks.x);
-        glUniform1f(glGetUniformLocation(gl_program_id,"material_n"),
-                    mesh->mat->n);
-        // bind texture params (txt_on, sampler)
-        _bind_texture("material_kd_txt", "material_kd_txt_on", mesh->mat->kd_txt, 0);
-        _bind_texture("material_ks_txt", "material_ks_txt_on", mesh->mat->ks_txt, 1);
-        _bind_texture("material_norm_txt", "material_norm_txt_on", mesh->mat->norm_txt, 2);
+    // foreach mesh, grouped by material so that its uniforms and textures are sent once
+    auto material_state = ShadeMaterialState();
+    for(auto mesh : shade_draw_order(scene->meshes)) {
+        if(not cull_mesh(mesh, view, visible_triangles, visible_quads)) {
+            // keep the buffers (and the pending changes) for when the mesh comes back into view
+            keep_mesh_buffers(mesh, frame);
+            if(mesh->subdiv) keep_mesh_buffers(mesh->subdiv->display, frame);
+            continue;
+        }
+        
+        // bind material kd, ks, n and textures (txt_on, sampler) if they changed
+        material_state.bind(locations, mesh->mat, gl_texture_id);
         
         // bind mesh frame - use frame_to_matrix
-        glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"mesh_frame"),
-                           1,true,&frame_to_matrix(mesh->frame)[0][0]);
+        glUniformMatrix4fv(locations.mesh_frame, 1, true, &frame_to_matrix(mesh->frame)[0][0]);
         
-        // enable vertex attributes arrays and set up pointers to the mesh data
-        auto vertex_pos_location = glGetAttribLocation(gl_program_id, "vertex_pos");
-        auto vertex_norm_location = glGetAttribLocation(gl_program_id, "vertex_norm");
-        auto vertex_texcoord_location = glGetAttribLocation(gl_program_id, "vertex_texcoord");
+        // enable vertex attributes arrays and set up pointers to the mesh buffers
+        auto vertex_pos_location = locations.vertex_pos;
+        auto vertex_norm_location = locations.vertex_norm;
+        auto vertex_texcoord_location = locations.vertex_texcoord;
+        // subdivided meshes draw their refined mesh: the cage is what is edited and sent
+        auto draw = subdivided_mesh(mesh);
+        auto& buffers = update_mesh_buffers(draw, frame);
         glEnableVertexAttribArray(vertex_pos_location);
-        glVertexAttribPointer(vertex_pos_location, 3, GL_FLOAT, GL_FALSE, 0, &mesh->pos[0].x);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.pos);
+        glVertexAttribPointer(vertex_pos_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
         glEnableVertexAttribArray(vertex_norm_location);
-        glVertexAttribPointer(vertex_norm_location, 3, GL_FLOAT, GL_FALSE, 0, &mesh->norm[0].x);
-        if(not mesh->texcoord.empty()) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.norm);
+        glVertexAttribPointer(vertex_norm_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        if(not draw->texcoord.empty()) {
             glEnableVertexAttribArray(vertex_texcoord_location);
-            glVertexAttribPointer(vertex_texcoord_location, 2, GL_FLOAT, GL_FALSE, 0, &mesh->texcoord[0].x);
+            glBindBuffer(GL_ARRAY_BUFFER, buffers.texcoord);
+            glVertexAttribPointer(vertex_texcoord_location, 2, GL_FLOAT, GL_FALSE, 0, 0);
         }
         else glVertexAttrib2f(vertex_texcoord_location, 0, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        
+        // faces to draw: refined meshes only have the index arrays
+        auto draw_triangles = (draw == mesh) ? mesh->triangle.size() : draw->triangle_index.size();
+        auto draw_quads = (draw == mesh) ? mesh->quad.size() : draw->quad_index.size();
+        auto draw_edges = (draw == mesh) ? mesh->edge.size() : draw->edge_index.size();
         
         // draw triangles and quads
         if(not wireframe) {
 //            if(mesh->triangle.size()) glDrawElements(GL_TRIANGLES, mesh->triangle_index.size()*3, GL_UNSIGNED_INT, &mesh->triangle_index[0].x);
 //            if(mesh->quad.size()) glDrawElements(GL_QUADS, mesh->quad_index.size()*4, GL_UNSIGNED_INT, &mesh->quad_index[0].x);
-            if(mesh->triangle.size()) glDrawRangeElements(GL_TRIANGLES, 0, mesh->pos.size() - 1,  mesh->triangle_index.size()*3, GL_UNSIGNED_INT, &mesh->triangle_index[0].x);
-            if(mesh->quad.size()) glDrawRangeElements(GL_QUADS, 0, mesh->pos.size() - 1, mesh->quad_index.size()*4, GL_UNSIGNED_INT, &mesh->quad_index[0].x);
+            // refined meshes are culled as a whole (the cage bounds contain them)
+            if(draw != mesh) {
+                visible_triangles.assign(1, make_pair(0, (int)draw->triangle_index.size()));
+                visible_quads.assign(1, make_pair(0, (int)draw->quad_index.size()));
+            }
+            if(draw_triangles) {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.triangle);
+                for(auto& faces : visible_triangles)
+                    glDrawRangeElements(GL_TRIANGLES, 0, draw->pos.size() - 1, (faces.second - faces.first)*3, GL_UNSIGNED_INT, (GLvoid*)(faces.first*sizeof(vec3i)));
+            }
+            if(draw_quads) {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.quad);
+                for(auto& faces : visible_quads)
+                    glDrawRangeElements(GL_QUADS, 0, draw->pos.size() - 1, (faces.second - faces.first)*4, GL_UNSIGNED_INT, (GLvoid*)(faces.first*sizeof(vec4i)));
+            }
 
         } else {
             //auto edges = EdgeMap(mesh->triangle, mesh->quad).edges();
             //if(mesh->edge.size()) glDrawElements(GL_LINES, mesh->edge_index.size()*2, GL_UNSIGNED_INT, &mesh->edge_index[0].x);
-            if(mesh->edge.size()) glDrawRangeElements(GL_LINES,  0, mesh->pos.size() - 1, mesh->edge_index.size()*2, GL_UNSIGNED_INT, &mesh->edge_index[0].x);
+            if(draw_edges) {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.edge);
+                glDrawRangeElements(GL_LINES, 0, draw->pos.size() - 1, draw->edge_index.size()*2, GL_UNSIGNED_INT, 0);
+            }
         }
         
-        // draw line sets
-        if(not mesh->line.empty()) glDrawElements(GL_LINES, mesh->line.size()*2, GL_UNSIGNED_INT, mesh->line.data());
-        for(auto segment : mesh->spline) glDrawElements(GL_LINE_STRIP, 4, GL_UNSIGNED_INT, &segment);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        
+        // draw line sets (their indices refer to the cage vertices)
+        if(draw == mesh and not mesh->line.empty()) glDrawElements(GL_LINES, mesh->line.size()*2, GL_UNSIGNED_INT, mesh->line.data());
+        if(draw == mesh) for(auto segment : mesh->spline) glDrawElements(GL_LINE_STRIP, 4, GL_UNSIGNED_INT, &segment);
         
         // disable vertex attribute arrays
         glDisableVertexAttribArray(vertex_pos_location);
         glDisableVertexAttribArray(vertex_norm_location);
-        if(not mesh->texcoord.empty()) glDisableVertexAttribArray(vertex_texcoord_location);
+        if(not draw->texcoord.empty()) glDisableVertexAttribArray(vertex_texcoord_location);
     }
+    
+    // free the buffers of meshes no longer in the scene
+    release_mesh_buffers(frame);
 }
 
 string scene_filename;          // scene filename
@@ -306,6 +314,9 @@ bool restore_old = false;
 bool send_meshdiff = false;
 bool write_log    = false;
 bool r_write_log    = false;
+int lod_level = 0;              // level of detail followed (0 is the full mesh, up to 3 coarser levels)
+bool send_lod = false;
+FrameBudget frame_budget;       // times of the frames of the ui loop
 
 
 // glfw callback for character input
@@ -345,6 +356,27 @@ void character_callback(GLFWwindow* window, unsigned int key) {
         case 'k':
             r_write_log = true;
             break;
+        case 'd':
+            lod_level = (lod_level + 1) % 4;
+            send_lod = true;
+            break;
+        case 'c':
+            // subdivision preview, local to this client
+            for(auto mesh : scene->meshes) mesh->subdivision_catmullclark_level = (mesh->subdivision_catmullclark_level + 1) % 4;
+            break;
+        case 'n':
+            for(auto mesh : scene->meshes) mesh->subdivision_catmullclark_smooth = not mesh->subdivision_catmullclark_smooth;
+            break;
+        case 'p':
+            scene->draw_animated = not scene->draw_animated;
+            break;
+        case ',':
+            // scrub the timeline one step back/forward (baked frames and skinning only)
+            animate_seek(scene, scene->animation->time - 1);
+            break;
+        case '.':
+            animate_seek(scene, scene->animation->time + 1);
+            break;
 
 
     }
@@ -537,11 +569,20 @@ void uiloop(editor_client* client) {
     auto mouse_last_x = -1.0;
     auto mouse_last_y = -1.0;
     
+    auto shown_edits = vector<long long>();  // traced edits applied since the last frame
+    
     while(not glfwWindowShouldClose(window)) {
+        frame_budget.begin_frame();
         glfwGetFramebufferSize(window, &scene->image_width, &scene->image_height);
         scene->camera->width = (scene->camera->height * scene->image_width) / scene->image_height;
         
-        shade(scene,wireframe);
+        // playback looks up baked frames and skins on the CPU; shade uploads only what moved
+        if(scene->draw_animated) animate_update(scene);
+        
+        {
+            FrameStage stage(&frame_budget, frame_shade);
+            shade(scene,wireframe);
+        }
         
         if(glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT)) {
             double x, y;
@@ -589,7 +630,9 @@ void uiloop(editor_client* client) {
         }
         */
         if(send_mesh){
-            client->write(scene->meshes[0]);
+            // a simplified mesh would replace the full one on the server
+            if(lod_level) message("switch back to the full mesh before sending it\n");
+            else client->write(scene->meshes[0]);
             send_mesh = false;
         }
         
@@ -611,51 +654,51 @@ void uiloop(editor_client* client) {
             if (c >= 0 && c <= 5 && c != scene->camera->_version) {
                 auto camera_diff = new CameraDiff();
                 filename = "../scenes/diff/c" + to_string(scene->camera->_version) + "toc" + to_string(c);
-                timing("deserialize_camera[start]");
+                timing_literal("deserialize_camera[start]");
                 restore_cameradiff(*camera_diff, filename.c_str());
-                timing("deserialize_camera[end]");
+                timing_literal("deserialize_camera[end]");
                 scene_diff->cameras.push_back(camera_diff);
             }
             if (l >= 0 && l <= 5 && l != scene->lights[0]->_version) {
                 auto light_diff = new LightDiff();
                 filename = "../scenes/diff/l" + to_string(scene->lights[0]->_version) + "tol" + to_string(l);
-                timing("deserialize_light[start]");
+                timing_literal("deserialize_light[start]");
                 restore_lightdiff(*light_diff, filename.c_str());
-                timing("deserialize_light[end]");
+                timing_literal("deserialize_light[end]");
                 scene_diff->lights.push_back(light_diff);
             }
             if (m >= 0 && m <= 5 && m != scene->meshes[0]->_version) {
                 auto mesh_diff = new MeshDiff();
                 filename = "../scenes/diff/m" + to_string(scene->meshes[0]->_version) + "tom" + to_string(m);
-                timing("deserialize_mesh[start]");
+                timing_literal("deserialize_mesh[start]");
                 restore_meshdiff(*mesh_diff, filename.c_str());
-                timing("deserialize_mesh[end]");
+                timing_literal("deserialize_mesh[end]");
                 scene_diff->meshes.push_back(mesh_diff);
             }
             if (mat >= 0 && mat <= 5 && mat != scene->materials[0]->_version) {
                 auto material_diff = new MaterialDiff();
                 filename = "../scenes/diff/mat" + to_string(scene->materials[0]->_version) + ".1tomat" + to_string(mat) + ".1";
-                timing("deserialize_material[start]");
+                timing_literal("deserialize_material[start]");
                 restore_materialdiff(*material_diff, filename.c_str());
-                timing("deserialize_material[end]");
+                timing_literal("deserialize_material[end]");
                 scene_diff->materials.push_back(material_diff);
             }
             if (mm >= 0 && mm <= 5 && mm != scene->meshes[0]->mat->_version) {
                 auto material_diff = new MaterialDiff();
                 filename = "../scenes/diff/mat" + to_string(scene->meshes[0]->mat->_version) + ".2tomat" + to_string(mm) + ".2";
-                timing("deserialize_mesh/mat[start]");
+                timing_literal("deserialize_mesh/mat[start]");
                 restore_materialdiff(*material_diff, filename.c_str());
-                timing("deserialize_mesh/mat[end]");
+                timing_literal("deserialize_mesh/mat[end]");
                 scene_diff->materials.push_back(material_diff);
             }
             
             // apply changes to mesh
-            timing("apply_diff[start]");
-            timing_apply("apply_diff[start]");
+            timing_literal("apply_diff[start]");
+            timing_apply_literal("apply_diff[start]");
             timestamp_t label = get_timestamp();
             apply_change_reverse(scene, scene_diff, label);
-            timing("apply_diff[end]");
-            timing_apply("apply_diff[end]");
+            timing_literal("apply_diff[end]");
+            timing_apply_literal("apply_diff[end]");
             message("actual mesh version: %d\n", scene->meshes[0]->_version);
             // send meshdiff
             //client->write(scene_diff);
@@ -663,18 +706,24 @@ void uiloop(editor_client* client) {
             send_meshdiff = false;
         }
         
-        while(client->has_pending_mesh()){
+        static const int deserialized_id = trace_id("edit.deserialized");
+        static const int applied_id = trace_id("edit.applied");
+        // with a drain budget the messages left are handled in the next frames
+        frame_budget.begin_stage(frame_drain);
+        while(client->has_pending_mesh() and not frame_budget.drain_exhausted()){
             // get next message
             auto msg = client->get_next_pending();
+            frame_budget.current.messages++;
             // switch between message type
             switch (msg->type()) {
                 case 0: // Message
                 {
                     auto message_tokens = msg->as_message();
                     if(message_tokens[0] == "restore_version"){
-                        timing_apply("restore_version[end]");
+                        FrameStage stage(&frame_budget, frame_apply);
+                        timing_apply_literal("restore_version[end]");
                         restore_to_version(scene, atoll(message_tokens[1].c_str()));
-                        timing_apply("restore_version[end]");
+                        timing_apply_literal("restore_version[end]");
                         message("scene restored to version %llu\n", message_tokens[1].c_str());
                     }
                     client->remove_first();
@@ -683,22 +732,41 @@ void uiloop(editor_client* client) {
                 case 1: // Mesh
                 {
                     // get the next mesh recived
-                    auto mesh = msg->as_mesh();
+                    Mesh* mesh = nullptr;
+                    {
+                        FrameStage stage(&frame_budget, frame_decode);
+                        mesh = msg->as_mesh();
+                    }
                     // save mesh in history and update mesh
-                    swap_mesh(mesh, scene, true);
+                    {
+                        FrameStage stage(&frame_budget, frame_apply);
+                        swap_mesh(mesh, scene, true);
+                    }
                     // remove from queue
                     client->remove_first();
                 }
                     break;
                 case 2: // SceneDiff
                 {
-                    timing("deserialize_from_msg[start]");
-                    auto scenediff = msg->as_scenediff();
-                    timing("deserialize_from_msg[end]");
+                    timing_literal("deserialize_from_msg[start]");
+                    SceneDiff* scenediff = nullptr;
+                    {
+                        FrameStage stage(&frame_budget, frame_decode);
+                        scenediff = msg->as_scenediff();
+                    }
+                    timing_literal("deserialize_from_msg[end]");
+                    if(msg->traced()) trace_event(deserialized_id, trace_instant, msg->edit_id());
                     // apply differences
-                    timing("apply_diff[start]");
-                    apply_change(scene, scenediff, 0);
-                    timing("apply_diff[end]");
+                    timing_literal("apply_diff[start]");
+                    {
+                        FrameStage stage(&frame_budget, frame_apply);
+                        apply_change(scene, scenediff, 0);
+                    }
+                    timing_literal("apply_diff[end]");
+                    if(msg->traced()){
+                        trace_event(applied_id, trace_instant, msg->edit_id());
+                        shown_edits.push_back(msg->edit_id());
+                    }
                     message("actual mesh version: %d\n", scene->meshes[0]->_version);
                     // remove from queue
                     client->remove_first();
@@ -707,13 +775,25 @@ void uiloop(editor_client* client) {
                 case 3: // MeshDiff
                 {
                     // get the next mesh recived
-                    timing("deserialize_from_msg[start]");
-                    auto meshdiff = msg->as_meshdiff();
-                    timing("deserialize_from_msg[end]");
+                    timing_literal("deserialize_from_msg[start]");
+                    MeshDiff* meshdiff = nullptr;
+                    {
+                        FrameStage stage(&frame_budget, frame_decode);
+                        meshdiff = msg->as_meshdiff();
+                    }
+                    timing_literal("deserialize_from_msg[end]");
+                    if(msg->traced()) trace_event(deserialized_id, trace_instant, msg->edit_id());
                     // apply differences
-                    timing("apply_diff[start]");
-                    apply_mesh_change(scene->meshes[0], meshdiff, get_timestamp());
-                    timing("apply_diff[end]");
+                    timing_literal("apply_diff[start]");
+                    {
+                        FrameStage stage(&frame_budget, frame_apply);
+                        apply_mesh_change(scene->meshes[0], meshdiff, get_timestamp());
+                    }
+                    timing_literal("apply_diff[end]");
+                    if(msg->traced()){
+                        trace_event(applied_id, trace_instant, msg->edit_id());
+                        shown_edits.push_back(msg->edit_id());
+                    }
                     message("actual mesh version: %d\n", scene->meshes[0]->_version);
                     // remove from queue
                     client->remove_first();
@@ -732,6 +812,16 @@ void uiloop(editor_client* client) {
                     break;
             }
         }
+        frame_budget.end_stage(frame_drain);
+        
+        // the server answers with the mesh at this level, then sends only its differences
+        if(send_lod){
+            stringstream lod_message;
+            lod_message << "lod " << lod_level;
+            client->write(lod_message.str().c_str());
+            message("following level of detail %d\n", lod_level);
+            send_lod = false;
+        }
         
         if(restore_old){
             timestamp_t old = get_global_version();
@@ -749,6 +839,7 @@ void uiloop(editor_client* client) {
         if(write_log){
             //save_timing("sender_timing_v" + scene_filename + to_string(scene->meshes[0]->_version));
             save_timing_apply("apply_timing_v" + scene_filename + to_string(scene->meshes[0]->_version));
+            save_trace("../log/client_trace_v" + scene_filename + to_string(scene->meshes[0]->_version) + ".json");
             write_log = false;
         }
         
@@ -795,6 +886,12 @@ void uiloop(editor_client* client) {
 //            cout << "vec3f(" << scene->camera->frame.y.x << "," << scene->camera->frame.y.y << "," << scene->camera->frame.y.z << "),";
 //            cout << "vec3f(" << scene->camera->frame.z.x << "," << scene->camera->frame.z.y << "," << scene->camera->frame.z.z << "))" << endl;
 
+            // the edit is followed by its id from here to the frames of the receivers
+            static const int origin_id = trace_id("edit.origin");
+            auto edit_id = trace_edit_id();
+            auto origin_time = trace_now();
+            trace_event_at(origin_time, origin_id, trace_instant, edit_id);
+            
             auto scene_diff = new SceneDiff();
             auto mdiff = new MaterialDiff(scene->meshes[0]->mat,m[mat]);
             apply_material_change(scene->meshes[0]->mat, mdiff, 0);
@@ -813,12 +910,22 @@ void uiloop(editor_client* client) {
             scene_diff->meshes.push_back(mediff);
             scene_diff->materials.push_back(mdiff);
             
-            client->write(scene_diff);
+            // a diff of a simplified mesh would corrupt the full one on the server
+            if(lod_level) message("switch back to the full mesh before sending edits\n");
+            else client->write(scene_diff, edit_id, origin_time);
             have_msg = false;
         }
         
-        glfwSwapBuffers(window);
+        {
+            FrameStage stage(&frame_budget, frame_swap);
+            glfwSwapBuffers(window);
+        }
+        // the edits applied in this frame are on screen
+        static const int shown_id = trace_id("edit.shown");
+        for(auto edit_id : shown_edits) trace_event(shown_id, trace_instant, edit_id);
+        shown_edits.clear();
         glfwPollEvents();
+        frame_budget.end_frame(client->pending_count());
     }
     
     glfwDestroyWindow(window);
@@ -938,16 +1045,22 @@ void check_dir(editor_client* client){
 int main(int argc, char** argv) {
     auto args = parse_cmdline(argc, argv,
                               { "3D viewer", "show 3d scene",
-                                  {  {"resolution", "r", "image resolution", typeid(int), true, jsonvalue() }  },
+                                  {  {"resolution", "r", "image resolution", typeid(int), true, jsonvalue() },
+                                     {"budget", "b", "work of a frame before an overrun (ms)", typeid(double), true, jsonvalue(16.0) },
+                                     {"drain_budget", "q", "time handling incoming messages per frame (ms, 0 for no limit)", typeid(double), true, jsonvalue(0.0) },
+                                     {"frame_report", "f", "seconds between frame time reports (0 for none)", typeid(double), true, jsonvalue(10.0) }  },
                                   {  {"scene_filename", "", "scene filename", typeid(string), false, jsonvalue("scene.json")},
                                       {"image_filename", "", "image filename", typeid(string), true, jsonvalue("")}  }
                               });
     scene_filename = args.object_element("scene_filename").as_string();
+    frame_budget.budget = (long long)(args.object_element("budget").as_double() * 1e6);
+    frame_budget.drain_budget = (long long)(args.object_element("drain_budget").as_double() * 1e6);
+    frame_budget.report_interval = args.object_element("frame_report").as_double();
     image_filename = (args.object_element("image_filename").as_string() != "") ?
     args.object_element("image_filename").as_string() :
     scene_filename.substr(0,scene_filename.size()-5)+".png";
     // load scene
-//    timing("parse_scene[start]");
+//    timing_literal("parse_scene[start]");
 //    scene = load_obj_scene("../scenes/fat_v0.obj");
 //    auto light = new Light();
 //    light->_id_ = 126128947120701270;
@@ -960,7 +1073,7 @@ int main(int argc, char** argv) {
     scene = load_json_scene("../scenes/shuttleply_v0.json");
     scene->background = zero3f;
     //scene->camera->frame = frame3f(vec3f(-1.68528,1.69959,11.5761),vec3f(0.999631,0,-0.0271681),vec3f(-0.00394499,0.989401,-0.145153),vec3f(0.0268802,0.145207,0.989036));
-    timing("parse_scene[end]");
+    timing_literal("parse_scene[end]");
     if(not args.object_element("resolution").is_null()) {
         scene->image_height = args.object_element("resolution").as_int();
         scene->image_width = scene->camera->width * scene->image_height / scene->camera->height;
@@ -986,7 +1099,7 @@ int main(int argc, char** argv) {
     // server start
     try
     {
-        if (argc != 2)
+        if (argc < 2)
         {
             std::cerr << "Usage: editor_client <scene> <host> <port>\n";
             return 1;
@@ -1012,7 +1125,7 @@ int main(int argc, char** argv) {
             c.write(msg);
         }
         */
-        client_id = atoi(argv[1]);
+        client_id = atoi(scene_filename.c_str());
         //check_dir(&c);
         uiloop(&c);
 
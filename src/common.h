@@ -10,6 +10,10 @@
 #include <cstdarg>
 #include <fstream>
 #include <cstdio>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
 
 
 // bringing stand libraray objects in scope
@@ -54,6 +58,31 @@ struct range {
     iterator end() { return iterator(max); }
 };
 
+// number of worker threads used by parallel_for (at least 1); queried once, since
+// hardware_concurrency may read the system configuration on every call
+inline int parallel_threads() { static auto n = std::max((int)std::thread::hardware_concurrency(), 1); return n; }
+
+// runs f(i) for i in [0,n) on a pool of worker threads; work is handed out in chunks of grain
+// indices through an atomic counter, so f must be safe to call concurrently on distinct indices
+inline void parallel_for(int n, const std::function<void(int)>& f, int grain = 1) {
+    if(n <= 0) return;
+    if(grain < 1) grain = 1;
+    if(n <= grain) { for(auto i = 0; i < n; i ++) f(i); return; }
+    auto nthreads = std::min(parallel_threads(), (n + grain - 1) / grain);
+    if(nthreads <= 1) { for(auto i = 0; i < n; i ++) f(i); return; }
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for(auto start = next.fetch_add(grain); start < n; start = next.fetch_add(grain)) {
+            auto end = std::min(start + grain, n);
+            for(auto i = start; i < end; i ++) f(i);
+        }
+    };
+    auto threads = vector<std::thread>();
+    for(auto t = 1; t < nthreads; t ++) threads.push_back(std::thread(worker));
+    worker();
+    for(auto& t : threads) t.join();
+}
+
 // load a text file into a buffer
 inline string load_text_file(const char* filename) {
     auto text = string("");
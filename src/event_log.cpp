@@ -0,0 +1,308 @@
+#include "event_log.h"
+#include "metrics.h"
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// wall clock (ns since the epoch)
+static long long _wall_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// bytes of a record with a payload of length bytes
+inline long long _record_length(long long length) {
+    return (sizeof(EventRecord) + length + 7) & ~7ll;
+}
+
+// FNV-1a of the header of record (with checksum 0) and its payload
+static uint32_t _checksum(const EventRecord& record, const char* payload) {
+    auto header = record;
+    header.checksum = 0;
+    auto hash = 2166136261u;
+    auto bytes = (const unsigned char*)&header;
+    for(auto i = 0; i < (int)sizeof(EventRecord); i ++) hash = (hash ^ bytes[i]) * 16777619u;
+    bytes = (const unsigned char*)payload;
+    for(auto i = 0u; i < record.payload_length(); i ++) hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+// filename of segment index in dir
+static string _segment_filename(const string& dir, int index) {
+    return dir + tostring("/events_%06d.log", index);
+}
+
+static bool _file_exists(const string& filename) {
+    struct stat info;
+    return stat(filename.c_str(), &info) == 0;
+}
+
+// creates dir and its parents
+static bool _make_dirs(const string& dir) {
+    for(auto slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+        auto path = dir.substr(0, slash);
+        if(not path.empty() and mkdir(path.c_str(), 0755) and errno != EEXIST) return false;
+        if(slash == string::npos) return true;
+    }
+}
+
+// visits the valid records of a mapped segment of size bytes after last_sequence; returns the end of the
+// last one and sets last_sequence to its sequence
+static long long _scan_segment(const char* map, long long size, long long& last_sequence,
+                               const std::function<void(const EventRecord&, const char*, long long)>& visit) {
+    auto offset = (long long)sizeof(EventSegmentHeader);
+    while(offset + (long long)sizeof(EventRecord) <= size) {
+        auto record = (const EventRecord*)(map + offset);
+        if(record->magic != event_log_magic or record->length < sizeof(EventRecord) or record->length % 8 or
+           offset + record->length > size or _record_length(record->payload_length()) != record->length) break;
+        if(last_sequence and record->sequence != last_sequence + 1) break;
+        auto payload = map + offset + sizeof(EventRecord);
+        if(_checksum(*record, payload) != record->checksum) break;
+        if(visit) visit(*record, payload, offset);
+        last_sequence = record->sequence;
+        offset += record->length;
+    }
+    return offset;
+}
+
+// whether the segment header at map is valid
+static bool _valid_segment(const char* map, long long size) {
+    return size >= (long long)sizeof(EventSegmentHeader) and not memcmp(map, event_segment_magic, sizeof(event_segment_magic));
+}
+
+bool EventLog::open(const string& dir) {
+    close();
+    if(not _make_dirs(dir)) { message("cannot create the event log directory <%s>\n", dir.c_str()); return false; }
+    this->dir = dir;
+    max_payload = std::min(max_payload, std::min(ring_size, segment_size) / 4);
+    ring.assign(ring_size, 0);
+    head = tail = flush_to = 0;
+    sequence = 0;
+
+    // resume after the last valid record of the last segment
+    auto last = 0;
+    while(_file_exists(_segment_filename(dir, last))) last ++;
+    auto ok = false;
+    if(last and _map_segment(last - 1, 0)) {
+        if(_valid_segment(segment_map, segment_length)) {
+            sequence = ((EventSegmentHeader*)segment_map)->first_sequence - 1;
+            auto records = 0;
+            segment_offset = _scan_segment(segment_map, segment_length, sequence,
+                                           [&records](const EventRecord&, const char*, long long){ records ++; });
+            // a torn tail is zeroed, so the records appended next are followed by zeros
+            auto torn = segment_map + segment_offset, end = segment_map + segment_length;
+            if(std::find_if(torn, end, [](char c){ return c != 0; }) != end) {
+                message("event log: segment %d torn after %d records at %lld, discarding the rest\n", last - 1, records, segment_offset);
+                std::fill(torn, end, 0);
+                msync(segment_map, segment_length, MS_SYNC);
+            }
+            ok = true;
+        }
+        else {
+            message("event log: segment %d has no valid header, starting a new one\n", last - 1);
+            _unmap_segment();
+        }
+    }
+    if(not ok and not _map_segment(last, sequence + 1)) { this->dir.clear(); return false; }
+
+    records_metric = metric_counter("dist_scene_event_log_records", "records committed to the event log");
+    bytes_metric = metric_counter("dist_scene_event_log_bytes", "bytes committed to the event log");
+    dropped_metric = metric_counter("dist_scene_event_log_dropped", "events dropped with the event log ring full");
+    commit_metric = metric_histogram("dist_scene_event_log_commit_seconds", "copy and sync of a batch of the event log", "", 1e-9);
+    message("event log %s: segment %d, last record %lld\n", dir.c_str(), segment_index, sequence);
+
+    closing = false;
+    writer = std::thread([this](){ _write_loop(); });
+    append(event_open, nullptr, 0, 0);
+    return true;
+}
+
+long long EventLog::append(int type, const char* data, long long length, long long version, long long edit_id, long long origin_time) {
+    if(dir.empty()) return 0;
+    auto record = EventRecord();
+    record.time = _wall_now();
+    record.origin_time = origin_time;
+    record.version = version;
+    record.edit_id = edit_id;
+    record.type = type;
+    record.message_length = (uint32_t)length;
+    record.flags = (length > max_payload) ? event_omitted : (length ? event_payload : 0);
+    record.length = (uint32_t)_record_length(record.payload_length());
+
+    std::lock_guard<std::mutex> guard(lock);
+    // records do not wrap around the ring: the space up to its end is skipped
+    auto position = head % ring_size, contiguous = ring_size - position;
+    auto needed = record.length + ((record.length > contiguous) ? contiguous : 0);
+    if(head + needed - tail > ring_size) {
+        dropped ++;
+        if(dropped_metric) dropped_metric->add();
+        return 0;
+    }
+    if(record.length > contiguous) {
+        *(uint32_t*)&ring[position] = event_log_padding;
+        head += contiguous;
+        position = 0;
+    }
+    record.sequence = ++ sequence;
+    auto target = ring.data() + position;
+    memcpy(target, &record, sizeof(EventRecord));
+    auto payload = record.payload_length();
+    if(payload) memcpy(target + sizeof(EventRecord), data, payload);
+    memset(target + sizeof(EventRecord) + payload, 0, record.length - sizeof(EventRecord) - payload);
+    head += record.length;
+    if(head - tail >= commit_bytes) wake.notify_all();
+    return record.sequence;
+}
+
+void EventLog::flush() {
+    if(dir.empty()) return;
+    std::unique_lock<std::mutex> guard(lock);
+    flush_to = std::max(flush_to, head);
+    wake.notify_all();
+    auto target = head;
+    wake.wait(guard, [this, target](){ return tail >= target or not writer.joinable(); });
+}
+
+void EventLog::close() {
+    if(dir.empty()) return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+        wake.notify_all();
+    }
+    if(writer.joinable()) writer.join();
+    _unmap_segment();
+    message("event log %s closed: %lld records, %lld dropped\n", dir.c_str(), sequence, dropped);
+    dir.clear();
+    ring = vector<char>();
+}
+
+void EventLog::_write_loop() {
+    auto interval = std::chrono::microseconds((long long)(commit_interval * 1e6));
+    std::unique_lock<std::mutex> guard(lock);
+    while(true) {
+        wake.wait_for(guard, interval, [this](){ return closing or flush_to > tail or head - tail >= commit_bytes; });
+        auto from = tail, to = head;
+        auto done = closing;
+        if(from != to) {
+            // the records [from,to) are only read here: append writes after head
+            guard.unlock();
+            _commit(from, to);
+            guard.lock();
+            tail = to;
+            wake.notify_all();
+        }
+        if(done and tail == head) break;
+    }
+}
+
+void EventLog::_commit(long long from, long long to) {
+    if(not segment_map) return;
+    auto start = trace_now();
+    auto synced = segment_offset, records = 0ll, bytes = to - from;
+    for(auto position = from; position < to; ) {
+        auto offset = position % ring_size;
+        if(*(uint32_t*)&ring[offset] == event_log_padding) { position += ring_size - offset; bytes -= ring_size - offset; continue; }
+        auto record = (EventRecord*)&ring[offset];
+        auto payload = &ring[offset + sizeof(EventRecord)];
+        if(segment_offset + record->length > segment_length) {
+            msync(segment_map + (synced & ~4095ll), segment_offset - (synced & ~4095ll), MS_SYNC);
+            _unmap_segment();
+            if(not _map_segment(segment_index + 1, record->sequence)) {
+                message("event log: cannot write segment %d, records after %lld are lost\n", segment_index + 1, record->sequence - 1);
+                return;
+            }
+            synced = segment_offset;
+        }
+        record->checksum = _checksum(*record, payload);
+        memcpy(segment_map + segment_offset, record, record->length);
+        segment_offset += record->length;
+        position += record->length;
+        records ++;
+    }
+    // one sync for the whole batch (from the page of its first record)
+    msync(segment_map + (synced & ~4095ll), segment_offset - (synced & ~4095ll), MS_SYNC);
+    records_metric->add(records);
+    bytes_metric->add(bytes);
+    commit_metric->record(trace_now() - start);
+}
+
+bool EventLog::_map_segment(int index, long long first_sequence) {
+    auto filename = _segment_filename(dir, index);
+    auto exists = _file_exists(filename);
+    segment_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if(segment_fd < 0) { message("cannot open <%s>\n", filename.c_str()); return false; }
+    struct stat info;
+    fstat(segment_fd, &info);
+    segment_length = (exists and info.st_size) ? info.st_size : segment_size;
+    if(not exists or not info.st_size) {
+        // preallocated, so that the records are written to mapped pages only
+        if(ftruncate(segment_fd, segment_length)) { message("cannot allocate <%s>\n", filename.c_str()); ::close(segment_fd); segment_fd = -1; return false; }
+    }
+    auto map = mmap(nullptr, segment_length, PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+    if(map == MAP_FAILED) { message("cannot map <%s>\n", filename.c_str()); ::close(segment_fd); segment_fd = -1; return false; }
+    segment_map = (char*)map;
+    segment_index = index;
+    segment_offset = sizeof(EventSegmentHeader);
+    if(not exists or not info.st_size) {
+        auto header = EventSegmentHeader();
+        memcpy(header.magic, event_segment_magic, sizeof(header.magic));
+        header.index = index;
+        header.first_sequence = first_sequence;
+        header.created = _wall_now();
+        header.size = segment_length;
+        memcpy(segment_map, &header, sizeof(header));
+        msync(segment_map, sizeof(header), MS_SYNC);
+    }
+    return true;
+}
+
+void EventLog::_unmap_segment() {
+    if(segment_map) munmap(segment_map, segment_length);
+    if(segment_fd >= 0) ::close(segment_fd);
+    segment_map = nullptr;
+    segment_fd = -1;
+}
+
+long long read_event_log(const string& dir,
+                         const std::function<void(const EventRecord&, const char* payload, int segment, long long offset)>& visit) {
+    auto count = 0ll, last_sequence = 0ll;
+    for(auto index = 0; _file_exists(_segment_filename(dir, index)); index ++) {
+        auto filename = _segment_filename(dir, index);
+        auto fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0) { message("cannot open <%s>\n", filename.c_str()); continue; }
+        struct stat info;
+        fstat(fd, &info);
+        auto map = (info.st_size) ? mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if(map == MAP_FAILED or not _valid_segment((const char*)map, info.st_size)) {
+            message("event log: segment %d has no valid header\n", index);
+            if(map != MAP_FAILED) munmap(map, info.st_size);
+            ::close(fd);
+            continue;
+        }
+        auto header = (const EventSegmentHeader*)map;
+        if(last_sequence and header->first_sequence != last_sequence + 1)
+            message("event log: segment %d starts at record %lld, after %lld\n", index, (long long)header->first_sequence, last_sequence);
+        last_sequence = header->first_sequence - 1;
+        auto end = _scan_segment((const char*)map, info.st_size, last_sequence,
+                                 [&](const EventRecord& record, const char* payload, long long offset){ count ++; visit(record, payload, index, offset); });
+        auto rest = (const char*)map + end, map_end = (const char*)map + info.st_size;
+        if(std::find_if(rest, map_end, [](char c){ return c != 0; }) != map_end)
+            message("event log: segment %d has an invalid record at %lld\n", index, end);
+        munmap(map, info.st_size);
+        ::close(fd);
+    }
+    return count;
+}
+
+const char* event_type_name(int type) {
+    static const char* names[] = { "Operation", "Mesh", "SceneDiff", "MeshDiff", "CameraDiff",
+                                   "LightDiff", "MaterialDiff", "Obj_Mtl" };
+    if(type == event_open) return "open";
+    return (type >= 0 and type < (int)(sizeof(names) / sizeof(names[0]))) ? names[type] : "Unknown";
+}
@@ -0,0 +1,122 @@
+#ifndef _EVENT_LOG_H_
+#define _EVENT_LOG_H_
+
+#include "common.h"
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Event log: append-only record of the edits the server accepted, for auditing, recovery and
+// replay. append copies the event (metadata and the bytes of its message) into a ring preallocated
+// at open, under a lock and without allocating; a full ring drops the event (counted) instead of
+// blocking the caller. A writer thread moves the records in batches (group commit) to segment files
+// of the log directory (events_000000.log, ...), preallocated and written through a shared memory
+// map, syncing each batch once. Segments start with an EventSegmentHeader followed by the records
+// (zeros after the last); open resumes after the last valid record of the last segment and zeros
+// its torn tail. Messages larger than max_payload are recorded without their bytes.
+
+const uint32_t event_log_magic = 0x4c564544;         // "DEVL" at the start of each record
+const uint32_t event_log_padding = 0x44415044;       // "DPAD" in the ring, up to its end
+const char     event_segment_magic[8] = { 'D', 'S', 'E', 'V', 'L', 'O', 'G', '1' };
+
+// flags of a record
+enum { event_payload = 1,       // the message bytes follow the header
+       event_omitted = 2 };     // the message was larger than max_payload, its bytes are not recorded
+
+// type of the events that are not messages (messages keep their mesh_msg type)
+enum { event_open = 0x1000 };
+
+// header of a record, followed by its payload and zeros up to a multiple of 8 bytes
+struct EventRecord {
+    uint32_t    magic = event_log_magic;
+    uint32_t    length = 0;             // whole record (header, payload and padding)
+    int64_t     sequence = 0;           // number of the record in the log, from 1
+    int64_t     time = 0;               // wall clock when appended (ns since the epoch)
+    int64_t     origin_time = 0;        // trace_now when the edit was made (0 if not traced)
+    int64_t     version = 0;            // scene version (history label) after the edit
+    int64_t     edit_id = 0;            // id of the edit (0 if not traced)
+    int32_t     type = 0;               // mesh_msg type of the message
+    uint32_t    flags = 0;              // event_payload, event_omitted
+    uint32_t    message_length = 0;     // bytes of the message
+    uint32_t    checksum = 0;           // FNV-1a of the header (with checksum 0) and payload
+
+    uint32_t payload_length() const { return (flags & event_payload) ? message_length : 0; }
+};
+
+// header of a segment file
+struct EventSegmentHeader {
+    char        magic[8];               // event_segment_magic
+    int64_t     index = 0;              // number of the segment in its file name
+    int64_t     first_sequence = 0;     // sequence of the first record written to it
+    int64_t     created = 0;            // wall clock of creation (ns since the epoch)
+    int64_t     size = 0;               // size of the file
+    char        reserved[24] = {};
+};
+
+struct MetricCounter;
+struct MetricHistogram;
+
+struct EventLog {
+    string                  dir;                        // directory of the segments ("" when closed)
+    long long               segment_size = 64 << 20;    // bytes of a segment file
+    long long               ring_size = 16 << 20;       // bytes of the ring
+    long long               max_payload = 1 << 20;      // largest message recorded with its bytes
+    double                  commit_interval = 0.05;     // seconds between the commits of the writer
+    long long               commit_bytes = 1 << 20;     // bytes in the ring that wake the writer early
+
+    // ring: records appended at [tail,head) positions (modulo ring_size), moved by the writer
+    vector<char>            ring;
+    long long               head = 0, tail = 0;
+    long long               sequence = 0;               // last sequence appended
+    long long               dropped = 0;                // events dropped with the ring full
+    long long               flush_to = 0;               // ring position a flush waits for
+    std::mutex              lock;
+    std::condition_variable wake;
+    bool                    closing = false;
+    std::thread             writer;
+
+    // segment being written, mapped (written by the writer thread only once open)
+    int                     segment_index = -1;
+    int                     segment_fd = -1;
+    char*                   segment_map = nullptr;
+    long long               segment_length = 0;         // size of the segment file
+    long long               segment_offset = 0;         // end of the records in the segment
+
+    MetricCounter*          records_metric = nullptr;
+    MetricCounter*          bytes_metric = nullptr;
+    MetricCounter*          dropped_metric = nullptr;
+    MetricHistogram*        commit_metric = nullptr;
+
+    ~EventLog() { close(); }
+
+    // opens the log in dir (created if missing), resuming after its last valid record; false on errors
+    bool open(const string& dir);
+    // appends an event with the message bytes data; returns its sequence (0 if dropped or closed)
+    long long append(int type, const char* data, long long length, long long version,
+                     long long edit_id = 0, long long origin_time = 0);
+    // commits the records appended so far and waits for them to be synced
+    void flush();
+    // commits the pending records and closes the segment
+    void close();
+    bool is_open() const { return not dir.empty(); }
+
+    // writer thread: commits a batch every commit_interval, or earlier when commit_bytes are pending
+    void _write_loop();
+    // copies the records [from,to) of the ring to the segments and syncs them
+    void _commit(long long from, long long to);
+    // maps segment index, creating it if missing; false on errors
+    bool _map_segment(int index, long long first_sequence);
+    void _unmap_segment();
+};
+
+// calls visit on each valid record of the segments in dir, in order, with the segment and offset
+// it was read at; returns the records read (stops at the first invalid record of each segment)
+long long read_event_log(const string& dir,
+                         const std::function<void(const EventRecord&, const char* payload, int segment, long long offset)>& visit);
+
+// name of the type of a record
+const char* event_type_name(int type);
+
+#endif
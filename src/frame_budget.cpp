@@ -0,0 +1,101 @@
+#include "frame_budget.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+
+// interned name of the frame span and of the span of each stage
+static int _frame_trace_id(int stage) {
+    static const int ids[] = { trace_id("frame.shade"), trace_id("frame.drain"), trace_id("frame.decode"),
+                               trace_id("frame.apply"), trace_id("frame.swap"), trace_id("frame") };
+    return ids[stage];
+}
+
+void FrameBudget::begin_frame() {
+    current = FrameRecord();
+    current.start = trace_now();
+    trace_event_at(current.start, _frame_trace_id(frame_stage_count), trace_begin, count, trace_frame);
+    if(not last_report) last_report = current.start;
+}
+
+void FrameBudget::end_frame(int backlog) {
+    auto now = trace_now();
+    current.duration = now - current.start;
+    current.backlog = backlog;
+    trace_event_at(now, _frame_trace_id(frame_stage_count), trace_end, count, trace_frame);
+    frames[count % frame_budget_window] = current;
+    count ++;
+
+    if(current.work() > budget) {
+        overruns ++;
+        message("frame %lld over budget: %.2f ms (shade %.2f, drain %.2f, decode %.2f, apply %.2f), %d messages, %d left\n",
+                count - 1, current.work() / 1e6, current.stages[frame_shade] / 1e6, current.stages[frame_drain] / 1e6,
+                current.stages[frame_decode] / 1e6, current.stages[frame_apply] / 1e6, current.messages, backlog);
+        // the trace of the frame shows what the other threads did meanwhile too
+        if(dumps < max_dumps and (not last_dump or (now - last_dump) / 1e9 >= dump_interval)) {
+            auto filename = dump_prefix + std::to_string(count - 1) + ".json";
+            if(save_trace(filename, current.start, now)) message("saved <%s>\n", filename.c_str());
+            dumps ++;
+            last_dump = trace_now();
+        }
+    }
+
+    if(report_interval > 0 and (now - last_report) / 1e9 >= report_interval) {
+        message("%s\n", summary().c_str());
+        last_report = now;
+        report_overruns = overruns;
+    }
+}
+
+void FrameBudget::begin_stage(FrameStageKind stage) {
+    stage_start[stage] = trace_now();
+    trace_event_at(stage_start[stage], _frame_trace_id(stage), trace_begin, 0, trace_frame);
+}
+
+void FrameBudget::end_stage(FrameStageKind stage) {
+    auto now = trace_now();
+    trace_event_at(now, _frame_trace_id(stage), trace_end, 0, trace_frame);
+    current.stages[stage] += now - stage_start[stage];
+    stage_start[stage] = 0;
+}
+
+bool FrameBudget::drain_exhausted() const {
+    if(drain_budget <= 0 or not stage_start[frame_drain]) return false;
+    return trace_now() - stage_start[frame_drain] >= drain_budget;
+}
+
+// value at fraction p of sorted values (nearest rank), in ms
+static double _percentile_ms(const vector<long long>& sorted, double p) {
+    if(sorted.empty()) return 0;
+    auto rank = (int)ceil(p * sorted.size()) - 1;
+    return sorted[std::max(0, std::min(rank, (int)sorted.size() - 1))] / 1e6;
+}
+
+string FrameBudget::summary() const {
+    auto n = (int)std::min(count, (long long)frame_budget_window);
+    if(not n) return "frames: none";
+    auto work = vector<long long>(), duration = vector<long long>();
+    auto stages = vector<vector<long long>>(frame_stage_count);
+    auto messages = 0ll;
+    auto backlog = 0;
+    for(auto i : range(n)) {
+        auto& frame = frames[i];
+        work.push_back(frame.work());
+        duration.push_back(frame.duration);
+        for(auto s : range(frame_stage_count)) stages[s].push_back(frame.stages[s]);
+        messages += frame.messages;
+        backlog = std::max(backlog, frame.backlog);
+    }
+    std::sort(work.begin(), work.end());
+    std::sort(duration.begin(), duration.end());
+    auto text = tostring("frames %lld (last %d): work p50 %.2f p90 %.2f p99 %.2f max %.2f ms, frame p50 %.2f p99 %.2f ms, p99",
+                         count, n, _percentile_ms(work, 0.5), _percentile_ms(work, 0.9), _percentile_ms(work, 0.99),
+                         _percentile_ms(work, 1), _percentile_ms(duration, 0.5), _percentile_ms(duration, 0.99));
+    for(auto s : range(frame_stage_count)) {
+        std::sort(stages[s].begin(), stages[s].end());
+        text += tostring(" %s %.2f", frame_stage_name((FrameStageKind)s), _percentile_ms(stages[s], 0.99));
+    }
+    text += tostring(" ms, %.1f messages/frame, backlog max %d, overruns %lld (%lld since the last report)",
+                     (double)messages / n, backlog, overruns, overruns - report_overruns);
+    return text;
+}
+
@@ -0,0 +1,73 @@
+#ifndef _FRAME_BUDGET_H_
+#define _FRAME_BUDGET_H_
+
+#include "common.h"
+
+// Frame budget: the ui loop marks each frame and the stages within it (shade, drain of the incoming
+// messages, decode and apply of each, buffer swap) with FrameStage scopes, recorded as trace spans
+// (category trace_frame) and summed per frame. The work of a frame is its time without the swap,
+// which waits for the display; a frame working more than the budget is an overrun and the trace
+// of its time range is saved. The last frame_budget_window frames give the percentiles reported.
+
+// stages of a frame (decode and apply happen within drain)
+enum FrameStageKind { frame_shade = 0, frame_drain, frame_decode, frame_apply, frame_swap, frame_stage_count };
+
+// name of a stage
+inline const char* frame_stage_name(FrameStageKind stage) {
+    static const char* names[] = { "shade", "drain", "decode", "apply", "swap" };
+    return (stage < frame_stage_count) ? names[stage] : "unknown";
+}
+
+const int frame_budget_window = 1024;   // frames kept for the percentiles
+
+// times of a frame (ns)
+struct FrameRecord {
+    long long   start = 0;                          // trace_now at the beginning
+    long long   duration = 0;                       // whole frame
+    long long   stages[frame_stage_count] = {};     // time in each stage
+    int         messages = 0;                       // incoming messages handled
+    int         backlog = 0;                        // incoming messages left for the next frames
+
+    long long work() const { return duration - stages[frame_swap]; }
+};
+
+struct FrameBudget {
+    long long           budget = 16000000;          // work of a frame (ns)
+    long long           drain_budget = 0;           // time draining messages per frame (ns, 0 for no limit)
+    double              report_interval = 10;       // seconds between reports (0 for none)
+    string              dump_prefix = "../log/client_frame_";  // traces of the overruns, followed by the frame number
+    double              dump_interval = 1;          // seconds between traces saved
+    int                 max_dumps = 20;             // traces saved at most
+
+    vector<FrameRecord> frames = vector<FrameRecord>(frame_budget_window);  // ring of the last frames
+    long long           count = 0;                  // frames ended
+    long long           overruns = 0;               // frames over the budget
+    int                 dumps = 0;                  // traces saved
+    FrameRecord         current;                    // frame in progress
+    long long           stage_start[frame_stage_count] = {};  // beginning of the open stages
+    long long           last_dump = 0;              // trace_now of the last trace saved
+    long long           last_report = 0;            // trace_now of the last report
+    long long           report_overruns = 0;        // overruns at the last report
+
+    // starts a frame
+    void begin_frame();
+    // ends the frame with backlog messages left; checks the budget and reports
+    void end_frame(int backlog = 0);
+    // starts and ends a stage of the current frame
+    void begin_stage(FrameStageKind stage);
+    void end_stage(FrameStageKind stage);
+    // whether the frame spent its drain budget (messages left wait for the next frame)
+    bool drain_exhausted() const;
+    // percentiles of the frames in the window, in one line
+    string summary() const;
+};
+
+// time of a stage from construction to destruction, added to the current frame of budget
+struct FrameStage {
+    FrameBudget*    budget;
+    FrameStageKind  stage;
+    FrameStage(FrameBudget* budget, FrameStageKind stage) : budget(budget), stage(stage) { budget->begin_stage(stage); }
+    ~FrameStage() { budget->end_stage(stage); }
+};
+
+#endif
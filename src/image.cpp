@@ -1,5 +1,87 @@
 #include "image.h"
 #include "lodepng.h"
+#include <cstring>
+
+// largest finite half-float value
+static const float _half_max = 65504.0f;
+
+// converts a float to a half-float (round to nearest, overflow to inf, denormals supported)
+static unsigned short _float_to_half(float f) {
+    unsigned int x; memcpy(&x, &f, sizeof(x));
+    unsigned int sign = (x >> 16) & 0x8000;
+    int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+    unsigned int mant = x & 0x7fffff;
+    if(((x >> 23) & 0xff) == 0xff) return (unsigned short)(sign | 0x7c00 | (mant ? 0x200 : 0));
+    if(exp >= 31) return (unsigned short)(sign | 0x7c00);
+    if(exp <= 0) {
+        if(exp < -10) return (unsigned short)sign;
+        mant |= 0x800000;
+        auto shift = (unsigned int)(14 - exp);
+        auto half = mant >> shift;
+        if((mant >> (shift-1)) & 1) half ++;
+        return (unsigned short)(sign | half);
+    }
+    auto half = (unsigned int)(sign | (exp << 10) | (mant >> 13));
+    if(mant & 0x1000) half ++;
+    return (unsigned short)half;
+}
+
+// converts a half-float to a float
+static float _half_to_float(unsigned short h) {
+    unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    unsigned int exp = (h >> 10) & 0x1f;
+    unsigned int mant = h & 0x3ff;
+    unsigned int x;
+    if(exp == 0) {
+        if(mant == 0) x = sign;
+        else {
+            exp = 127 - 15 + 1;
+            while(not (mant & 0x400)) { mant <<= 1; exp --; }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if(exp == 31) x = sign | 0x7f800000 | (mant << 13);
+    else x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    float f; memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+vec3f texture3::at(int i, int j) const {
+    auto idx = j*_w+i;
+    switch(_f) {
+        case texel_format::rgb8: {
+            auto t = _d.data() + idx*3;
+            return vec3f(t[0] / 255.0f, t[1] / 255.0f, t[2] / 255.0f);
+        }
+        case texel_format::rgb16f: {
+            auto t = (const unsigned short*)_d.data() + idx*3;
+            return vec3f(_half_to_float(t[0]), _half_to_float(t[1]), _half_to_float(t[2]));
+        }
+        case texel_format::rgb32f: {
+            auto t = (const float*)_d.data() + idx*3;
+            return vec3f(t[0], t[1], t[2]);
+        }
+    }
+    return zero3f;
+}
+
+texture3 make_texture(const image3f& img) {
+    auto hdr = false;
+    for(auto i : range(img.width()*img.height())) {
+        auto& c = img.data()[i];
+        if(fabs(c.x) > _half_max or fabs(c.y) > _half_max or fabs(c.z) > _half_max) { hdr = true; break; }
+    }
+    auto txt = texture3(img.width(), img.height(), (hdr) ? texel_format::rgb32f : texel_format::rgb16f);
+    if(hdr) memcpy(txt._d.data(), img.data(), txt._d.size());
+    else {
+        auto t = (unsigned short*)txt._d.data();
+        for(auto i : range(img.width()*img.height())) {
+            t[i*3+0] = _float_to_half(img.data()[i].x);
+            t[i*3+1] = _float_to_half(img.data()[i].y);
+            t[i*3+2] = _float_to_half(img.data()[i].z);
+        }
+    }
+    return txt;
+}
 
 static void _read_pnm(const string& filename, char& type,
                int& width, int& height, int& nc,
@@ -164,6 +246,26 @@ image3f read_png(const string& filename, bool flipY) {
 	return img;
 }
 
+texture3 read_png_texture(const string& filename, bool flipY) {
+    vector<unsigned char> pixels;
+    unsigned width, height;
+    
+    // decode straight to 8-bit rgb, no float conversion
+    unsigned error = lodepng::decode(pixels, width, height, filename, LCT_RGB, 8);
+    error_if_not(not error,"cannot read png image: %s", filename.c_str());
+    if(error) return texture3();
+    
+    error_if_not(pixels.size() == width*height*3, "bad reading");
+    
+    auto txt = texture3(width, height, texel_format::rgb8);
+    auto row = width*3;
+    for(auto y = 0u; y < height; y ++) {
+        auto yy = (flipY) ? height-y-1 : y;
+        memcpy(txt._d.data() + yy*row, pixels.data() + y*row, row);
+    }
+    return txt;
+}
+
 void write_png(const string& filename, const image3f& img, bool flipY) {
     vector<unsigned char> img_png(img.width()*img.height()*4);
     for(int x = 0; x < img.width(); x++ ) {
@@ -68,6 +68,52 @@ private:
 	vector<vec3f> _d;
 };
 
+// Texel storage of a texture: 8-bit normalized, half-float or float (only for values beyond half range)
+enum struct texel_format { rgb8, rgb16f, rgb32f };
+
+// A color texture kept in compact texel storage (3 bytes per texel for ldr images, 6 for hdr ones)
+struct texture3 {
+    // Default Constructor (empty texture)
+    texture3() : _w(0), _h(0), _f(texel_format::rgb8) { }
+    // Size Constructor (sets width, height and texel format)
+    texture3(int w, int h, texel_format f) : _w(w), _h(h), _f(f), _d(w*h*texel_size(f),0) { }
+    
+    // texture width
+    int width() const { return _w; }
+    // texture height
+    int height() const { return _h; }
+    // texel format
+    texel_format format() const { return _f; }
+    // whether the texture holds no texels (not loaded yet or failed to load)
+    bool empty() const { return _w == 0 or _h == 0; }
+    
+    // raw texel data (layout given by format)
+    void* data() { return _d.data(); }
+    // raw texel data (layout given by format)
+    const void* data() const { return _d.data(); }
+    // size of the texel data in bytes
+    size_t bytes() const { return _d.size(); }
+    
+    // texel lookup converted to floating point
+    vec3f at(int i, int j) const;
+    
+    // size in bytes of a texel in format f
+    static int texel_size(texel_format f) { return (f == texel_format::rgb8) ? 3 : ((f == texel_format::rgb16f) ? 6 : 12); }
+    
+private:
+    int _w, _h;
+    texel_format _f;
+    vector<unsigned char> _d;
+    
+    friend texture3 make_texture(const image3f& img);
+    friend texture3 read_png_texture(const string& filename, bool flipY);
+};
+
+// Converts a floating point image to a texture, using half-float texels (or float if out of half range)
+texture3 make_texture(const image3f& img);
+// Load a compressed PNG color image keeping its 8-bit texels
+texture3 read_png_texture(const string& filename, bool flipY);
+
 // Write an floating point color PFM image file
 void write_pfm(const string& filename, const image3f& img, bool flipY = false);
 // Write an 8-bit color compressed PNG file (sets PNG alpha to 1 everywhere)
@@ -0,0 +1,607 @@
+#include "intersect.h"
+#include "common.h"
+
+int     bvh_leaf_size = 4;
+float   bvh_rebuild_threshold = 1.5f;
+int     bounds_cluster_size = 1024;
+float   cull_min_pixels = 1;
+
+// number of bins used to evaluate the SAH splits
+const int _bvh_bins = 16;
+// nodes with more elements than this compute bounds and bins in parallel
+const int _bvh_parallel_elements = 1 << 16;
+// max depth of the traversal stack
+const int _bvh_stack_size = 256;
+
+// empty box, grown by _grow
+inline range3f _empty_bbox() { return range3f(vec3f(HUGE_VALF,HUGE_VALF,HUGE_VALF), vec3f(-HUGE_VALF,-HUGE_VALF,-HUGE_VALF)); }
+inline void _grow(range3f& bbox, const vec3f& p) { bbox.min = min(bbox.min,p); bbox.max = max(bbox.max,p); }
+inline void _grow(range3f& bbox, const range3f& b) { bbox.min = min(bbox.min,b.min); bbox.max = max(bbox.max,b.max); }
+
+// surface area of a box (0 if empty)
+inline float _area(const range3f& bbox) {
+    auto s = bbox.max - bbox.min;
+    if(s.x < 0 or s.y < 0 or s.z < 0) return 0;
+    return 2 * (s.x*s.y + s.y*s.z + s.z*s.x);
+}
+
+// component of v along axis
+inline float _axis(const vec3f& v, int axis) { return (&v.x)[axis]; }
+
+// bounding box of an element
+inline range3f _element_bbox(Mesh* mesh, int triangles, int element) {
+    auto bbox = _empty_bbox();
+    if(element < triangles) {
+        auto& t = mesh->triangle_index[element];
+        _grow(bbox, mesh->pos[t.x]); _grow(bbox, mesh->pos[t.y]); _grow(bbox, mesh->pos[t.z]);
+    } else {
+        auto& q = mesh->quad_index[element-triangles];
+        _grow(bbox, mesh->pos[q.x]); _grow(bbox, mesh->pos[q.y]); _grow(bbox, mesh->pos[q.z]); _grow(bbox, mesh->pos[q.w]);
+    }
+    return bbox;
+}
+
+// SAH cost contributed by a node: traversal for internal nodes, intersection for leaves
+inline double _node_cost(const BVHNode& node) { return _area(node.bbox) * (node.count ? node.count : 1); }
+
+// top-down binned SAH builder
+struct _bvh_builder {
+    BVHAccelerator*     bvh = nullptr;
+    vector<range3f>     bboxes;         // element bounds
+    vector<vec3f>       centroids;      // element bounds centers
+
+    // number of chunks a range of n elements is split into for the parallel passes
+    int chunks(int n) { return (n > _bvh_parallel_elements) ? parallel_threads() * 4 : 1; }
+
+    // bounds of the elements in [start,end) and of their centroids
+    void bounds(int start, int end, range3f& bbox, range3f& cbox) {
+        auto nchunks = chunks(end - start);
+        auto chunk_bbox = vector<range3f>(nchunks, _empty_bbox());
+        auto chunk_cbox = vector<range3f>(nchunks, _empty_bbox());
+        parallel_for(nchunks, [&](int c) {
+            auto cstart = start + (long long)(end - start) * c / nchunks;
+            auto cend = start + (long long)(end - start) * (c+1) / nchunks;
+            for(auto i = cstart; i < cend; i ++) {
+                auto e = bvh->elements[i];
+                _grow(chunk_bbox[c], bboxes[e]);
+                _grow(chunk_cbox[c], centroids[e]);
+            }
+        });
+        bbox = cbox = _empty_bbox();
+        for(auto c : range(nchunks)) { _grow(bbox, chunk_bbox[c]); _grow(cbox, chunk_cbox[c]); }
+    }
+
+    // builds the subtree over elements [start,end), returns its node
+    int build(int start, int end, int parent) {
+        auto n = (int)bvh->nodes.size();
+        bvh->nodes.push_back(BVHNode());
+        bvh->parent.push_back(parent);
+        auto bbox = _empty_bbox(), cbox = _empty_bbox();
+        bounds(start, end, bbox, cbox);
+        bvh->nodes[n].bbox = bbox;
+
+        auto count = end - start;
+        auto extent = cbox.max - cbox.min;
+        auto axis = (extent.x >= extent.y and extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+        auto axis_min = _axis(cbox.min, axis), axis_extent = _axis(extent, axis);
+        if(count <= bvh_leaf_size or axis_extent <= 0) {
+            bvh->nodes[n].start = start;
+            bvh->nodes[n].count = count;
+            return n;
+        }
+
+        // bin the centroids along the axis
+        auto bin_of = [&](int e) { return min((int)(_bvh_bins * (_axis(centroids[e], axis) - axis_min) / axis_extent), _bvh_bins-1); };
+        auto nchunks = chunks(count);
+        auto chunk_bins = vector<array<pair<int,range3f>,_bvh_bins>>(nchunks);
+        for(auto& bins : chunk_bins) for(auto& bin : bins) bin = make_pair(0, _empty_bbox());
+        parallel_for(nchunks, [&](int c) {
+            auto cstart = start + (long long)count * c / nchunks;
+            auto cend = start + (long long)count * (c+1) / nchunks;
+            for(auto i = cstart; i < cend; i ++) {
+                auto e = bvh->elements[i];
+                auto& bin = chunk_bins[c][bin_of(e)];
+                bin.first ++;
+                _grow(bin.second, bboxes[e]);
+            }
+        });
+        auto bins = chunk_bins[0];
+        for(auto c = 1; c < nchunks; c ++) {
+            for(auto b : range(_bvh_bins)) {
+                bins[b].first += chunk_bins[c][b].first;
+                _grow(bins[b].second, chunk_bins[c][b].second);
+            }
+        }
+
+        // sweep the split planes: cost of splitting after bin k is n_left*area_left + n_right*area_right
+        float right_cost[_bvh_bins];
+        auto acc = _empty_bbox();
+        auto acc_count = 0;
+        for(auto b = _bvh_bins-1; b > 0; b --) {
+            acc_count += bins[b].first;
+            _grow(acc, bins[b].second);
+            right_cost[b] = acc_count * _area(acc);
+        }
+        auto best_split = -1;
+        auto best_cost = HUGE_VALF;
+        acc = _empty_bbox();
+        acc_count = 0;
+        for(auto b = 1; b < _bvh_bins; b ++) {
+            acc_count += bins[b-1].first;
+            _grow(acc, bins[b-1].second);
+            auto cost = acc_count * _area(acc) + right_cost[b];
+            if(cost < best_cost) { best_cost = cost; best_split = b; }
+        }
+
+        // small nodes stay leaves when splitting does not pay off
+        if(count <= 4 * bvh_leaf_size and best_cost + _area(bbox) >= count * _area(bbox)) {
+            bvh->nodes[n].start = start;
+            bvh->nodes[n].count = count;
+            return n;
+        }
+
+        auto elements = bvh->elements.begin();
+        auto mid = (int)(partition(elements+start, elements+end, [&](int e){ return bin_of(e) < best_split; }) - elements);
+        if(mid == start or mid == end) {
+            mid = (start + end) / 2;
+            nth_element(elements+start, elements+mid, elements+end, [&](int a, int b){ return _axis(centroids[a], axis) < _axis(centroids[b], axis); });
+        }
+
+        build(start, mid, n);
+        auto right = build(mid, end, n);
+        bvh->nodes[n].start = right;
+        bvh->nodes[n].count = 0;
+        return n;
+    }
+};
+
+void make_bvh(Mesh* mesh) {
+    if(not mesh->bvh) mesh->bvh = new BVHAccelerator();
+    auto bvh = mesh->bvh;
+    *bvh = BVHAccelerator();
+
+    // only the entries referenced by the face maps are elements
+    bvh->triangles = mesh->triangle_index.size();
+    auto total = bvh->triangles + (int)mesh->quad_index.size();
+    bvh->element_ids.assign(total, 0);
+    bvh->element_leaf.assign(total, -1);
+    bvh->elements.reserve(mesh->triangle.size() + mesh->quad.size());
+    for(auto& t : mesh->triangle) {
+        auto e = get<0>(t.second);
+        bvh->element_ids[e] = t.first;
+        bvh->elements.push_back(e);
+    }
+    for(auto& q : mesh->quad) {
+        auto e = bvh->triangles + get<0>(q.second);
+        bvh->element_ids[e] = q.first;
+        bvh->elements.push_back(e);
+    }
+    bvh->valid = true;
+    if(bvh->elements.empty()) return;
+
+    auto builder = _bvh_builder();
+    builder.bvh = bvh;
+    builder.bboxes.resize(total);
+    builder.centroids.resize(total);
+    parallel_for(bvh->elements.size(), [&](int i) {
+        auto e = bvh->elements[i];
+        builder.bboxes[e] = _element_bbox(mesh, bvh->triangles, e);
+        builder.centroids[e] = center(builder.bboxes[e]);
+    }, 4096);
+    bvh->nodes.reserve(2 * bvh->elements.size() / max(bvh_leaf_size,1) + 1);
+    builder.build(0, bvh->elements.size(), -1);
+
+    for(auto n : range(bvh->nodes.size())) {
+        auto& node = bvh->nodes[n];
+        bvh->cost += _node_cost(node);
+        for(auto i = node.start; i < node.start + node.count; i ++) bvh->element_leaf[bvh->elements[i]] = n;
+    }
+    auto root_area = _area(bvh->nodes[0].bbox);
+    bvh->build_cost = (root_area > 0) ? bvh->cost / root_area : 0;
+}
+
+void refit_bvh(Mesh* mesh, const vector<int>& elements) {
+    auto bvh = mesh->bvh;
+    if(not bvh or not bvh->valid or bvh->nodes.empty()) return;
+
+    // nodes to refit, children before parents (children always follow their parent)
+    auto nodes = vector<int>();
+    if(elements.empty()) {
+        nodes.resize(bvh->nodes.size());
+        for(auto n : range(bvh->nodes.size())) nodes[n] = n;
+    } else {
+        for(auto e : elements) {
+            if(e >= 0 and e < (int)bvh->element_leaf.size() and bvh->element_leaf[e] >= 0) nodes.push_back(bvh->element_leaf[e]);
+        }
+        sort(nodes.begin(), nodes.end());
+        nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+        auto leaves = nodes.size();
+        for(auto i : range(leaves)) {
+            for(auto n = bvh->parent[nodes[i]]; n >= 0; n = bvh->parent[n]) nodes.push_back(n);
+        }
+        sort(nodes.begin(), nodes.end());
+        nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+    }
+
+    for(auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+        auto& node = bvh->nodes[*it];
+        bvh->cost -= _node_cost(node);
+        if(node.count) {
+            node.bbox = _empty_bbox();
+            for(auto i = node.start; i < node.start + node.count; i ++) _grow(node.bbox, _element_bbox(mesh, bvh->triangles, bvh->elements[i]));
+        } else {
+            node.bbox = bvh->nodes[*it+1].bbox;
+            _grow(node.bbox, bvh->nodes[node.start].bbox);
+        }
+        bvh->cost += _node_cost(node);
+    }
+
+    // refitting keeps the topology: when the boxes grew too much relative to the build, rebuild
+    auto root_area = _area(bvh->nodes[0].bbox);
+    if(root_area > 0 and bvh->cost / root_area > bvh_rebuild_threshold * bvh->build_cost) make_bvh(mesh);
+}
+
+void update_bvh(Mesh* mesh, MeshDiff* meshdiff) {
+    auto bvh = mesh->bvh;
+    if(not bvh or not bvh->valid) return;
+    if(not meshdiff->add_triangle.empty() or not meshdiff->remove_triangle.empty() or
+       not meshdiff->add_quad.empty() or not meshdiff->remove_quad.empty()) {
+        invalidate_bvh(mesh);
+        return;
+    }
+    auto elements = vector<int>();
+    for(auto& v : meshdiff->update_vertex) {
+        auto vertex = mesh->vertices.find(v.first);
+        if(vertex == mesh->vertices.end()) continue;
+        for(auto f : vertex->second.second) {
+            auto t = mesh->triangle.find(f);
+            if(t != mesh->triangle.end()) { elements.push_back(get<0>(t->second)); continue; }
+            auto q = mesh->quad.find(f);
+            if(q != mesh->quad.end()) elements.push_back(bvh->triangles + get<0>(q->second));
+        }
+    }
+    if(not elements.empty()) refit_bvh(mesh, elements);
+}
+
+void invalidate_bvh(Mesh* mesh) {
+    if(mesh->bvh) mesh->bvh->valid = false;
+}
+
+// grows bbox with the vertices of a face (skipping removed faces)
+inline void _grow_face(range3f& bbox, const vector<vec3f>& pos, const vec3i& f) {
+    if(f.x < 0) return;
+    _grow(bbox, pos[f.x]); _grow(bbox, pos[f.y]); _grow(bbox, pos[f.z]);
+}
+inline void _grow_face(range3f& bbox, const vector<vec3f>& pos, const vec4i& f) {
+    if(f.x < 0) return;
+    _grow(bbox, pos[f.x]); _grow(bbox, pos[f.y]); _grow(bbox, pos[f.z]); _grow(bbox, pos[f.w]);
+}
+
+// bounds of cluster c of the faces in index
+template<typename T>
+range3f _cluster_bbox(const vector<vec3f>& pos, const vector<T>& index, int c) {
+    auto bbox = _empty_bbox();
+    auto end = min((int)index.size(), (c + 1) * bounds_cluster_size);
+    for(auto i = c * bounds_cluster_size; i < end; i ++) _grow_face(bbox, pos, index[i]);
+    return bbox;
+}
+
+// resizes the clusters of bounds to the faces of mesh; new clusters are loose
+void _resize_clusters(Mesh* mesh, MeshBounds* bounds) {
+    auto triangles = (mesh->triangle_index.size() + bounds_cluster_size - 1) / bounds_cluster_size;
+    auto quads = (mesh->quad_index.size() + bounds_cluster_size - 1) / bounds_cluster_size;
+    bounds->triangle_clusters.resize(triangles);
+    bounds->triangle_loose.resize(triangles, 1);
+    bounds->quad_clusters.resize(quads);
+    bounds->quad_loose.resize(quads, 1);
+}
+
+void fit_bounds(Mesh* mesh) {
+    if(not mesh->bounds) mesh->bounds = new MeshBounds();
+    auto bounds = mesh->bounds;
+    _resize_clusters(mesh, bounds);
+    if(not bounds->valid) {
+        fill(bounds->triangle_loose.begin(), bounds->triangle_loose.end(), 1);
+        fill(bounds->quad_loose.begin(), bounds->quad_loose.end(), 1);
+    }
+    // loose clusters, quads after triangles
+    auto loose = vector<int>();
+    for(auto c : range(bounds->triangle_loose.size())) if(bounds->triangle_loose[c]) loose.push_back(c);
+    auto loose_triangles = (int)loose.size();
+    for(auto c : range(bounds->quad_loose.size())) if(bounds->quad_loose[c]) loose.push_back(c);
+    if(not loose.empty() or not bounds->valid) {
+        parallel_for(loose.size(), [&](int i) {
+            auto c = loose[i];
+            if(i < loose_triangles) bounds->triangle_clusters[c] = _cluster_bbox(mesh->pos, mesh->triangle_index, c);
+            else bounds->quad_clusters[c] = _cluster_bbox(mesh->pos, mesh->quad_index, c);
+        }, 4);
+        fill(bounds->triangle_loose.begin(), bounds->triangle_loose.end(), 0);
+        fill(bounds->quad_loose.begin(), bounds->quad_loose.end(), 0);
+        bounds->bbox = _empty_bbox();
+        for(auto& bbox : bounds->triangle_clusters) _grow(bounds->bbox, bbox);
+        for(auto& bbox : bounds->quad_clusters) _grow(bounds->bbox, bbox);
+        // points, lines and splines may use vertices of no face
+        if(not mesh->point.empty() or not mesh->line.empty() or not mesh->spline.empty() or
+           (mesh->triangle_index.empty() and mesh->quad_index.empty()))
+            for(auto& p : mesh->pos) _grow(bounds->bbox, p);
+    }
+    bounds->valid = true;
+}
+
+void update_bounds(Mesh* mesh, MeshDiff* meshdiff) {
+    auto bounds = mesh->bounds;
+    if(not bounds or not bounds->valid) return;
+    if(mesh->dirty.all) {
+        invalidate_bounds(mesh);
+        return;
+    }
+    _resize_clusters(mesh, bounds);
+    // faces moved in the index arrays from the first changed entry on
+    if(mesh->dirty.triangle_from >= 0)
+        for(auto c = mesh->dirty.triangle_from / bounds_cluster_size; c < bounds->triangle_loose.size(); c ++) bounds->triangle_loose[c] = 1;
+    if(mesh->dirty.quad_from >= 0)
+        for(auto c = mesh->dirty.quad_from / bounds_cluster_size; c < bounds->quad_loose.size(); c ++) bounds->quad_loose[c] = 1;
+    // faces around the moved vertices
+    for(auto& v : meshdiff->update_vertex) {
+        auto vertex = mesh->vertices.find(v.first);
+        if(vertex == mesh->vertices.end()) continue;
+        for(auto f : vertex->second.second) {
+            auto t = mesh->triangle.find(f);
+            if(t != mesh->triangle.end()) { bounds->triangle_loose[get<0>(t->second) / bounds_cluster_size] = 1; continue; }
+            auto q = mesh->quad.find(f);
+            if(q != mesh->quad.end()) bounds->quad_loose[get<0>(q->second) / bounds_cluster_size] = 1;
+        }
+    }
+    // vertices of no face only matter to points and lines
+    if(not meshdiff->add_vertex.empty() and (not mesh->point.empty() or not mesh->line.empty() or not mesh->spline.empty()))
+        invalidate_bounds(mesh);
+}
+
+void invalidate_bounds(Mesh* mesh) {
+    if(mesh->bounds) mesh->bounds->valid = false;
+}
+
+ViewFrustum view_frustum(Scene* scene) {
+    auto camera = scene->camera;
+    auto view = ViewFrustum();
+    view.frame = camera->frame;
+    view.slope_x = camera->width / 2;
+    view.slope_y = camera->height / 2;
+    view.near = camera->dist;
+    view.far = 10000;
+    view.pixels = scene->image_height / camera->height;
+    return view;
+}
+
+// frustum test of a box: 0 if outside, 1 if crossing the frustum, 2 if inside
+int _frustum_test(const ViewFrustum& view, const frame3f& frame, const range3f& bbox) {
+    int outside[6] = {0,0,0,0,0,0};
+    for(auto i : range(8)) {
+        auto corner = vec3f((i & 1) ? bbox.max.x : bbox.min.x, (i & 2) ? bbox.max.y : bbox.min.y, (i & 4) ? bbox.max.z : bbox.min.z);
+        auto p = transform_point_inverse(view.frame, transform_point(frame, corner));
+        auto depth = -p.z;
+        outside[0] += depth < view.near;
+        outside[1] += depth > view.far;
+        outside[2] += p.x > depth * view.slope_x;
+        outside[3] += p.x < -depth * view.slope_x;
+        outside[4] += p.y > depth * view.slope_y;
+        outside[5] += p.y < -depth * view.slope_y;
+    }
+    auto crossing = false;
+    for(auto n : outside) {
+        if(n == 8) return 0;
+        if(n) crossing = true;
+    }
+    return crossing ? 1 : 2;
+}
+
+bool cull_bbox(const ViewFrustum& view, const frame3f& frame, const range3f& bbox) {
+    if(not isvalid(bbox)) return true;
+    if(_frustum_test(view, frame, bbox) == 0) return true;
+    // coverage of the bounding sphere, unless the camera is inside it
+    auto center = transform_point_inverse(view.frame, transform_point(frame, (bbox.min + bbox.max) / 2));
+    auto radius = length(bbox.max - bbox.min) / 2;
+    auto depth = -center.z;
+    return depth > radius and 2 * radius / depth * view.pixels < cull_min_pixels;
+}
+
+// appends the visible clusters of index to ranges, merging adjacent ones
+template<typename T>
+void _cull_clusters(const ViewFrustum& view, const frame3f& frame, const vector<range3f>& clusters, const vector<T>& index, bool inside, vector<pair<int,int>>& ranges) {
+    for(auto c : range(clusters.size())) {
+        if(not isvalid(clusters[c])) continue;
+        if(not inside and _frustum_test(view, frame, clusters[c]) == 0) continue;
+        auto begin = c * bounds_cluster_size, end = min((int)index.size(), begin + bounds_cluster_size);
+        if(not ranges.empty() and ranges.back().second == begin) ranges.back().second = end;
+        else ranges.push_back(make_pair(begin, end));
+    }
+}
+
+bool cull_mesh(Mesh* mesh, const ViewFrustum& view, vector<pair<int,int>>& triangles, vector<pair<int,int>>& quads) {
+    triangles.clear();
+    quads.clear();
+    fit_bounds(mesh);
+    auto bounds = mesh->bounds;
+    if(cull_bbox(view, mesh->frame, bounds->bbox)) return false;
+    // clusters are only tested when the mesh crosses the frustum
+    auto inside = _frustum_test(view, mesh->frame, bounds->bbox) == 2;
+    _cull_clusters(view, mesh->frame, bounds->triangle_clusters, mesh->triangle_index, inside, triangles);
+    _cull_clusters(view, mesh->frame, bounds->quad_clusters, mesh->quad_index, inside, quads);
+    return true;
+}
+
+// ray-box intersection (slabs), returns the entry distance in t
+inline bool _intersect_bbox(const range3f& bbox, const vec3f& e, const vec3f& inv_d, float tmin, float tmax, float& t) {
+    auto t0 = (bbox.min - e) * inv_d, t1 = (bbox.max - e) * inv_d;
+    auto tnear = max(max(min(t0.x,t1.x), min(t0.y,t1.y)), max(min(t0.z,t1.z), tmin));
+    auto tfar = min(min(max(t0.x,t1.x), max(t0.y,t1.y)), min(max(t0.z,t1.z), tmax));
+    t = tnear;
+    return tnear <= tfar;
+}
+
+// ray-triangle intersection (Moller-Trumbore), returns the distance in t and the barycentric
+// coordinates of v1 and v2 in uv
+inline bool _intersect_triangle(const ray3f& ray, const vec3f& v0, const vec3f& v1, const vec3f& v2, float tmax, float& t, vec2f& uv) {
+    auto e1 = v1 - v0, e2 = v2 - v0;
+    auto p = cross(ray.d, e2);
+    auto det = dot(e1, p);
+    if(det == 0) return false;
+    auto inv_det = 1 / det;
+    auto s = ray.e - v0;
+    auto u = dot(s, p) * inv_det;
+    if(u < 0 or u > 1) return false;
+    auto q = cross(s, e1);
+    auto v = dot(ray.d, q) * inv_det;
+    if(v < 0 or u + v > 1) return false;
+    t = dot(e2, q) * inv_det;
+    uv = vec2f(u, v);
+    return t >= ray.tmin and t <= tmax;
+}
+
+// closest hit of a ray with mesh (or any hit if intersection is nullptr)
+bool _intersect_mesh(Mesh* mesh, const ray3f& world_ray, intersection3f* intersection) {
+    if(not mesh->bvh or not mesh->bvh->valid) make_bvh(mesh);
+    auto bvh = mesh->bvh;
+    if(bvh->nodes.empty()) return false;
+
+    auto ray = transform_ray_inverse(mesh->frame, world_ray);
+    auto inv_d = vec3f(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+    auto tmax = ray.tmax;
+    auto hit_element = -1;
+    auto hit_vertices = vec3i(0,0,0);
+    auto hit_uv = zero2f;
+
+    int stack[_bvh_stack_size];
+    auto stack_size = 0;
+    float t = 0;
+    auto uv = zero2f;
+    if(not _intersect_bbox(bvh->nodes[0].bbox, ray.e, inv_d, ray.tmin, tmax, t)) return false;
+    stack[stack_size++] = 0;
+    while(stack_size) {
+        auto& node = bvh->nodes[stack[--stack_size]];
+        if(node.count) {
+            for(auto i = node.start; i < node.start + node.count; i ++) {
+                auto e = bvh->elements[i];
+                if(e < bvh->triangles) {
+                    auto& f = mesh->triangle_index[e];
+                    if(_intersect_triangle(ray, mesh->pos[f.x], mesh->pos[f.y], mesh->pos[f.z], tmax, t, uv)) {
+                        tmax = t; hit_element = e; hit_vertices = f; hit_uv = uv;
+                    }
+                } else {
+                    auto& f = mesh->quad_index[e-bvh->triangles];
+                    if(_intersect_triangle(ray, mesh->pos[f.x], mesh->pos[f.y], mesh->pos[f.z], tmax, t, uv)) {
+                        tmax = t; hit_element = e; hit_vertices = vec3i(f.x,f.y,f.z); hit_uv = uv;
+                    }
+                    if(_intersect_triangle(ray, mesh->pos[f.x], mesh->pos[f.z], mesh->pos[f.w], tmax, t, uv)) {
+                        tmax = t; hit_element = e; hit_vertices = vec3i(f.x,f.z,f.w); hit_uv = uv;
+                    }
+                }
+                if(hit_element >= 0 and not intersection) return true;
+            }
+            continue;
+        }
+        // visit the nearer child first
+        auto left = (int)(&node - &bvh->nodes[0]) + 1, right = node.start;
+        float tleft = 0, tright = 0;
+        auto hit_left = _intersect_bbox(bvh->nodes[left].bbox, ray.e, inv_d, ray.tmin, tmax, tleft);
+        auto hit_right = _intersect_bbox(bvh->nodes[right].bbox, ray.e, inv_d, ray.tmin, tmax, tright);
+        if(stack_size + 2 > _bvh_stack_size) continue;
+        if(hit_left and hit_right) {
+            if(tleft <= tright) { stack[stack_size++] = right; stack[stack_size++] = left; }
+            else { stack[stack_size++] = left; stack[stack_size++] = right; }
+        }
+        else if(hit_left) stack[stack_size++] = left;
+        else if(hit_right) stack[stack_size++] = right;
+    }
+    if(hit_element < 0) return false;
+    if(not intersection) return true;
+
+    auto &v0 = mesh->pos[hit_vertices.x], &v1 = mesh->pos[hit_vertices.y], &v2 = mesh->pos[hit_vertices.z];
+    auto w = vec3f(1 - hit_uv.x - hit_uv.y, hit_uv.x, hit_uv.y);
+    auto norm = cross(v1-v0, v2-v0);
+    if(mesh->norm.size() == mesh->pos.size()) {
+        auto interpolated = mesh->norm[hit_vertices.x]*w.x + mesh->norm[hit_vertices.y]*w.y + mesh->norm[hit_vertices.z]*w.z;
+        if(length(interpolated) > 0) norm = interpolated;
+    }
+    intersection->texcoord = zero2f;
+    if(mesh->texcoord.size() == mesh->pos.size())
+        intersection->texcoord = mesh->texcoord[hit_vertices.x]*w.x + mesh->texcoord[hit_vertices.y]*w.y + mesh->texcoord[hit_vertices.z]*w.z;
+
+    intersection->hit = true;
+    intersection->ray_t = tmax;
+    intersection->pos = world_ray.eval(tmax);
+    intersection->norm = normalize(transform_normal(mesh->frame, norm));
+    intersection->mat = mesh->mat;
+    intersection->mesh = mesh;
+    intersection->surface = nullptr;
+    intersection->face = bvh->element_ids[hit_element];
+    return true;
+}
+
+// closest hit of a ray with a sphere or quad surface
+bool _intersect_surface(Surface* surface, const ray3f& world_ray, intersection3f& intersection) {
+    auto ray = transform_ray_inverse(surface->frame, world_ray);
+    auto t = 0.0f;
+    auto norm = zero3f;
+    auto texcoord = zero2f;
+    if(surface->isquad) {
+        if(ray.d.z == 0) return false;
+        t = -ray.e.z / ray.d.z;
+        auto p = ray.eval(t);
+        if(t < ray.tmin or t > ray.tmax or fabs(p.x) > surface->radius or fabs(p.y) > surface->radius) return false;
+        norm = z3f;
+        texcoord = vec2f((p.x/surface->radius+1)/2, (p.y/surface->radius+1)/2);
+    } else {
+        auto a = dot(ray.d, ray.d), b = 2*dot(ray.d, ray.e), c = dot(ray.e, ray.e) - surface->radius*surface->radius;
+        auto det = b*b - 4*a*c;
+        if(det < 0) return false;
+        t = (-b - sqrt(det)) / (2*a);
+        if(t < ray.tmin) t = (-b + sqrt(det)) / (2*a);
+        if(t < ray.tmin or t > ray.tmax) return false;
+        norm = normalize(ray.eval(t));
+        texcoord = vec2f((atan2(norm.y, norm.x)/pif+1)/2, acos(clamp(norm.z,-1.0f,1.0f))/pif);
+    }
+    intersection.hit = true;
+    intersection.ray_t = t;
+    intersection.pos = world_ray.eval(t);
+    intersection.norm = normalize(transform_normal(surface->frame, norm));
+    intersection.texcoord = texcoord;
+    intersection.mat = surface->mat;
+    intersection.mesh = nullptr;
+    intersection.surface = surface;
+    intersection.face = 0;
+    return true;
+}
+
+bool intersect_mesh(Mesh* mesh, const ray3f& ray, intersection3f& intersection) {
+    return _intersect_mesh(mesh, ray, &intersection);
+}
+
+bool hit_mesh(Mesh* mesh, const ray3f& ray) {
+    return _intersect_mesh(mesh, ray, nullptr);
+}
+
+intersection3f intersect_scene(Scene* scene, const ray3f& ray) {
+    auto intersection = intersection3f();
+    auto closest = ray;
+    for(auto mesh : scene->meshes) {
+        if(intersect_mesh(mesh, closest, intersection)) closest.tmax = intersection.ray_t;
+    }
+    for(auto surface : scene->surfaces) {
+        if(_intersect_surface(surface, closest, intersection)) closest.tmax = intersection.ray_t;
+    }
+    return intersection;
+}
+
+bool hit_scene(Scene* scene, const ray3f& ray) {
+    for(auto mesh : scene->meshes) if(hit_mesh(mesh, ray)) return true;
+    auto intersection = intersection3f();
+    for(auto surface : scene->surfaces) if(_intersect_surface(surface, ray, intersection)) return true;
+    return false;
+}
+
+void make_scene_bvhs(Scene* scene) {
+    for(auto mesh : scene->meshes) {
+        if(not mesh->bvh or not mesh->bvh->valid) make_bvh(mesh);
+    }
+}
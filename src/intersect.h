@@ -0,0 +1,119 @@
+#ifndef _INTERSECT_H_
+#define _INTERSECT_H_
+
+#include "scene_distributed.h"
+
+// bvh node (32 bytes): the children of an internal node are the next node and the node at
+// start; a leaf references count consecutive entries of BVHAccelerator::elements from start
+struct BVHNode {
+    range3f     bbox;               // bounding box
+    int         start = 0;          // leaf: first element entry - internal: right child
+    int         count = 0;          // leaf: number of elements - internal: 0
+};
+
+// bounding volume hierarchy over the faces of a mesh; elements number the entries of
+// triangle_index first and then those of quad_index
+struct BVHAccelerator {
+    vector<BVHNode>     nodes;          // nodes in depth-first order (root first)
+    vector<int>         parent;         // parent of each node (-1 for the root)
+    vector<int>         elements;       // elements grouped by leaf
+    vector<int>         element_leaf;   // leaf of each element (-1 if not in the tree)
+    vector<timestamp_t> element_ids;    // face id of each element
+    int                 triangles = 0;  // elements that are triangles
+    double              cost = 0;       // current SAH cost (not normalized)
+    double              build_cost = 0; // SAH cost right after the build, relative to the root area
+    bool                valid = false;  // false once the faces changed, rebuilt on the next query
+};
+
+// bounds of a mesh for culling: the entries of triangle_index and quad_index are grouped in clusters
+// of bounds_cluster_size consecutive faces, which are drawn as ranges of the index buffers
+struct MeshBounds {
+    range3f             bbox;               // bounds of the whole mesh (local coordinates)
+    vector<range3f>     triangle_clusters;  // bounds of each cluster of triangle_index
+    vector<range3f>     quad_clusters;      // bounds of each cluster of quad_index
+    vector<char>        triangle_loose;     // clusters whose faces changed, fitted again before culling
+    vector<char>        quad_loose;
+    bool                valid = false;      // false once most of the mesh changed, fitted again as a whole
+};
+
+// view frustum of the scene camera with the pixel size used by the coverage test
+struct ViewFrustum {
+    frame3f     frame = identity_frame3f;   // camera frame (looking along -z)
+    float       slope_x = 1;                // half width of the image plane over its distance
+    float       slope_y = 1;                // half height of the image plane over its distance
+    float       near = 1;                   // near plane distance
+    float       far = 10000;                // far plane distance
+    float       pixels = 512;               // image height in pixels over the image plane height at unit distance
+};
+
+// ray intersection
+struct intersection3f {
+    bool        hit = false;        // whether the ray hit something
+    float       ray_t = 0;          // ray parameter at the hit
+    vec3f       pos = zero3f;       // hit position (world coordinates)
+    vec3f       norm = zero3f;      // shading normal at the hit (world coordinates): interpolated
+                                    // vertex normals when the mesh has them, the face normal otherwise
+    vec2f       texcoord = zero2f;  // interpolated texture coordinates (zero if the mesh has none)
+    Material*   mat = nullptr;      // material at the hit
+    Mesh*       mesh = nullptr;     // mesh hit (nullptr for surfaces)
+    Surface*    surface = nullptr;  // surface hit (nullptr for meshes)
+    timestamp_t face = 0;           // id of the triangle or quad hit
+};
+
+extern int      bvh_leaf_size;          // elements per leaf below which nodes are not split
+extern float    bvh_rebuild_threshold;  // SAH cost growth (refit over build) that triggers a rebuild
+
+// builds the bvh of mesh (binned SAH, node bounds and bins computed in parallel)
+void make_bvh(Mesh* mesh);
+
+// refits the nodes containing the given elements (all nodes if empty), rebuilding
+// the tree if its quality degraded past bvh_rebuild_threshold
+void refit_bvh(Mesh* mesh, const vector<int>& elements);
+
+// keeps the bvh in sync after apply_mesh_change: moved vertices refit their faces,
+// added or removed faces invalidate the tree
+void update_bvh(Mesh* mesh, MeshDiff* meshdiff);
+
+// marks the bvh for a rebuild on the next query
+void invalidate_bvh(Mesh* mesh);
+
+extern int      bounds_cluster_size;    // faces per culling cluster
+extern float    cull_min_pixels;        // objects covering fewer pixels than this (in height) are culled
+
+// fits the bounds of mesh again: all clusters if invalid, otherwise the loose ones
+void fit_bounds(Mesh* mesh);
+
+// keeps the bounds in sync after apply_mesh_change: the clusters of the faces around moved
+// vertices, and those past the first changed face entry, are marked loose
+void update_bounds(Mesh* mesh, MeshDiff* meshdiff);
+
+// marks the bounds for fitting from scratch on the next cull
+void invalidate_bounds(Mesh* mesh);
+
+// frustum of the scene camera, as set up by shade (image plane at dist, far plane at 10000)
+ViewFrustum view_frustum(Scene* scene);
+
+// whether the box (coordinates of frame) is outside the frustum or covers less than cull_min_pixels
+bool cull_bbox(const ViewFrustum& view, const frame3f& frame, const range3f& bbox);
+
+// ranges [begin,end) of triangle_index and quad_index entries of mesh to draw for view (visible
+// clusters, adjacent ones merged); returns false when the whole mesh is culled
+bool cull_mesh(Mesh* mesh, const ViewFrustum& view, vector<pair<int,int>>& triangles, vector<pair<int,int>>& quads);
+
+// intersects a ray (world coordinates) with mesh, building its bvh if needed
+bool intersect_mesh(Mesh* mesh, const ray3f& ray, intersection3f& intersection);
+
+// whether a ray (world coordinates) hits mesh anywhere in [tmin,tmax]; stops at the first hit
+bool hit_mesh(Mesh* mesh, const ray3f& ray);
+
+// intersects a ray with the meshes and surfaces of the scene, returning the closest hit;
+// bvhs must be up to date when called from several threads (see make_scene_bvhs)
+intersection3f intersect_scene(Scene* scene, const ray3f& ray);
+
+// whether a ray hits anything in the scene (shadow rays)
+bool hit_scene(Scene* scene, const ray3f& ray);
+
+// builds the missing or invalidated bvhs of the scene meshes
+void make_scene_bvhs(Scene* scene);
+
+#endif
@@ -84,9 +84,9 @@ static jsonvalue _cmdline_parse_value(const string& str, const CommandLine::Argu
         if(typeid(int) == opt.type) {
             return jsonvalue( std::stoi(str) );
         } else if(typeid(float) == opt.type) {
-            return jsonvalue( std::stoll(str) );
+            return jsonvalue( (double)std::stof(str) );
         } else if(typeid(double) == opt.type) {
-            return jsonvalue( std::stoll(str) );
+            return jsonvalue( std::stod(str) );
         } else if(typeid(string) == opt.type) {
             return jsonvalue( str );
         } else error("unknown type");
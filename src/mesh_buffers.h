@@ -0,0 +1,101 @@
+#ifndef _MESH_BUFFERS_H_
+#define _MESH_BUFFERS_H_
+
+// OpenGL buffers holding the arrays of each mesh; they live across frames and only the
+// ranges recorded in Mesh::dirty are uploaded again. Include after the OpenGL headers.
+
+#include "scene_distributed.h"
+
+// buffers of a mesh
+struct MeshBuffers {
+    GLuint  pos = 0;                    // vertex positions
+    GLuint  norm = 0;                   // vertex normals
+    GLuint  texcoord = 0;               // vertex texture coordinates
+    GLuint  triangle = 0;               // triangle indices
+    GLuint  quad = 0;                   // quad indices
+    GLuint  edge = 0;                   // edge indices
+
+    int     pos_capacity = 0;           // elements allocated in each buffer
+    int     norm_capacity = 0;
+    int     texcoord_capacity = 0;
+    int     triangle_capacity = 0;
+    int     quad_capacity = 0;
+    int     edge_capacity = 0;
+
+    int     frame = 0;                  // last frame the mesh was drawn
+};
+
+// dirty vertex ranges closer than this are uploaded with a single call
+const int mesh_buffers_merge_gap = 256;
+
+// buffers of the meshes drawn so far
+inline map<Mesh*,MeshBuffers>& mesh_buffers() {
+    static auto buffers = map<Mesh*,MeshBuffers>();
+    return buffers;
+}
+
+// uploads the [begin,end) elements of data; when data outgrows the buffer, it is reallocated
+// with room to grow and uploaded whole
+template <typename T>
+inline void _upload_buffer(GLenum target, GLuint& buffer, int& capacity, const vector<T>& data, int begin, int end) {
+    if(data.empty()) return;
+    if(not buffer) glGenBuffers(1, &buffer);
+    glBindBuffer(target, buffer);
+    if((int)data.size() > capacity) {
+        capacity = data.size() + data.size() / 2;
+        glBufferData(target, capacity * sizeof(T), nullptr, GL_DYNAMIC_DRAW);
+        begin = 0;
+        end = data.size();
+    }
+    end = min(end, (int)data.size());
+    if(begin < end) glBufferSubData(target, begin * sizeof(T), (end - begin) * sizeof(T), &data[begin]);
+}
+
+// brings the buffers of mesh up to date and marks them as used in frame
+inline MeshBuffers& update_mesh_buffers(Mesh* mesh, int frame) {
+    auto& buffers = mesh_buffers()[mesh];
+    auto& dirty = mesh->dirty;
+    buffers.frame = frame;
+
+    if(dirty.all) {
+        _upload_buffer(GL_ARRAY_BUFFER, buffers.pos, buffers.pos_capacity, mesh->pos, 0, mesh->pos.size());
+        _upload_buffer(GL_ARRAY_BUFFER, buffers.norm, buffers.norm_capacity, mesh->norm, 0, mesh->norm.size());
+        _upload_buffer(GL_ARRAY_BUFFER, buffers.texcoord, buffers.texcoord_capacity, mesh->texcoord, 0, mesh->texcoord.size());
+        dirty.triangle_from = dirty.quad_from = dirty.edge_from = 0;
+    } else {
+        for(auto range : dirty.vertex_ranges(mesh_buffers_merge_gap)) {
+            _upload_buffer(GL_ARRAY_BUFFER, buffers.pos, buffers.pos_capacity, mesh->pos, range.first, range.second);
+            _upload_buffer(GL_ARRAY_BUFFER, buffers.norm, buffers.norm_capacity, mesh->norm, range.first, range.second);
+        }
+    }
+    if(dirty.triangle_from >= 0)
+        _upload_buffer(GL_ELEMENT_ARRAY_BUFFER, buffers.triangle, buffers.triangle_capacity, mesh->triangle_index, dirty.triangle_from, mesh->triangle_index.size());
+    if(dirty.quad_from >= 0)
+        _upload_buffer(GL_ELEMENT_ARRAY_BUFFER, buffers.quad, buffers.quad_capacity, mesh->quad_index, dirty.quad_from, mesh->quad_index.size());
+    if(dirty.edge_from >= 0)
+        _upload_buffer(GL_ELEMENT_ARRAY_BUFFER, buffers.edge, buffers.edge_capacity, mesh->edge_index, dirty.edge_from, mesh->edge_index.size());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    dirty.clear();
+    return buffers;
+}
+
+// marks the buffers of mesh, if any, as used in frame without updating them (culled meshes)
+inline void keep_mesh_buffers(Mesh* mesh, int frame) {
+    auto it = mesh_buffers().find(mesh);
+    if(it != mesh_buffers().end()) it->second.frame = frame;
+}
+
+// deletes the buffers of the meshes not drawn in frame (removed or replaced meshes)
+inline void release_mesh_buffers(int frame) {
+    auto& all = mesh_buffers();
+    for(auto it = all.begin(); it != all.end();) {
+        if(it->second.frame == frame) { ++it; continue; }
+        GLuint ids[] = { it->second.pos, it->second.norm, it->second.texcoord, it->second.triangle, it->second.quad, it->second.edge };
+        glDeleteBuffers(6, ids);
+        it = all.erase(it);
+    }
+}
+
+#endif
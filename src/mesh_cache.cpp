@@ -0,0 +1,299 @@
+#include "mesh_cache.h"
+#include "id_reference.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool    mesh_cache_enabled = true;
+string  mesh_cache_dir = "../cache/";
+
+// files read by the last parse besides the source
+vector<string> mesh_cache_deps;
+
+static const char _cache_magic[8] = { 'D','S','M','C','A','C','H','E' };
+
+// material data as stored in the cache (textures are not cached)
+struct _cache_material {
+    vec3f       ke, kd, ks, kr;
+    float       n;
+    bool        double_sided, microfacet;
+    timestamp_t _id_;
+    int         _version;
+};
+
+unsigned long long hash_file(const string& filename) {
+    auto f = fopen(filename.c_str(), "rb");
+    if(not f) return 0;
+    unsigned long long h = 14695981039346656037ull;
+    unsigned char buf[65536];
+    size_t n = 0;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        for(auto i = 0; i < n; i ++) { h ^= buf[i]; h *= 1099511628211ull; }
+    }
+    fclose(f);
+    return h;
+}
+
+void mesh_cache_depend(const string& filename) { mesh_cache_deps.push_back(filename); }
+
+// cache entry name for a source with content hash h
+static string _cache_entry(unsigned long long h) {
+    return mesh_cache_dir + tostring("%016llx_p%d.bin", h, mesh_cache_parser_version);
+}
+
+// whether the cache can represent every part of this scene
+static bool _cacheable(Scene* scene) {
+    if(not scene->surfaces.empty() or not get_textures(scene).empty()) return false;
+    for(auto mesh : scene->meshes) {
+        if(mesh->animation or mesh->skinning or mesh->simulation or mesh->collision) return false;
+    }
+    return true;
+}
+
+// binary writer ----------
+struct _cache_writer {
+    vector<unsigned char> buf;
+
+    void bytes(const void* d, size_t n) { auto c = (const unsigned char*)d; buf.insert(buf.end(), c, c+n); }
+    template<typename T> void pod(const T& v) { bytes(&v, sizeof(T)); }
+    template<typename T> void array(const vector<T>& v) { pod((long long)v.size()); if(not v.empty()) bytes(v.data(), v.size()*sizeof(T)); }
+    void str(const string& s) { pod((long long)s.size()); bytes(s.data(), s.size()); }
+    void material(Material* m) {
+        auto c = _cache_material{m->ke, m->kd, m->ks, m->kr, m->n, m->double_sided, m->microfacet, m->_id_, m->_version};
+        pod(c);
+    }
+};
+
+// binary reader over the mmapped entry ----------
+struct _cache_reader {
+    const unsigned char* cur;
+    const unsigned char* end;
+    bool ok = true;
+
+    _cache_reader(const unsigned char* d, size_t n) : cur(d), end(d+n) { }
+
+    void bytes(void* d, size_t n) { if(cur+n > end) { ok = false; return; } memcpy(d, cur, n); cur += n; }
+    template<typename T> T pod() { auto v = T(); bytes(&v, sizeof(T)); return v; }
+    template<typename T> void array(vector<T>& v) {
+        auto n = pod<long long>();
+        if(not ok or n < 0 or (size_t)n*sizeof(T) > (size_t)(end-cur)) { ok = false; return; }
+        v.resize(n);
+        if(n) bytes(v.data(), n*sizeof(T));
+    }
+    string str() {
+        auto n = pod<long long>();
+        if(not ok or n < 0 or n > end-cur) { ok = false; return string(); }
+        auto s = string((const char*)cur, n); cur += n;
+        return s;
+    }
+    void material(Material* m) {
+        auto c = pod<_cache_material>();
+        m->ke = c.ke; m->kd = c.kd; m->ks = c.ks; m->kr = c.kr; m->n = c.n;
+        m->double_sided = c.double_sided; m->microfacet = c.microfacet;
+        m->_id_ = c._id_; m->_version = c._version;
+    }
+};
+
+static void _write_mesh(_cache_writer& w, Mesh* mesh, Scene* scene) {
+    w.pod(mesh->frame);
+    w.pod(mesh->_id_);
+    w.pod(mesh->_version);
+    w.pod(mesh->subdivision_catmullclark_level);
+    w.pod(mesh->subdivision_catmullclark_smooth);
+    w.pod(mesh->subdivision_bezier_level);
+    // material is either shared with the scene or owned by the mesh
+    auto mat = std::find(scene->materials.begin(), scene->materials.end(), mesh->mat);
+    w.pod((int)((mat == scene->materials.end()) ? -1 : mat - scene->materials.begin()));
+    w.material(mesh->mat);
+
+    // vertices (face adjacency is rebuilt from the faces)
+    auto v_ids = vector<timestamp_t>(); auto v_idx = vector<int>();
+    for(auto& v : mesh->vertices) { v_ids.push_back(v.first); v_idx.push_back(v.second.first); }
+    w.array(v_ids); w.array(v_idx);
+    w.array(mesh->pos);
+    w.array(mesh->normal_ids);
+    w.array(mesh->norm);
+    w.array(mesh->texcoord);
+
+    // triangles
+    auto t_ids = vector<timestamp_t>(); auto t_idx = vector<int>(); auto t_v = vector<vec3id>(); auto t_n = vector<vec3f>();
+    for(auto& t : mesh->triangle) { t_ids.push_back(t.first); t_idx.push_back(get<0>(t.second)); t_v.push_back(get<1>(t.second)); t_n.push_back(get<2>(t.second)); }
+    w.array(t_ids); w.array(t_idx); w.array(t_v); w.array(t_n);
+    w.array(mesh->triangle_index);
+
+    // quads
+    auto q_ids = vector<timestamp_t>(); auto q_idx = vector<int>(); auto q_v = vector<vec4id>(); auto q_n = vector<vec3f>();
+    for(auto& q : mesh->quad) { q_ids.push_back(q.first); q_idx.push_back(get<0>(q.second)); q_v.push_back(get<1>(q.second)); q_n.push_back(get<2>(q.second)); }
+    w.array(q_ids); w.array(q_idx); w.array(q_v); w.array(q_n);
+    w.array(mesh->quad_index);
+
+    // edges
+    auto e_ids = vector<timestamp_t>(); auto e_idx = vector<int>(); auto e_v = vector<vec2id>();
+    for(auto& e : mesh->edge) { e_ids.push_back(e.first); e_idx.push_back(e.second.first); e_v.push_back(e.second.second); }
+    w.array(e_ids); w.array(e_idx); w.array(e_v);
+    w.array(mesh->edge_index);
+
+    w.array(mesh->point);
+    w.array(mesh->line);
+    w.array(mesh->spline);
+}
+
+static Mesh* _read_mesh(_cache_reader& r, Scene* scene) {
+    auto mesh = new Mesh();
+    mesh->frame = r.pod<frame3f>();
+    mesh->_id_ = r.pod<timestamp_t>();
+    mesh->_version = r.pod<int>();
+    mesh->subdivision_catmullclark_level = r.pod<int>();
+    mesh->subdivision_catmullclark_smooth = r.pod<bool>();
+    mesh->subdivision_bezier_level = r.pod<int>();
+    auto mat = r.pod<int>();
+    r.material(mesh->mat);
+    if(mat >= 0 and mat < scene->materials.size()) { delete mesh->mat; mesh->mat = scene->materials[mat]; }
+
+    // vertices (ids are stored in map order, so every insertion goes at the end)
+    auto v_ids = vector<timestamp_t>(); auto v_idx = vector<int>();
+    r.array(v_ids); r.array(v_idx);
+    if(v_ids.size() != v_idx.size()) r.ok = false;
+    if(not r.ok) return mesh;
+    for(auto i : range(v_ids.size())) mesh->vertices.emplace_hint(mesh->vertices.end(), v_ids[i], make_pair(v_idx[i], set<timestamp_t>()));
+    r.array(mesh->pos);
+    r.array(mesh->normal_ids);
+    r.array(mesh->norm);
+    r.array(mesh->texcoord);
+
+    // triangles
+    auto t_ids = vector<timestamp_t>(); auto t_idx = vector<int>(); auto t_v = vector<vec3id>(); auto t_n = vector<vec3f>();
+    r.array(t_ids); r.array(t_idx); r.array(t_v); r.array(t_n);
+    if(t_idx.size() != t_ids.size() or t_v.size() != t_ids.size() or t_n.size() != t_ids.size()) r.ok = false;
+    if(not r.ok) return mesh;
+    for(auto i : range(t_ids.size())) {
+        mesh->triangle.emplace_hint(mesh->triangle.end(), t_ids[i], make_tuple(t_idx[i], t_v[i], t_n[i]));
+        for(auto v : { t_v[i].first, t_v[i].second, t_v[i].third }) mesh->vertices[v].second.insert(t_ids[i]);
+    }
+    r.array(mesh->triangle_index);
+
+    // quads
+    auto q_ids = vector<timestamp_t>(); auto q_idx = vector<int>(); auto q_v = vector<vec4id>(); auto q_n = vector<vec3f>();
+    r.array(q_ids); r.array(q_idx); r.array(q_v); r.array(q_n);
+    if(q_idx.size() != q_ids.size() or q_v.size() != q_ids.size() or q_n.size() != q_ids.size()) r.ok = false;
+    if(not r.ok) return mesh;
+    for(auto i : range(q_ids.size())) {
+        mesh->quad.emplace_hint(mesh->quad.end(), q_ids[i], make_tuple(q_idx[i], q_v[i], q_n[i]));
+        for(auto v : { q_v[i].first, q_v[i].second, q_v[i].third, q_v[i].fourth }) mesh->vertices[v].second.insert(q_ids[i]);
+    }
+    r.array(mesh->quad_index);
+
+    // edges
+    auto e_ids = vector<timestamp_t>(); auto e_idx = vector<int>(); auto e_v = vector<vec2id>();
+    r.array(e_ids); r.array(e_idx); r.array(e_v);
+    if(e_idx.size() != e_ids.size() or e_v.size() != e_ids.size()) r.ok = false;
+    if(not r.ok) return mesh;
+    for(auto i : range(e_ids.size())) mesh->edge.emplace_hint(mesh->edge.end(), e_ids[i], make_pair(e_idx[i], e_v[i]));
+    r.array(mesh->edge_index);
+
+    r.array(mesh->point);
+    r.array(mesh->line);
+    r.array(mesh->spline);
+    return mesh;
+}
+
+Scene* mesh_cache_load(const string& filename) {
+    mesh_cache_deps.clear();
+    if(not mesh_cache_enabled) return nullptr;
+    auto h = hash_file(filename);
+    if(not h) return nullptr;
+
+    // map the entry
+    auto fd = open(_cache_entry(h).c_str(), O_RDONLY);
+    if(fd < 0) return nullptr;
+    struct stat st;
+    if(fstat(fd, &st) != 0 or st.st_size == 0) { close(fd); return nullptr; }
+    auto size = (size_t)st.st_size;
+    auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return nullptr;
+    auto r = _cache_reader((const unsigned char*)data, size);
+
+    // header and dependencies
+    char magic[8];
+    r.bytes(magic, 8);
+    auto version = r.pod<int>();
+    auto valid = r.ok and memcmp(magic, _cache_magic, 8) == 0 and version == mesh_cache_parser_version;
+    auto ndeps = (valid) ? r.pod<int>() : 0;
+    for(auto i = 0; valid and i < ndeps; i ++) {
+        auto dep = r.str();
+        auto dep_hash = r.pod<unsigned long long>();
+        valid = r.ok and hash_file(dep) == dep_hash;
+    }
+    if(not valid) { munmap(data, size); return nullptr; }
+
+    // scene
+    auto scene = new Scene();
+    auto has_camera = r.pod<bool>();
+    *scene->camera = r.pod<Camera>();
+    if(has_camera) scene->ids_map.emplace(scene->camera->_id_, *new id_reference(scene->camera, scene->camera->_id_));
+    auto nlights = r.pod<int>();
+    for(auto i = 0; r.ok and i < nlights; i ++) {
+        auto light = new Light(r.pod<Light>());
+        scene->lights.push_back(light);
+        scene->ids_map.emplace(light->_id_, *new id_reference(light, light->_id_));
+    }
+    auto nmaterials = r.pod<int>();
+    for(auto i = 0; r.ok and i < nmaterials; i ++) {
+        auto material = new Material();
+        r.material(material);
+        scene->materials.push_back(material);
+        scene->ids_map.emplace(material->_id_, *new id_reference(material, material->_id_));
+    }
+    auto nmeshes = r.pod<int>();
+    for(auto i = 0; r.ok and i < nmeshes; i ++) {
+        auto mesh = _read_mesh(r, scene);
+        scene->meshes.push_back(mesh);
+        scene->ids_map.emplace(mesh->_id_, *new id_reference(mesh, mesh->_id_));
+    }
+    munmap(data, size);
+
+    // a truncated entry is treated as a miss and reparsed
+    if(not r.ok) {
+        message("mesh cache: corrupted entry for %s\n", filename.c_str());
+        mesh_cache_deps.clear();
+        return nullptr;
+    }
+    return scene;
+}
+
+void mesh_cache_save(const string& filename, Scene* scene) {
+    auto deps = mesh_cache_deps;
+    mesh_cache_deps.clear();
+    if(not mesh_cache_enabled or not _cacheable(scene)) return;
+    auto h = hash_file(filename);
+    if(not h) return;
+
+    auto w = _cache_writer();
+    w.bytes(_cache_magic, 8);
+    w.pod(mesh_cache_parser_version);
+    w.pod((int)deps.size());
+    for(auto& dep : deps) { w.str(dep); w.pod(hash_file(dep)); }
+
+    auto camera = scene->ids_map.find(scene->camera->_id_);
+    w.pod((bool)(camera != scene->ids_map.end() and camera->second.is_camera()));
+    w.pod(*scene->camera);
+    w.pod((int)scene->lights.size());
+    for(auto light : scene->lights) w.pod(*light);
+    w.pod((int)scene->materials.size());
+    for(auto material : scene->materials) w.material(material);
+    w.pod((int)scene->meshes.size());
+    for(auto mesh : scene->meshes) _write_mesh(w, mesh, scene);
+
+    // write aside and rename, so that concurrent launches never map a partial entry
+    mkdir(mesh_cache_dir.c_str(), 0755);
+    auto entry = _cache_entry(h);
+    auto temp = entry + tostring(".%d", (int)getpid());
+    auto f = fopen(temp.c_str(), "wb");
+    if(not f) { message("mesh cache: cannot write %s\n", temp.c_str()); return; }
+    auto written = fwrite(w.buf.data(), 1, w.buf.size(), f);
+    fclose(f);
+    if(written != w.buf.size() or rename(temp.c_str(), entry.c_str()) != 0) remove(temp.c_str());
+}
@@ -0,0 +1,28 @@
+#ifndef _MESH_CACHE_H_
+#define _MESH_CACHE_H_
+
+#include "scene_distributed.h"
+
+// version of the parsed data layout: bump it whenever the json/obj parsers or the
+// binary layout change, so that entries written by older builds are ignored
+const int mesh_cache_parser_version = 1;
+
+extern bool     mesh_cache_enabled;     // whether the loaders consult the cache
+extern string   mesh_cache_dir;         // directory of the cache entries (created on demand)
+
+// 64-bit content hash of a file (FNV-1a); returns 0 if the file cannot be read
+unsigned long long hash_file(const string& filename);
+
+// records a file read while parsing besides the source (external meshes, material libraries);
+// its hash is stored in the entry so that editing it invalidates the cached scene
+void mesh_cache_depend(const string& filename);
+
+// returns the scene cached for the content of filename, or nullptr if there is no valid entry;
+// on a miss the dependency list is reset, ready for the parser to fill it
+Scene* mesh_cache_load(const string& filename);
+
+// stores the scene parsed from filename; scenes with textures, surfaces or animation,
+// skinning, simulation and collision data are not cached
+void mesh_cache_save(const string& filename, Scene* scene);
+
+#endif
@@ -0,0 +1,381 @@
+#include "mesh_lod.h"
+#include "common.h"
+#include <array>
+#include <queue>
+#include <unordered_map>
+
+int             mesh_lod_grid = 16;
+vector<float>   mesh_lod_ratios = { 0.25f, 0.0625f, 0.015625f };
+
+// minimum cosine between a face normal before and after a collapse
+const float _lod_min_normal_cos = 0.2f;
+
+// id of a simplified face or edge: hash of its vertex ids (rotated to start from the smallest, so
+// that it does not depend on which vertex comes first); bit 62 set keeps them apart from timestamps
+inline timestamp_t _lod_id(const timestamp_t* ids, int n) {
+    auto first = 0;
+    for(auto i = 1; i < n; i ++) if(ids[i] < ids[first]) first = i;
+    auto h = 14695981039346656037ull;
+    for(auto i = 0; i < n; i ++) {
+        h = (h ^ ids[(first + i) % n]) * 1099511628211ull;
+        h ^= h >> 29;
+    }
+    return (h & ~(3ull << 62)) | (1ull << 62);
+}
+inline timestamp_t _lod_triangle_id(const vec3id& t) { timestamp_t ids[] = { t.first, t.second, t.third }; return _lod_id(ids, 3); }
+inline timestamp_t _lod_edge_id(timestamp_t a, timestamp_t b) { timestamp_t ids[] = { min(a,b), max(a,b) }; return _lod_id(ids, 2); }
+
+// symmetric 4x4 quadric (upper triangle)
+struct _quadric {
+    double q[10] = {0,0,0,0,0,0,0,0,0,0};
+
+    // plane n.x + d = 0 weighted by w
+    void add_plane(const vec3f& n, float d, float w) {
+        double p[4] = { n.x, n.y, n.z, d };
+        auto k = 0;
+        for(auto i = 0; i < 4; i ++) for(auto j = i; j < 4; j ++) q[k++] += w * p[i] * p[j];
+    }
+    void add(const _quadric& o) { for(auto i : range(10)) q[i] += o.q[i]; }
+    // error at p
+    double eval(const vec3f& p) const {
+        double x = p.x, y = p.y, z = p.z;
+        return q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x + q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y + q[7]*z*z + 2*q[8]*z + q[9];
+    }
+};
+
+// candidate collapse of u into v
+struct _collapse {
+    double  cost;
+    int     u, v;
+    int     u_stamp, v_stamp;
+    bool operator<(const _collapse& o) const { return cost > o.cost; }
+};
+
+// position of a source vertex
+inline const vec3f& _vertex_pos(Mesh* mesh, timestamp_t id) { return mesh->pos[mesh->vertices.find(id)->second.first]; }
+
+// grid cell of a source face, from its centroid
+int _face_cluster(MeshLOD* lod, timestamp_t face) {
+    auto mesh = lod->mesh;
+    auto c = zero3f;
+    auto t = mesh->triangle.find(face);
+    if(t != mesh->triangle.end()) {
+        auto& v = get<1>(t->second);
+        c = (_vertex_pos(mesh, v.first) + _vertex_pos(mesh, v.second) + _vertex_pos(mesh, v.third)) / 3;
+    } else {
+        auto& v = get<1>(mesh->quad.find(face)->second);
+        c = (_vertex_pos(mesh, v.first) + _vertex_pos(mesh, v.second) + _vertex_pos(mesh, v.third) + _vertex_pos(mesh, v.fourth)) / 4;
+    }
+    auto cell = [&](float x, float min, float max) {
+        if(max <= min) return 0;
+        return clamp((int)(mesh_lod_grid * (x - min) / (max - min)), 0, mesh_lod_grid-1);
+    };
+    return (cell(c.x, lod->bbox.min.x, lod->bbox.max.x) * mesh_lod_grid + cell(c.y, lod->bbox.min.y, lod->bbox.max.y)) * mesh_lod_grid +
+           cell(c.z, lod->bbox.min.z, lod->bbox.max.z);
+}
+
+// simplifies the faces of a cluster, returning its triangles at each level
+vector<vector<pair<timestamp_t,vec3id>>> _simplify_cluster(MeshLOD* lod, int cluster) {
+    auto mesh = lod->mesh;
+    auto& faces = lod->cluster_faces.find(cluster)->second;
+
+    // local vertices and triangles (quads are split along their first diagonal)
+    auto ids = vector<timestamp_t>();
+    auto index = unordered_map<timestamp_t,int>();
+    auto local = [&](timestamp_t id) {
+        auto it = index.find(id);
+        if(it != index.end()) return it->second;
+        index[id] = ids.size();
+        ids.push_back(id);
+        return (int)ids.size()-1;
+    };
+    auto tris = vector<array<int,3>>();
+    for(auto f : faces) {
+        auto t = mesh->triangle.find(f);
+        if(t != mesh->triangle.end()) {
+            auto& v = get<1>(t->second);
+            tris.push_back({{ local(v.first), local(v.second), local(v.third) }});
+        } else {
+            auto& v = get<1>(mesh->quad.find(f)->second);
+            auto a = local(v.first), b = local(v.second), c = local(v.third), d = local(v.fourth);
+            tris.push_back({{ a, b, c }});
+            tris.push_back({{ a, c, d }});
+        }
+    }
+    auto nverts = (int)ids.size();
+    auto pos = vector<vec3f>(nverts);
+    for(auto i : range(nverts)) pos[i] = _vertex_pos(mesh, ids[i]);
+
+    // vertex triangles and quadrics
+    auto vtris = vector<vector<int>>(nverts);
+    auto quadrics = vector<_quadric>(nverts);
+    for(auto t : range(tris.size())) {
+        auto& tri = tris[t];
+        auto n = cross(pos[tri[1]]-pos[tri[0]], pos[tri[2]]-pos[tri[0]]);
+        auto area = length(n);
+        if(area > 0) n /= area;
+        for(auto k : range(3)) {
+            vtris[tri[k]].push_back(t);
+            quadrics[tri[k]].add_plane(n, -dot(n, pos[tri[0]]), area);
+        }
+    }
+
+    // locked vertices: shared with faces of other clusters, or on edges not shared by two triangles
+    auto locked = vector<char>(nverts, 0);
+    for(auto i : range(nverts)) {
+        for(auto f : mesh->vertices.find(ids[i])->second.second) {
+            auto c = lod->face_cluster.find(f);
+            if(c != lod->face_cluster.end() and c->second != cluster) { locked[i] = 1; break; }
+        }
+    }
+    auto edges = map<pair<int,int>,int>();
+    for(auto& tri : tris) for(auto k : range(3)) edges[make_pair(min(tri[k],tri[(k+1)%3]), max(tri[k],tri[(k+1)%3]))] ++;
+    for(auto& e : edges) if(e.second != 2) locked[e.first.first] = locked[e.first.second] = 1;
+
+    auto alive = vector<char>(tris.size(), 1);
+    auto removed = vector<char>(nverts, 0);
+    auto stamp = vector<int>(nverts, 0);
+    auto heap = priority_queue<_collapse>();
+    auto push = [&](int u, int v) {
+        if(locked[u]) return;
+        auto q = quadrics[u];
+        q.add(quadrics[v]);
+        heap.push({ q.eval(pos[v]), u, v, stamp[u], stamp[v] });
+    };
+    for(auto& e : edges) { push(e.first.first, e.first.second); push(e.first.second, e.first.first); }
+
+    // whether collapsing u into v keeps the surface manifold and does not flip faces
+    auto mark = vector<int>(nverts, -1);
+    auto mark_id = 0;
+    auto valid = [&](int u, int v) {
+        // the neighbors shared by u and v must be the opposite vertices of the triangles on uv
+        auto shared = 0;
+        mark_id ++;
+        for(auto t : vtris[u]) {
+            if(not alive[t]) continue;
+            auto& tri = tris[t];
+            if(tri[0] == v or tri[1] == v or tri[2] == v) shared ++;
+            for(auto k : range(3)) mark[tri[k]] = mark_id;
+        }
+        if(not shared) return false;
+        auto common = 0;
+        for(auto t : vtris[v]) {
+            if(not alive[t]) continue;
+            for(auto k : range(3)) {
+                auto w = tris[t][k];
+                if(w != u and w != v and mark[w] == mark_id) { common ++; mark[w] = -1; }
+            }
+        }
+        if(common != shared) return false;
+        for(auto t : vtris[u]) {
+            if(not alive[t]) continue;
+            auto tri = tris[t];
+            if(tri[0] == v or tri[1] == v or tri[2] == v) continue;
+            auto n0 = cross(pos[tri[1]]-pos[tri[0]], pos[tri[2]]-pos[tri[0]]);
+            for(auto k : range(3)) if(tri[k] == u) tri[k] = v;
+            auto n1 = cross(pos[tri[1]]-pos[tri[0]], pos[tri[2]]-pos[tri[0]]);
+            auto l0 = length(n0), l1 = length(n1);
+            if(l1 <= 0 or (l0 > 0 and dot(n0, n1) < _lod_min_normal_cos * l0 * l1)) return false;
+        }
+        return true;
+    };
+
+    // collapse the cheapest edges, saving the triangles each time a level is reached
+    auto levels = vector<vector<pair<timestamp_t,vec3id>>>(lod->ratios.size());
+    auto alive_count = (int)tris.size();
+    auto level = 0;
+    auto snapshot = [&]() {
+        auto& out = levels[level++];
+        for(auto t : range(tris.size())) {
+            if(not alive[t]) continue;
+            auto v = vec3id(ids[tris[t][0]], ids[tris[t][1]], ids[tris[t][2]]);
+            out.push_back(make_pair(_lod_triangle_id(v), v));
+        }
+    };
+    while(level < levels.size()) {
+        if(alive_count <= max(1, (int)(lod->ratios[level] * tris.size()))) { snapshot(); continue; }
+        if(heap.empty()) break;
+        auto c = heap.top();
+        heap.pop();
+        if(removed[c.u] or removed[c.v] or c.u_stamp != stamp[c.u] or c.v_stamp != stamp[c.v]) continue;
+        if(not valid(c.u, c.v)) continue;
+        for(auto t : vtris[c.u]) {
+            if(not alive[t]) continue;
+            auto& tri = tris[t];
+            if(tri[0] == c.v or tri[1] == c.v or tri[2] == c.v) { alive[t] = 0; alive_count --; continue; }
+            for(auto k : range(3)) if(tri[k] == c.u) tri[k] = c.v;
+            vtris[c.v].push_back(t);
+        }
+        vtris[c.u].clear();
+        removed[c.u] = 1;
+        quadrics[c.v].add(quadrics[c.u]);
+        stamp[c.v] ++;
+        vtris[c.v].erase(remove_if(vtris[c.v].begin(), vtris[c.v].end(), [&](int t){ return not alive[t]; }), vtris[c.v].end());
+        for(auto t : vtris[c.v]) {
+            if(not alive[t]) continue;
+            for(auto w : tris[t]) if(w != c.v) { push(w, c.v); push(c.v, w); }
+        }
+    }
+    while(level < levels.size()) snapshot();
+    return levels;
+}
+
+// re-simplifies clusters and returns the differences of each level; source vertices in updated
+// changed position
+vector<MeshDiff*> _resimplify(MeshLOD* lod, const set<int>& clusters, const map<timestamp_t,vec3f>& updated) {
+    auto mesh = lod->mesh;
+    auto list = vector<int>(clusters.begin(), clusters.end());
+    auto results = vector<vector<vector<pair<timestamp_t,vec3id>>>>(list.size());
+    parallel_for(list.size(), [&](int i) {
+        if(lod->cluster_faces.count(list[i])) results[i] = _simplify_cluster(lod, list[i]);
+    });
+
+    auto diffs = vector<MeshDiff*>();
+    for(auto l : range(lod->ratios.size())) {
+        auto diff = new MeshDiff();
+        diff->_id_ = mesh->_id_;
+        diff->_version = mesh->_version;
+        auto old_triangles = map<timestamp_t,vec3id>(), new_triangles = map<timestamp_t,vec3id>();
+        for(auto i : range(list.size())) {
+            auto old = lod->cluster_triangles.find(list[i]);
+            if(old != lod->cluster_triangles.end()) for(auto& t : old->second[l]) old_triangles.insert(t);
+            if(not results[i].empty()) for(auto& t : results[i][l]) new_triangles.insert(t);
+        }
+
+        // reference counts of the vertices and edges of the triangles that changed: elements are
+        // added when their count leaves zero and removed when it gets back to it
+        auto& vertex_refs = lod->vertex_refs[l];
+        auto& edge_refs = lod->edge_refs[l];
+        auto vertices_before = map<timestamp_t,int>();
+        auto edges_before = map<timestamp_t,pair<int,vec2id>>();
+        auto reference = [&](const vec3id& t, int delta) {
+            timestamp_t v[] = { t.first, t.second, t.third };
+            for(auto k : range(3)) {
+                auto& count = vertex_refs[v[k]];
+                vertices_before.emplace(v[k], count);
+                count += delta;
+                auto e = _lod_edge_id(v[k], v[(k+1)%3]);
+                auto& edge_count = edge_refs[e];
+                edges_before.emplace(e, make_pair(edge_count, vec2id(v[k], v[(k+1)%3])));
+                edge_count += delta;
+            }
+        };
+        for(auto& t : old_triangles) {
+            if(new_triangles.count(t.first)) continue;
+            diff->remove_triangle.push_back(t.first);
+            reference(t.second, -1);
+        }
+        for(auto& t : new_triangles) {
+            if(old_triangles.count(t.first)) continue;
+            diff->add_triangle[t.first] = t.second;
+            reference(t.second, +1);
+        }
+        for(auto& v : vertices_before) {
+            auto after = vertex_refs[v.first];
+            if(v.second == 0 and after > 0) diff->add_vertex[v.first] = _vertex_pos(mesh, v.first);
+            if(v.second > 0 and after == 0) diff->remove_vertex.push_back(v.first);
+            if(after == 0) vertex_refs.erase(v.first);
+        }
+        for(auto& e : edges_before) {
+            auto after = edge_refs[e.first];
+            if(e.second.first == 0 and after > 0) diff->add_edge[e.first] = e.second.second;
+            if(e.second.first > 0 and after == 0) diff->remove_edge.push_back(e.first);
+            if(after == 0) edge_refs.erase(e.first);
+        }
+        for(auto& v : updated) {
+            if(vertex_refs.count(v.first) and not diff->add_vertex.count(v.first)) diff->update_vertex[v.first] = v.second;
+        }
+        diffs.push_back(diff);
+    }
+    for(auto i : range(list.size())) {
+        if(results[i].empty()) lod->cluster_triangles.erase(list[i]);
+        else lod->cluster_triangles[list[i]] = results[i];
+    }
+    return diffs;
+}
+
+MeshLOD* make_mesh_lod(Mesh* mesh) {
+    auto lod = new MeshLOD();
+    lod->mesh = mesh;
+    lod->ratios = mesh_lod_ratios;
+    lod->bbox = range3f();
+    for(auto& v : mesh->vertices) lod->bbox = runion(lod->bbox, mesh->pos[v.second.first]);
+    lod->vertex_refs.resize(lod->ratios.size());
+    lod->edge_refs.resize(lod->ratios.size());
+
+    // clusters
+    for(auto& t : mesh->triangle) lod->face_cluster[t.first] = -1;
+    for(auto& q : mesh->quad) lod->face_cluster[q.first] = -1;
+    for(auto& f : lod->face_cluster) {
+        f.second = _face_cluster(lod, f.first);
+        lod->cluster_faces[f.second].insert(f.first);
+    }
+    auto clusters = set<int>();
+    for(auto& c : lod->cluster_faces) clusters.insert(c.first);
+
+    // levels are built by applying the additions to empty meshes
+    auto diffs = _resimplify(lod, clusters, map<timestamp_t,vec3f>());
+    for(auto diff : diffs) {
+        auto level = new Mesh();
+        level->_id_ = mesh->_id_;
+        level->frame = mesh->frame;
+        level->mat = mesh->mat;
+        apply_mesh_change(level, diff, 0);
+        lod->levels.push_back(level);
+        delete diff;
+    }
+    return lod;
+}
+
+Mesh* mesh_lod_level(MeshLOD* lod, int level) {
+    if(level <= 0 or lod->levels.empty()) return lod->mesh;
+    return lod->levels[min(level, (int)lod->levels.size()) - 1];
+}
+
+vector<MeshDiff*> update_mesh_lod(MeshLOD* lod, MeshDiff* meshdiff) {
+    auto mesh = lod->mesh;
+    auto clusters = set<int>();
+    // clusters of the faces around a vertex, whose locking or quadrics may have changed
+    auto touch_vertex = [&](timestamp_t id) {
+        auto v = mesh->vertices.find(id);
+        if(v == mesh->vertices.end()) return;
+        for(auto f : v->second.second) {
+            auto c = lod->face_cluster.find(f);
+            if(c != lod->face_cluster.end()) clusters.insert(c->second);
+        }
+    };
+    auto remove_face = [&](timestamp_t f) {
+        auto c = lod->face_cluster.find(f);
+        if(c == lod->face_cluster.end()) return;
+        clusters.insert(c->second);
+        lod->cluster_faces[c->second].erase(f);
+        if(lod->cluster_faces[c->second].empty()) lod->cluster_faces.erase(c->second);
+        lod->face_cluster.erase(c);
+    };
+    for(auto f : meshdiff->remove_triangle) remove_face(f);
+    for(auto f : meshdiff->remove_quad) remove_face(f);
+    // the faces are already in the mesh: assign the new ones first, then collect the neighbors
+    auto added = vector<timestamp_t>();
+    for(auto& f : meshdiff->add_triangle) added.push_back(f.first);
+    for(auto& f : meshdiff->add_quad) added.push_back(f.first);
+    for(auto f : added) {
+        if(not mesh->triangle.count(f) and not mesh->quad.count(f)) continue;
+        auto c = _face_cluster(lod, f);
+        lod->face_cluster[f] = c;
+        lod->cluster_faces[c].insert(f);
+        clusters.insert(c);
+    }
+    for(auto& f : meshdiff->add_triangle) for(auto v : { f.second.first, f.second.second, f.second.third }) touch_vertex(v);
+    for(auto& f : meshdiff->add_quad) for(auto v : { f.second.first, f.second.second, f.second.third, f.second.fourth }) touch_vertex(v);
+    for(auto& v : meshdiff->update_vertex) touch_vertex(v.first);
+
+    auto diffs = _resimplify(lod, clusters, meshdiff->update_vertex);
+    for(auto i : range(diffs.size())) {
+        if(not isnan(meshdiff->frame)) {
+            diffs[i]->frame = meshdiff->frame;
+            lod->levels[i]->frame = meshdiff->frame;
+        }
+        apply_mesh_change(lod->levels[i], diffs[i], 0);
+    }
+    return diffs;
+}
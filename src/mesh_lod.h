@@ -0,0 +1,43 @@
+#ifndef _MESH_LOD_H_
+#define _MESH_LOD_H_
+
+#include "scene_distributed.h"
+
+// levels of detail of a mesh: the faces are grouped into clusters by a grid over the mesh bounds
+// and each cluster is simplified on its own with quadric error half-edge collapses. Vertices shared
+// with other clusters or on open borders are locked, so the clusters stay watertight with each
+// other and an edit only re-simplifies the clusters it touches. Simplified meshes keep the ids and
+// positions of the source vertices; their faces are triangles and edges with ids derived from
+// their vertex ids, so that re-simplifying unchanged regions gives the same ids.
+
+extern int      mesh_lod_grid;          // grid cells per axis used to cluster the faces
+extern vector<float> mesh_lod_ratios;   // fraction of the triangles kept at levels 1, 2, ...
+
+// lod chain of a mesh
+struct MeshLOD {
+    Mesh*                   mesh = nullptr;     // source mesh (level 0)
+    vector<float>           ratios;             // fraction of the triangles kept at each level
+    range3f                 bbox;               // bounds of the grid, fixed when the chain is built
+    vector<Mesh*>           levels;             // simplified meshes (levels[0] is level 1)
+
+    map<timestamp_t,int>    face_cluster;       // cluster of each source face
+    map<int,set<timestamp_t>> cluster_faces;    // source faces of each cluster
+    map<int,vector<vector<pair<timestamp_t,vec3id>>>> cluster_triangles; // triangles of each cluster at each level
+    vector<map<timestamp_t,int>> vertex_refs;   // triangles referencing each vertex, per level
+    vector<map<timestamp_t,int>> edge_refs;     // triangles referencing each edge, per level
+
+    // destructor (the source mesh is not owned)
+    ~MeshLOD() { for(auto level : levels) delete level; }
+};
+
+// builds the lod chain of mesh with mesh_lod_ratios
+MeshLOD* make_mesh_lod(Mesh* mesh);
+
+// mesh at level (0 is the source mesh), clamped to the available levels
+Mesh* mesh_lod_level(MeshLOD* lod, int level);
+
+// re-simplifies the clusters touched by meshdiff, already applied to the source mesh; the levels
+// are updated and the differences of each level are returned (levels[i] changed by result[i])
+vector<MeshDiff*> update_mesh_lod(MeshLOD* lod, MeshDiff* meshdiff);
+
+#endif
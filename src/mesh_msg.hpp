@@ -7,6 +7,8 @@
 #include <iostream>
 #include <sstream>
 #include "obj_parser.h"
+#include "trace.h"
+#include "alloc_track.h"
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/filesystem.hpp>
@@ -19,6 +21,10 @@ public:
     enum { max_body_length = 512 };
     enum { Operation_type = 0, Mesh_type = 1, SceneDiff_type = 2, MeshDiff_type = 3, CameraDiff_type = 4,
            LightDiff_type = 5, MaterialDiff_type = 6, Obj_Mtl_type = 7 };
+    // traced messages set trace_flag in their type and start their body with an extension of
+    // trace_length hex chars: edit id, origin time and sent time (16 each, trace_now clock)
+    enum { trace_flag = 0x100 };
+    enum { trace_length = 48 };
     
     mesh_msg()
     : body_length_(0)
@@ -28,6 +34,7 @@ public:
     template <typename T>
     mesh_msg(const T obj)
     {
+        AllocScope alloc_scope(alloc_serialize);
         int type = 0;
         if (typeid(*obj) == typeid(Mesh)) type = Mesh_type;
         if (typeid(*obj) == typeid(SceneDiff)) type = SceneDiff_type;
@@ -77,6 +84,7 @@ public:
     // obj and mtl constructor
     mesh_msg(const string& path)
     {
+        AllocScope alloc_scope(alloc_serialize);
         // load files
         auto obj_stream = load_obj(path + ".obj");
         auto mtl_stream = load_obj(path + ".mtl");
@@ -187,6 +195,7 @@ public:
     // deprecated
     mesh_msg(const Mesh* mesh )
     {
+        AllocScope alloc_scope(alloc_serialize);
         // Serialize the mesh.
         std::ostringstream archive_stream;
         boost::archive::text_oarchive archive(archive_stream);
@@ -226,6 +235,7 @@ public:
     // deprecated
     mesh_msg(const MeshDiff* meshdiff )
     {
+        AllocScope alloc_scope(alloc_serialize);
         // Serialize the mesh.
         std::ostringstream archive_stream;
         boost::archive::text_oarchive archive(archive_stream);
@@ -271,7 +281,7 @@ public:
     vector<string> as_message() const
     {
         vector<string> tokens;
-        string str(mesh_msg_data_.data()+header_length+type_length,body_length_);
+        string str(mesh_msg_data_.data()+payload_offset(),payload_length());
         stringstream ss(str);
         string buf;
         while (ss >> buf)
@@ -282,7 +292,7 @@ public:
     vector<string> as_message()
     {
         vector<string> tokens;
-        string str(mesh_msg_data_.data()+header_length+type_length,body_length_);
+        string str(mesh_msg_data_.data()+payload_offset(),payload_length());
         stringstream ss(str);
         string buf;
         while (ss >> buf)
@@ -293,8 +303,9 @@ public:
     // get as mesh
     Mesh* as_mesh() const
     {
+        AllocScope alloc_scope(alloc_serialize);
         auto mesh = new Mesh();
-        std::string archive_data(&mesh_msg_data_[header_length + type_length], body_length_);
+        std::string archive_data(&mesh_msg_data_[payload_offset()], payload_length());
         std::istringstream archive_stream(archive_data);
         boost::archive::text_iarchive archive(archive_stream);
         archive >> *mesh;
@@ -304,8 +315,9 @@ public:
     
      Mesh* as_mesh()
     {
+        AllocScope alloc_scope(alloc_serialize);
         auto mesh = new Mesh();
-        std::string archive_data(&mesh_msg_data_[header_length + type_length], body_length_);
+        std::string archive_data(&mesh_msg_data_[payload_offset()], payload_length());
         std::istringstream archive_stream(archive_data);
         boost::archive::text_iarchive archive(archive_stream);
         archive >> *mesh;
@@ -316,7 +328,8 @@ public:
     // get as mesh
     void mesh(Mesh& mesh) const
     {
-        std::string archive_data(&mesh_msg_data_[header_length + type_length], body_length_);
+        AllocScope alloc_scope(alloc_serialize);
+        std::string archive_data(&mesh_msg_data_[payload_offset()], payload_length());
         std::istringstream archive_stream(archive_data);
         boost::archive::text_iarchive archive(archive_stream);
         archive >> mesh;
@@ -324,7 +337,8 @@ public:
     
     void as_mesh(Mesh& mesh)
     {
-        std::string archive_data(&mesh_msg_data_[header_length + type_length], body_length_);
+        AllocScope alloc_scope(alloc_serialize);
+        std::string archive_data(&mesh_msg_data_[payload_offset()], payload_length());
         std::istringstream archive_stream(archive_data);
         boost::archive::text_iarchive archive(archive_stream);
         archive >> mesh;
@@ -333,8 +347,9 @@ public:
     // get as meshdiff
     MeshDiff* as_meshdiff() const
     {
+        AllocScope alloc_scope(alloc_serialize);
         auto meshdiff = new MeshDiff();
-        std::string archive_data(&mesh_msg_data_[header_length + type_length], body_length_);
+        std::string archive_data(&mesh_msg_data_[payload_offset()], payload_length());
         std::istringstream archive_stream(archive_data);
         boost::archive::text_iarchive archive(archive_stream);
         archive >> *meshdiff;
@@ -344,8 +359,9 @@ public:
     
     MeshDiff* as_meshdiff()
     {
+        AllocScope alloc_scope(alloc_serialize);
         auto meshdiff = new MeshDiff();
-        std::string archive_data(&mesh_msg_data_[header_length + type_length], body_length_);
+        std::string archive_data(&mesh_msg_data_[payload_offset()], payload_length());
         std::istringstream archive_stream(archive_data);
         boost::archive::text_iarchive archive(archive_stream);
         archive >> *meshdiff;
@@ -356,8 +372,9 @@ public:
     // get as meshdiff
     SceneDiff* as_scenediff() const
     {
+        AllocScope alloc_scope(alloc_serialize);
         auto scenediff = new SceneDiff();
-        std::string archive_data(&mesh_msg_data_[header_length + type_length], body_length_);
+        std::string archive_data(&mesh_msg_data_[payload_offset()], payload_length());
         std::istringstream archive_stream(archive_data);
         boost::archive::text_iarchive archive(archive_stream);
         archive >> *scenediff;
@@ -367,8 +384,9 @@ public:
     
     SceneDiff* as_scenediff()
     {
+        AllocScope alloc_scope(alloc_serialize);
         auto scenediff = new SceneDiff();
-        std::string archive_data(&mesh_msg_data_[header_length + type_length], body_length_);
+        std::string archive_data(&mesh_msg_data_[payload_offset()], payload_length());
         std::istringstream archive_stream(archive_data);
         boost::archive::text_iarchive archive(archive_stream);
         archive >> *scenediff;
@@ -379,8 +397,9 @@ public:
     // get as obj stream
     stringstream as_obj() const
     {
+        AllocScope alloc_scope(alloc_serialize);
         // body length = inner header + obj length + mtl length
-        auto header_type_skip = header_length + type_length + header_length + filename_length_;
+        auto header_type_skip = payload_offset() + header_length + filename_length_;
         std::size_t obj_length = 0;
         
         stringstream inner_header(string(&mesh_msg_data_[header_type_skip], header_length));
@@ -392,8 +411,9 @@ public:
     
     stringstream as_obj()
     {
+        AllocScope alloc_scope(alloc_serialize);
         // body length = inner header + obj length + mtl length
-        auto header_type_skip = header_length + type_length + header_length + filename_length_;
+        auto header_type_skip = payload_offset() + header_length + filename_length_;
         std::size_t obj_length = 0;
         
         stringstream inner_header(string(&mesh_msg_data_[header_type_skip], header_length));
@@ -406,14 +426,15 @@ public:
     // get as obj stream
     stringstream as_mtl() const
     {
+        AllocScope alloc_scope(alloc_serialize);
         // body length = inner header + obj length + mtl length
-        auto header_type_skip = header_length + type_length + header_length + filename_length_;
+        auto header_type_skip = payload_offset() + header_length + filename_length_;
         std::size_t obj_length = 0, mtl_length = 0;
         
         stringstream inner_header(string(&mesh_msg_data_[header_type_skip], header_length));
         inner_header >> std::hex >> obj_length;
         error_if_not(obj_length, "error in as_obj() - obj length 0");
-        mtl_length = body_length_ - (header_length + filename_length_ + header_length + obj_length);
+        mtl_length = payload_length() - (header_length + filename_length_ + header_length + obj_length);
         
         // load mtl stream
         return stringstream(string(&mesh_msg_data_[header_type_skip + header_length + obj_length], mtl_length));
@@ -421,14 +442,15 @@ public:
     
     stringstream as_mtl()
     {
+        AllocScope alloc_scope(alloc_serialize);
         // body length = inner header + obj length + mtl length
-        auto header_type_skip = header_length + type_length + header_length + filename_length_;
+        auto header_type_skip = payload_offset() + header_length + filename_length_;
         std::size_t obj_length = 0, mtl_length = 0;
         
         stringstream inner_header(string(&mesh_msg_data_[header_type_skip], header_length));
         inner_header >> std::hex >> obj_length;
         error_if_not(obj_length, "error in as_obj() - obj length 0");
-        mtl_length = body_length_ - (header_length + filename_length_ + header_length + obj_length);
+        mtl_length = payload_length() - (header_length + filename_length_ + header_length + obj_length);
         
         // load mtl stream
         return stringstream(string(&mesh_msg_data_[header_type_skip + header_length + obj_length], mtl_length));
@@ -480,6 +502,14 @@ public:
         return message_type;
     }
     
+    // name of a message type (as the class sent)
+    static const char* type_name(int type)
+    {
+        static const char* names[] = { "Operation", "Mesh", "SceneDiff", "MeshDiff", "CameraDiff",
+                                       "LightDiff", "MaterialDiff", "Obj_Mtl" };
+        return (type >= 0 && type <= Obj_Mtl_type) ? names[type] : "Unknown";
+    }
+    
     // get filename if obj/mtl
     string filename() const
     {
@@ -511,13 +541,62 @@ public:
             body_length_ = max_body_length;
     }
     
+    // offset of the payload (after header, type and trace extension)
+    std::size_t payload_offset() const
+    {
+        return header_length + type_length + (traced_ ? trace_length : 0);
+    }
+    
+    // get payload length (body without trace extension)
+    std::size_t payload_length() const
+    {
+        return body_length_ - (traced_ ? trace_length : 0);
+    }
+    
+    // tag the message with the id of the edit it carries and the time the edit was made;
+    // the sent time starts as the origin time and is updated by set_sent_time at every hop
+    void set_trace(long long edit_id, long long origin_time)
+    {
+        if(!body_length_) return;
+        if(!traced_){
+            mesh_msg_data_.insert(mesh_msg_data_.begin() + header_length + type_length, trace_length, '0');
+            body_length_ += trace_length;
+            traced_ = true;
+            encode_prefix();
+        }
+        encode_trace_field(0, edit_id);
+        encode_trace_field(1, origin_time);
+        encode_trace_field(2, origin_time);
+    }
+    
+    // set the time the message is written on a socket (ignored if not traced)
+    void set_sent_time(long long sent_time)
+    {
+        if(traced_) encode_trace_field(2, sent_time);
+    }
+    
+    // whether the message carries a trace extension
+    bool traced() const
+    {
+        return traced_;
+    }
+    
+    // get trace extension fields (0 if not traced)
+    long long edit_id() const { return decode_trace_field(0); }
+    long long origin_time() const { return decode_trace_field(1); }
+    long long sent_time() const { return decode_trace_field(2); }
+    
     // decode message header
     bool decode_header()
     {
+        AllocScope alloc_scope(alloc_net);
         std::istringstream is(std::string(&mesh_msg_data_[0], header_length));
         std::istringstream is2(std::string(&mesh_msg_data_[header_length], type_length));
         if (!(is >> std::hex >> body_length_)) return false;
         if (!(is2 >> std::hex >> message_type)) return false;
+        traced_ = message_type & trace_flag;
+        message_type &= ~trace_flag;
+        if (traced_ && body_length_ < trace_length) return false;
 
         mesh_msg_data_.resize(header_length + type_length +  body_length_);
 
@@ -528,9 +607,9 @@ public:
     bool decode_body()
     {
         if(message_type == Obj_Mtl_type){
-            std::istringstream is_fnl(std::string(&mesh_msg_data_[header_length + type_length], header_length));
+            std::istringstream is_fnl(std::string(&mesh_msg_data_[payload_offset()], header_length));
             if (!(is_fnl >> std::hex >> filename_length_)) return false;
-            std::istringstream is_fn(std::string(&mesh_msg_data_[header_length + type_length + header_length], filename_length_));
+            std::istringstream is_fn(std::string(&mesh_msg_data_[payload_offset() + header_length], filename_length_));
             if (!(is_fn >> filename_)) return false;
             return true;
         }
@@ -546,12 +625,57 @@ public:
     }
     
 private:
+    // rewrite header and type (with trace flag) in front of the data
+    void encode_prefix()
+    {
+        char prefix[header_length + type_length + 1];
+        std::snprintf(prefix, sizeof(prefix), "%8lx%3x", (unsigned long)body_length_, message_type | (traced_ ? trace_flag : 0));
+        std::memcpy(&mesh_msg_data_[0], prefix, header_length + type_length);
+    }
+    
+    // write field i of the trace extension
+    void encode_trace_field(int i, long long value)
+    {
+        char field[trace_length / 3 + 1];
+        std::snprintf(field, sizeof(field), "%016llx", (unsigned long long)value);
+        std::memcpy(&mesh_msg_data_[header_length + type_length + i * (trace_length / 3)], field, trace_length / 3);
+    }
+    
+    // read field i of the trace extension
+    long long decode_trace_field(int i) const
+    {
+        if(!traced_) return 0;
+        std::string field(&mesh_msg_data_[header_length + type_length + i * (trace_length / 3)], trace_length / 3);
+        return (long long)std::strtoull(field.c_str(), nullptr, 16);
+    }
+    
     std::vector<char> mesh_msg_data_ = std::vector<char>(header_length + type_length);
     std::string filename_;
     int message_type = -1;
+    bool traced_ = false;
     char data_[header_length + max_body_length];
     std::size_t body_length_;
     std::size_t filename_length_;
 };
 
+// records the arrival of a traced message as edit.recv, and the time the previous hop sent it
+// (clock of that process) as edit.upstream_sent; both events are valued with the edit id
+inline void trace_received(const mesh_msg& m_msg)
+{
+    static const int upstream_sent_id = trace_id("edit.upstream_sent");
+    static const int recv_id = trace_id("edit.recv");
+    if(!m_msg.traced()) return;
+    trace_event_at(m_msg.sent_time(), upstream_sent_id, trace_instant, m_msg.edit_id());
+    trace_event(recv_id, trace_instant, m_msg.edit_id());
+}
+
+// stamps the sent time of a traced message about to be written and records it as event name
+inline void trace_sent(mesh_msg& m_msg, int name)
+{
+    if(!m_msg.traced()) return;
+    auto now = trace_now();
+    m_msg.set_sent_time(now);
+    trace_event_at(now, name, trace_instant, m_msg.edit_id());
+}
+
 #endif
@@ -0,0 +1,186 @@
+#include "metrics.h"
+#include <climits>
+#include <cmath>
+#include <mutex>
+
+// metrics of a name: kind, help and one metric per label set
+struct _MetricFamily {
+    char                            kind = 'c';     // c (counter), g (gauge) or h (histogram)
+    string                          help;
+    map<string,MetricCounter*>      counters;
+    map<string,MetricGauge*>        gauges;
+    map<string,MetricHistogram*>    histograms;
+};
+
+// registry, built on first use so that metrics can be created by the initializers of globals
+struct _MetricRegistry {
+    std::mutex                  mutex;              // guards the families
+    map<string,_MetricFamily>   families;           // metric families by name
+};
+
+_MetricRegistry& _registry() {
+    static auto registry = new _MetricRegistry();
+    return *registry;
+}
+
+// index of the most significant bit of v > 0
+inline int _msb(unsigned long long v) {
+    auto b = 0;
+    while(v >>= 1) b ++;
+    return b;
+}
+
+int metric_histogram_bucket(long long v) {
+    const int half = metric_histogram_sub_buckets / 2, bits = _msb(metric_histogram_sub_buckets) - 1;
+    if(v < metric_histogram_sub_buckets) return (int)std::max(v, 0ll);
+    auto shift = _msb(v) - bits;
+    return metric_histogram_sub_buckets + (shift - 1) * half + (int)((v >> shift) - half);
+}
+
+long long metric_histogram_bucket_min(int bucket) {
+    const int half = metric_histogram_sub_buckets / 2;
+    if(bucket < metric_histogram_sub_buckets) return bucket;
+    auto shift = (bucket - metric_histogram_sub_buckets) / half + 1;
+    return (long long)((bucket - metric_histogram_sub_buckets) % half + half) << shift;
+}
+
+long long metric_histogram_bucket_max(int bucket) {
+    if(bucket + 1 >= metric_histogram_buckets) return LLONG_MAX;
+    return metric_histogram_bucket_min(bucket + 1) - 1;
+}
+
+void MetricHistogram::record(long long v) {
+    v = std::max(v, 0ll);
+    counts[metric_histogram_bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(v, std::memory_order_relaxed);
+    auto current = max.load(std::memory_order_relaxed);
+    while(v > current and not max.compare_exchange_weak(current, v, std::memory_order_relaxed)) { }
+    count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// value at quantile q of bucket counts (the counts may be changing, their sum is the total)
+long long _quantile(const vector<long long>& counts, double q, long long max) {
+    auto total = 0ll;
+    for(auto c : counts) total += c;
+    if(not total) return 0;
+    auto rank = std::max(1ll, (long long)ceil(q * total));
+    auto seen = 0ll;
+    for(auto i : range(counts.size())) {
+        seen += counts[i];
+        if(seen < rank) continue;
+        auto low = metric_histogram_bucket_min(i), high = metric_histogram_bucket_max(i);
+        return std::min(low + (high - low) / 2, max);
+    }
+    return max;
+}
+
+// bucket counts of histograms
+vector<long long> _counts(const vector<MetricHistogram*>& histograms) {
+    auto counts = vector<long long>(metric_histogram_buckets, 0);
+    for(auto histogram : histograms)
+        for(auto i : range(metric_histogram_buckets)) counts[i] += histogram->counts[i].load(std::memory_order_relaxed);
+    return counts;
+}
+
+long long MetricHistogram::quantile(double q) const {
+    return _quantile(_counts({ const_cast<MetricHistogram*>(this) }), q, max.load(std::memory_order_relaxed));
+}
+
+// family name, checking that it is not used by metrics of another kind
+_MetricFamily& _family(const string& name, const string& help, char kind) {
+    auto& family = _registry().families[name];
+    if(family.help.empty()) { family.kind = kind; family.help = help; }
+    error_if_not(family.kind == kind, "metric %s used with two kinds\n", name.c_str());
+    return family;
+}
+
+MetricCounter* metric_counter(const string& name, const string& help, const string& labels) {
+    std::lock_guard<std::mutex> lock(_registry().mutex);
+    auto& metric = _family(name, help, 'c').counters[labels];
+    if(not metric) metric = new MetricCounter();
+    return metric;
+}
+
+MetricGauge* metric_gauge(const string& name, const string& help, const string& labels) {
+    std::lock_guard<std::mutex> lock(_registry().mutex);
+    auto& metric = _family(name, help, 'g').gauges[labels];
+    if(not metric) metric = new MetricGauge();
+    return metric;
+}
+
+MetricHistogram* metric_histogram(const string& name, const string& help, const string& labels, double scale) {
+    std::lock_guard<std::mutex> lock(_registry().mutex);
+    auto& metric = _family(name, help, 'h').histograms[labels];
+    if(not metric) { metric = new MetricHistogram(); metric->scale = scale; }
+    return metric;
+}
+
+void metric_remove(const string& name, const string& labels) {
+    std::lock_guard<std::mutex> lock(_registry().mutex);
+    auto& families = _registry().families;
+    auto it = families.find(name);
+    if(it == families.end()) return;
+    auto& family = it->second;
+    if(family.counters.count(labels)) { delete family.counters[labels]; family.counters.erase(labels); }
+    if(family.gauges.count(labels)) { delete family.gauges[labels]; family.gauges.erase(labels); }
+    if(family.histograms.count(labels)) { delete family.histograms[labels]; family.histograms.erase(labels); }
+    if(family.counters.empty() and family.gauges.empty() and family.histograms.empty()) families.erase(it);
+}
+
+// {labels} with an extra label, empty if none
+string _labels(const string& labels, const string& extra = "") {
+    if(labels.empty() and extra.empty()) return "";
+    return "{" + labels + ((labels.empty() or extra.empty()) ? "" : ",") + extra + "}";
+}
+
+string metrics_text() {
+    std::lock_guard<std::mutex> lock(_registry().mutex);
+    const char* types[] = { "counter", "gauge", "summary" };
+    auto text = string();
+    for(auto& it : _registry().families) {
+        auto& name = it.first;
+        auto& family = it.second;
+        auto type = (family.kind == 'c') ? types[0] : (family.kind == 'g') ? types[1] : types[2];
+        text += "# HELP " + name + " " + family.help + "\n# TYPE " + name + " " + type + "\n";
+        for(auto& metric : family.counters) text += name + _labels(metric.first) + " " + std::to_string(metric.second->get()) + "\n";
+        for(auto& metric : family.gauges) text += name + _labels(metric.first) + " " + std::to_string(metric.second->get()) + "\n";
+        for(auto& metric : family.histograms) {
+            auto histogram = metric.second;
+            auto counts = _counts({ histogram });
+            auto max = histogram->max.load(std::memory_order_relaxed);
+            for(auto q : { 0.5, 0.9, 0.99, 0.999, 1.0 })
+                text += name + _labels(metric.first, tostring("quantile=\"%g\"", q)) + " " +
+                        tostring("%.9g", _quantile(counts, q, max) * histogram->scale) + "\n";
+            text += name + "_sum" + _labels(metric.first) + " " + tostring("%.9g", histogram->sum.load() * histogram->scale) + "\n";
+            text += name + "_count" + _labels(metric.first) + " " + std::to_string(histogram->get_count()) + "\n";
+        }
+    }
+    return text;
+}
+
+string metrics_summary() {
+    std::lock_guard<std::mutex> lock(_registry().mutex);
+    auto line = string();
+    for(auto& it : _registry().families) {
+        auto& family = it.second;
+        if(not line.empty()) line += " ";
+        if(family.kind == 'h') {
+            auto histograms = vector<MetricHistogram*>();
+            auto max = 0ll, count = 0ll;
+            for(auto& metric : family.histograms) {
+                histograms.push_back(metric.second);
+                max = std::max(max, metric.second->max.load());
+                count += metric.second->get_count();
+            }
+            auto counts = _counts(histograms);
+            auto scale = histograms.empty() ? 1.0 : histograms[0]->scale;
+            line += it.first + tostring("=%lld:%.3g/%.3g", count, _quantile(counts, 0.5, max) * scale, _quantile(counts, 0.99, max) * scale);
+        } else {
+            auto value = 0ll;
+            for(auto& metric : family.counters) value += metric.second->get();
+            for(auto& metric : family.gauges) value += metric.second->get();
+            line += it.first + "=" + std::to_string(value);
+        }
+    }
+    return line;
+}
@@ -0,0 +1,67 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "common.h"
+
+// Metrics: counters, gauges and histograms kept in a global registry, updated lock-free from any
+// thread (a relaxed atomic add per update) and read while they change to render the Prometheus
+// text exposition or a one-line summary for the log. A metric is a name and a label set, as
+// type="MeshDiff" or session="3"; lookups take a lock, so hot paths keep the returned pointer.
+
+// monotonic count (events, bytes)
+struct MetricCounter {
+    std::atomic<long long>  value {0};
+
+    void add(long long n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    long long get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// value that goes up and down (queue depth, memory)
+struct MetricGauge {
+    std::atomic<long long>  value {0};
+
+    void set(long long v) { value.store(v, std::memory_order_relaxed); }
+    void add(long long n) { value.fetch_add(n, std::memory_order_relaxed); }
+    long long get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// distribution of non-negative values in log-linear buckets as HDR histograms: exact below
+// metric_histogram_sub_buckets, then metric_histogram_sub_buckets/2 buckets per power of two,
+// so quantiles are within 1/metric_histogram_sub_buckets of the recorded values (2 significant digits)
+const int metric_histogram_sub_buckets = 128;
+const int metric_histogram_buckets = metric_histogram_sub_buckets + 56 * metric_histogram_sub_buckets / 2;
+
+struct MetricHistogram {
+    vector<std::atomic<long long>>  counts = vector<std::atomic<long long>>(metric_histogram_buckets);
+    std::atomic<long long>          count {0};  // values recorded
+    std::atomic<long long>          sum {0};    // sum of the values
+    std::atomic<long long>          max {0};    // largest value
+    double                          scale = 1;  // unit of the exposition per recorded unit (1e-9 for ns as seconds)
+
+    // records v (negative values as 0)
+    void record(long long v);
+    // value at quantile q in [0,1] (midpoint of its bucket, 0 if empty)
+    long long quantile(double q) const;
+    long long get_count() const { return count.load(std::memory_order_relaxed); }
+};
+
+// bucket of value v and bounds [min,max] of a bucket
+int metric_histogram_bucket(long long v);
+long long metric_histogram_bucket_min(int bucket);
+long long metric_histogram_bucket_max(int bucket);
+
+// metric name with labels, created on first use (thread-safe); help describes the metric name
+MetricCounter* metric_counter(const string& name, const string& help, const string& labels = "");
+MetricGauge* metric_gauge(const string& name, const string& help, const string& labels = "");
+MetricHistogram* metric_histogram(const string& name, const string& help, const string& labels = "", double scale = 1);
+
+// removes the metric name with labels (the pointer must not be used anymore)
+void metric_remove(const string& name, const string& labels);
+
+// registry in the Prometheus text exposition format (histograms as summaries with quantiles)
+string metrics_text();
+
+// one line with the value of each counter and gauge (summed over labels) and the p50/p99 of each histogram
+string metrics_summary();
+
+#endif
@@ -9,6 +9,7 @@
 #include "obj_parser.h"
 #include "common.h"
 #include "id_reference.h"
+#include "mesh_cache.h"
 #include <sstream>
 
 using namespace std;
@@ -43,6 +44,7 @@ stringstream load_obj(const string& filename){
 void obj_read_vertices(Scene* scene, Mesh* mesh, stringstream* ss){
     string line, v, x, y, z;
     timestamp_t v_id = 1;
+    auto start = ss->tellg();
     while(getline(*ss, line)){
         stringstream c;
         c << line;
@@ -61,74 +63,154 @@ void obj_read_vertices(Scene* scene, Mesh* mesh, stringstream* ss){
                 if(mat->_id_ == stoull(x)) mesh->mat = mat;
             }
         }
-        else
+        else {
+            // leave the first non vertex line (usually a face) to the next reader
+            ss->clear();
+            ss->seekg(start);
             break;
+        }
+        start = ss->tellg();
     }
     
 }
 
+// face corner as read from a face record (0 if the element is missing)
+struct _obj_corner {
+    long long v = 0, t = 0, n = 0;
+};
+
+// max number of corners per face record
+const int _obj_max_corners = 64;
+
+// parses a signed integer at c, advancing it; returns false if there are no digits
+static bool _obj_parse_int(const char*& c, long long& value){
+    auto negative = (*c == '-');
+    if(*c == '-' or *c == '+') c++;
+    if(*c < '0' or *c > '9') return false;
+    value = 0;
+    while(*c >= '0' and *c <= '9') value = value * 10 + (*c++ - '0');
+    if(negative) value = -value;
+    return true;
+}
+
+// parses a face corner in any of the forms v, v/t, v//n, v/t/n, advancing c
+static bool _obj_parse_corner(const char*& c, _obj_corner& corner){
+    corner = _obj_corner();
+    if(not _obj_parse_int(c, corner.v)) return false;
+    if(*c != '/') return true;
+    c++;
+    if(*c != '/' and not _obj_parse_int(c, corner.t)) return *c == ' ' or *c == '\t' or *c == 0 or *c == '\r';
+    if(*c != '/') return true;
+    c++;
+    return _obj_parse_int(c, corner.n);
+}
+
+// resolves a relative (negative) index against the count of elements read so far
+static long long _obj_resolve_index(long long index, size_t count){
+    return (index < 0) ? (long long)count + index + 1 : index;
+}
+
+// reads face records parsing them in place: all index forms and negative indices are supported,
+// faces with more than 4 corners are fan-split into quads (plus a triangle for odd leftovers)
 void obj_read_faces(Mesh* mesh, stringstream *ss){
     timestamp_t _id = 1;
-    string line, v_id, n_id;
+    string line;
     vector<vec3f> temp_norm = vector<vec3f>(mesh->pos.size(), zero3f);
-    while(getline(*ss, line)){
-        if(line.find(obj_face_el) == string::npos)
-            break;
-        istringstream iss(line);
-        vector<string> tokens{istream_iterator<string>{iss},
-            istream_iterator<string>{}};
-        vector<timestamp_t> v_ids, n_ids;
-        for(int j = 1; j < tokens.size(); j++){
-            size_t pos = tokens[j].find("/");
-            v_ids.push_back(stoull(tokens[j].substr(0, pos)));
-            pos = tokens[j].find("/", pos + 1);
-            n_ids.push_back(stoull(tokens[j].substr(pos+1)));
-        }
-        if(v_ids.size() == 3){
+    vector<bool> has_norm = vector<bool>(mesh->pos.size(), false);
+    _obj_corner corners[_obj_max_corners];
+    timestamp_t v_ids[_obj_max_corners];
+    auto nverts = mesh->pos.size();
+    auto nnorms = mesh->norm.size();
+    // direct access to vertex data by obj index, avoiding a map lookup per corner
+    vector<pair<int,set<timestamp_t>>*> vertex_ref = vector<pair<int,set<timestamp_t>>*>(nverts+1, nullptr);
+    for (auto& v : mesh->vertices) if(v.first <= nverts) vertex_ref[v.first] = &v.second;
+    
+    // adds a face made of corners k of the current record to the triangle or quad map
+    auto add_face = [&](std::initializer_list<int> k){
+        auto ids = k.begin();
+        if(k.size() == 3){
             // find indices position
-            auto& a = mesh->vertices[v_ids[0]];
-            auto& b = mesh->vertices[v_ids[1]];
-            auto& c = mesh->vertices[v_ids[2]];
+            auto& a = *vertex_ref[v_ids[ids[0]]];
+            auto& b = *vertex_ref[v_ids[ids[1]]];
+            auto& c = *vertex_ref[v_ids[ids[2]]];
             // insert this id in vertex adiacencis
-            a.second.insert(_id);
-            b.second.insert(_id);
-            c.second.insert(_id);
+            a.second.insert(a.second.end(),_id);
+            b.second.insert(b.second.end(),_id);
+            c.second.insert(c.second.end(),_id);
             // compute normal
             auto n = normalize(cross(mesh->pos[b.first]-mesh->pos[a.first], mesh->pos[c.first]-mesh->pos[a.first]));
             // build triangle structure
-            mesh->triangle.emplace(_id++,make_tuple(mesh->triangle_index.size(),vec3id(v_ids[0],v_ids[1],v_ids[2]),n));
+            mesh->triangle.emplace_hint(mesh->triangle.end(),_id++,make_tuple(mesh->triangle_index.size(),vec3id(v_ids[ids[0]],v_ids[ids[1]],v_ids[ids[2]]),n));
             mesh->triangle_index.push_back({a.first,b.first,c.first});
-            // rearrange normals
-            for (int i = 0; i < 3; i++) {
-                if (v_ids[i] != n_ids[i]) temp_norm[v_ids[i]-1] = mesh->norm[n_ids[i]-1];
-                else temp_norm[n_ids[i]-1] = mesh->norm[n_ids[i]-1];
-            }
-        }
-        if(v_ids.size() == 4){
+            // accumulate face normal on vertices without a normal
+            for (auto i : {a.first,b.first,c.first}) if(not has_norm[i]) temp_norm[i] += n;
+        } else {
             // find indices position
-            auto& a = mesh->vertices[v_ids[0]];
-            auto& b = mesh->vertices[v_ids[1]];
-            auto& c = mesh->vertices[v_ids[2]];
-            auto& d = mesh->vertices[v_ids[3]];
+            auto& a = *vertex_ref[v_ids[ids[0]]];
+            auto& b = *vertex_ref[v_ids[ids[1]]];
+            auto& c = *vertex_ref[v_ids[ids[2]]];
+            auto& d = *vertex_ref[v_ids[ids[3]]];
             // insert this id in vertex adiacencis
-            a.second.insert(_id);
-            b.second.insert(_id);
-            c.second.insert(_id);
-            d.second.insert(_id);
+            a.second.insert(a.second.end(),_id);
+            b.second.insert(b.second.end(),_id);
+            c.second.insert(c.second.end(),_id);
+            d.second.insert(d.second.end(),_id);
             // compute normal
             auto n = normalize(normalize(cross(mesh->pos[b.first]-mesh->pos[a.first], mesh->pos[c.first]-mesh->pos[a.first])) +
                                normalize(cross(mesh->pos[c.first]-mesh->pos[a.first], mesh->pos[d.first]-mesh->pos[a.first])));
             // build quad structure
-            mesh->quad.emplace(_id,make_tuple(mesh->quad_index.size(),vec4id(v_ids[0],v_ids[1],v_ids[2],v_ids[3]),n));
+            mesh->quad.emplace_hint(mesh->quad.end(),_id++,make_tuple(mesh->quad_index.size(),vec4id(v_ids[ids[0]],v_ids[ids[1]],v_ids[ids[2]],v_ids[ids[3]]),n));
             mesh->quad_index.push_back({a.first,b.first,c.first,d.first});
-            // rearrange normals
-            for (int i = 0; i < 4; i++) {
-                if (v_ids[i] != n_ids[i]) temp_norm[v_ids[i]-1] = mesh->norm[n_ids[i]-1];
-                else temp_norm[n_ids[i]-1] = mesh->norm[n_ids[i]-1];
-            }
-
+            // accumulate face normal on vertices without a normal
+            for (auto i : {a.first,b.first,c.first,d.first}) if(not has_norm[i]) temp_norm[i] += n;
+        }
+    };
+    
+    auto start = ss->tellg();
+    while(getline(*ss, line)){
+        auto c = line.c_str();
+        while(*c == ' ' or *c == '\t') c++;
+        // a new object starts: leave it to the scene parser
+        if(c[0] == 'o' and (c[1] == ' ' or c[1] == '\t')) { ss->clear(); ss->seekg(start); break; }
+        start = ss->tellg();
+        // skip everything else that is not a face (comments, groups, smoothing)
+        if(c[0] != 'f' or (c[1] != ' ' and c[1] != '\t')) continue;
+        c++;
+        
+        // parse corners
+        auto count = 0;
+        auto valid = true;
+        while(true){
+            while(*c == ' ' or *c == '\t') c++;
+            if(*c == 0 or *c == '\r' or *c == '#') break;
+            if(count == _obj_max_corners or not _obj_parse_corner(c, corners[count])) { valid = false; break; }
+            auto& corner = corners[count];
+            corner.v = _obj_resolve_index(corner.v, nverts);
+            corner.n = _obj_resolve_index(corner.n, nnorms);
+            if(corner.v < 1 or corner.v > nverts or not vertex_ref[corner.v] or corner.n < 0 or corner.n > nnorms) { valid = false; break; }
+            v_ids[count] = corner.v;
+            count++;
+        }
+        if(not valid or count < 3) { message("skipping bad face record: %s\n", line.c_str()); continue; }
+        
+        // rearrange normals
+        for (auto i = 0; i < count; i++) {
+            if (not corners[i].n) continue;
+            temp_norm[corners[i].v-1] = mesh->norm[corners[i].n-1];
+            has_norm[corners[i].v-1] = true;
+        }
+        
+        // build faces
+        if(count == 3) add_face({0,1,2});
+        else if(count == 4) add_face({0,1,2,3});
+        else {
+            auto i = 1;
+            for(; i + 2 < count; i += 2) add_face({0,i,i+1,i+2});
+            if(i + 1 < count) add_face({0,i,i+1});
         }
     }
+    // normalize normals computed from faces
+    for (auto i : range(temp_norm.size())) if(not has_norm[i] and length(temp_norm[i]) > 0) temp_norm[i] = normalize(temp_norm[i]);
     mesh->norm = temp_norm;
 }
 
@@ -204,6 +286,7 @@ Scene* obj_parse_scene(stringstream obj, bool mtl_file = true, Scene* s = nullpt
             c << line;
             c >> m;
             c >> matlib;
+            mesh_cache_depend(dirname + matlib);
             obj_parse_materials(scene, load_obj(dirname + matlib));
             continue;
         }
@@ -229,10 +312,21 @@ Scene* obj_parse_scene(stringstream obj, bool mtl_file = true, Scene* s = nullpt
 
 
 Scene* load_obj_scene(const string& filename) {
+    AllocScope alloc_scope(alloc_load);
     //get directory name
     auto pos = filename.rfind("/");
     dirname = (pos == string::npos) ? string() : filename.substr(0,pos+1);
+    // skip parsing if this content was already parsed
+    if(auto scene = mesh_cache_load(filename)) return scene;
     auto scene = obj_parse_scene(load_obj(filename));
+    mesh_cache_save(filename, scene);
     return scene;
 }
 
+
+
+MeshDiff* obj_import_meshdiff(Mesh* mesh, Mesh* imported){
+    AllocScope alloc_scope(alloc_diff);
+    // exported coordinates are rounded to a few decimals by most tools
+    return meshdiff_spatial_match(mesh, imported, 1e-5f);
+}
@@ -25,4 +25,8 @@ Scene* obj_parse_scene(stringstream obj, bool mtl_file, Scene* s);
 stringstream load_obj(const string& filename);
 Scene* load_obj_scene(const string& filename);
 
+// differences that turn mesh into imported, a re-export of it from an external tool
+// (see meshdiff_spatial_match), expressed with the ids of mesh
+MeshDiff* obj_import_meshdiff(Mesh* mesh, Mesh* imported);
+
 #endif /* defined(__dist_scene__obj_parser__) */
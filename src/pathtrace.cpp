@@ -0,0 +1,290 @@
+#include "pathtrace.h"
+#include "intersect.h"
+#include "id_reference.h"
+#include "common.h"
+#include <random>
+
+int pathtrace_tile_size = 32;
+
+// random number generator of a tile: seeded by the tile index, so images do not depend on
+// the thread that rendered each tile
+struct _pathtrace_rng {
+    minstd_rand                         engine;
+    uniform_real_distribution<float>    uniform = uniform_real_distribution<float>(0,1);
+
+    _pathtrace_rng(int seed) : engine(seed + 1) { }
+    float next() { return uniform(engine); }
+};
+
+// bilinear texture lookup with wrapping; one when there is no texture
+vec3f _lookup(texture3* txt, const vec2f& uv) {
+    if(not txt or txt->empty()) return one3f;
+    auto s = (uv.x - floor(uv.x)) * txt->width(), t = (uv.y - floor(uv.y)) * txt->height();
+    auto i = min((int)s, txt->width()-1), j = min((int)t, txt->height()-1);
+    auto ii = (i+1) % txt->width(), jj = (j+1) % txt->height();
+    auto u = s - i, v = t - j;
+    return txt->at(i,j)*(1-u)*(1-v) + txt->at(ii,j)*u*(1-v) + txt->at(i,jj)*(1-u)*v + txt->at(ii,jj)*u*v;
+}
+
+// background color along direction d (latitude-longitude background texture if any)
+vec3f _background(Scene* scene, const vec3f& d) {
+    if(not scene->background_txt) return scene->background;
+    auto uv = vec2f(atan2(d.z, d.x)/(2*pif) + 0.5f, acos(clamp(d.y,-1.0f,1.0f))/pif);
+    return scene->background * _lookup(scene->background_txt, uv);
+}
+
+// direction given in the local frame of normal n
+vec3f _to_world(const vec3f& n, const vec3f& local) {
+    auto x = (fabs(n.x) > 0.5f) ? y3f : x3f, y = zero3f, z = n;
+    orthonormalize_zxy(x, y, z);
+    return x*local.x + y*local.y + z*local.z;
+}
+
+// shaded material values at a hit
+struct _pathtrace_point {
+    vec3f       pos, norm, v;           // position, shading normal and direction to the viewer
+    vec3f       ke, kd, ks, kr;         // material coefficients after texture lookups
+    float       n = 10;                 // specular exponent
+    bool        microfacet = false;     // microfacet formulation
+};
+
+// brdf times cosine for light direction l; normalized selects energy-conserving Blinn-Phong for
+// the classic model (used for indirect light), otherwise the classic model matches fragment.glsl
+vec3f _brdfcos(const _pathtrace_point& pt, const vec3f& l, bool normalized) {
+    auto ln = dot(pt.norm, l), vn = dot(pt.norm, pt.v);
+    if(ln <= 0) return zero3f;
+    auto h = normalize(pt.v + l);
+    auto hn = max(0.0f, dot(pt.norm, h));
+    if(not pt.microfacet) {
+        if(not normalized) return (pt.kd + pt.ks * pow(hn, pt.n)) * ln;
+        return (pt.kd / pif + pt.ks * ((pt.n + 2) / (2*pif)) * pow(hn, pt.n)) * ln;
+    }
+    if(vn <= 0) return pt.kd / pif * ln;
+    auto d = (pt.n + 2) / (2*pif) * pow(hn, pt.n);
+    auto f = pt.ks + (one3f - pt.ks) * pow(1 - max(0.0f, dot(h, l)), 5.0f);
+    auto g = min(1.0f, min(2*hn*vn/dot(pt.v,h), 2*hn*ln/dot(l,h)));
+    return (pt.kd / pif + f * (d * g / (4 * ln * vn))) * ln;
+}
+
+// radiance along ray
+vec3f _pathtrace_ray(Scene* scene, const ray3f& ray, int depth, _pathtrace_rng& rng) {
+    auto intersection = intersect_scene(scene, ray);
+    if(not intersection.hit) return _background(scene, ray.d);
+
+    auto mat = intersection.mat;
+    auto uv = intersection.texcoord;
+    auto pt = _pathtrace_point();
+    pt.pos = intersection.pos;
+    pt.v = -normalize(ray.d);
+    pt.norm = (mat->norm_txt) ? normalize(2*_lookup(mat->norm_txt, uv) - one3f) : intersection.norm;
+    if(mat->double_sided and dot(pt.norm, pt.v) < 0) pt.norm = -pt.norm;
+    pt.ke = mat->ke * _lookup(mat->ke_txt, uv);
+    pt.kd = mat->kd * _lookup(mat->kd_txt, uv);
+    pt.ks = mat->ks * _lookup(mat->ks_txt, uv);
+    pt.kr = mat->kr * _lookup(mat->kr_txt, uv);
+    pt.n = mat->n;
+    pt.microfacet = mat->microfacet;
+
+    // emission, ambient and point lights
+    auto c = pt.ke + scene->ambient * pt.kd;
+    for(auto light : scene->lights) {
+        auto dl = light->frame.o - pt.pos;
+        auto distance = length(dl);
+        if(distance <= 0) continue;
+        auto l = dl / distance;
+        auto brdfcos = _brdfcos(pt, l, false);
+        if(brdfcos == zero3f) continue;
+        if(scene->path_shadows and hit_scene(scene, ray3f(pt.pos, l, ray3f_epsilon, distance - ray3f_epsilon))) continue;
+        c += light->intensity / (distance*distance) * brdfcos;
+    }
+    if(depth >= scene->path_max_depth) return c;
+
+    // mirror reflection
+    if(not (pt.kr == zero3f)) c += pt.kr * _pathtrace_ray(scene, ray3f(pt.pos, reflect(-pt.v, pt.norm)), depth+1, rng);
+
+    // indirect light: cosine-weighted hemisphere, or a mix of it with the specular lobe
+    // proportional to kd and ks when sampling the brdf
+    auto diffuse_weight = max(mean(pt.kd), 0.0f);
+    auto specular_weight = (scene->path_sample_brdf) ? max(mean(pt.ks), 0.0f) : 0.0f;
+    if(diffuse_weight + specular_weight <= 0) return c;
+    if(not scene->path_sample_brdf) diffuse_weight = 1;
+    auto total = diffuse_weight + specular_weight;
+    auto u0 = rng.next(), u1 = rng.next(), u2 = rng.next();
+    auto phi = 2 * pif * u2;
+    auto l = zero3f;
+    if(u0 * total < specular_weight) {
+        auto cos_theta = pow(u1, 1 / (pt.n + 1)), sin_theta = sqrt(max(0.0f, 1 - cos_theta*cos_theta));
+        auto h = _to_world(pt.norm, vec3f(cos(phi)*sin_theta, sin(phi)*sin_theta, cos_theta));
+        l = 2 * dot(pt.v, h) * h - pt.v;
+    } else {
+        auto sin_theta = sqrt(u1), cos_theta = sqrt(max(0.0f, 1 - u1));
+        l = _to_world(pt.norm, vec3f(cos(phi)*sin_theta, sin(phi)*sin_theta, cos_theta));
+    }
+    auto ln = dot(pt.norm, l);
+    if(ln <= 0) return c;
+    auto pdf = diffuse_weight * ln / pif;
+    if(specular_weight > 0) {
+        auto h = normalize(pt.v + l);
+        auto vh = dot(pt.v, h);
+        if(vh > 0) pdf += specular_weight * (pt.n + 1) / (2*pif) * pow(max(0.0f, dot(pt.norm, h)), pt.n) / (4 * vh);
+    }
+    pdf /= total;
+    if(pdf <= 0) return c;
+    auto brdfcos = _brdfcos(pt, l, true);
+    if(brdfcos == zero3f) return c;
+    return c + brdfcos * _pathtrace_ray(scene, ray3f(pt.pos, l), depth+1, rng) / pdf;
+}
+
+image3f pathtrace(Scene* scene, int width, int height, int samples) {
+    auto image = image3f(width, height);
+    if(width <= 0 or height <= 0) return image;
+    samples = max(samples, 1);
+    // bvhs are built up front: the worker threads only read them
+    make_scene_bvhs(scene);
+
+    // keep the camera aspect consistent with the image, as the monitor does
+    auto camera = scene->camera;
+    auto camera_width = camera->height * width / height;
+
+    auto tiles_x = (width + pathtrace_tile_size - 1) / pathtrace_tile_size;
+    auto tiles_y = (height + pathtrace_tile_size - 1) / pathtrace_tile_size;
+    // tiles are handed out one at a time, so that threads finishing early take the remaining ones
+    parallel_for(tiles_x * tiles_y, [&](int tile) {
+        auto rng = _pathtrace_rng(tile);
+        auto i0 = (tile % tiles_x) * pathtrace_tile_size, j0 = (tile / tiles_x) * pathtrace_tile_size;
+        for(auto j = j0; j < min(j0 + pathtrace_tile_size, height); j ++) {
+            for(auto i = i0; i < min(i0 + pathtrace_tile_size, width); i ++) {
+                auto c = zero3f;
+                for(auto sj : range(samples)) {
+                    for(auto si : range(samples)) {
+                        auto u = (i + (si + rng.next()) / samples) / width;
+                        auto v = (j + (sj + rng.next()) / samples) / height;
+                        auto q = vec3f((u - 0.5f) * camera_width, (v - 0.5f) * camera->height, -camera->dist);
+                        c += _pathtrace_ray(scene, transform_ray(camera->frame, ray3f(zero3f, normalize(q))), 0, rng);
+                    }
+                }
+                image.at(i,j) = c / (samples * samples);
+            }
+        }
+    }, 1);
+    return image;
+}
+
+image3f pathtrace(Scene* scene) {
+    return pathtrace(scene, scene->image_width, scene->image_height, scene->image_samples);
+}
+
+void pathtrace_thumbnail(Scene* scene, const string& filename, int size) {
+    auto aspect = scene->camera->width / scene->camera->height;
+    auto width = (aspect >= 1) ? size : max(1, (int)(size * aspect));
+    auto height = (aspect >= 1) ? max(1, (int)(size / aspect)) : size;
+    write_png(filename, pathtrace(scene, width, height, 1), true);
+}
+
+// copy of a material with its textures (shared)
+Material* _pathtrace_copy_material(Material* mat) {
+    auto copy = new Material(*mat);
+    copy->ke_txt = mat->ke_txt;
+    copy->kd_txt = mat->kd_txt;
+    copy->ks_txt = mat->ks_txt;
+    copy->kr_txt = mat->kr_txt;
+    copy->norm_txt = mat->norm_txt;
+    copy->double_sided = mat->double_sided;
+    copy->microfacet = mat->microfacet;
+    return copy;
+}
+
+// copy of what the path tracer reads from scene, without bvhs
+Scene* _pathtrace_copy_scene(Scene* scene) {
+    auto copy = new Scene();
+    *copy->camera = *scene->camera;
+    for(auto mesh : scene->meshes) {
+        auto mesh_copy = new Mesh(*mesh);
+        delete mesh_copy->mat;
+        mesh_copy->mat = _pathtrace_copy_material(mesh->mat);
+        copy->meshes.push_back(mesh_copy);
+    }
+    for(auto surface : scene->surfaces) {
+        auto surface_copy = new Surface(*surface);
+        surface_copy->mat = _pathtrace_copy_material(surface->mat);
+        surface_copy->animation = nullptr;
+        surface_copy->_display_mesh = nullptr;
+        copy->surfaces.push_back(surface_copy);
+    }
+    for(auto light : scene->lights) copy->lights.push_back(new Light(*light));
+    copy->background = scene->background;
+    copy->background_txt = scene->background_txt;
+    copy->ambient = scene->ambient;
+    copy->image_samples = scene->image_samples;
+    copy->path_max_depth = scene->path_max_depth;
+    copy->path_sample_brdf = scene->path_sample_brdf;
+    copy->path_shadows = scene->path_shadows;
+    return copy;
+}
+
+// frees a copy made by _pathtrace_copy_scene
+void _pathtrace_delete_scene(Scene* scene) {
+    for(auto mesh : scene->meshes) {
+        delete mesh->mat;
+        delete mesh->bvh;
+        delete mesh;
+    }
+    for(auto surface : scene->surfaces) {
+        delete surface->mat;
+        delete surface;
+    }
+    for(auto light : scene->lights) delete light;
+    delete scene->camera;
+    delete scene->animation;
+    delete scene;
+}
+
+bool ThumbnailWorker::idle() {
+    std::lock_guard<std::mutex> guard(lock);
+    return not busy;
+}
+
+void ThumbnailWorker::render(Scene* scene, const string& filename) {
+    auto copy = _pathtrace_copy_scene(scene);
+    std::lock_guard<std::mutex> guard(lock);
+    if(not worker.joinable()) {
+        closing = false;
+        worker = std::thread([this]() { _render_loop(); });
+    }
+    if(pending) _pathtrace_delete_scene(pending);
+    pending = copy;
+    pending_filename = filename;
+    busy = true;
+    wake.notify_one();
+}
+
+void ThumbnailWorker::close() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(not worker.joinable()) return;
+        closing = true;
+        wake.notify_one();
+    }
+    worker.join();
+    if(pending) _pathtrace_delete_scene(pending);
+    pending = nullptr;
+    busy = false;
+}
+
+void ThumbnailWorker::_render_loop() {
+    std::unique_lock<std::mutex> guard(lock);
+    while(true) {
+        wake.wait(guard, [this]() { return closing or pending; });
+        if(closing) return;
+        auto scene = pending;
+        auto filename = pending_filename;
+        pending = nullptr;
+        guard.unlock();
+        timing_literal("thumbnail[start]");
+        pathtrace_thumbnail(scene, filename, size);
+        timing_literal("thumbnail[end]");
+        _pathtrace_delete_scene(scene);
+        guard.lock();
+        busy = (pending != nullptr);
+    }
+}
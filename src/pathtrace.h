@@ -0,0 +1,52 @@
+#ifndef _PATHTRACE_H_
+#define _PATHTRACE_H_
+
+#include "scene_distributed.h"
+#include "image.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// CPU path tracer for headless previews: no OpenGL context is needed. It reads the path
+// tracing settings of Scene (path_max_depth, path_sample_brdf, path_shadows, image_samples);
+// direct lighting uses the same point-light model as the OpenGL monitor.
+
+extern int pathtrace_tile_size;     // side of the square tiles handed out to the worker threads
+
+// renders scene at width x height with samples x samples stratified samples per pixel;
+// rows are stored bottom first, as read back from OpenGL (write with flipY)
+image3f pathtrace(Scene* scene, int width, int height, int samples);
+
+// renders scene at its image size and samples
+image3f pathtrace(Scene* scene);
+
+// renders a preview of scene with the longest side of size pixels and writes it as png
+void pathtrace_thumbnail(Scene* scene, const string& filename, int size);
+
+// renders thumbnails on its own thread, so that the caller does not wait for the path tracer.
+// render copies what the path tracer reads from the scene (textures are shared: they are not
+// edited) and returns; the copy builds its own bvhs on the worker thread. A render requested
+// while another one is pending replaces it.
+struct ThumbnailWorker {
+    int                     size = 128;             // longest side of the thumbnails
+    std::mutex              lock;
+    std::condition_variable wake;
+    std::thread             worker;
+    bool                    closing = false;
+    bool                    busy = false;           // a thumbnail is pending or being rendered
+    Scene*                  pending = nullptr;      // copy waiting for the worker
+    string                  pending_filename;
+
+    ~ThumbnailWorker() { close(); }
+
+    // true when no thumbnail is pending or being rendered
+    bool idle();
+    // renders a copy of scene to filename on the worker thread (started on first use)
+    void render(Scene* scene, const string& filename);
+    // waits for the thumbnail being rendered and stops the worker (a pending one is dropped)
+    void close();
+
+    void _render_loop();
+};
+
+#endif
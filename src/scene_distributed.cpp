@@ -1,57 +1,84 @@
 #include "scene_distributed.h"
 #include "serialization.hpp"
 #include "id_reference.h"
+#include "mesh_cache.h"
+#include "intersect.h"
+#include "trace.h"
 #include <iostream>
 #include <chrono>
 #include <ctime>
+#include <array>
+#include <unordered_map>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 
 #include <boost/serialization/map.hpp>
 
-map<string, long long> timing_log;
-map<string, long long> apply_log;
+// names ending in [start] and [end] delimit a span
+TimingEntry timing_entry(const string& s){
+    static const string start = "[start]", end = "[end]";
+    auto ends_with = [&](const string& suffix) { return s.size() > suffix.size() and s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0; };
+    auto entry = TimingEntry();
+    if (ends_with(start)) { entry.name = trace_id(s.substr(0, s.size() - start.size())); entry.phase = trace_begin; }
+    else if (ends_with(end)) { entry.name = trace_id(s.substr(0, s.size() - end.size())); entry.phase = trace_end; }
+    else entry.name = trace_id(s);
+    return entry;
+}
 
+// records a timing log entry
+void _timing(const string& s, TraceCategory category){
+    auto entry = timing_entry(s);
+    trace_event(entry.name, entry.phase, 0, category);
+}
+
+// saves a timing log as the map of the last time (or value) of each entry
+void _save_timing(const string& s, TraceCategory category){
+    auto log = trace_timing_log(category);
+    string filename = "../log/" + s;
+    std::ofstream ofs(filename);
+    boost::archive::text_oarchive oa(ofs);
+    oa << log;
+}
 
 void timing(const string& s){
-    std::chrono::high_resolution_clock::time_point time = std::chrono::high_resolution_clock::now();
-    timing_log[s] = time.time_since_epoch().count();
+    _timing(s, trace_timing);
 }
 
 void timing(const string& s, long long i){
-    timing_log[s] = i;
+    trace_event(trace_id(s), trace_counter, i, trace_timing);
 };
 
+void timing(const TimingEntry& entry){
+    trace_event(entry.name, entry.phase, 0, trace_timing);
+}
+
+void timing_apply(const TimingEntry& entry){
+    trace_event(entry.name, entry.phase, 0, trace_apply);
+}
+
 // save timing log
 void save_timing(const string& s){
-    string filename = "../log/" + s;
-    std::ofstream ofs(filename);
-    boost::archive::text_oarchive oa(ofs);
-    oa << timing_log;
+    _save_timing(s, trace_timing);
 };
 
 void timing_apply(const string& s){
-    std::chrono::high_resolution_clock::time_point time = std::chrono::high_resolution_clock::now();
-    apply_log[s] = time.time_since_epoch().count();
+    _timing(s, trace_apply);
 }
 
 void timing_apply(const string& s, long long i){
-    apply_log[s] = i;
+    trace_event(trace_id(s), trace_counter, i, trace_apply);
 };
 
 // save timing log
 void save_timing_apply(const string& s){
-    string filename = "../log/" + s;
-    std::ofstream ofs(filename);
-    boost::archive::text_oarchive oa(ofs);
-    oa << apply_log;
+    _save_timing(s, trace_apply);
 };
 
 // reference to solve
 vector<id_reference*> ref_to_solve;
 
-vector<image3f*> get_textures(Scene* scene) {
-    auto textures = set<image3f*>();
+vector<texture3*> get_textures(Scene* scene) {
+    auto textures = set<texture3*>();
     for(auto mesh : scene->meshes) {
         if(mesh->mat->ke_txt) textures.insert(mesh->mat->ke_txt);
         if(mesh->mat->kd_txt) textures.insert(mesh->mat->kd_txt);
@@ -65,7 +92,7 @@ vector<image3f*> get_textures(Scene* scene) {
         if(surface->mat->norm_txt) textures.insert(surface->mat->norm_txt);
     }
     if(scene->background_txt) textures.insert(scene->background_txt);
-    return vector<image3f*>(textures.begin(),textures.end());
+    return vector<texture3*>(textures.begin(),textures.end());
 }
 
 map<timestamp_t,Mesh*> mesh_history;
@@ -81,6 +108,57 @@ timestamp_t get_global_version(){
     return global_scene_version;
 }
 
+// bytes of a std::map of n entries (nodes of three pointers and a color)
+template <typename K, typename V>
+long long map_memory(const map<K,V>& m){
+    return m.size() * (sizeof(pair<const K,V>) + 32);
+}
+
+// bytes of a std::vector
+template <typename T>
+long long vector_memory(const vector<T>& v){
+    return v.capacity() * sizeof(T);
+}
+
+long long meshdiff_memory(const MeshDiff* meshdiff){
+    return sizeof(MeshDiff) + vector_memory(meshdiff->remove_vertex) + vector_memory(meshdiff->remove_edge) +
+        vector_memory(meshdiff->remove_triangle) + vector_memory(meshdiff->remove_quad) + map_memory(meshdiff->add_vertex) +
+        map_memory(meshdiff->add_norm) + map_memory(meshdiff->add_edge) + map_memory(meshdiff->add_triangle) +
+        map_memory(meshdiff->add_quad) + map_memory(meshdiff->update_vertex) + map_memory(meshdiff->update_norm) +
+        vector_memory(meshdiff->remove_keyframe) + map_memory(meshdiff->update_keyframe);
+}
+
+long long mesh_memory(const Mesh* mesh){
+    auto bytes = (long long)sizeof(Mesh) + map_memory(mesh->vertices) + vector_memory(mesh->pos) + vector_memory(mesh->normal_ids) +
+        vector_memory(mesh->norm) + vector_memory(mesh->texcoord) + map_memory(mesh->triangle) + vector_memory(mesh->triangle_index) +
+        map_memory(mesh->quad) + vector_memory(mesh->quad_index) + map_memory(mesh->edge) + vector_memory(mesh->edge_index) +
+        vector_memory(mesh->point) + vector_memory(mesh->line) + vector_memory(mesh->spline);
+    // face ids of the vertices
+    for (auto& v : mesh->vertices) bytes += v.second.second.size() * (sizeof(timestamp_t) + 32);
+    return bytes;
+}
+
+long long history_memory(){
+    auto bytes = map_memory(mesh_history) + map_memory(meshdiff_history) + map_memory(cameradiff_history) +
+        map_memory(lightdiff_history) + map_memory(materialdiff_history) +
+        vector_memory(scenediff_history) + vector_memory(scenediff_history_reverse);
+    for (auto& m : mesh_history) bytes += mesh_memory(m.second);
+    for (auto& m : meshdiff_history) bytes += meshdiff_memory(m.second);
+    bytes += cameradiff_history.size() * sizeof(CameraDiff) + lightdiff_history.size() * sizeof(LightDiff) +
+        materialdiff_history.size() * sizeof(MaterialDiff);
+    // scene diffs share their diffs with the histories above
+    for (auto& history : { &scenediff_history, &scenediff_history_reverse })
+        for (auto& s : *history)
+            bytes += sizeof(SceneDiff) + vector_memory(s.second->cameras) + vector_memory(s.second->lights) +
+                vector_memory(s.second->materials) + vector_memory(s.second->meshes);
+    return bytes;
+}
+
+int history_size(){
+    return mesh_history.size() + meshdiff_history.size() + cameradiff_history.size() + lightdiff_history.size() +
+        materialdiff_history.size() + scenediff_history.size();
+}
+
 void restore_backward(Scene* scene, int previous, int current){
     for (auto i = current; i >= previous; i--)
         apply_change(scene, scenediff_history_reverse[i].second, 0);
@@ -300,7 +378,8 @@ Camera* json_parse_lookatcamera(const jsonvalue& json) {
 }
 
 vector<string>          json_texture_paths;
-map<string,image3f*>    json_texture_cache;
+map<string,texture3*>   json_texture_cache;
+map<texture3*,string>   json_texture_pending;   // textures referenced while parsing, decoded afterwards
 
 void json_texture_path_push(string filename) {
     auto pos = filename.rfind("/");
@@ -309,24 +388,39 @@ void json_texture_path_push(string filename) {
 }
 void json_texture_path_pop() { json_texture_paths.pop_back(); }
 
-void json_parse_opttexture(jsonvalue json, image3f*& txt, string name) {
+// only records the texture: decoding is deferred to json_load_textures so that files are read in parallel
+void json_parse_opttexture(jsonvalue json, texture3*& txt, string name) {
     if(not json.object_contains(name)) return;
     auto filename = json.object_element(name).as_string();
     if(filename.empty()) { txt = nullptr; return; }
     auto dirname = json_texture_paths.back();
     auto fullname = dirname + filename;
     if (json_texture_cache.find(fullname) == json_texture_cache.end()) {
+        auto ext = fullname.substr(fullname.size()-3);
+        error_if_not(ext == "pfm" or ext == "png", "unsupported image format %s\n", ext.c_str());
+        json_texture_cache[fullname] = new texture3();
+        json_texture_pending[json_texture_cache[fullname]] = fullname;
+    }
+    txt = json_texture_cache[fullname];
+}
+
+// decode all the textures recorded during parsing on worker threads
+// png stay 8-bit, pfm are stored as half-float
+void json_load_textures() {
+    auto pending = vector<pair<texture3*,string>>(json_texture_pending.begin(),json_texture_pending.end());
+    json_texture_pending.clear();
+    parallel_for((int)pending.size(), [&pending](int i){
+        auto txt = pending[i].first;
+        auto& fullname = pending[i].second;
         auto ext = fullname.substr(fullname.size()-3);
         if(ext == "pfm") {
             auto image = read_pnm("models/pisa_latlong.pfm", true);
             image = image.gamma(1/2.2);
-            json_texture_cache[fullname] = new image3f(image);
+            *txt = make_texture(image);
         } else if(ext == "png") {
-            auto image = read_png(fullname,true);
-            json_texture_cache[fullname] = new image3f(image);
-        } else error("unsupported image format %s\n", ext.c_str());
-    }
-    txt = json_texture_cache[fullname];
+            *txt = read_png_texture(fullname,true);
+        }
+    });
 }
 
 Material* json_parse_material(const jsonvalue& json) {
@@ -355,6 +449,42 @@ FrameAnimation* json_parse_frame_animation(const jsonvalue& json) {
     return animation;
 }
 
+int keyframe_index(const FrameAnimation* animation, int time) {
+    auto it = lower_bound(animation->keytimes.begin(), animation->keytimes.end(), time);
+    if (it == animation->keytimes.end() or *it != time) return -1;
+    return it - animation->keytimes.begin();
+}
+
+// marks the baked frames interpolated with key frame k as stale
+void _mark_key_stale(FrameAnimation* animation, int k) {
+    auto from = (k > 0) ? animation->keytimes[k-1] : 0;
+    auto to = (k + 1 < animation->keytimes.size()) ? animation->keytimes[k+1] + 1 : INT_MAX;
+    animation->mark_stale(from, to);
+}
+
+void animation_set_key(FrameAnimation* animation, int time, const vec3f& translation, const vec3f& rotation) {
+    auto k = keyframe_index(animation, time);
+    if (k < 0) {
+        k = lower_bound(animation->keytimes.begin(), animation->keytimes.end(), time) - animation->keytimes.begin();
+        animation->keytimes.insert(animation->keytimes.begin() + k, time);
+        animation->translation.insert(animation->translation.begin() + k, translation);
+        animation->rotation.insert(animation->rotation.begin() + k, rotation);
+    } else {
+        animation->translation[k] = translation;
+        animation->rotation[k] = rotation;
+    }
+    _mark_key_stale(animation, k);
+}
+
+void animation_remove_key(FrameAnimation* animation, int time) {
+    auto k = keyframe_index(animation, time);
+    if (k < 0) return;
+    _mark_key_stale(animation, k);
+    animation->keytimes.erase(animation->keytimes.begin() + k);
+    animation->translation.erase(animation->translation.begin() + k);
+    animation->rotation.erase(animation->rotation.begin() + k);
+}
+
 Surface* json_parse_surface(const jsonvalue& json) {
     auto surface = new Surface();
     json_set_optvalue(json, surface->frame, "frame");
@@ -403,6 +533,13 @@ MeshSimulation* json_parse_mesh_simulation(const jsonvalue& json) {
     return simulation;
 }
 
+MeshCollision* json_parse_mesh_collision(const jsonvalue& json) {
+    auto collision = new MeshCollision();
+    json_set_optvalue(json, collision->radius, "radius");
+    json_set_optvalue(json, collision->isquad, "isquad");
+    return collision;
+}
+
 /*
 // deprecated: too slow
 void init_mesh_properties_from_array(Mesh* mesh){
@@ -570,16 +707,23 @@ void indexing_vertex_position(Mesh* mesh){
     }
     temp_norm.clear();
     temp.clear();
+    // every vertex may have moved
+    mesh->dirty.mark_all();
+    invalidate_bvh(mesh);
+    invalidate_bounds(mesh);
 }
 
 void indexing_triangle_position(Mesh* mesh){
     vector<vec3i> temp = mesh->triangle_index;
     mesh->triangle_index.clear();
     for (auto& triangle : mesh->triangle){
+        // entries from the first moved one on change for the renderer
+        if (get<0>(triangle.second) != mesh->triangle_index.size()) mesh->dirty.mark_triangles(mesh->triangle_index.size());
         // move index position
         mesh->triangle_index.push_back(temp[get<0>(triangle.second)]);
         get<0>(triangle.second) = mesh->triangle_index.size()-1;
     }
+    if (temp.size() != mesh->triangle_index.size()) mesh->dirty.mark_triangles(min(temp.size(), mesh->triangle_index.size()));
     temp.clear();
 }
 
@@ -587,10 +731,13 @@ void indexing_quad_position(Mesh* mesh){
     vector<vec4i> temp = mesh->quad_index;
     mesh->quad_index.clear();
     for (auto& quad : mesh->quad){
+        // entries from the first moved one on change for the renderer
+        if (get<0>(quad.second) != mesh->quad_index.size()) mesh->dirty.mark_quads(mesh->quad_index.size());
         // move index position
         mesh->quad_index.push_back(temp[get<0>(quad.second)]);
         get<0>(quad.second) = mesh->quad_index.size()-1;
     }
+    if (temp.size() != mesh->quad_index.size()) mesh->dirty.mark_quads(min(temp.size(), mesh->quad_index.size()));
     temp.clear();
 }
 
@@ -598,10 +745,13 @@ void indexing_edge_position(Mesh* mesh){
     vector<vec2i> temp = mesh->edge_index;
     mesh->edge_index.clear();
     for (auto& edge : mesh->edge){
+        // entries from the first moved one on change for the renderer
+        if (get<0>(edge.second) != mesh->edge_index.size()) mesh->dirty.mark_edges(mesh->edge_index.size());
         // move index position
         mesh->edge_index.push_back(temp[get<0>(edge.second)]);
         get<0>(edge.second) = mesh->edge_index.size()-1;
     }
+    if (temp.size() != mesh->edge_index.size()) mesh->dirty.mark_edges(min(temp.size(), mesh->edge_index.size()));
     temp.clear();
 }
 
@@ -611,6 +761,7 @@ Mesh* json_parse_mesh(const jsonvalue& json) {
     json_set_optvalue(json, mesh->_id_, "_id_");
     json_set_optvalue(json, mesh->_version, "version");
     if(json.object_contains("json_mesh")) {
+        mesh_cache_depend(json.object_element("json_mesh").as_string());
         json_texture_path_push(json.object_element("json_mesh").as_string());
         mesh = json_parse_mesh(load_json(json.object_element("json_mesh").as_string()));
         json_texture_path_pop();
@@ -766,6 +917,7 @@ Mesh* json_parse_mesh(const jsonvalue& json) {
     if(json.object_contains("skinning")) mesh->skinning = json_parse_mesh_skinning(json.object_element("skinning"));
     if(json.object_contains("json_skinning")) mesh->skinning = json_parse_mesh_skinning(load_json(json.object_element("json_skinning").as_string()));
     if(json.object_contains("simulation")) mesh->simulation = json_parse_mesh_simulation(json.object_element("simulation"));
+    if(json.object_contains("collision")) mesh->collision = json_parse_mesh_collision(json.object_element("collision"));
     if (mesh->skinning) {
         if (mesh->skinning->rest_pos.empty()) mesh->skinning->rest_pos = mesh->pos;
         if (mesh->skinning->rest_norm.empty()) mesh->skinning->rest_norm = mesh->norm;
@@ -842,6 +994,7 @@ void solve_references(Scene* scene){
 }
 
 MeshDiff* meshdiff_assume_ordered( Mesh* first_mesh, Mesh* second_mesh){
+    AllocScope alloc_scope(alloc_diff);
     auto mesh_diff = new MeshDiff();
     
     if ( not (first_mesh->vertices.size() == first_mesh->pos.size()) ) indexing_vertex_position(first_mesh);
@@ -864,7 +1017,7 @@ MeshDiff* meshdiff_assume_ordered( Mesh* first_mesh, Mesh* second_mesh){
             mesh_diff->remove_vertex.push_back(i+1);
         }
     }
-    if (first_mesh->pos.size() > second_mesh->pos.size()){
+    if (first_mesh->pos.size() < second_mesh->pos.size()){
         // added vertices
         for (; i < size_max; i++){
             mesh_diff->add_vertex.emplace(i+1, second_mesh->pos[i]);
@@ -957,10 +1110,237 @@ MeshDiff* meshdiff_assume_ordered( Mesh* first_mesh, Mesh* second_mesh){
     return mesh_diff;
 }
 
+// cell of the spatial hash grid containing p
+static unsigned long long _grid_cell_hash(long long x, long long y, long long z){
+    return (unsigned long long)(x * 73856093LL) ^ (unsigned long long)(y * 19349663LL) ^ (unsigned long long)(z * 83492791LL);
+}
+
+// face vertex ids rotated to start from the smallest one (winding is preserved)
+template <int N>
+static array<timestamp_t,N> _face_key(array<timestamp_t,N> ids){
+    rotate(ids.begin(), min_element(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+static array<timestamp_t,3> _face_ids(const vec3id& t){ return {{t.first, t.second, t.third}}; }
+static array<timestamp_t,4> _face_ids(const vec4id& q){ return {{q.first, q.second, q.third, q.fourth}}; }
+
+template <int N>
+struct _face_key_hash {
+    size_t operator()(const array<timestamp_t,N>& k) const {
+        size_t h = 0;
+        for (auto id : k) h = h * 1099511628211ULL ^ hash<timestamp_t>()(id);
+        return h;
+    }
+};
+
+// matches the faces of second (remapped to first vertex ids) against those of first:
+// faces found in both are kept, the others are removed or added with fresh ids
+template <int N, typename V, typename R, typename I>
+static void _diff_faces(const map<timestamp_t,tuple<int,V,vec3f>>& first, const map<timestamp_t,tuple<int,V,vec3f>>& second,
+                        const R& remap, const I& new_id, vector<timestamp_t>& removed, map<timestamp_t,V>& added){
+    // faces in the same order in both meshes are kept without hashing them
+    auto it1 = first.begin();
+    auto it2 = second.begin();
+    for (; it1 != first.end() and it2 != second.end(); ++it1, ++it2)
+        if (not (_face_key<N>(_face_ids(get<1>(it1->second))) == _face_key<N>(_face_ids(remap(get<1>(it2->second)))))) break;
+    
+    unordered_multimap<array<timestamp_t,N>,timestamp_t,_face_key_hash<N>> faces;
+    faces.reserve(distance(it1, first.end()));
+    for (; it1 != first.end(); ++it1) faces.emplace(_face_key<N>(_face_ids(get<1>(it1->second))), it1->first);
+    for (; it2 != second.end(); ++it2){
+        auto ids = remap(get<1>(it2->second));
+        auto it = faces.find(_face_key<N>(_face_ids(ids)));
+        if (it != faces.end()) faces.erase(it);
+        else added.emplace(new_id(), ids);
+    }
+    for (auto& f : faces) removed.push_back(f.second);
+}
+
+MeshDiff* meshdiff_spatial_match( Mesh* first_mesh, Mesh* second_mesh, float epsilon){
+    AllocScope alloc_scope(alloc_diff);
+    auto mesh_diff = new MeshDiff();
+    mesh_diff->_id_ = first_mesh->_id_;
+    mesh_diff->_version = first_mesh->_version + 1;
+    
+    // vertices in id order (the order of an exported mesh); pos may still hold removed vertices
+    vector<timestamp_t> first_ids, second_ids;
+    vector<vec3f> first_pos, second_pos;
+    first_ids.reserve(first_mesh->vertices.size());
+    first_pos.reserve(first_mesh->vertices.size());
+    for (auto& v : first_mesh->vertices){
+        first_ids.push_back(v.first);
+        first_pos.push_back(first_mesh->pos[v.second.first]);
+    }
+    second_ids.reserve(second_mesh->vertices.size());
+    second_pos.reserve(second_mesh->vertices.size());
+    for (auto& v : second_mesh->vertices){
+        second_ids.push_back(v.first);
+        second_pos.push_back(second_mesh->pos[v.second.first]);
+    }
+    int n1 = first_pos.size(), n2 = second_pos.size();
+    
+    // fresh ids, never colliding with the elements of the first mesh
+    auto next_id = get_timestamp();
+    auto new_id = [&]() -> timestamp_t {
+        while (first_mesh->vertices.count(next_id) or first_mesh->triangle.count(next_id) or
+               first_mesh->quad.count(next_id) or first_mesh->edge.count(next_id)) next_id++;
+        return next_id++;
+    };
+    
+    // spatial hash grid over the first mesh: cells of size epsilon sorted by hash,
+    // so a vertex within epsilon is always in one of the 27 cells around the probe
+    timing_literal("spatial_grid[start]");
+    auto cell = [epsilon](float c){ return (long long)floor(c / epsilon); };
+    vector<pair<unsigned long long,int>> grid(n1);
+    parallel_for(n1, [&](int i){
+        auto& p = first_pos[i];
+        grid[i] = make_pair(_grid_cell_hash(cell(p.x), cell(p.y), cell(p.z)), i);
+    }, 4096);
+    sort(grid.begin(), grid.end());
+    // open addressing table from cell hash to the first grid entry of the cell
+    auto table_size = 1;
+    while (table_size < 2 * n1) table_size *= 2;
+    vector<int> table(table_size, -1);
+    for (auto k = 0; k < n1; k++){
+        if (k > 0 and grid[k].first == grid[k-1].first) continue;
+        auto slot = grid[k].first & (table_size - 1);
+        while (table[slot] >= 0) slot = (slot + 1) & (table_size - 1);
+        table[slot] = k;
+    }
+    auto find_cell = [&](unsigned long long h) -> int {
+        for (auto slot = h & (table_size - 1); table[slot] >= 0; slot = (slot + 1) & (table_size - 1))
+            if (grid[table[slot]].first == h) return table[slot];
+        return -1;
+    };
+    timing_literal("spatial_grid[end]");
+    
+    // nearest vertex of the first mesh within epsilon, the one with the same index winning
+    // over the others; vertices already in used are skipped
+    auto probe = [&](int i, const vector<bool>* used) -> int {
+        auto& p = second_pos[i];
+        if (i < n1 and not (used and (*used)[i]) and lengthSqr(first_pos[i] - p) <= epsilon * epsilon) return i;
+        auto cx = cell(p.x), cy = cell(p.y), cz = cell(p.z);
+        auto best = -1;
+        auto best_dist = epsilon * epsilon;
+        for (auto dx = -1; dx <= 1; dx++) for (auto dy = -1; dy <= 1; dy++) for (auto dz = -1; dz <= 1; dz++){
+            auto h = _grid_cell_hash(cx + dx, cy + dy, cz + dz);
+            auto k = find_cell(h);
+            if (k < 0) continue;
+            for (; k < n1 and grid[k].first == h; k++){
+                auto j = grid[k].second;
+                if (used and (*used)[j]) continue;
+                auto d = lengthSqr(first_pos[j] - p);
+                if (d > epsilon * epsilon) continue;
+                if (best < 0 or d < best_dist or (d == best_dist and j < best)){
+                    best = j;
+                    best_dist = d;
+                }
+            }
+        }
+        return best;
+    };
+    
+    // probe in parallel, then resolve vertices claimed twice in index order
+    timing_literal("spatial_probe[start]");
+    vector<int> match(n2, -1);
+    parallel_for(n2, [&](int i){ match[i] = probe(i, nullptr); }, 1024);
+    vector<bool> used(n1, false);
+    for (auto i = 0; i < n2; i++){
+        if (match[i] < 0) continue;
+        if (used[match[i]]) match[i] = probe(i, &used);
+        if (match[i] >= 0) used[match[i]] = true;
+    }
+    timing_literal("spatial_probe[end]");
+    
+    // vertices moved within epsilon
+    for (auto i = 0; i < n2; i++){
+        if (match[i] >= 0 and not (first_pos[match[i]] == second_pos[i]))
+            mesh_diff->update_vertex.emplace(first_ids[match[i]], second_pos[i]);
+    }
+    
+    // vertices moved further keep the identity of the vertex with the same index
+    for (auto i = 0; i < n2; i++){
+        if (match[i] >= 0 or i >= n1 or used[i]) continue;
+        match[i] = i;
+        used[i] = true;
+        mesh_diff->update_vertex.emplace(first_ids[i], second_pos[i]);
+    }
+    
+    // first mesh vertex ids of the second mesh vertices, the remaining vertices are new
+    vector<timestamp_t> matched_ids(n2);
+    for (auto i = 0; i < n2; i++){
+        if (match[i] >= 0) matched_ids[i] = first_ids[match[i]];
+        else {
+            matched_ids[i] = new_id();
+            mesh_diff->add_vertex.emplace(matched_ids[i], second_pos[i]);
+        }
+    }
+    // second_ids is sorted and usually contiguous (1..n for obj files)
+    auto id_map = [&](timestamp_t id) -> timestamp_t {
+        auto i = (n2 > 0) ? id - second_ids[0] : 0;
+        if (i >= n2 or second_ids[i] != id) i = lower_bound(second_ids.begin(), second_ids.end(), id) - second_ids.begin();
+        return matched_ids[i];
+    };
+    
+    // vertices not matched are deleted, along with the edges using them
+    set<timestamp_t> removed_vertex;
+    for (auto i = 0; i < n1; i++){
+        if (used[i]) continue;
+        mesh_diff->remove_vertex.push_back(first_ids[i]);
+        removed_vertex.insert(first_ids[i]);
+    }
+    for (auto& e : first_mesh->edge){
+        auto& ids = get<1>(e.second);
+        if (removed_vertex.count(ids.first) or removed_vertex.count(ids.second)) mesh_diff->remove_edge.push_back(e.first);
+    }
+    
+    // faces by matched vertex ids
+    _diff_faces<3>(first_mesh->triangle, second_mesh->triangle,
+                   [&](const vec3id& t){ return vec3id(id_map(t.first), id_map(t.second), id_map(t.third)); },
+                   new_id, mesh_diff->remove_triangle, mesh_diff->add_triangle);
+    _diff_faces<4>(first_mesh->quad, second_mesh->quad,
+                   [&](const vec4id& q){ return vec4id(id_map(q.first), id_map(q.second), id_map(q.third), id_map(q.fourth)); },
+                   new_id, mesh_diff->remove_quad, mesh_diff->add_quad);
+    
+    return mesh_diff;
+}
+
+// applies the key frame changes of meshdiff to the animation of mesh (creating it at the mesh frame if
+// missing), recording in reverse, if given, the changes that undo them
+void _apply_keyframe_change(Mesh* mesh, MeshDiff* meshdiff, MeshDiff* reverse) {
+    if (meshdiff->remove_keyframe.empty() and meshdiff->update_keyframe.empty()) return;
+    if (not mesh->animation) {
+        mesh->animation = new FrameAnimation();
+        mesh->animation->rest_frame = mesh->frame;
+    }
+    auto animation = mesh->animation;
+    for (auto time : meshdiff->remove_keyframe) {
+        auto k = keyframe_index(animation, time);
+        if (k < 0) continue;
+        if (reverse) reverse->update_keyframe.emplace(time, make_pair(animation->translation[k], animation->rotation[k]));
+        animation_remove_key(animation, time);
+    }
+    for (auto& key : meshdiff->update_keyframe) {
+        if (reverse) {
+            auto k = keyframe_index(animation, key.first);
+            if (k < 0) reverse->remove_keyframe.push_back(key.first);
+            else reverse->update_keyframe.emplace(key.first, make_pair(animation->translation[k], animation->rotation[k]));
+        }
+        animation_set_key(animation, key.first, key.second.first, key.second.second);
+    }
+}
+
 // new version
 // applay vertex creation, elimination and update on a mesh.
 // It updates also all other structure in a mesh (edges & faces)
 void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history){
+    AllocScope alloc_scope(alloc_apply);
+    // changes are not tracked element by element here
+    mesh->dirty.mark_all();
+    invalidate_bvh(mesh);
+    invalidate_bounds(mesh);
+    
     
     auto vs = mesh->vertices.size();
     auto ts = mesh->triangle.size();
@@ -969,21 +1349,23 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
     
     if ( not (mesh->vertices.size() == mesh->pos.size()) ) indexing_vertex_position(mesh);
     
-    timing_apply("save_history[start]");
+    timing_apply_literal("save_history[start]");
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new MeshDiff(*meshdiff);
         meshdiff_history.emplace(save_history,clone);
     }
-    timing_apply("save_history[end]");
+    timing_apply_literal("save_history[end]");
     
     
     // remove
     
-    timing_apply("remove_edges[start]");
+    timing_apply_literal("remove_edges[start]");
     // remove edges
     for (auto edge : meshdiff->remove_edge){
         // set index to -1
         mesh->edge_index[mesh->edge[edge].first] = none2i;
+        mesh->dirty.mark_edges(mesh->edge[edge].first);
         // remove edge
         mesh->edge.erase(edge);
     }
@@ -994,8 +1376,8 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
     else
         es -= meshdiff->remove_edge.size();
     
-    timing_apply("remove_edges[end]");
-    timing_apply("remove_triangle[start]");
+    timing_apply_literal("remove_edges[end]");
+    timing_apply_literal("remove_triangle[start]");
     // remove triangles
     for (auto triangle : meshdiff->remove_triangle){
         auto t = mesh->triangle[triangle];
@@ -1011,6 +1393,7 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
         // set index to -1
         //mesh->triangle_index[get<0>(t)] = zero3i;
         mesh->triangle_index[get<0>(t)] = none3i;
+        mesh->dirty.mark_triangles(get<0>(t));
         // remove triangle
         mesh->triangle.erase(triangle);
     }
@@ -1021,8 +1404,8 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
     else
         ts -= meshdiff->remove_triangle.size();
     
-    timing_apply("remove_triangle[end]");
-    timing_apply("remove_quad[start]");
+    timing_apply_literal("remove_triangle[end]");
+    timing_apply_literal("remove_quad[start]");
     // remove quads
     for (auto quad : meshdiff->remove_quad){
         auto q = mesh->quad[quad];
@@ -1039,6 +1422,7 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
         
         // set index to -1
         mesh->quad_index[get<0>(q)] = none4i;
+        mesh->dirty.mark_quads(get<0>(q));
         // remove quad
         mesh->quad.erase(quad);
     }
@@ -1049,9 +1433,9 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
         qs -= meshdiff->remove_quad.size();
     
     
-    timing_apply("remove_quad[end]");
+    timing_apply_literal("remove_quad[end]");
     
-    timing_apply("delete_vertex[start]");
+    timing_apply_literal("delete_vertex[start]");
     // vertex delete
     for (auto v : meshdiff->remove_vertex){
         mesh->vertices.erase(v);
@@ -1068,13 +1452,13 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
         vs -= meshdiff->add_vertex.size();
     
     
-    timing_apply("delete_vertex[end]");
+    timing_apply_literal("delete_vertex[end]");
 
 
     
     // update
     
-    timing_apply("update_vertex[start]");
+    timing_apply_literal("update_vertex[start]");
     // update existing vertex
     for (auto v : meshdiff->update_vertex) mesh->pos[mesh->vertices[v.first].first] = v.second;
     
@@ -1085,12 +1469,12 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
         message("error 3\n");
     }
     
-    timing_apply("update_vertex[end]");
+    timing_apply_literal("update_vertex[end]");
 
     
     // add
     
-    timing_apply("add_vertex[start]");
+    timing_apply_literal("add_vertex[start]");
     // add new vertex
     for (auto v : meshdiff->add_vertex){
         if(mesh->vertices.find(v.first) != mesh->vertices.end()){
@@ -1099,7 +1483,7 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
         mesh->vertices.emplace(v.first, make_pair(mesh->pos.size(),set<timestamp_t>() ));
         mesh->pos.push_back(v.second);
     }
-    timing_apply("add_vertex[end]");
+    timing_apply_literal("add_vertex[end]");
     
     if(mesh->vertices.size() != vs + meshdiff->add_vertex.size()){
         message("error 1: %d != %d + %d\n", mesh->vertices.size() , vs , meshdiff->add_vertex.size());
@@ -1107,7 +1491,7 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
     else
         vs += meshdiff->add_vertex.size();
     
-    timing_apply("add_norm[start]");
+    timing_apply_literal("add_norm[start]");
 
     for (auto v : meshdiff->add_norm){
         if(mesh->vertices.find(v.first) != mesh->vertices.end()){
@@ -1115,11 +1499,11 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
         }
         mesh->norm.push_back(v.second);
     }
-    timing_apply("add_norm[end]");
+    timing_apply_literal("add_norm[end]");
 
     
     
-    timing_apply("add_edge[start]");
+    timing_apply_literal("add_edge[start]");
     // add edges
     for (auto edge : meshdiff->add_edge){
         mesh->edge.emplace(edge.first,make_pair(mesh->edge_index.size(),edge.second));
@@ -1134,8 +1518,8 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
     else
         es += meshdiff->add_edge.size();
     
-    timing_apply("add_edge[end]");
-    timing_apply("add_triangle[start]");
+    timing_apply_literal("add_edge[end]");
+    timing_apply_literal("add_triangle[start]");
     // add triangles
     for (auto triangle : meshdiff->add_triangle){
         auto& a = mesh->vertices[triangle.second.first];
@@ -1160,8 +1544,8 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
         ts += meshdiff->add_triangle.size();
     
     
-    timing_apply("add_triangle[end]");
-    timing_apply("add_quad[start]");
+    timing_apply_literal("add_triangle[end]");
+    timing_apply_literal("add_quad[start]");
     // add quads
     for (auto quad : meshdiff->add_quad){
         auto& a = mesh->vertices[quad.second.first];
@@ -1187,7 +1571,7 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
     else
         qs += meshdiff->add_quad.size();
     
-    timing_apply("add_quad[end]");
+    timing_apply_literal("add_quad[end]");
     
     // set mesh version for shuttle
     mesh->_version = meshdiff->_version;
@@ -1195,16 +1579,19 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
     // if set change frame coordinates
     if (not isnan(meshdiff->frame)) mesh->frame = meshdiff->frame;
     
+    // key frames
+    _apply_keyframe_change(mesh, meshdiff, nullptr);
+    
     vs = mesh->vertices.size();
     ts = mesh->triangle.size();
     qs = mesh->quad.size();
     
     //indexing_vertex_position(mesh);
-    timing_apply("indexing[start]");
+    timing_apply_literal("indexing[start]");
     indexing_triangle_position(mesh);
     indexing_quad_position(mesh);
     //indexing_edge_position(mesh);
-    timing_apply("indexing[end]");
+    timing_apply_literal("indexing[end]");
     
     
 }
@@ -1213,19 +1600,22 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
 // applay vertex creation, elimination and update on a mesh.
 // It updates also all other structure in a mesh (edges & faces)
 void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history){
+    trace_scope("apply_mesh_change", trace_apply);
+    AllocScope alloc_scope(alloc_apply);
     auto vs = mesh->vertices.size();
     auto ts = mesh->triangle.size();
     auto qs = mesh->quad.size();
     auto es = mesh->edge.size();
     
-    timing_apply("save_history[start]");
+    timing_apply_literal("save_history[start]");
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new MeshDiff(*meshdiff);
         meshdiff_history.emplace(save_history,clone);
     }
-    timing_apply("save_history[end]");
+    timing_apply_literal("save_history[end]");
 
-    timing_apply("add_vertex[start]");
+    timing_apply_literal("add_vertex[start]");
     // add new vertex
     for (auto v : meshdiff->add_vertex){
         if(mesh->vertices.find(v.first) != mesh->vertices.end()){
@@ -1234,8 +1624,9 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         mesh->vertices.emplace(v.first, make_pair(mesh->pos.size(),set<timestamp_t>() ));
         mesh->pos.push_back(v.second);
         mesh->norm.push_back(zero3f);
+        mesh->dirty.mark_vertex(mesh->pos.size()-1);
     }
-    timing_apply("add_vertex[end]");
+    timing_apply_literal("add_vertex[end]");
     
     if(mesh->vertices.size() != vs + meshdiff->add_vertex.size()){
         message("error 1: %d != %d + %d\n", mesh->vertices.size() , vs , meshdiff->add_vertex.size());
@@ -1243,9 +1634,12 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
     else
         vs += meshdiff->add_vertex.size();
     
-    timing_apply("update_vertex[start]");
+    timing_apply_literal("update_vertex[start]");
     // update existing vertex
-    for (auto v : meshdiff->update_vertex) mesh->pos[mesh->vertices[v.first].first] = v.second;
+    for (auto v : meshdiff->update_vertex){
+        mesh->pos[mesh->vertices[v.first].first] = v.second;
+        mesh->dirty.mark_vertex(mesh->vertices[v.first].first);
+    }
     
     if(mesh->vertices.size() != vs){
         message("error 2\n");
@@ -1273,6 +1667,9 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
                 mesh->norm[a.first] += (n - old_face_norm) / a.second.size();
                 mesh->norm[b.first] += (n - old_face_norm) / b.second.size();
                 mesh->norm[c.first] += (n - old_face_norm) / c.second.size();
+                mesh->dirty.mark_vertex(a.first);
+                mesh->dirty.mark_vertex(b.first);
+                mesh->dirty.mark_vertex(c.first);
              
                 get<2>(triangle_info->second) = n; // update face normal
             }
@@ -1294,6 +1691,10 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
                 mesh->norm[b.first] += (n - old_face_norm) / b.second.size();
                 mesh->norm[c.first] += (n - old_face_norm) / c.second.size();
                 mesh->norm[d.first] += (n - old_face_norm) / d.second.size();
+                mesh->dirty.mark_vertex(a.first);
+                mesh->dirty.mark_vertex(b.first);
+                mesh->dirty.mark_vertex(c.first);
+                mesh->dirty.mark_vertex(d.first);
                 std::get<2>(quad_info) = n; // update face normal
             }
         }
@@ -1306,17 +1707,18 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         message("error 3\n");
     }
 
-    timing_apply("update_vertex[end]");
+    timing_apply_literal("update_vertex[end]");
     
-//    timing_apply("init_position[start]");
+//    timing_apply_literal("init_position[start]");
 //    // restore vertex position indexing
 //    if(need_update_pos_faces) indexing_vertex_position(mesh);
-//    timing_apply("init_position[end]");
-    timing_apply("remove_edges[start]");
+//    timing_apply_literal("init_position[end]");
+    timing_apply_literal("remove_edges[start]");
     // remove edges
     for (auto edge : meshdiff->remove_edge){
         // set index to -1
         mesh->edge_index[mesh->edge[edge].first] = none2i;
+        mesh->dirty.mark_edges(mesh->edge[edge].first);
         // remove edge
         mesh->edge.erase(edge);
     }
@@ -1327,8 +1729,8 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
     else
         es -= meshdiff->remove_edge.size();
     
-    timing_apply("remove_edges[end]");
-    timing_apply("remove_triangle[start]");
+    timing_apply_literal("remove_edges[end]");
+    timing_apply_literal("remove_triangle[start]");
     // remove triangles
     for (auto triangle : meshdiff->remove_triangle){
         auto t = mesh->triangle[triangle];
@@ -1336,6 +1738,9 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         auto& a = mesh->vertices[get<1>(t).first];
         auto& b = mesh->vertices[get<1>(t).second];
         auto& c = mesh->vertices[get<1>(t).third];
+        mesh->dirty.mark_vertex(a.first);
+        mesh->dirty.mark_vertex(b.first);
+        mesh->dirty.mark_vertex(c.first);
         
         if (a.second.size()){
             mesh->norm[a.first] = (mesh->norm[a.first] * a.second.size()) - get<2>(t);
@@ -1357,6 +1762,7 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         // set index to -1
         //mesh->triangle_index[get<0>(t)] = zero3i;
         mesh->triangle_index[get<0>(t)] = none3i;
+        mesh->dirty.mark_triangles(get<0>(t));
         
         // remove triangle
         mesh->triangle.erase(triangle);
@@ -1368,8 +1774,8 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
     else
         ts -= meshdiff->remove_triangle.size();
     
-    timing_apply("remove_triangle[end]");
-    timing_apply("remove_quad[start]");
+    timing_apply_literal("remove_triangle[end]");
+    timing_apply_literal("remove_quad[start]");
     // remove quads
     for (auto quad : meshdiff->remove_quad){
         auto q = mesh->quad[quad];
@@ -1378,6 +1784,10 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         auto& b = mesh->vertices[get<1>(q).second];
         auto& c = mesh->vertices[get<1>(q).third];
         auto& d = mesh->vertices[get<1>(q).fourth];
+        mesh->dirty.mark_vertex(a.first);
+        mesh->dirty.mark_vertex(b.first);
+        mesh->dirty.mark_vertex(c.first);
+        mesh->dirty.mark_vertex(d.first);
         
         if (a.second.size()){
             mesh->norm[a.first] = (mesh->norm[a.first] * a.second.size()) - get<2>(q);
@@ -1402,6 +1812,7 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         // set index to -1
         //mesh->quad_index[get<0>(q)] = zero4i;
         mesh->quad_index[get<0>(q)] = none4i;
+        mesh->dirty.mark_quads(get<0>(q));
         
         // remove qiad
         mesh->quad.erase(quad);
@@ -1413,9 +1824,9 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         qs -= meshdiff->remove_quad.size();
 
     
-    timing_apply("remove_quad[end]");
+    timing_apply_literal("remove_quad[end]");
     
-    timing_apply("delete_vertex[start]");
+    timing_apply_literal("delete_vertex[start]");
     // vertex delete
     for (auto v : meshdiff->remove_vertex){
         mesh->vertices.erase(v);
@@ -1432,15 +1843,16 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         vs -= meshdiff->add_vertex.size();
     
     
-    timing_apply("delete_vertex[end]");
+    timing_apply_literal("delete_vertex[end]");
 
     
-    timing_apply("add_edge[start]");
+    timing_apply_literal("add_edge[start]");
     // add edges
     for (auto edge : meshdiff->add_edge){
         mesh->edge.emplace(edge.first,make_pair(mesh->edge_index.size(),edge.second));
         auto& a = mesh->vertices[edge.second.first];
         auto& b = mesh->vertices[edge.second.second];
+        mesh->dirty.mark_edges(mesh->edge_index.size());
         mesh->edge_index.push_back({a.first,b.first});
     }
     
@@ -1450,8 +1862,8 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
     else
         es += meshdiff->add_edge.size();
 
-    timing_apply("add_edge[end]");
-    timing_apply("add_triangle[start]");
+    timing_apply_literal("add_edge[end]");
+    timing_apply_literal("add_triangle[start]");
     // add triangles
     for (auto triangle : meshdiff->add_triangle){
         auto& a = mesh->vertices[triangle.second.first];
@@ -1473,6 +1885,10 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         mesh->norm[c.first] /= c.second.size();
         
         // add
+        mesh->dirty.mark_vertex(a.first);
+        mesh->dirty.mark_vertex(b.first);
+        mesh->dirty.mark_vertex(c.first);
+        mesh->dirty.mark_triangles(mesh->triangle_index.size());
         mesh->triangle.emplace(triangle.first, make_tuple(mesh->triangle_index.size(),triangle.second,n) );
         mesh->triangle_index.push_back({a.first,b.first,c.first});
     }
@@ -1484,8 +1900,8 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         ts += meshdiff->add_triangle.size();
 
     
-    timing_apply("add_triangle[end]");
-    timing_apply("add_quad[start]");
+    timing_apply_literal("add_triangle[end]");
+    timing_apply_literal("add_quad[start]");
     // add quads
     for (auto quad : meshdiff->add_quad){
         auto& a = mesh->vertices[quad.second.first];
@@ -1513,6 +1929,11 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
         mesh->norm[d.first] /= d.second.size();
         
         // add
+        mesh->dirty.mark_vertex(a.first);
+        mesh->dirty.mark_vertex(b.first);
+        mesh->dirty.mark_vertex(c.first);
+        mesh->dirty.mark_vertex(d.first);
+        mesh->dirty.mark_quads(mesh->quad_index.size());
         mesh->quad.emplace(quad.first, make_tuple(mesh->quad_index.size(),quad.second,n));
         mesh->quad_index.push_back({a.first,b.first,c.first,d.first});
     }
@@ -1522,7 +1943,7 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
     else
         qs += meshdiff->add_quad.size();
 
-    timing_apply("add_quad[end]");
+    timing_apply_literal("add_quad[end]");
 
     // set mesh version for shuttle
     mesh->_version = meshdiff->_version;
@@ -1530,22 +1951,30 @@ void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history)
     // if set change frame coordinates
     if (not isnan(meshdiff->frame)) mesh->frame = meshdiff->frame;
     
+    // key frames
+    _apply_keyframe_change(mesh, meshdiff, nullptr);
+    
     vs = mesh->vertices.size();
     ts = mesh->triangle.size();
     qs = mesh->quad.size();
 
     //indexing_vertex_position(mesh);
-    timing_apply("indexing[start]");
+    timing_apply_literal("indexing[start]");
     indexing_triangle_position(mesh);
     indexing_quad_position(mesh);
     indexing_edge_position(mesh);
-    timing_apply("indexing[end]");
+    timing_apply_literal("indexing[end]");
 
+    // refit the faces that moved, or drop the tree if faces changed; mark their culling clusters loose
+    update_bvh(mesh, meshdiff);
+    update_bounds(mesh, meshdiff);
 
 }
 
 void apply_camera_change(Camera* camera, CameraDiff* cameradiff, timestamp_t save_history){
+    AllocScope alloc_scope(alloc_apply);
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new CameraDiff(*cameradiff);
         cameradiff_history.emplace(save_history,clone);
     }
@@ -1559,7 +1988,9 @@ void apply_camera_change(Camera* camera, CameraDiff* cameradiff, timestamp_t sav
 }
 
 void apply_light_change(Light* light, LightDiff* lightdiff, timestamp_t save_history){
+    AllocScope alloc_scope(alloc_apply);
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new LightDiff(*lightdiff);
         lightdiff_history.emplace(save_history,clone);
     }
@@ -1569,7 +2000,9 @@ void apply_light_change(Light* light, LightDiff* lightdiff, timestamp_t save_his
 }
 
 void apply_material_change(Material* material, MaterialDiff* matdiff, timestamp_t save_history){
+    AllocScope alloc_scope(alloc_apply);
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new MaterialDiff(*matdiff);
         materialdiff_history.emplace(save_history,clone);
     }
@@ -1582,8 +2015,10 @@ void apply_material_change(Material* material, MaterialDiff* matdiff, timestamp_
 }
 
 void apply_change(Scene* scene, SceneDiff* scenediff, timestamp_t save_history){
+    AllocScope alloc_scope(alloc_apply);
     if (save_history) {
         scenediff->_label = save_history;
+        AllocScope history_scope(alloc_history);
         auto clone = new SceneDiff(*scenediff);
         scenediff_history.push_back(make_pair(save_history,clone));
     }
@@ -1622,6 +2057,12 @@ void apply_change(Scene* scene, SceneDiff* scenediff, timestamp_t save_history){
 
 //reverse
 MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history){
+    AllocScope alloc_scope(alloc_apply);
+    // changes are not tracked element by element here
+    mesh->dirty.mark_all();
+    invalidate_bvh(mesh);
+    invalidate_bounds(mesh);
+    
     auto reverse = new MeshDiff();
     reverse->_id_ = mesh->_id_;
 
@@ -1630,14 +2071,15 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
     auto qs = mesh->quad.size();
     auto es = mesh->edge.size();
     
-    timing_apply("save_history[start]");
+    timing_apply_literal("save_history[start]");
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new MeshDiff(*meshdiff);
         meshdiff_history.emplace(save_history,clone);
     }
-    timing_apply("save_history[end]");
+    timing_apply_literal("save_history[end]");
     
-    timing_apply("add_vertex[start]");
+    timing_apply_literal("add_vertex[start]");
     // add new vertex
     for (auto v : meshdiff->add_vertex){
         if(mesh->vertices.find(v.first) != mesh->vertices.end()){
@@ -1650,7 +2092,7 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
         mesh->pos.push_back(v.second);
         mesh->norm.push_back(zero3f);
     }
-    timing_apply("add_vertex[end]");
+    timing_apply_literal("add_vertex[end]");
     
     if(mesh->vertices.size() != vs + meshdiff->add_vertex.size()){
         message("error 1: %d != %d + %d\n", mesh->vertices.size() , vs , meshdiff->add_vertex.size());
@@ -1658,7 +2100,7 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
     else
         vs += meshdiff->add_vertex.size();
     
-    timing_apply("update_vertex[start]");
+    timing_apply_literal("update_vertex[start]");
     // update existing vertex
     for (auto v : meshdiff->update_vertex){
         // reverse
@@ -1726,13 +2168,13 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
         message("error 3\n");
     }
     
-    timing_apply("update_vertex[end]");
+    timing_apply_literal("update_vertex[end]");
     
-    //    timing_apply("init_position[start]");
+    //    timing_apply_literal("init_position[start]");
     //    // restore vertex position indexing
     //    if(need_update_pos_faces) indexing_vertex_position(mesh);
-    //    timing_apply("init_position[end]");
-    timing_apply("remove_edges[start]");
+    //    timing_apply_literal("init_position[end]");
+    timing_apply_literal("remove_edges[start]");
     // remove edges
     for (auto edge : meshdiff->remove_edge){
         // reverse
@@ -1740,6 +2182,7 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
         
         // set index to -1
         mesh->edge_index[mesh->edge[edge].first] = none2i;
+        mesh->dirty.mark_edges(mesh->edge[edge].first);
         // remove edge
         mesh->edge.erase(edge);
     }
@@ -1750,8 +2193,8 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
     else
         es -= meshdiff->remove_edge.size();
     
-    timing_apply("remove_edges[end]");
-    timing_apply("remove_triangle[start]");
+    timing_apply_literal("remove_edges[end]");
+    timing_apply_literal("remove_triangle[start]");
     // remove triangles
     for (auto triangle : meshdiff->remove_triangle){
         auto t = mesh->triangle[triangle];
@@ -1784,6 +2227,7 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
         // set index to -1
         //mesh->triangle_index[get<0>(t)] = zero3i;
         mesh->triangle_index[get<0>(t)] = none3i;
+        mesh->dirty.mark_triangles(get<0>(t));
         
         // remove triangle
         mesh->triangle.erase(triangle);
@@ -1795,8 +2239,8 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
     else
         ts -= meshdiff->remove_triangle.size();
     
-    timing_apply("remove_triangle[end]");
-    timing_apply("remove_quad[start]");
+    timing_apply_literal("remove_triangle[end]");
+    timing_apply_literal("remove_quad[start]");
     // remove quads
     for (auto quad : meshdiff->remove_quad){
         auto q = mesh->quad[quad];
@@ -1833,6 +2277,7 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
         // set index to -1
         //mesh->quad_index[get<0>(q)] = zero4i;
         mesh->quad_index[get<0>(q)] = none4i;
+        mesh->dirty.mark_quads(get<0>(q));
         
         // remove quad
         mesh->quad.erase(quad);
@@ -1844,9 +2289,9 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
         qs -= meshdiff->remove_quad.size();
     
     
-    timing_apply("remove_quad[end]");
+    timing_apply_literal("remove_quad[end]");
     
-    timing_apply("delete_vertex[start]");
+    timing_apply_literal("delete_vertex[start]");
     // vertex delete
     for (auto v : meshdiff->remove_vertex){
         // reverse
@@ -1866,10 +2311,10 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
         vs -= meshdiff->add_vertex.size();
     
     
-    timing_apply("delete_vertex[end]");
+    timing_apply_literal("delete_vertex[end]");
     
     
-    timing_apply("add_edge[start]");
+    timing_apply_literal("add_edge[start]");
     // add edges
     for (auto edge : meshdiff->add_edge){
         // reverse
@@ -1887,8 +2332,8 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
     else
         es += meshdiff->add_edge.size();
     
-    timing_apply("add_edge[end]");
-    timing_apply("add_triangle[start]");
+    timing_apply_literal("add_edge[end]");
+    timing_apply_literal("add_triangle[start]");
     // add triangles
     for (auto triangle : meshdiff->add_triangle){
         // reverse
@@ -1924,8 +2369,8 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
         ts += meshdiff->add_triangle.size();
     
     
-    timing_apply("add_triangle[end]");
-    timing_apply("add_quad[start]");
+    timing_apply_literal("add_triangle[end]");
+    timing_apply_literal("add_quad[start]");
     // add quads
     for (auto quad : meshdiff->add_quad){
         // reverse
@@ -1965,7 +2410,7 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
     else
         qs += meshdiff->add_quad.size();
     
-    timing_apply("add_quad[end]");
+    timing_apply_literal("add_quad[end]");
     
     // set mesh version for shuttle
     reverse->_version = mesh->_version;
@@ -1974,16 +2419,19 @@ MeshDiff* apply_mesh_change_reverse(Mesh* mesh, MeshDiff* meshdiff, timestamp_t
     // if set change frame coordinates
     if (not isnan(meshdiff->frame)){ reverse->frame = mesh->frame; mesh->frame = meshdiff->frame; }
     
+    // key frames
+    _apply_keyframe_change(mesh, meshdiff, reverse);
+    
     vs = mesh->vertices.size();
     ts = mesh->triangle.size();
     qs = mesh->quad.size();
     
     //indexing_vertex_position(mesh);
-    timing_apply("indexing[start]");
+    timing_apply_literal("indexing[start]");
     indexing_triangle_position(mesh);
     indexing_quad_position(mesh);
     indexing_edge_position(mesh);
-    timing_apply("indexing[end]");
+    timing_apply_literal("indexing[end]");
     
     return reverse;
 }
@@ -1993,6 +2441,7 @@ CameraDiff* apply_camera_change_reverse(Camera* camera, CameraDiff* cameradiff,
     reverse->_id_ = camera->_id_;
 
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new CameraDiff(*cameradiff);
         cameradiff_history.emplace(save_history,clone);
     }
@@ -2013,6 +2462,7 @@ LightDiff* apply_light_change_reverse(Light* light, LightDiff* lightdiff, timest
     reverse->_id_ = light->_id_;
 
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new LightDiff(*lightdiff);
         lightdiff_history.emplace(save_history,clone);
     }
@@ -2030,6 +2480,7 @@ MaterialDiff* apply_material_change_reverse(Material* material, MaterialDiff* ma
     reverse->_id_ = material->_id_;
     
     if (save_history) {
+        AllocScope history_scope(alloc_history);
         auto clone = new MaterialDiff(*matdiff);
         materialdiff_history.emplace(save_history,clone);
     }
@@ -2046,11 +2497,13 @@ MaterialDiff* apply_material_change_reverse(Material* material, MaterialDiff* ma
 }
 
 void apply_change_reverse(Scene* scene, SceneDiff* scenediff, timestamp_t save_history){
+    AllocScope alloc_scope(alloc_apply);
     auto reverse = new SceneDiff();
     
     if (save_history) {
         scenediff->_label = save_history;
         reverse->_label = save_history;
+        AllocScope history_scope(alloc_history);
         auto clone = new SceneDiff(*scenediff);
         scenediff_history.push_back(make_pair(save_history,clone));
     }
@@ -2094,10 +2547,12 @@ void apply_change_reverse(Scene* scene, SceneDiff* scenediff, timestamp_t save_h
 
 // swap 2 mesh
 void swap_mesh(Mesh* mesh, Scene* scene, bool save_history){
+    AllocScope alloc_scope(alloc_apply);
     // update mesh pointers for this id
     auto i = indexof(scene->ids_map[mesh->_id_].as_mesh(), scene->meshes);
     if( i >= 0){
         if (save_history) {
+            AllocScope history_scope(alloc_history);
             auto clone = new Mesh(*scene->meshes[i]);
             mesh_history.emplace(get_timestamp(),clone);
         }
@@ -2197,11 +2652,16 @@ Scene* json_parse_scene(const jsonvalue& json) {
 }
 
 Scene* load_json_scene(const string& filename) {
+    AllocScope alloc_scope(alloc_load);
+    // skip parsing if this content was already parsed
+    if(auto scene = mesh_cache_load(filename)) return scene;
     json_texture_cache.clear();
     json_texture_paths = { "" };
     auto scene = json_parse_scene(load_json(filename));
+    json_load_textures();
     json_texture_cache.clear();
     json_texture_paths = { "" };
+    mesh_cache_save(filename, scene);
     return scene;
 }
 
@@ -2234,6 +2694,7 @@ void load_json_objects(vector<Light*>* lights, vector<Material*>* materials, vec
     json_texture_cache.clear();
     json_texture_paths = { "" };
     json_parse_objects(lights, materials, cameras, meshes, load_json(filename));
+    json_load_textures();
     json_texture_cache.clear();
     json_texture_paths = { "" };
 }
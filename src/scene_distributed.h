@@ -5,11 +5,18 @@
 #include "json.h"
 #include "vmath.h"
 #include "image.h"
+#include "alloc_track.h"
+#include "trace.h"
+#include <climits>
 
 class id_reference;
 
 // forward declarations
 struct BVHAccelerator;
+struct MeshBounds;
+struct MeshSubdiv;
+struct SkinningBlocks;
+struct SimulationState;
 
 // blinn-phong material
 // textures are scaled by the respective coefficient and may be missing
@@ -20,11 +27,11 @@ struct Material {
     float       n = 10;                 // specular exponent
     vec3f       kr = zero3f;            // reflection coefficient
     
-    image3f*    ke_txt = nullptr;       // emission texture
-    image3f*    kd_txt = nullptr;       // diffuse texture
-    image3f*    ks_txt = nullptr;       // specular texture
-    image3f*    kr_txt = nullptr;       // reflection texture
-    image3f*    norm_txt = nullptr;     // normal texture
+    texture3*   ke_txt = nullptr;       // emission texture
+    texture3*   kd_txt = nullptr;       // diffuse texture
+    texture3*   ks_txt = nullptr;       // specular texture
+    texture3*   kr_txt = nullptr;       // reflection texture
+    texture3*   norm_txt = nullptr;     // normal texture
     
     bool        double_sided = false;   // double-sided material
     bool        microfacet = false;     // use microfacet formulation
@@ -65,6 +72,16 @@ struct FrameAnimation {
     vector<int>             keytimes;   // key frame times
     vector<vec3f>           translation;// translation key frames
     vector<vec3f>           rotation;   // rotation key frames
+    
+    vector<frame3f>         _frames;            // frame at each animation time, baked by animate_frames
+    int                     _stale_from = 0;    // baked frames in [_stale_from,_stale_to) are out of date
+    int                     _stale_to = INT_MAX;
+    
+    void mark_stale(int from, int to) {
+        if (_stale_from >= _stale_to) { _stale_from = from; _stale_to = to; }
+        else { _stale_from = min(_stale_from, from); _stale_to = max(_stale_to, to); }
+    }
+    void clear_stale() { _stale_from = _stale_to = 0; }
 };
 
 // Mesh Skinning Data
@@ -74,6 +91,8 @@ struct MeshSkinning {
     vector<vec4i>           bone_ids;      // skin bones
     vector<vec4f>           bone_weights;  // skin weights
     vector<vector<mat4f>>   bone_xforms;   // bone xforms (bone index is the first index)
+    
+    SkinningBlocks*         _blocks = nullptr; // rest data laid out for skinning, built on first use
 };
 
 // Mesh Simulation Data
@@ -96,12 +115,47 @@ struct MeshSimulation {
     // simulation compute data
     vector<vec3f>           vel;       // velocity
     vector<vec3f>           force;     // forces
+    
+    SimulationState*        _state = nullptr; // particles and springs laid out for the solver
 };
 
 // Mesh Collision Data
 struct MeshCollision {
-    float                   radius;     // collision radius
-    bool                    isquad;     // whether the collision object is a sphere or quad
+    float                   radius = 1;     // collision radius
+    bool                    isquad = false; // whether the collision object is a sphere or quad
+};
+
+// Mesh elements changed since a renderer last uploaded its arrays
+struct MeshDirty {
+    bool            all = true;                 // whole mesh changed (new mesh or untracked edit)
+    vector<int>     vertices;                   // changed pos/norm entries (unsorted, may repeat)
+    int             triangle_from = -1;         // triangle_index changed from this entry on (-1 if not)
+    int             quad_from = -1;             // quad_index changed from this entry on (-1 if not)
+    int             edge_from = -1;             // edge_index changed from this entry on (-1 if not)
+    
+    void mark_all() { all = true; vertices.clear(); }
+    void mark_vertex(int i) {
+        if (all) return;
+        vertices.push_back(i);
+        // nobody is consuming the changes: stop tracking them one by one
+        if (vertices.size() > (1 << 22)) mark_all();
+    }
+    void mark_triangles(int from) { if (triangle_from < 0 or from < triangle_from) triangle_from = from; }
+    void mark_quads(int from) { if (quad_from < 0 or from < quad_from) quad_from = from; }
+    void mark_edges(int from) { if (edge_from < 0 or from < edge_from) edge_from = from; }
+    
+    // changed vertices as sorted [begin,end) ranges, merging ranges closer than gap entries
+    vector<pair<int,int>> vertex_ranges(int gap) {
+        sort(vertices.begin(), vertices.end());
+        auto ranges = vector<pair<int,int>>();
+        for (auto i : vertices) {
+            if (not ranges.empty() and i <= ranges.back().second + gap) ranges.back().second = max(ranges.back().second, i + 1);
+            else ranges.push_back(make_pair(i, i + 1));
+        }
+        return ranges;
+    }
+    
+    void clear() { all = false; vertices.clear(); triangle_from = quad_from = edge_from = -1; }
 };
 
 // indexed mesh data structure with vertex positions and normals,
@@ -142,6 +196,10 @@ struct Mesh {
     MeshCollision*  collision = nullptr;        // collision data
     
     BVHAccelerator* bvh = nullptr;              // bvh accelerator for intersection
+    MeshBounds*     bounds = nullptr;           // face cluster bounds for culling
+    MeshSubdiv*     subdiv = nullptr;           // subdivision stencils and refined mesh for display
+    
+    MeshDirty       dirty;                      // changes not yet uploaded by the renderer
     
     timestamp_t         _id_ = 0;               // unique id
     int                 _version = -1;          // version
@@ -167,7 +225,7 @@ struct Mesh {
         _id_ = mesh._id_;
         _version = mesh._version;
         
-        mat = new Material();
+        // mat is already allocated by its initializer
         *mat = *mesh.mat;
     }
 };
@@ -237,7 +295,7 @@ struct Scene {
     vector<Material*>   materials;              // materials
 
     vec3f               background = one3f*0.2; // background color
-    image3f*            background_txt = nullptr;// background texture
+    texture3*           background_txt = nullptr;// background texture
     vec3f               ambient = one3f*0.2;    // ambient illumination
 
     SceneAnimation*     animation = new SceneAnimation();    // scene animation data
@@ -370,6 +428,8 @@ struct MaterialDiff {
 
 };
 
+// index of the key frame of animation at time (-1 if none)
+int keyframe_index(const FrameAnimation* animation, int time);
 
 struct MeshDiff {
     frame3f         frame = nanframe3f;   // frame
@@ -391,6 +451,10 @@ struct MeshDiff {
     map<timestamp_t, vec3f> update_vertex;
     map<timestamp_t, vec3f> update_norm;
     
+    // animation key frames
+    vector<int>                         remove_keyframe;    // key frame times
+    map<int, pair<vec3f,vec3f>>         update_keyframe;    // key frame time -> (translation, rotation), added if missing
+    
     timestamp_t             _id_ = 0;
     int                     _version = -1;
     
@@ -410,18 +474,38 @@ struct MeshDiff {
         add_triangle = meshdiff.add_triangle;
         update_vertex = meshdiff.update_vertex;
         update_norm = meshdiff.update_norm;
+        remove_keyframe = meshdiff.remove_keyframe;
+        update_keyframe = meshdiff.update_keyframe;
         _id_ = meshdiff._id_;
         _version = meshdiff._version;
     }
     
     // constructor from 2 meshes
     MeshDiff(const Mesh* first_mesh,const Mesh* second_mesh, bool geometric_only = false){
+        AllocScope alloc_scope(alloc_diff);
         error_if_not(first_mesh->_id_ == second_mesh->_id_, "[MeshDiff] meshes have different ids: %llu != %llu", first_mesh->_id_, second_mesh->_id_);
         
         _id_ = second_mesh->_id_;
         _version = second_mesh->_version;
         
         if (not (first_mesh->frame == second_mesh->frame)) frame = second_mesh->frame;
+        
+        // key frame difference
+        if (second_mesh->animation) {
+            auto second_animation = second_mesh->animation;
+            auto first_animation = first_mesh->animation;
+            for (auto k = 0; k < second_animation->keytimes.size(); k++) {
+                auto time = second_animation->keytimes[k];
+                auto key = make_pair(second_animation->translation[k], second_animation->rotation[k]);
+                auto first_k = first_animation ? keyframe_index(first_animation, time) : -1;
+                if (first_k < 0 or not (first_animation->translation[first_k] == key.first and first_animation->rotation[first_k] == key.second))
+                    update_keyframe.emplace(time, key);
+            }
+        }
+        if (first_mesh->animation) {
+            for (auto time : first_mesh->animation->keytimes)
+                if (not second_mesh->animation or keyframe_index(second_mesh->animation, time) < 0) remove_keyframe.push_back(time);
+        }
 
         //check vertex difference
         map<timestamp_t, pair<int,set<timestamp_t>>> diffVertex;
@@ -572,7 +656,7 @@ struct SceneDiff {
 };
 
 // grab all scene textures
-vector<image3f*> get_textures(Scene* scene);
+vector<texture3*> get_textures(Scene* scene);
 
 // create a Camera at eye, pointing towards center with up vector up, and with specified image plane params
 //Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist);
@@ -596,10 +680,20 @@ void indexing_vertex_position(Mesh* mesh);
 //void init_mesh_properties_from_map(Mesh* mesh, bool force_quad_update, bool force_triangle_update, bool force_edges_update, bool force_norm_update);
 timestamp_t get_global_version();
 
+// estimated bytes held by the version history (meshes and differences saved by the apply functions)
+long long history_memory();
+
+// entries in the version history
+int history_size();
+
 void restore_to_version(Scene* scene, timestamp_t version);
 timestamp_t restore_version(Scene* scene);
 
 MeshDiff* meshdiff_assume_ordered( Mesh* first_mesh, Mesh* second_mesh);
+// diff for meshes without stable ids (e.g. re-exported obj): vertices are matched to the nearest
+// vertex within epsilon through a spatial hash grid (then by index for the moved ones) and faces
+// by their matched vertex ids; the diff uses the ids of first_mesh
+MeshDiff* meshdiff_spatial_match( Mesh* first_mesh, Mesh* second_mesh, float epsilon);
 void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history);
 
 
@@ -608,6 +702,12 @@ void obj_apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_hist
 
 void apply_mesh_change(Mesh* mesh, MeshDiff* meshdiff, timestamp_t save_history);
 
+// sets the key frame of animation at time (adding it if missing) and marks the baked frames it affects as stale
+void animation_set_key(FrameAnimation* animation, int time, const vec3f& translation, const vec3f& rotation);
+
+// removes the key frame of animation at time, if any, and marks the baked frames it affected as stale
+void animation_remove_key(FrameAnimation* animation, int time);
+
 void apply_camera_change(Camera* camera, CameraDiff* cameradiff, timestamp_t save_history);
 
 void apply_light_change(Light* light, LightDiff* lightdiff, timestamp_t save_history);
@@ -623,18 +723,32 @@ void apply_change_reverse(Scene* scene, SceneDiff* scenediff, timestamp_t save_h
 // swap 2 mesh
 void swap_mesh(Mesh* mesh, Scene* scene, bool save_history);
 
-// put in timing log
+// put in timing log (recorded in the trace, see trace.h): names ending in [start] and [end]
+// begin and end a span, the version with a value records a counter
 void timing(const string& s);
 void timing(const string& s, long long i);
 
-// save timing log
+// timing log entry parsed once: interned name and phase (begin for [start], end for [end])
+struct TimingEntry {
+    int         name = 0;
+    TracePhase  phase = trace_instant;
+};
+TimingEntry timing_entry(const string& s);
+void timing(const TimingEntry& entry);
+void timing_apply(const TimingEntry& entry);
+
+// timing and timing_apply of a string literal, parsed and interned once per call site
+#define timing_literal(s) do { static const TimingEntry _timing_entry = timing_entry(s); timing(_timing_entry); } while(0)
+#define timing_apply_literal(s) do { static const TimingEntry _timing_entry = timing_entry(s); timing_apply(_timing_entry); } while(0)
+
+// save timing log: last time (or value) of each entry still in the trace
 void save_timing(const string& s);
 
-// put in timing log
+// put in timing log of apply_mesh_change
 void timing_apply(const string& s);
 void timing_apply(const string& s, long long i);
 
-// save timing log
+// save timing log of apply_mesh_change
 void save_timing_apply(const string& s);
 
 #endif
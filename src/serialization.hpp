@@ -5,6 +5,8 @@
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/map.hpp>
 #include <boost/serialization/set.hpp>
+#include <boost/serialization/utility.hpp>
+#include <boost/serialization/version.hpp>
 
 namespace boost {
     namespace serialization {
@@ -224,6 +226,11 @@ namespace boost {
             ar & md.update_vertex;
             ar & md._id_;
             ar & md._version;
+            // key frames since version 1
+            if (version >= 1) {
+                ar & md.remove_keyframe;
+                ar & md.update_keyframe;
+            }
         }
         
         // scenediff serialization
@@ -240,5 +247,8 @@ namespace boost {
     } // namespace serialization
 } // namespace boost
 
+// versions of the archives of classes that changed (older archives still load)
+BOOST_CLASS_VERSION(MeshDiff, 1)
+
 
 #endif
@@ -6,13 +6,16 @@
 #include <deque>
 #include <iostream>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <utility>
 #include <string>
 #include <boost/asio.hpp>
 #include "message.h"
 #include "mesh_msg.hpp"
+#include "metrics.h"
 
 
 using boost::asio::ip::tcp;
@@ -24,12 +27,28 @@ typedef std::deque<mesh_msg> mesh_message_queue;
 
 int id_gen = 1;
 
+// messages received (sent false) or sent by the server, by type
+inline MetricCounter* message_counter(bool sent, int type)
+{
+    static auto counters = [](){
+        std::vector<MetricCounter*> counters;
+        for (auto name : { "dist_scene_messages_received_total", "dist_scene_messages_sent_total" })
+            for (auto t = 0; t <= mesh_msg::Obj_Mtl_type + 1; t++)
+                counters.push_back(metric_counter(name, "messages by mesh_msg type",
+                                                  std::string("type=\"") + mesh_msg::type_name(t) + "\""));
+        return counters;
+    }();
+    auto types = mesh_msg::Obj_Mtl_type + 2;
+    return counters[sent * types + std::min(std::max(type, 0), types - 1)];
+}
+
 //----------------------------------------------------------------------
 
 class chat_participant
 {
 public:
     int id = id_gen++;
+    int lod = 0;    // level of detail followed by the client (0 is the full mesh), network thread only
     virtual ~chat_participant() {}
     virtual void deliver(const op_message& msg) = 0;
     virtual void deliver_mesh(const mesh_msg& m_msg) = 0;
@@ -46,6 +65,7 @@ public:
     void join(chat_participant_ptr participant)
     {
         participants_.insert(participant);
+        sessions_metric_->set(participants_.size());
         //for (auto msg: edit_history_)
         //    participant->deliver(msg);
     }
@@ -53,6 +73,9 @@ public:
     void leave(chat_participant_ptr participant)
     {
         participants_.erase(participant);
+        sessions_metric_->set(participants_.size());
+        std::lock_guard<std::mutex> lock(lod_mutex_);
+        lod_followers_.erase(participant->id);
     }
     
     void deliver(const op_message& msg, chat_participant_ptr editor)
@@ -77,31 +100,52 @@ public:
     {
         if(m_msg.body_length()){
             // send mesh to partecipant
-            timing("send_all[start]");
+            trace_scope("send_all", trace_timing);
             for (auto participant: participants_)
+                if (receives_mesh(participant, m_msg))
                     participant->deliver_mesh(m_msg);
-            timing("send_all[end]");
-            
         }
     }
     
     void deliver_mesh(const mesh_msg& m_msg, chat_participant_ptr editor)
     {
+        trace_scope("deliver_mesh", trace_timing);
         if(m_msg.body_length()){
+            // level of detail requests are answered by the server, not relayed
+            if (m_msg.type() == mesh_msg::Operation_type){
+                auto tokens = m_msg.as_message();
+                if (!tokens.empty() && tokens[0] == "lod"){
+                    auto level = (tokens.size() > 1) ? std::max(0, atoi(tokens[1].c_str())) : 0;
+                    std::lock_guard<std::mutex> lock(lod_mutex_);
+                    lod_requests_.push_back(std::make_pair(editor, level));
+                    return;
+                }
+            }
+            // clients following a level of detail edit a coarser mesh, their mesh edits are not applied
+            if (!receives_mesh(editor, m_msg)){
+                message("dropped mesh edit of client %d following level of detail %d\n", editor->id, editor->lod);
+                return;
+            }
             // track meshes history on scene
             //meshes_history_.push_back(m_msg);
             // put this mesh as pending
-            pending_meshes_.push_back(m_msg);
+            {
+                AllocScope alloc_scope(alloc_net);
+                pending_meshes_.push_back(m_msg);
+            }
+            pending_metric_->set(pending_meshes_.size());
             //while (edit_history_.size() > max_recent_msgs)
             //    edit_history_.pop_front();
             
+            // obj/mtl are re-imported by the server, which sends out only the differences
+            if (m_msg.type() == mesh_msg::Obj_Mtl_type) return;
+            
             // send mesh to partecipant
-            timing("send_all[start]");
+            trace_scope("send_all", trace_timing);
             for (auto participant: participants_)
-                if (participant->id != editor->id) {
+                if (participant->id != editor->id && receives_mesh(participant, m_msg)) {
                     participant->deliver_mesh(m_msg);
                 }
-            timing("send_all[end]");
 
         }
     }
@@ -143,24 +187,93 @@ public:
     
     void remove_first_mesh(){
         if(!pending_meshes_.empty())
-            return pending_meshes_.pop_front();
+            pending_meshes_.pop_front();
+        pending_metric_->set(pending_meshes_.size());
     }
     
     void remove_first(){
         if(!pending_meshes_.empty())
-            return pending_meshes_.pop_front();
+            pending_meshes_.pop_front();
+        pending_metric_->set(pending_meshes_.size());
+    }
+    
+    // send a level of detail to the clients following it
+    void deliver_lod(int level, const mesh_msg& m_msg)
+    {
+        if(m_msg.body_length()){
+            for (auto participant: participants_)
+                if (participant->lod == level)
+                    participant->deliver_mesh(m_msg);
+        }
+    }
+    
+    // records the level followed by a client (called from the server loop, so that the next
+    // lod_levels includes it before the level reaches the client)
+    void record_lod(chat_participant_ptr participant, int level)
+    {
+        std::lock_guard<std::mutex> lock(lod_mutex_);
+        if (level > 0) lod_followers_[participant->id] = level;
+        else lod_followers_.erase(participant->id);
+    }
+    
+    // a client starts following level (the mesh of the level is m_msg), if still connected
+    void follow_lod(chat_participant_ptr participant, int level, const mesh_msg& m_msg)
+    {
+        if (!participants_.count(participant)) {
+            // left before its level was recorded
+            std::lock_guard<std::mutex> lock(lod_mutex_);
+            lod_followers_.erase(participant->id);
+            return;
+        }
+        participant->lod = level;
+        if(m_msg.body_length())
+            participant->deliver_mesh(m_msg);
+    }
+    
+    // levels of detail followed by at least one client (called from the server loop)
+    std::set<int> lod_levels(){
+        std::lock_guard<std::mutex> lock(lod_mutex_);
+        std::set<int> levels;
+        for (auto follower: lod_followers_)
+            levels.insert(follower.second);
+        return levels;
     }
     
+    bool has_lod_request(){
+        std::lock_guard<std::mutex> lock(lod_mutex_);
+        return !lod_requests_.empty();
+    }
     
+    std::pair<chat_participant_ptr,int> next_lod_request(){
+        std::lock_guard<std::mutex> lock(lod_mutex_);
+        auto request = lod_requests_.front();
+        lod_requests_.pop_front();
+        return request;
+    }
     
 private:
+    // clients following a level of detail get the mesh and its differences from the server
+    bool receives_mesh(chat_participant_ptr participant, const mesh_msg& m_msg){
+        if (participant->lod == 0) return true;
+        return m_msg.type() != mesh_msg::Mesh_type && m_msg.type() != mesh_msg::MeshDiff_type &&
+               m_msg.type() != mesh_msg::SceneDiff_type;
+    }
+    
+
     std::set<chat_participant_ptr> participants_;
     enum { max_recent_msgs = 100 };
     op_message_queue edit_history_;
     op_message_queue pending_op_;
     //mesh_message_queue meshes_history_;
     mesh_message_queue pending_meshes_;
+    // level of detail requests (from the network thread) and levels followed by client id (from
+    // record_lod), read by the server loop
+    std::mutex lod_mutex_;
+    std::deque<std::pair<chat_participant_ptr,int>> lod_requests_;
+    std::map<int,int> lod_followers_;
     Mesh current_mesh;
+    MetricGauge* sessions_metric_ = metric_gauge("dist_scene_sessions", "connected clients");
+    MetricGauge* pending_metric_ = metric_gauge("dist_scene_pending_messages", "received messages waiting for the server loop");
 };
 
 //----------------------------------------------------------------------
@@ -174,6 +287,20 @@ public:
     : socket_(std::move(socket)),
     room_(room)
     {
+        // per-session metrics, removed with the session
+        auto labels = "session=\"" + std::to_string(id) + "\"";
+        queue_depth_ = metric_gauge("dist_scene_session_queue_depth", "messages queued for sending to a client", labels);
+        queue_bytes_ = metric_gauge("dist_scene_session_queue_bytes", "bytes queued for sending to a client", labels);
+        received_bytes_ = metric_counter("dist_scene_session_received_bytes_total", "bytes received from a client", labels);
+        sent_bytes_ = metric_counter("dist_scene_session_sent_bytes_total", "bytes sent to a client", labels);
+    }
+    
+    ~edit_session()
+    {
+        auto labels = "session=\"" + std::to_string(id) + "\"";
+        for (auto name : { "dist_scene_session_queue_depth", "dist_scene_session_queue_bytes",
+                           "dist_scene_session_received_bytes_total", "dist_scene_session_sent_bytes_total" })
+            metric_remove(name, labels);
     }
     
     void start()
@@ -200,10 +327,17 @@ public:
     void deliver_mesh(const mesh_msg& m_msg)
     {
         bool write_in_progress = !write_meshes_.empty();
-        write_meshes_.push_back(m_msg);
+        {
+            AllocScope alloc_scope(alloc_net);
+            write_meshes_.push_back(m_msg);
+        }
+        queue_depth_->add(1);
+        queue_bytes_->add(m_msg.length());
         if (!write_in_progress)
         {
-            timing("send_client_" + to_string(shared_from_this()->id) + "[start]");
+            // one name for all the sessions, the session id is the value of the events
+            static const int send_client_id = trace_id("send_client");
+            trace_event(send_client_id, trace_begin, id);
             do_write_mesh();
         }
     }
@@ -236,7 +370,7 @@ private:
                                 {
                                     if (!ec && read_incoming_mesh_.decode_header())
                                     {
-                                        timing("recive_mesh[start]");
+                                        timing_literal("recive_mesh[start]");
                                         do_read_mesh_body();
                                     }
                                     else
@@ -279,7 +413,10 @@ private:
                                 {
                                     if (!ec)
                                     {
-                                        timing("recive_mesh[end]");
+                                        timing_literal("recive_mesh[end]");
+                                        trace_received(read_incoming_mesh_);
+                                        message_counter(false, read_incoming_mesh_.type())->add();
+                                        received_bytes_->add(read_incoming_mesh_.length());
                                         // print recived op
                                         switch (read_incoming_mesh_.type()) {
                                             case 1: // Mesh
@@ -334,6 +471,8 @@ private:
     
     void do_write_mesh()
     {
+        static const int sent_id = trace_id("edit.server_sent");
+        trace_sent(write_meshes_.front(), sent_id);
         auto self(shared_from_this());
         boost::asio::async_write(socket_,
                                  boost::asio::buffer(write_meshes_.front()[0],
@@ -342,8 +481,13 @@ private:
                                  {
                                      if (!ec)
                                      {
+                                         message_counter(true, write_meshes_.front().type())->add();
+                                         sent_bytes_->add(write_meshes_.front().length());
+                                         queue_depth_->add(-1);
+                                         queue_bytes_->add(-(long long)write_meshes_.front().length());
                                          write_meshes_.pop_front();
-                                         timing("send_client_" + to_string(shared_from_this()->id) + "[end]");
+                                         static const int send_client_id = trace_id("send_client");
+                                         trace_event(send_client_id, trace_end, id);
                                          if (!write_meshes_.empty())
                                          {
                                              do_write_mesh();
@@ -362,6 +506,10 @@ private:
     mesh_msg read_incoming_mesh_;
     op_message_queue write_msgs_;
     mesh_message_queue write_meshes_;
+    MetricGauge* queue_depth_;
+    MetricGauge* queue_bytes_;
+    MetricCounter* received_bytes_;
+    MetricCounter* sent_bytes_;
 };
 
 //----------------------------------------------------------------------
@@ -413,11 +561,46 @@ public:
         return room_.remove_first_mesh();
     }
     
+    // the room and its sessions are only touched by the network thread: sends are posted to it
+    void deliver_all(const mesh_msg& m_msg){
+        auto msg = std::make_shared<mesh_msg>(m_msg);
+        io_service_.post([this, msg]() { room_.deliver_all(*msg); });
+    }
+    
     template <typename T>
     void write_all(const T obj)
     {
-                             auto m_msg = mesh_msg(obj);
-                             room_.deliver_all(m_msg);
+        auto msg = std::make_shared<mesh_msg>(obj);
+        io_service_.post([this, msg]() { room_.deliver_all(*msg); });
+    }
+    
+    bool has_lod_request(){
+        return room_.has_lod_request();
+    }
+    
+    std::pair<chat_participant_ptr,int> next_lod_request(){
+        return room_.next_lod_request();
+    }
+    
+    std::set<int> lod_levels(){
+        return room_.lod_levels();
+    }
+    
+    // send obj to the clients following level of detail level
+    template <typename T>
+    void write_lod(int level, const T obj)
+    {
+        auto msg = std::make_shared<mesh_msg>(obj);
+        io_service_.post([this, level, msg]() { room_.deliver_lod(level, *msg); });
+    }
+    
+    // a client follows level of detail level from now on, starting from its mesh obj
+    template <typename T>
+    void follow_lod(chat_participant_ptr participant, int level, const T obj)
+    {
+        room_.record_lod(participant, level);
+        auto msg = std::make_shared<mesh_msg>(obj);
+        io_service_.post([this, participant, level, msg]() { room_.follow_lod(participant, level, *msg); });
     }
     
     void close()
@@ -447,5 +630,76 @@ private:
     chat_room room_;
 };
 
+//----------------------------------------------------------------------
+
+// answers a http request with the metrics, then closes the connection
+class metrics_request
+: public std::enable_shared_from_this<metrics_request>
+{
+public:
+    metrics_request(tcp::socket socket)
+    : socket_(std::move(socket))
+    {
+    }
+    
+    void start()
+    {
+        auto self(shared_from_this());
+        // any request gets the metrics
+        boost::asio::async_read_until(socket_, request_, "\r\n\r\n",
+                                      [this, self](boost::system::error_code ec, std::size_t /*length*/)
+                                      {
+                                          if (!ec)
+                                              do_write();
+                                      });
+    }
+    
+private:
+    void do_write()
+    {
+        auto self(shared_from_this());
+        auto body = metrics_text();
+        response_ = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        boost::asio::async_write(socket_, boost::asio::buffer(response_),
+                                 [this, self](boost::system::error_code ec, std::size_t /*length*/)
+                                 {
+                                     boost::system::error_code ignored;
+                                     socket_.shutdown(tcp::socket::shutdown_both, ignored);
+                                 });
+    }
+    
+    tcp::socket socket_;
+    boost::asio::streambuf request_;
+    std::string response_;
+};
+
+// serves the metrics in the Prometheus text format over http on a local port
+class metrics_endpoint
+{
+public:
+    metrics_endpoint(boost::asio::io_service& io_service, unsigned short port)
+    : acceptor_(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)),
+    socket_(io_service)
+    {
+        do_accept();
+    }
+    
+private:
+    void do_accept()
+    {
+        acceptor_.async_accept(socket_,
+                               [this](boost::system::error_code ec)
+                               {
+                                   if (!ec)
+                                       std::make_shared<metrics_request>(std::move(socket_))->start();
+                                   do_accept();
+                               });
+    }
+    
+    tcp::acceptor acceptor_;
+    tcp::socket socket_;
+};
+
 #endif
 
@@ -16,6 +16,15 @@
 #include "serialization.hpp"
 #include "image.h"
 #include "id_reference.h"
+#include "mesh_buffers.h"
+#include "shade_state.h"
+#include "subdiv.h"
+#include "intersect.h"
+#include "pathtrace.h"
+#include "mesh_lod.h"
+#include "trace.h"
+#include "metrics.h"
+#include "event_log.h"
 #include "server.h"
 #include <boost/asio.hpp>
 #include <thread>
@@ -46,7 +55,7 @@ using boost::asio::ip::tcp;
 int gl_program_id = 0;          // OpenGL program handle
 int gl_vertex_shader_id = 0;    // OpenGL vertex shader handle
 int gl_fragment_shader_id = 0;  // OpenGL fragment shader handle
-map<image3f*,int> gl_texture_id;// OpenGL texture handles
+map<texture3*,int> gl_texture_id;// OpenGL texture handles
 
 
 //map<timestamp_t,Mesh*> mesh_history;
@@ -153,33 +162,16 @@ void init_textures(Scene* scene) {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
-		// load texture data
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-					 texture->width(), texture->height(),
-					 0, GL_RGB, GL_FLOAT, texture->data());
-	}
-}
-
-// utility to bind texture parameters for shaders
-// uses texture name, texture_on name, texture pointer and texture unit position
-void _bind_texture(string name_map, string name_on, image3f* txt, int pos) {
-	// if txt is not null
-	if(txt) {
-		// set texture on boolean parameter to true
-		glUniform1i(glGetUniformLocation(gl_program_id,name_on.c_str()),GL_TRUE);
-		// activate a texture unit at position pos
-		glActiveTexture(GL_TEXTURE0+pos);
-		// bind texture object to it from gl_texture_id map
-		glBindTexture(GL_TEXTURE_2D, gl_texture_id[txt]);
-		// set texture parameter to the position pos
-		glUniform1i(glGetUniformLocation(gl_program_id, name_map.c_str()), pos);
-	} else {
-		// set texture on boolean parameter to false
-		glUniform1i(glGetUniformLocation(gl_program_id,name_on.c_str()),GL_FALSE);
-		// activate a texture unit at position pos
-		glActiveTexture(GL_TEXTURE0+pos);
-		// set zero as the texture id
-		glBindTexture(GL_TEXTURE_2D, 0);
+		// load texture data in its own compact format (no conversion to float)
+		auto internal = GL_RGB8; auto type = GL_UNSIGNED_BYTE;
+		if(texture->format() == texel_format::rgb16f) { internal = GL_RGB16F_ARB; type = GL_HALF_FLOAT_ARB; }
+		if(texture->format() == texel_format::rgb32f) { internal = GL_RGB32F_ARB; type = GL_FLOAT; }
+		// 8-bit rgb rows are not 4-byte aligned
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, internal,
+		             texture->width(), texture->height(),
+		             0, GL_RGB, type, texture->data());
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 	}
 }
 
@@ -203,87 +195,105 @@ void shade(Scene* scene, bool wireframe) {
 	// enable program
 	glUseProgram(gl_program_id);
 	
-	// bind camera's position, inverse of frame and projection
-	// use frame_to_matrix_inverse and frustum_matrix
-	glUniform3fv(glGetUniformLocation(gl_program_id,"camera_pos"),
-				 1, &scene->camera->frame.o.x);
-	glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"camera_frame_inverse"),
-					   1, true, &frame_to_matrix_inverse(scene->camera->frame)[0][0]);
-	glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"camera_projection"),
-					   1, true, &frustum_matrix(-scene->camera->dist*scene->camera->width/2, scene->camera->dist*scene->camera->width/2,
-												-scene->camera->dist*scene->camera->height/2, scene->camera->dist*scene->camera->height/2,
-												scene->camera->dist,10000)[0][0]);
-	
-	// bind ambient and number of lights
-	glUniform3fv(glGetUniformLocation(gl_program_id,"ambient"),1,&scene->ambient.x);
-	glUniform1i(glGetUniformLocation(gl_program_id,"lights_num"),scene->lights.size());
-	
-	// foreach light
-	auto count = 0;
-	for(auto light : scene->lights) {
-		// bind light position and internsity (create param name with tostring)
-		glUniform3fv(glGetUniformLocation(gl_program_id,tostring("light_pos[%d]",count).c_str()),
-					 1, &light->frame.o.x);
-		glUniform3fv(glGetUniformLocation(gl_program_id,tostring("light_intensity[%d]",count).c_str()),
-					 1, &light->intensity.x);
-		count++;
-	}
+	// bind camera, ambient and lights once for the frame
+	auto& locations = shade_locations(gl_program_id);
+	shade_bind_frame(locations, scene);
+	
+	// mesh arrays live in gpu buffers, uploaded again only where they changed
+	static auto frame = 0;
+	frame++;
+	
+	// meshes out of the view or too small on screen are skipped, and only the visible
+	// face clusters of the others are drawn
+	auto view = view_frustum(scene);
+	auto visible_triangles = vector<pair<int,int>>(), visible_quads = vector<pair<int,int>>();
 	
-	// foreach mesh
-	for(auto mesh : scene->meshes) {
-		// bind material kd, ks, n
-		glUniform3fv(glGetUniformLocation(gl_program_id,"material_kd"),
-					 1,&mesh->mat->kd.x);
-		glUniform3fv(glGetUniformLocation(gl_program_id,"material_ks"),
-					 1,&mesh->mat->ks.x);
-		glUniform1f(glGetUniformLocation(gl_program_id,"material_n"),
-					mesh->mat->n);
-		// bind texture params (txt_on, sampler)
-		_bind_texture("material_kd_txt", "material_kd_txt_on", mesh->mat->kd_txt, 0);
-		_bind_texture("material_ks_txt", "material_ks_txt_on", mesh->mat->ks_txt, 1);
-		_bind_texture("material_norm_txt", "material_norm_txt_on", mesh->mat->norm_txt, 2);
+	// foreach mesh, grouped by material so that its uniforms and textures are sent once
+	auto material_state = ShadeMaterialState();
+	for(auto mesh : shade_draw_order(scene->meshes)) {
+		if(not cull_mesh(mesh, view, visible_triangles, visible_quads)) {
+			// keep the buffers (and the pending changes) for when the mesh comes back into view
+			keep_mesh_buffers(mesh, frame);
+			if(mesh->subdiv) keep_mesh_buffers(mesh->subdiv->display, frame);
+			continue;
+		}
+		
+		// bind material kd, ks, n and textures (txt_on, sampler) if they changed
+		material_state.bind(locations, mesh->mat, gl_texture_id);
 		
 		// bind mesh frame - use frame_to_matrix
-		glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"mesh_frame"),
-						   1,true,&frame_to_matrix(mesh->frame)[0][0]);
+		glUniformMatrix4fv(locations.mesh_frame, 1, true, &frame_to_matrix(mesh->frame)[0][0]);
 		
-		// enable vertex attributes arrays and set up pointers to the mesh data
-		auto vertex_pos_location = glGetAttribLocation(gl_program_id, "vertex_pos");
-		auto vertex_norm_location = glGetAttribLocation(gl_program_id, "vertex_norm");
-		auto vertex_texcoord_location = glGetAttribLocation(gl_program_id, "vertex_texcoord");
+		// enable vertex attributes arrays and set up pointers to the mesh buffers
+		auto vertex_pos_location = locations.vertex_pos;
+		auto vertex_norm_location = locations.vertex_norm;
+		auto vertex_texcoord_location = locations.vertex_texcoord;
+		// subdivided meshes draw their refined mesh: the cage is what is edited and sent
+		auto draw = subdivided_mesh(mesh);
+		auto& buffers = update_mesh_buffers(draw, frame);
 		glEnableVertexAttribArray(vertex_pos_location);
-		glVertexAttribPointer(vertex_pos_location, 3, GL_FLOAT, GL_FALSE, 0, &mesh->pos[0].x);
+		glBindBuffer(GL_ARRAY_BUFFER, buffers.pos);
+		glVertexAttribPointer(vertex_pos_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
 		glEnableVertexAttribArray(vertex_norm_location);
-		glVertexAttribPointer(vertex_norm_location, 3, GL_FLOAT, GL_FALSE, 0, &mesh->norm[0].x);
-		if(not mesh->texcoord.empty()) {
+		glBindBuffer(GL_ARRAY_BUFFER, buffers.norm);
+		glVertexAttribPointer(vertex_norm_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+		if(not draw->texcoord.empty()) {
 			glEnableVertexAttribArray(vertex_texcoord_location);
-			glVertexAttribPointer(vertex_texcoord_location, 2, GL_FLOAT, GL_FALSE, 0, &mesh->texcoord[0].x);
+			glBindBuffer(GL_ARRAY_BUFFER, buffers.texcoord);
+			glVertexAttribPointer(vertex_texcoord_location, 2, GL_FLOAT, GL_FALSE, 0, 0);
 		}
 		else glVertexAttrib2f(vertex_texcoord_location, 0, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		
+		// faces to draw: refined meshes only have the index arrays
+		auto draw_triangles = (draw == mesh) ? mesh->triangle.size() : draw->triangle_index.size();
+		auto draw_quads = (draw == mesh) ? mesh->quad.size() : draw->quad_index.size();
+		auto draw_edges = (draw == mesh) ? mesh->edge.size() : draw->edge_index.size();
 		
 		// draw triangles and quads
 		if(not wireframe) {
             //            if(mesh->triangle.size()) glDrawElements(GL_TRIANGLES, mesh->triangle_index.size()*3, GL_UNSIGNED_INT, &mesh->triangle_index[0].x);
             //            if(mesh->quad.size()) glDrawElements(GL_QUADS, mesh->quad_index.size()*4, GL_UNSIGNED_INT, &mesh->quad_index[0].x);
-            if(mesh->triangle.size()) glDrawRangeElements(GL_TRIANGLES, 0, mesh->pos.size() - 1,  mesh->triangle_index.size()*3, GL_UNSIGNED_INT, &mesh->triangle_index[0].x);
-            if(mesh->quad.size()) glDrawRangeElements(GL_QUADS, 0, mesh->pos.size() - 1, mesh->quad_index.size()*4, GL_UNSIGNED_INT, &mesh->quad_index[0].x);
+			// refined meshes are culled as a whole (the cage bounds contain them)
+			if(draw != mesh) {
+				visible_triangles.assign(1, make_pair(0, (int)draw->triangle_index.size()));
+				visible_quads.assign(1, make_pair(0, (int)draw->quad_index.size()));
+			}
+			if(draw_triangles) {
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.triangle);
+				for(auto& faces : visible_triangles)
+					glDrawRangeElements(GL_TRIANGLES, 0, draw->pos.size() - 1, (faces.second - faces.first)*3, GL_UNSIGNED_INT, (GLvoid*)(faces.first*sizeof(vec3i)));
+			}
+			if(draw_quads) {
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.quad);
+				for(auto& faces : visible_quads)
+					glDrawRangeElements(GL_QUADS, 0, draw->pos.size() - 1, (faces.second - faces.first)*4, GL_UNSIGNED_INT, (GLvoid*)(faces.first*sizeof(vec4i)));
+			}
 		} else {
 			//auto edges = EdgeMap(mesh->triangle, mesh->quad).edges();
             //if(mesh->edge.size()) glDrawElements(GL_LINES, mesh->edge_index.size()*2, GL_UNSIGNED_INT, &mesh->edge_index[0].x);
-            if(mesh->edge.size()) glDrawRangeElements(GL_LINES,  0, mesh->pos.size() - 1, mesh->edge_index.size()*2, GL_UNSIGNED_INT, &mesh->edge_index[0].x);
+			if(draw_edges) {
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.edge);
+				glDrawRangeElements(GL_LINES, 0, draw->pos.size() - 1, draw->edge_index.size()*2, GL_UNSIGNED_INT, 0);
+			}
 		}
 		
-		// draw line sets
-		if(not mesh->line.empty()) glDrawElements(GL_LINES, mesh->line.size()*2, GL_UNSIGNED_INT, mesh->line.data());
-		if (not mesh->spline.empty()) {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		
+		// draw line sets (their indices refer to the cage vertices)
+		if(draw == mesh and not mesh->line.empty()) glDrawElements(GL_LINES, mesh->line.size()*2, GL_UNSIGNED_INT, mesh->line.data());
+		if (draw == mesh and not mesh->spline.empty()) {
 			for(auto segment : mesh->spline) glDrawElements(GL_LINE_STRIP, 4, GL_UNSIGNED_INT, &segment);
 		}
 		
 		// disable vertex attribute arrays
 		glDisableVertexAttribArray(vertex_pos_location);
 		glDisableVertexAttribArray(vertex_norm_location);
-		if(not mesh->texcoord.empty()) glDisableVertexAttribArray(vertex_texcoord_location);
+		if(not draw->texcoord.empty()) glDisableVertexAttribArray(vertex_texcoord_location);
 	}
+	
+	// free the buffers of meshes no longer in the scene
+	release_mesh_buffers(frame);
 }
 
 string scene_filename;          // scene filename
@@ -300,6 +310,18 @@ bool restore_old = false;
 bool write_log    = false;
 bool sync_scene = false;
 int c = 1;
+string thumbnail_dir;           // directory of the version thumbnails (disabled if empty)
+ThumbnailWorker thumbnail_worker;   // renders the version thumbnails off the server loop
+timestamp_t thumbnail_version = 0;  // newest version waiting for its thumbnail (0 if none)
+double thumbnail_interval = 1;      // seconds between the thumbnails started (versions in between get none)
+long long thumbnail_started = 0;    // trace_now when the last thumbnail was started
+MeshLOD* mesh_lod = nullptr;    // lod chain of the scene mesh, built when a client asks for a level
+double metrics_interval = 10;   // seconds between the metrics log lines (disabled if 0)
+map<int,MetricHistogram*> decode_metrics;   // deserialization time of the received messages by type
+map<int,MetricHistogram*> apply_metrics;    // time to apply the received messages by type
+MetricGauge* history_bytes_metric = nullptr;    // estimated memory of the version history
+MetricGauge* history_entries_metric = nullptr;  // entries in the version history
+EventLog event_log;             // accepted edits (disabled if not open)
 
 // glfw callback for character input
 void character_callback(GLFWwindow* window, unsigned int key) {
@@ -370,6 +392,104 @@ void restore_meshdiff(MeshDiff &m, const char * filename)
     ia >> m;
 }
 
+// marks a history entry for a preview of the scene, when thumbnails are enabled; start_thumbnail
+// renders the newest entry marked, so that the apply path only records the version
+void save_thumbnail(timestamp_t version) {
+	if(thumbnail_dir.empty()) return;
+	thumbnail_version = version;
+}
+
+// hands the scene of the newest entry marked to the thumbnail worker, once it is idle and
+// thumbnail_interval passed since the last thumbnail was started
+void start_thumbnail() {
+	if(not thumbnail_version or not thumbnail_worker.idle()) return;
+	if(trace_now() - thumbnail_started < thumbnail_interval * 1e9) return;
+	timing_literal("thumbnail_copy[start]");
+	thumbnail_worker.render(scene, thumbnail_dir + "/" + to_string(thumbnail_version) + ".png");
+	timing_literal("thumbnail_copy[end]");
+	thumbnail_version = 0;
+	thumbnail_started = trace_now();
+}
+
+// lod chain of the scene mesh, rebuilt if the mesh was replaced
+MeshLOD* scene_mesh_lod() {
+	if(mesh_lod and mesh_lod->mesh == scene->meshes[0]) return mesh_lod;
+	if(mesh_lod) delete mesh_lod;
+	timing_literal("make_lod[start]");
+	mesh_lod = make_mesh_lod(scene->meshes[0]);
+	timing_literal("make_lod[end]");
+	return mesh_lod;
+}
+
+// sends the clients following a level of detail their level of the scene mesh after it was
+// replaced or restored as a whole (the lod chain is rebuilt, or dropped if nobody follows one)
+void send_lod_meshes(editor_server* server) {
+	auto levels = server->lod_levels();
+	delete mesh_lod;
+	mesh_lod = nullptr;
+	if(levels.empty()) return;
+	scene_mesh_lod();
+	for(auto level : levels) server->write_lod(level, mesh_lod_level(mesh_lod, level));
+}
+
+// true when the clients following a level of detail can be sent the differences of their level:
+// the lod chain is dropped when nobody follows one, and rebuilt when missing or built for another
+// mesh, in which case the followers get their whole level instead
+bool lod_followed(editor_server* server) {
+	if(server->lod_levels().empty()) {
+		delete mesh_lod;
+		mesh_lod = nullptr;
+		return false;
+	}
+	if(mesh_lod and mesh_lod->mesh == scene->meshes[0]) return true;
+	send_lod_meshes(server);
+	return false;
+}
+
+// updates the lod chain with the mesh differences of scenediff, already applied to the scene mesh,
+// and sends the clients following a level of detail scenediff with the differences of their level
+void send_lod_scenediff(editor_server* server, SceneDiff* scenediff) {
+	if(not lod_followed(server)) return;
+	timing_literal("update_lod[start]");
+	auto diffs = vector<vector<MeshDiff*>>();
+	for(auto meshdiff : scenediff->meshes) diffs.push_back(update_mesh_lod(mesh_lod, meshdiff));
+	timing_literal("update_lod[end]");
+	for(auto level : server->lod_levels()) {
+		auto lod_scenediff = SceneDiff(*scenediff);
+		lod_scenediff.meshes.clear();
+		for(auto& level_diffs : diffs) lod_scenediff.meshes.push_back(level_diffs[level-1]);
+		server->write_lod(level, &lod_scenediff);
+	}
+	for(auto& level_diffs : diffs) for(auto diff : level_diffs) delete diff;
+}
+
+// as above for a single mesh difference
+void send_lod_meshdiff(editor_server* server, MeshDiff* meshdiff) {
+	if(not lod_followed(server)) return;
+	timing_literal("update_lod[start]");
+	auto diffs = update_mesh_lod(mesh_lod, meshdiff);
+	timing_literal("update_lod[end]");
+	for(auto level : server->lod_levels()) server->write_lod(level, diffs[level-1]);
+	for(auto diff : diffs) delete diff;
+}
+
+// metrics of the messages applied by the server (the sessions keep theirs, see server.h)
+void init_metrics() {
+	for(auto type : { mesh_msg::Mesh_type, mesh_msg::SceneDiff_type, mesh_msg::MeshDiff_type, mesh_msg::Obj_Mtl_type }) {
+		auto labels = tostring("type=\"%s\"", mesh_msg::type_name(type));
+		decode_metrics[type] = metric_histogram("dist_scene_decode_seconds", "deserialization of the received messages", labels, 1e-9);
+		apply_metrics[type] = metric_histogram("dist_scene_apply_seconds", "applying the received messages to the scene", labels, 1e-9);
+	}
+	history_bytes_metric = metric_gauge("dist_scene_history_bytes", "estimated memory of the version history");
+	history_entries_metric = metric_gauge("dist_scene_history_entries", "meshes and differences in the version history");
+}
+
+// records an accepted message in the event log with the scene version it led to
+void log_event(mesh_msg* msg, long long version) {
+	if(not event_log.is_open()) return;
+	event_log.append(msg->type(), (*msg)[0], msg->length(), version, msg->edit_id(), msg->origin_time());
+}
+
 // uiloop
 void uiloop(editor_server* server) {
 	auto ok = glfwInit();
@@ -397,6 +517,7 @@ void uiloop(editor_server* server) {
 	
 	auto mouse_last_x = -1.0;
 	auto mouse_last_y = -1.0;
+	auto metrics_logged = trace_now();
 	
 	while(not glfwWindowShouldClose(window)) {
 		glfwGetFramebufferSize(window, &scene->image_width, &scene->image_height);
@@ -438,6 +559,7 @@ void uiloop(editor_server* server) {
 		if(mesh_ver){
 			auto mesh = scene->ids_map[7].as_mesh();
 			mesh->pos[214] += transform_vector(mesh->frame, z3f);
+			mesh->dirty.mark_vertex(214);
 			server->remove_front_op();
 			mesh_ver = false;
 		}
@@ -454,9 +576,12 @@ void uiloop(editor_server* server) {
             auto version = restore_version(scene);
             
             if(old != version){
+                // the scene no longer shows the version marked for a thumbnail
+                thumbnail_version = 0;
                 stringstream restore_message;
                 restore_message << "restore_version " << version;
                 server->write_all(restore_message.str().c_str());
+                send_lod_meshes(server);
             }
             
             sync_scene = false;
@@ -480,7 +605,17 @@ void uiloop(editor_server* server) {
 			server->remove_front_op();
 		}
 		
+		// clients asking for a level of detail get the whole level, then only its differences
+		while(server->has_lod_request()){
+			auto request = server->next_lod_request();
+			auto level = min(request.second, (int)mesh_lod_ratios.size());
+			server->follow_lod(request.first, level, (level) ? mesh_lod_level(scene_mesh_lod(), level) : scene->meshes[0]);
+			message("client %d follows level of detail %d\n", request.first->id, level);
+		}
+		
+		auto history_changed = false;
 		while(server->has_pending_mesh()){
+            history_changed = true;
             // get next message
             auto msg = server->get_next_pending();
             // switch between message type
@@ -490,29 +625,45 @@ void uiloop(editor_server* server) {
                     auto message_tokens = msg->as_message();
                     if(message_tokens[0] == "restore_version"){
                         restore_to_version(scene, atoll(message_tokens[1].c_str()));
+                        thumbnail_version = 0;
+                        log_event(msg, atoll(message_tokens[1].c_str()));
                         message("scene restored to version %llu", message_tokens[1].c_str());
+                        send_lod_meshes(server);
                     }
                 }
                     break;
                 case 1: // Mesh
                 {
                     // get the next mesh recived
+                    auto decode_start = trace_now();
                     auto mesh = msg->as_mesh();
+                    decode_metrics[mesh_msg::Mesh_type]->record(trace_now() - decode_start);
                     // save mesh in history and update mesh
+                    auto apply_start = trace_now();
                     swap_mesh(mesh, scene, true);
+                    apply_metrics[mesh_msg::Mesh_type]->record(trace_now() - apply_start);
+                    log_event(msg, scene->meshes[0]->_version);
+                    send_lod_meshes(server);
                     // remove from queue
                     server->remove_first();
                 }
                     break;
                 case 2: // SceneDiff
                 {
-                    timing("deserialize_from_msg[start]");
+                    timing_literal("deserialize_from_msg[start]");
+                    auto decode_start = trace_now();
                     auto scenediff = msg->as_scenediff();
-                    timing("deserialize_from_msg[end]");
+                    decode_metrics[mesh_msg::SceneDiff_type]->record(trace_now() - decode_start);
+                    timing_literal("deserialize_from_msg[end]");
                     // apply differences
-                    timing("apply_diff[start]");
+                    timing_literal("apply_diff[start]");
+                    auto apply_start = trace_now();
                     apply_change_reverse(scene, scenediff, scenediff->_label);
-                    timing("apply_diff[end]");
+                    apply_metrics[mesh_msg::SceneDiff_type]->record(trace_now() - apply_start);
+                    timing_literal("apply_diff[end]");
+                    log_event(msg, scenediff->_label);
+                    send_lod_scenediff(server, scenediff);
+                    save_thumbnail(scenediff->_label);
                     message("actual mesh version: %d\n", scene->meshes[0]->_version);
                     // remove from queue
                     // remove from queue
@@ -522,15 +673,23 @@ void uiloop(editor_server* server) {
                 case 3: // MeshDiff
                 {
                     // get the next mesh recived
-                    timing("deserialize_from_msg[start]");
+                    timing_literal("deserialize_from_msg[start]");
+                    auto decode_start = trace_now();
                     auto meshdiff = msg->as_meshdiff();
-                    timing("deserialize_from_msg[end]");
+                    decode_metrics[mesh_msg::MeshDiff_type]->record(trace_now() - decode_start);
+                    timing_literal("deserialize_from_msg[end]");
                     // apply differences
-                    timing("apply_diff[start]");
-                    timing_apply("apply_diff[start]");
-                    apply_mesh_change(scene->meshes[0], meshdiff, get_timestamp());
-                    timing("apply_diff[end]");
-                    timing_apply("apply_diff[end]");
+                    timing_literal("apply_diff[start]");
+                    timing_apply_literal("apply_diff[start]");
+                    auto version = get_timestamp();
+                    auto apply_start = trace_now();
+                    apply_mesh_change(scene->meshes[0], meshdiff, version);
+                    apply_metrics[mesh_msg::MeshDiff_type]->record(trace_now() - apply_start);
+                    timing_literal("apply_diff[end]");
+                    timing_apply_literal("apply_diff[end]");
+                    log_event(msg, version);
+                    send_lod_meshdiff(server, meshdiff);
+                    save_thumbnail(version);
                     message("actual mesh version: %d\n", scene->meshes[0]->_version);
                     // remove from queue
                     server->remove_first();
@@ -539,19 +698,49 @@ void uiloop(editor_server* server) {
                 case 7: // OBJ - MTL
                 {
                     // parse material and scene from obj & mtl
+                    auto decode_start = trace_now();
                     auto tmp_scene = new Scene();
                     obj_parse_materials(tmp_scene, msg->as_mtl());
-                    scene = obj_parse_scene(msg->as_obj(), false, tmp_scene);
-                    auto light = new Light();
-                    light->_id_ = 126128947120701270;
-                    light->frame.o = vec3f(2.0,6.0,5.0);
-                    light->intensity = vec3f(25.0,25.0,25.0);
-                    scene->meshes[0]->frame.o = vec3f(-2.0,0.0,-1.0);
-                    scene->lights.push_back(light);
-                    scene->camera = lookat_camera(vec3f(1.0,6.0,10.0), zero3f, y3f, 1.0f, 1.0f, 1.0f,129849216921865, 0);
-
-                    
-                    message("scene reloaded\n");
+                    auto imported = obj_parse_scene(msg->as_obj(), false, tmp_scene);
+                    decode_metrics[mesh_msg::Obj_Mtl_type]->record(trace_now() - decode_start);
+                    if(scene and not scene->meshes.empty() and not imported->meshes.empty()){
+                        // re-import: only the differences are applied and sent to the clients
+                        timing_literal("import_diff[start]");
+                        auto meshdiff = obj_import_meshdiff(scene->meshes[0], imported->meshes[0]);
+                        timing_literal("import_diff[end]");
+                        // the imported scene (tmp_scene) is not needed anymore: its ids_map owns its meshes and materials
+                        delete imported->camera;
+                        delete imported->animation;
+                        delete imported;
+                        auto version = get_timestamp();
+                        auto apply_start = trace_now();
+                        apply_mesh_change(scene->meshes[0], meshdiff, version);
+                        apply_metrics[mesh_msg::Obj_Mtl_type]->record(trace_now() - apply_start);
+                        log_event(msg, version);
+                        server->write_all(meshdiff);
+                        send_lod_meshdiff(server, meshdiff);
+                        save_thumbnail(version);
+                        message("scene re-imported: %d vertices, %d triangles, %d quads changed (obj %d bytes)\n",
+                                (int)(meshdiff->add_vertex.size() + meshdiff->update_vertex.size() + meshdiff->remove_vertex.size()),
+                                (int)(meshdiff->add_triangle.size() + meshdiff->remove_triangle.size()),
+                                (int)(meshdiff->add_quad.size() + meshdiff->remove_quad.size()), (int)msg->body_length());
+                        delete meshdiff;
+                    }
+                    else{
+                        scene = imported;
+                        auto light = new Light();
+                        light->_id_ = 126128947120701270;
+                        light->frame.o = vec3f(2.0,6.0,5.0);
+                        light->intensity = vec3f(25.0,25.0,25.0);
+                        scene->meshes[0]->frame.o = vec3f(-2.0,0.0,-1.0);
+                        scene->lights.push_back(light);
+                        scene->camera = lookat_camera(vec3f(1.0,6.0,10.0), zero3f, y3f, 1.0f, 1.0f, 1.0f,129849216921865, 0);
+                        log_event(msg, 0);
+                        // first import: clients get the whole obj
+                        server->deliver_all(*msg);
+                        send_lod_meshes(server);
+                        message("scene reloaded\n");
+                    }
                     // remove from queue
                     server->remove_first();
                 }
@@ -560,9 +749,20 @@ void uiloop(editor_server* server) {
                     break;
             }
         }
+		if(history_changed){
+			history_bytes_metric->set(history_memory());
+			history_entries_metric->set(history_size());
+		}
+		start_thumbnail();
+		
+		if(metrics_interval > 0 and trace_now() - metrics_logged > metrics_interval * 1e9){
+			message("metrics %s\n", metrics_summary().c_str());
+			metrics_logged = trace_now();
+		}
 		
         if(write_log){
             save_timing("server_timing_v" + scene_filename + to_string(scene->meshes[0]->_version));
+            save_trace("../log/server_trace_v" + scene_filename + to_string(scene->meshes[0]->_version) + ".json");
             write_log = false;
         }
 		
@@ -570,8 +770,8 @@ void uiloop(editor_server* server) {
             scene2 = load_obj_scene("../scenes/fat_v"+ to_string(c++) +".obj");
             scene2->meshes[0]->frame.o = vec3f(-2.0,0.0,-1.0);
 
-            auto diff = meshdiff_assume_ordered(scene->meshes[0], scene2->meshes[0]);
-            obj_apply_mesh_change(scene->meshes[0], diff, 0);
+            auto diff = obj_import_meshdiff(scene->meshes[0], scene2->meshes[0]);
+            apply_mesh_change(scene->meshes[0], diff, 0);
             c = c % 5;
             check = false;
 		}
@@ -588,7 +788,13 @@ void uiloop(editor_server* server) {
 int main(int argc, char** argv) {
 	auto args = parse_cmdline(argc, argv,
 							  { "3D viewer", "show 3d scene",
-								  {  {"resolution", "r", "image resolution", typeid(int), true, jsonvalue() }  },
+								  {  {"resolution", "r", "image resolution", typeid(int), true, jsonvalue() },
+									  {"thumbnails", "t", "directory of the version thumbnails", typeid(string), true, jsonvalue("")},
+									  {"thumbnail_interval", "T", "seconds between the version thumbnails rendered", typeid(double), true, jsonvalue(1.0)},
+									  {"metrics_port", "m", "local port of the metrics endpoint (0 to disable)", typeid(int), true, jsonvalue(3312)},
+									  {"metrics_interval", "i", "seconds between the metrics log lines (0 to disable)", typeid(double), true, jsonvalue(10.0)},
+									  {"event_log", "e", "directory of the event log of the accepted edits (empty to disable)", typeid(string), true, jsonvalue("../log/events")},
+									  {"event_segment", "s", "size of the event log segments (MB)", typeid(int), true, jsonvalue(64)}  },
 								  {  {"scene_filename", "", "scene filename", typeid(string), false, jsonvalue("scene.json")},
 									  {"image_filename", "", "image filename", typeid(string), true, jsonvalue("")}  }
 							  });
@@ -596,11 +802,19 @@ int main(int argc, char** argv) {
 	image_filename = (args.object_element("image_filename").as_string() != "") ?
 	args.object_element("image_filename").as_string() :
 	scene_filename.substr(0,scene_filename.size()-5)+".png";
+	thumbnail_dir = args.object_element("thumbnails").as_string();
+	thumbnail_interval = args.object_element("thumbnail_interval").as_double();
+	metrics_interval = args.object_element("metrics_interval").as_double();
+	auto metrics_port = args.object_element("metrics_port").as_int();
+	init_metrics();
+	auto event_log_dir = args.object_element("event_log").as_string();
+	event_log.segment_size = (long long)args.object_element("event_segment").as_int() << 20;
+	if(event_log_dir != "" and not event_log.open(event_log_dir)) message("event log disabled\n");
     scene = load_json_scene("../scenes/shuttleply_v0.json");
     scene->background = zero3f;
     
     //scene = load_json_scene("../scenes/shuttleply_v" + scene_filename + ".json");
-    timing("parse_scene[end]");
+    timing_literal("parse_scene[end]");
 	if(not args.object_element("resolution").is_null()) {
 		scene->image_height = args.object_element("resolution").as_int();
 		scene->image_width = scene->camera->width * scene->image_height / scene->camera->height;
@@ -616,9 +830,14 @@ int main(int argc, char** argv) {
 		
 		tcp::endpoint endpoint(tcp::v4(), 3311);
 		editor_server server(io_service, endpoint);
+		// metrics on http://localhost:metrics_port/metrics (any path)
+		std::unique_ptr<metrics_endpoint> metrics;
+		if(metrics_port) metrics.reset(new metrics_endpoint(io_service, metrics_port));
 		std::thread t([&io_service](){ io_service.run(); });
         
 		uiloop(&server);
+		thumbnail_worker.close();
+		event_log.close();
 		server.close();
 		io_service.stop();
 		
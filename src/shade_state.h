@@ -0,0 +1,133 @@
+#ifndef _SHADE_STATE_H_
+#define _SHADE_STATE_H_
+
+// render state of the scene program used by shade(): uniform and attribute locations are
+// resolved once per program, meshes are drawn grouped by material and textures, and material
+// uniforms and texture bindings are only sent when they change. Include after the OpenGL headers.
+
+#include "scene_distributed.h"
+
+// size of the light arrays in fragment.glsl
+const int shade_max_lights = 16;
+
+// uniform and attribute locations of the scene program
+struct ShadeLocations {
+    GLuint  program = 0;                    // program the locations belong to
+
+    GLint   camera_pos = -1;
+    GLint   camera_frame_inverse = -1;
+    GLint   camera_projection = -1;
+    GLint   ambient = -1;
+    GLint   lights_num = -1;
+    GLint   light_pos = -1;                 // first element, the array is set with one call
+    GLint   light_intensity = -1;           // first element, the array is set with one call
+
+    GLint   material_kd = -1;
+    GLint   material_ks = -1;
+    GLint   material_n = -1;
+    GLint   material_txt[3] = {-1,-1,-1};   // kd, ks and norm samplers
+    GLint   material_txt_on[3] = {-1,-1,-1};// kd, ks and norm enable flags
+    GLint   mesh_frame = -1;
+
+    GLint   vertex_pos = -1;
+    GLint   vertex_norm = -1;
+    GLint   vertex_texcoord = -1;
+};
+
+// locations of program, looked up again only when the program changes
+inline const ShadeLocations& shade_locations(GLuint program) {
+    static auto locations = ShadeLocations();
+    if(locations.program == program) return locations;
+    locations.program = program;
+    locations.camera_pos = glGetUniformLocation(program, "camera_pos");
+    locations.camera_frame_inverse = glGetUniformLocation(program, "camera_frame_inverse");
+    locations.camera_projection = glGetUniformLocation(program, "camera_projection");
+    locations.ambient = glGetUniformLocation(program, "ambient");
+    locations.lights_num = glGetUniformLocation(program, "lights_num");
+    locations.light_pos = glGetUniformLocation(program, "light_pos[0]");
+    locations.light_intensity = glGetUniformLocation(program, "light_intensity[0]");
+    locations.material_kd = glGetUniformLocation(program, "material_kd");
+    locations.material_ks = glGetUniformLocation(program, "material_ks");
+    locations.material_n = glGetUniformLocation(program, "material_n");
+    locations.material_txt[0] = glGetUniformLocation(program, "material_kd_txt");
+    locations.material_txt[1] = glGetUniformLocation(program, "material_ks_txt");
+    locations.material_txt[2] = glGetUniformLocation(program, "material_norm_txt");
+    locations.material_txt_on[0] = glGetUniformLocation(program, "material_kd_txt_on");
+    locations.material_txt_on[1] = glGetUniformLocation(program, "material_ks_txt_on");
+    locations.material_txt_on[2] = glGetUniformLocation(program, "material_norm_txt_on");
+    locations.mesh_frame = glGetUniformLocation(program, "mesh_frame");
+    locations.vertex_pos = glGetAttribLocation(program, "vertex_pos");
+    locations.vertex_norm = glGetAttribLocation(program, "vertex_norm");
+    locations.vertex_texcoord = glGetAttribLocation(program, "vertex_texcoord");
+    // samplers always read from the same texture units
+    glUseProgram(program);
+    for(auto i : range(3)) glUniform1i(locations.material_txt[i], i);
+    return locations;
+}
+
+// sets camera and lights, once per frame; the light arrays are sent with a single call each
+inline void shade_bind_frame(const ShadeLocations& locations, Scene* scene) {
+    auto camera = scene->camera;
+    glUniform3fv(locations.camera_pos, 1, &camera->frame.o.x);
+    glUniformMatrix4fv(locations.camera_frame_inverse, 1, true, &frame_to_matrix_inverse(camera->frame)[0][0]);
+    glUniformMatrix4fv(locations.camera_projection, 1, true,
+                       &frustum_matrix(-camera->dist*camera->width/2, camera->dist*camera->width/2,
+                                       -camera->dist*camera->height/2, camera->dist*camera->height/2,
+                                       camera->dist,10000)[0][0]);
+    glUniform3fv(locations.ambient, 1, &scene->ambient.x);
+
+    auto lights_num = min((int)scene->lights.size(), shade_max_lights);
+    vec3f light_pos[shade_max_lights], light_intensity[shade_max_lights];
+    for(auto i : range(lights_num)) {
+        light_pos[i] = scene->lights[i]->frame.o;
+        light_intensity[i] = scene->lights[i]->intensity;
+    }
+    glUniform1i(locations.lights_num, lights_num);
+    if(lights_num) {
+        glUniform3fv(locations.light_pos, lights_num, &light_pos[0].x);
+        glUniform3fv(locations.light_intensity, lights_num, &light_intensity[0].x);
+    }
+}
+
+// meshes in draw order: grouped by material, then by textures, so that state changes are few
+inline vector<Mesh*> shade_draw_order(const vector<Mesh*>& meshes) {
+    auto order = meshes;
+    stable_sort(order.begin(), order.end(), [](Mesh* a, Mesh* b) {
+        return make_tuple(a->mat, a->mat->kd_txt, a->mat->ks_txt, a->mat->norm_txt) <
+               make_tuple(b->mat, b->mat->kd_txt, b->mat->ks_txt, b->mat->norm_txt);
+    });
+    return order;
+}
+
+// material uniforms and textures currently bound, to skip redundant updates within a frame
+struct ShadeMaterialState {
+    Material*   material = nullptr;             // material whose uniforms are set
+    vec3f       kd, ks;                         // values sent for it
+    float       n = 0;
+    texture3*   textures[3] = {nullptr,nullptr,nullptr};
+    bool        textures_valid = false;         // whether textures reflects the bound units
+
+    // binds mat, sending only what differs from the previous material
+    void bind(const ShadeLocations& locations, Material* mat, map<texture3*,int>& texture_ids) {
+        if(mat != material or not (mat->kd == kd) or not (mat->ks == ks) or mat->n != n) {
+            glUniform3fv(locations.material_kd, 1, &mat->kd.x);
+            glUniform3fv(locations.material_ks, 1, &mat->ks.x);
+            glUniform1f(locations.material_n, mat->n);
+            material = mat;
+            kd = mat->kd;
+            ks = mat->ks;
+            n = mat->n;
+        }
+        texture3* txt[3] = { mat->kd_txt, mat->ks_txt, mat->norm_txt };
+        for(auto i : range(3)) {
+            if(textures_valid and txt[i] == textures[i]) continue;
+            glUniform1i(locations.material_txt_on[i], txt[i] ? GL_TRUE : GL_FALSE);
+            glActiveTexture(GL_TEXTURE0+i);
+            glBindTexture(GL_TEXTURE_2D, txt[i] ? texture_ids[txt[i]] : 0);
+            textures[i] = txt[i];
+        }
+        textures_valid = true;
+    }
+};
+
+#endif
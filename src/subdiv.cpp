@@ -0,0 +1,376 @@
+#include "subdiv.h"
+
+int subdiv_grain = 4096;
+
+// adjacency of a level, used to build the stencils of the next one
+struct _subdiv_topology {
+    int             vertices = 0;       // number of vertices
+    vector<vec4i>   faces;              // faces (w < 0 for triangles)
+    vector<vec4i>   face_edges;         // edge of each side (v[i],v[i+1]) of each face
+    vector<vec2i>   edges;              // edge endpoints
+    vector<vec2i>   edge_faces;         // first two faces of each edge (-1 if missing)
+    vector<int>     edge_nfaces;        // faces of each edge
+    vector<int>     vertex_offsets;     // range in vertex_edges of each vertex
+    vector<int>     vertex_edges;       // edges around each vertex
+    vector<int>     face_offsets;       // range in vertex_faces of each vertex
+    vector<int>     vertex_faces;       // faces around each vertex
+};
+
+// number of corners of a face
+inline int _corners(const vec4i& f) { return (f.w < 0) ? 3 : 4; }
+
+// compressed adjacency of n items from (item, value) pairs: the values of item i end up in
+// values[offsets[i],offsets[i+1]), in the order of pairs
+void _adjacency(int n, const vector<pair<int,int>>& pairs, vector<int>& offsets, vector<int>& values) {
+    offsets.assign(n+1, 0);
+    for(auto& p : pairs) offsets[p.first+1] ++;
+    for(auto i : range(n)) offsets[i+1] += offsets[i];
+    values.resize(pairs.size());
+    auto next = vector<int>(offsets.begin(), offsets.end()-1);
+    for(auto& p : pairs) values[next[p.first]++] = p.second;
+}
+
+// builds edges and vertex adjacency of faces
+void _build_topology(_subdiv_topology& topo) {
+    auto& faces = topo.faces;
+    // half-edges sorted by their endpoints, so that the sides of an edge are consecutive
+    auto sides = vector<pair<unsigned long long,int>>();
+    sides.reserve(faces.size()*4);
+    for(auto f : range(faces.size())) {
+        auto k = _corners(faces[f]);
+        for(auto i : range(k)) {
+            auto a = (&faces[f].x)[i], b = (&faces[f].x)[(i+1)%k];
+            auto key = ((unsigned long long)min(a,b) << 32) | (unsigned long long)max(a,b);
+            sides.push_back(make_pair(key, f*4+i));
+        }
+    }
+    sort(sides.begin(), sides.end());
+
+    topo.face_edges.assign(faces.size(), none4i);
+    topo.edges.clear();
+    topo.edge_faces.clear();
+    topo.edge_nfaces.clear();
+    for(auto i = 0; i < (int)sides.size(); i ++) {
+        if(i == 0 or sides[i].first != sides[i-1].first) {
+            topo.edges.push_back(vec2i((int)(sides[i].first >> 32), (int)(sides[i].first & 0xffffffff)));
+            topo.edge_faces.push_back(vec2i(-1,-1));
+            topo.edge_nfaces.push_back(0);
+        }
+        auto e = (int)topo.edges.size()-1;
+        auto f = sides[i].second / 4;
+        (&topo.face_edges[f].x)[sides[i].second % 4] = e;
+        if(topo.edge_nfaces[e] < 2) (&topo.edge_faces[e].x)[topo.edge_nfaces[e]] = f;
+        topo.edge_nfaces[e] ++;
+    }
+
+    auto vertex_edges = vector<pair<int,int>>();
+    vertex_edges.reserve(topo.edges.size()*2);
+    for(auto e : range(topo.edges.size())) {
+        vertex_edges.push_back(make_pair(topo.edges[e].x, e));
+        vertex_edges.push_back(make_pair(topo.edges[e].y, e));
+    }
+    _adjacency(topo.vertices, vertex_edges, topo.vertex_offsets, topo.vertex_edges);
+    auto vertex_faces = vector<pair<int,int>>();
+    vertex_faces.reserve(faces.size()*4);
+    for(auto f : range(faces.size()))
+        for(auto i : range(_corners(faces[f]))) vertex_faces.push_back(make_pair((&faces[f].x)[i], f));
+    _adjacency(topo.vertices, vertex_faces, topo.face_offsets, topo.vertex_faces);
+}
+
+// stencil of vertex i of the finer level; finer vertices are numbered as the coarser
+// vertices, then one per face, then one per edge
+void _stencil(const _subdiv_topology& topo, int i, vector<pair<int,float>>& row) {
+    row.clear();
+    auto nfaces = (int)topo.faces.size();
+    // face point: centroid of the face
+    auto add_face = [&](int f, float w) {
+        auto k = _corners(topo.faces[f]);
+        for(auto j : range(k)) row.push_back(make_pair((&topo.faces[f].x)[j], w / k));
+    };
+    if(i < topo.vertices) {
+        auto v = i;
+        auto n = topo.vertex_offsets[v+1] - topo.vertex_offsets[v];
+        auto nf = topo.face_offsets[v+1] - topo.face_offsets[v];
+        auto boundary = vector<int>();
+        for(auto k = topo.vertex_offsets[v]; k < topo.vertex_offsets[v+1]; k ++) {
+            auto e = topo.vertex_edges[k];
+            if(topo.edge_nfaces[e] != 2) boundary.push_back((topo.edges[e].x == v) ? topo.edges[e].y : topo.edges[e].x);
+        }
+        if(boundary.empty() and n >= 3 and nf == n) {
+            // interior vertex: (Q + 2R + (n-3)P) / n with Q the mean of the face points
+            // and R the mean of the edge midpoints
+            row.push_back(make_pair(v, (n-3) / (float)n));
+            for(auto k = topo.face_offsets[v]; k < topo.face_offsets[v+1]; k ++) add_face(topo.vertex_faces[k], 1 / (float)(n*n));
+            for(auto k = topo.vertex_offsets[v]; k < topo.vertex_offsets[v+1]; k ++) {
+                auto e = topo.vertex_edges[k];
+                row.push_back(make_pair(topo.edges[e].x, 1 / (float)(n*n)));
+                row.push_back(make_pair(topo.edges[e].y, 1 / (float)(n*n)));
+            }
+        } else if(boundary.size() == 2) {
+            // crease: cubic b-spline along the boundary
+            row.push_back(make_pair(v, 0.75f));
+            row.push_back(make_pair(boundary[0], 0.125f));
+            row.push_back(make_pair(boundary[1], 0.125f));
+        } else {
+            // corners, non-manifold and isolated vertices stay in place
+            row.push_back(make_pair(v, 1.0f));
+        }
+    } else if(i < topo.vertices + nfaces) {
+        add_face(i - topo.vertices, 1);
+    } else {
+        auto e = i - topo.vertices - nfaces;
+        if(topo.edge_nfaces[e] == 2) {
+            row.push_back(make_pair(topo.edges[e].x, 0.25f));
+            row.push_back(make_pair(topo.edges[e].y, 0.25f));
+            add_face(topo.edge_faces[e].x, 0.25f);
+            add_face(topo.edge_faces[e].y, 0.25f);
+        } else {
+            row.push_back(make_pair(topo.edges[e].x, 0.5f));
+            row.push_back(make_pair(topo.edges[e].y, 0.5f));
+        }
+    }
+    // merge repeated vertices
+    sort(row.begin(), row.end());
+    auto n = 0;
+    for(auto& r : row) {
+        if(n and row[n-1].first == r.first) row[n-1].second += r.second;
+        else row[n++] = r;
+    }
+    row.resize(n);
+}
+
+// builds the stencils refining topo and the faces of the finer level
+void _build_level(const _subdiv_topology& topo, SubdivLevel& level, vector<vec4i>& faces) {
+    auto nfaces = (int)topo.faces.size();
+    auto count = topo.vertices + nfaces + (int)topo.edges.size();
+    // stencil sizes first, so that the rows are written in parallel in place
+    level.offsets.assign(count+1, 0);
+    parallel_for(count, [&](int i) {
+        static thread_local auto row = vector<pair<int,float>>();
+        _stencil(topo, i, row);
+        level.offsets[i+1] = row.size();
+    }, subdiv_grain);
+    for(auto i : range(count)) level.offsets[i+1] += level.offsets[i];
+    level.indices.resize(level.offsets.back());
+    level.weights.resize(level.offsets.back());
+    parallel_for(count, [&](int i) {
+        static thread_local auto row = vector<pair<int,float>>();
+        _stencil(topo, i, row);
+        for(auto k : range(row.size())) {
+            level.indices[level.offsets[i]+k] = row[k].first;
+            level.weights[level.offsets[i]+k] = row[k].second;
+        }
+    }, subdiv_grain);
+
+    auto users = vector<pair<int,int>>();
+    users.reserve(level.indices.size());
+    for(auto i : range(count))
+        for(auto k = level.offsets[i]; k < level.offsets[i+1]; k ++) users.push_back(make_pair(level.indices[k], i));
+    _adjacency(topo.vertices, users, level.user_offsets, level.users);
+
+    // each face is split into one quad per corner
+    faces.clear();
+    faces.reserve(nfaces*4);
+    for(auto f : range(nfaces)) {
+        auto k = _corners(topo.faces[f]);
+        for(auto j : range(k)) {
+            auto e = (&topo.face_edges[f].x)[j], ep = (&topo.face_edges[f].x)[(j+k-1)%k];
+            faces.push_back(vec4i((&topo.faces[f].x)[j], topo.vertices + nfaces + e, topo.vertices + f, topo.vertices + nfaces + ep));
+        }
+    }
+}
+
+// evaluates vertex i of a level from the coarser values
+template <typename T>
+inline void _evaluate(const SubdivLevel& level, const vector<T>& coarse, vector<T>& fine, int i) {
+    auto k = level.offsets[i];
+    auto v = coarse[level.indices[k]] * level.weights[k];
+    for(k ++; k < level.offsets[i+1]; k ++) v += coarse[level.indices[k]] * level.weights[k];
+    fine[i] = v;
+}
+
+// normal of a quad of the last level
+inline vec3f _quad_normal(const vector<vec3f>& pos, const vec4i& q) {
+    return normalize(cross(pos[q.z]-pos[q.x], pos[q.w]-pos[q.y]));
+}
+
+// writes the given vertices (smooth) or quads (faceted) of the last level into the display mesh
+void _update_display(MeshSubdiv* subdiv, const vector<int>& vertices, const vector<int>& quads) {
+    auto display = subdiv->display;
+    auto& pos = subdiv->pos.back();
+    auto texcoord = (subdiv->texcoord.empty()) ? nullptr : &subdiv->texcoord.back();
+    if(subdiv->smooth) {
+        parallel_for(vertices.size(), [&](int k) {
+            auto v = vertices[k];
+            auto n = zero3f;
+            for(auto j = subdiv->quad_offsets[v]; j < subdiv->quad_offsets[v+1]; j ++)
+                n += _quad_normal(pos, subdiv->quads[subdiv->vertex_quads[j]]);
+            display->pos[v] = pos[v];
+            display->norm[v] = normalize(n);
+            if(texcoord) display->texcoord[v] = (*texcoord)[v];
+        }, subdiv_grain);
+        for(auto v : vertices) display->dirty.mark_vertex(v);
+    } else {
+        parallel_for(quads.size(), [&](int k) {
+            auto q = quads[k];
+            auto& quad = subdiv->quads[q];
+            auto n = _quad_normal(pos, quad);
+            for(auto c : range(4)) {
+                display->pos[q*4+c] = pos[(&quad.x)[c]];
+                display->norm[q*4+c] = n;
+                if(texcoord) display->texcoord[q*4+c] = (*texcoord)[(&quad.x)[c]];
+            }
+        }, subdiv_grain);
+        for(auto q : quads) for(auto c : range(4)) display->dirty.mark_vertex(q*4+c);
+    }
+}
+
+void make_subdiv(Mesh* mesh) {
+    if(not mesh->subdiv) mesh->subdiv = new MeshSubdiv();
+    auto subdiv = mesh->subdiv;
+    if(not subdiv->display) subdiv->display = new Mesh();
+    subdiv->level = max(mesh->subdivision_catmullclark_level, 1);
+    subdiv->smooth = mesh->subdivision_catmullclark_smooth;
+    subdiv->cage_vertices = mesh->pos.size();
+    auto has_texcoord = not mesh->texcoord.empty() and mesh->texcoord.size() == mesh->pos.size();
+
+    // cage faces, skipping removed entries
+    auto topo = _subdiv_topology();
+    topo.vertices = mesh->pos.size();
+    for(auto& t : mesh->triangle_index) if(t.x >= 0) topo.faces.push_back(vec4i(t.x,t.y,t.z,-1));
+    for(auto& q : mesh->quad_index) if(q.x >= 0) topo.faces.push_back(q);
+
+    subdiv->levels.assign(subdiv->level, SubdivLevel());
+    subdiv->pos.assign(subdiv->level, vector<vec3f>());
+    subdiv->texcoord.assign((has_texcoord) ? subdiv->level : 0, vector<vec2f>());
+    auto faces = vector<vec4i>();
+    for(auto l : range(subdiv->level)) {
+        _build_topology(topo);
+        auto& level = subdiv->levels[l];
+        _build_level(topo, level, faces);
+        auto count = (int)level.offsets.size()-1;
+        auto& coarse = (l) ? subdiv->pos[l-1] : mesh->pos;
+        subdiv->pos[l].resize(count);
+        parallel_for(count, [&](int i) { _evaluate(level, coarse, subdiv->pos[l], i); }, subdiv_grain);
+        if(has_texcoord) {
+            auto& coarse_texcoord = (l) ? subdiv->texcoord[l-1] : mesh->texcoord;
+            subdiv->texcoord[l].resize(count);
+            parallel_for(count, [&](int i) { _evaluate(level, coarse_texcoord, subdiv->texcoord[l], i); }, subdiv_grain);
+        }
+        // edges of the last level: the halves of the coarser edges and the face to edge points
+        if(l == subdiv->level-1) {
+            auto nfaces = (int)topo.faces.size();
+            subdiv->edges.clear();
+            for(auto e : range(topo.edges.size())) {
+                subdiv->edges.push_back(vec2i(topo.edges[e].x, topo.vertices + nfaces + e));
+                subdiv->edges.push_back(vec2i(topo.vertices + nfaces + e, topo.edges[e].y));
+            }
+            for(auto f : range(nfaces))
+                for(auto j : range(_corners(topo.faces[f]))) subdiv->edges.push_back(vec2i(topo.vertices + f, topo.vertices + nfaces + (&topo.face_edges[f].x)[j]));
+        }
+        topo = _subdiv_topology();
+        topo.vertices = count;
+        topo.faces = move(faces);
+        faces = vector<vec4i>();
+    }
+    subdiv->quads = move(topo.faces);
+    auto vertex_quads = vector<pair<int,int>>();
+    vertex_quads.reserve(subdiv->quads.size()*4);
+    for(auto q : range(subdiv->quads.size())) for(auto c : range(4)) vertex_quads.push_back(make_pair((&subdiv->quads[q].x)[c], q));
+    _adjacency(topo.vertices, vertex_quads, subdiv->quad_offsets, subdiv->vertex_quads);
+
+    // display mesh: shared vertices with smooth normals, or four vertices per quad when faceted
+    auto display = subdiv->display;
+    auto nverts = (subdiv->smooth) ? topo.vertices : (int)subdiv->quads.size()*4;
+    display->pos.assign(nverts, zero3f);
+    display->norm.assign(nverts, zero3f);
+    display->texcoord.assign((has_texcoord) ? nverts : 0, zero2f);
+    display->triangle_index.clear();
+    display->quad_index.clear();
+    display->edge_index.clear();
+    if(subdiv->smooth) {
+        display->quad_index = subdiv->quads;
+        display->edge_index = subdiv->edges;
+    } else {
+        for(auto q : range(subdiv->quads.size())) {
+            display->quad_index.push_back(vec4i(q*4, q*4+1, q*4+2, q*4+3));
+            for(auto c : range(4)) display->edge_index.push_back(vec2i(q*4+c, q*4+(c+1)%4));
+        }
+    }
+    auto all_vertices = vector<int>(), all_quads = vector<int>();
+    if(subdiv->smooth) for(auto v : range(topo.vertices)) all_vertices.push_back(v);
+    else for(auto q : range(subdiv->quads.size())) all_quads.push_back(q);
+    _update_display(subdiv, all_vertices, all_quads);
+    display->dirty.mark_all();
+}
+
+void update_subdiv(Mesh* mesh, const vector<int>& vertices) {
+    auto subdiv = mesh->subdiv;
+    if(not subdiv) { make_subdiv(mesh); return; }
+    auto has_texcoord = not subdiv->texcoord.empty();
+
+    // vertices to evaluate at each level: the users of the vertices changed in the coarser one
+    auto changed = vector<int>();
+    for(auto v : vertices) if(v >= 0 and v < subdiv->cage_vertices) changed.push_back(v);
+    sort(changed.begin(), changed.end());
+    changed.erase(unique(changed.begin(), changed.end()), changed.end());
+    for(auto l : range(subdiv->level)) {
+        auto& level = subdiv->levels[l];
+        auto rows = vector<int>();
+        for(auto v : changed) rows.insert(rows.end(), level.users.begin() + level.user_offsets[v], level.users.begin() + level.user_offsets[v+1]);
+        sort(rows.begin(), rows.end());
+        rows.erase(unique(rows.begin(), rows.end()), rows.end());
+        auto& coarse = (l) ? subdiv->pos[l-1] : mesh->pos;
+        auto& coarse_texcoord = (l) ? subdiv->texcoord[l-1] : mesh->texcoord;
+        parallel_for(rows.size(), [&](int k) {
+            _evaluate(level, coarse, subdiv->pos[l], rows[k]);
+            if(has_texcoord) _evaluate(level, coarse_texcoord, subdiv->texcoord[l], rows[k]);
+        }, subdiv_grain);
+        changed = move(rows);
+    }
+
+    // faces around the moved vertices, whose normals changed, and the vertices sharing them
+    auto quads = vector<int>();
+    for(auto v : changed) quads.insert(quads.end(), subdiv->vertex_quads.begin() + subdiv->quad_offsets[v], subdiv->vertex_quads.begin() + subdiv->quad_offsets[v+1]);
+    sort(quads.begin(), quads.end());
+    quads.erase(unique(quads.begin(), quads.end()), quads.end());
+    auto normals = vector<int>();
+    if(subdiv->smooth) {
+        for(auto q : quads) for(auto c : range(4)) normals.push_back((&subdiv->quads[q].x)[c]);
+        sort(normals.begin(), normals.end());
+        normals.erase(unique(normals.begin(), normals.end()), normals.end());
+    }
+    _update_display(subdiv, normals, quads);
+}
+
+Mesh* subdivided_mesh(Mesh* mesh) {
+    if(mesh->subdivision_catmullclark_level <= 0) {
+        if(mesh->subdiv) {
+            // the cage buffers missed the changes consumed while subdividing
+            delete mesh->subdiv;
+            mesh->subdiv = nullptr;
+            mesh->dirty.mark_all();
+        }
+        return mesh;
+    }
+    auto& dirty = mesh->dirty;
+    auto subdiv = mesh->subdiv;
+    if(not subdiv or dirty.all or dirty.triangle_from >= 0 or dirty.quad_from >= 0 or
+       subdiv->level != mesh->subdivision_catmullclark_level or subdiv->smooth != mesh->subdivision_catmullclark_smooth or
+       subdiv->cage_vertices != (int)mesh->pos.size()) {
+        timing_literal("subdiv_build[start]");
+        make_subdiv(mesh);
+        timing_literal("subdiv_build[end]");
+    }
+    else if(not dirty.vertices.empty()) {
+        timing_literal("subdiv_update[start]");
+        update_subdiv(mesh, dirty.vertices);
+        timing_literal("subdiv_update[end]");
+    }
+    dirty.clear();
+    auto display = mesh->subdiv->display;
+    display->frame = mesh->frame;
+    display->mat = mesh->mat;
+    display->_id_ = mesh->_id_;
+    return display;
+}
@@ -0,0 +1,55 @@
+#ifndef _SUBDIV_H_
+#define _SUBDIV_H_
+
+#include "scene_distributed.h"
+
+// Catmull-Clark subdivision for display: the refinement of each level is precomputed from the
+// cage topology as stencils (weighted sums of the coarser vertices), so moving cage vertices only
+// re-evaluates the stencils that depend on them. Stencils are rebuilt when the faces change or
+// when subdivision_catmullclark_level changes. Boundary edges and vertices follow the crease rules
+// (cubic B-spline along the boundary); non-manifold vertices and corners stay in place. Triangles
+// and quads are both refined into quads. The cage is what is edited and sent over the network.
+
+extern int subdiv_grain;    // vertices evaluated per parallel_for chunk
+
+// refinement of one level: vertex i of the finer level is the sum of weights[k] times
+// the coarser vertex indices[k] for k in [offsets[i],offsets[i+1])
+struct SubdivLevel {
+    vector<int>     offsets;            // stencil range of each finer vertex
+    vector<int>     indices;            // coarser vertices
+    vector<float>   weights;            // their weights
+    vector<int>     user_offsets;       // range in users of each coarser vertex
+    vector<int>     users;              // finer vertices whose stencil has each coarser vertex
+};
+
+// subdivision of a mesh and the refined mesh drawn in its place
+struct MeshSubdiv {
+    int                 level = 0;              // catmull-clark levels the stencils were built for
+    bool                smooth = false;         // smooth normals (faceted otherwise)
+    int                 cage_vertices = 0;      // pos entries of the cage when the stencils were built
+
+    vector<SubdivLevel> levels;                 // refinement of each level
+    vector<vector<vec3f>> pos;                  // positions of each level (pos[0] is level 1)
+    vector<vector<vec2f>> texcoord;             // texture coordinates of each level (if the cage has them)
+    vector<vec4i>       quads;                  // faces of the last level
+    vector<vec2i>       edges;                  // edges of the last level
+    vector<int>         quad_offsets;           // range in vertex_quads of each vertex of the last level
+    vector<int>         vertex_quads;           // faces around each vertex of the last level
+
+    Mesh*               display = nullptr;      // refined mesh, drawn instead of the cage
+
+    // destructor
+    ~MeshSubdiv() { delete display; }
+};
+
+// builds the stencils of mesh for its subdivision settings and evaluates the refined mesh
+void make_subdiv(Mesh* mesh);
+
+// re-evaluates the refined mesh where it depends on the given cage vertices (pos indices)
+void update_subdiv(Mesh* mesh, const vector<int>& vertices);
+
+// mesh to draw for mesh: mesh itself without subdivision, otherwise its refined mesh brought
+// up to date with the changes recorded in mesh->dirty (which are consumed)
+Mesh* subdivided_mesh(Mesh* mesh);
+
+#endif
@@ -0,0 +1,176 @@
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <unistd.h>
+
+std::atomic<bool> trace_enabled(true);
+
+// ring of a thread: events [start,head) are valid, the last trace_ring_size of them still stored
+struct _TraceRing {
+    vector<TraceEvent>      events = vector<TraceEvent>(trace_ring_size);
+    std::atomic<long long>  head {0};           // events written (only the owner thread writes)
+    std::atomic<long long>  start {0};          // first event not cleared
+    short                   thread = 0;         // thread index
+};
+
+std::mutex                      _trace_mutex;   // guards the ring list and the interned names
+vector<_TraceRing*>             _trace_rings;   // rings of all threads (kept after the thread exits)
+std::unordered_map<string,int>  _trace_ids;     // interned names
+vector<string>                  _trace_names;   // names of the interned ids
+
+thread_local _TraceRing*                        _trace_ring = nullptr;  // ring of this thread
+thread_local std::unordered_map<string,int>*    _trace_local_ids = nullptr; // ids already looked up by this thread
+
+int trace_id(const string& name) {
+    if(not _trace_local_ids) _trace_local_ids = new std::unordered_map<string,int>();
+    auto local = _trace_local_ids->find(name);
+    if(local != _trace_local_ids->end()) return local->second;
+    std::lock_guard<std::mutex> lock(_trace_mutex);
+    auto it = _trace_ids.find(name);
+    auto id = 0;
+    if(it != _trace_ids.end()) id = it->second;
+    else {
+        id = _trace_names.size();
+        _trace_names.push_back(name);
+        _trace_ids.emplace(name, id);
+    }
+    _trace_local_ids->emplace(name, id);
+    return id;
+}
+
+string trace_name(int id) {
+    std::lock_guard<std::mutex> lock(_trace_mutex);
+    return (id >= 0 and id < _trace_names.size()) ? _trace_names[id] : string();
+}
+
+// ring of the calling thread, registered on first use
+inline _TraceRing* _thread_ring() {
+    if(_trace_ring) return _trace_ring;
+    auto ring = new _TraceRing();
+    std::lock_guard<std::mutex> lock(_trace_mutex);
+    ring->thread = _trace_rings.size();
+    _trace_rings.push_back(ring);
+    _trace_ring = ring;
+    return ring;
+}
+
+long long trace_now() {
+    return std::chrono::high_resolution_clock::now().time_since_epoch().count();
+}
+
+void trace_event(int name, TracePhase phase, long long value, TraceCategory category) {
+    if(not trace_enabled.load(std::memory_order_relaxed)) return;
+    trace_event_at(trace_now(), name, phase, value, category);
+}
+
+void trace_event_at(long long time, int name, TracePhase phase, long long value, TraceCategory category) {
+    if(not trace_enabled.load(std::memory_order_relaxed)) return;
+    auto ring = _thread_ring();
+    auto head = ring->head.load(std::memory_order_relaxed);
+    auto& event = ring->events[head & (trace_ring_size - 1)];
+    event.time = time;
+    event.value = value;
+    event.name = name;
+    event.thread = ring->thread;
+    event.phase = phase;
+    event.category = category;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+long long trace_edit_id() {
+    // the high 30 bits tell processes apart, the low 32 count the edits of this one
+    static const long long process = (long long)(std::random_device()() & 0x3fffffff) << 32;
+    static std::atomic<unsigned int> count(0);
+    return process | count.fetch_add(1);
+}
+
+vector<TraceEvent> trace_snapshot() {
+    auto rings = vector<_TraceRing*>();
+    {
+        std::lock_guard<std::mutex> lock(_trace_mutex);
+        rings = _trace_rings;
+    }
+    auto events = vector<TraceEvent>();
+    for(auto ring : rings) {
+        auto head = ring->head.load(std::memory_order_acquire);
+        auto first = std::max(ring->start.load(), head - trace_ring_size);
+        auto copied = events.size();
+        for(auto i = first; i < head; i ++) events.push_back(ring->events[i & (trace_ring_size - 1)]);
+        // drop the events the owner may have overwritten while they were copied, and the slot it may be writing
+        auto overwritten = ring->head.load(std::memory_order_acquire) - trace_ring_size + 1 - first;
+        if(overwritten > 0) events.erase(events.begin() + copied, events.begin() + copied + std::min(overwritten, head - first));
+    }
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.time < b.time; });
+    return events;
+}
+
+// writes s as a json string
+void _write_json_string(FILE* f, const string& s) {
+    fputc('"', f);
+    for(auto c : s) {
+        if(c == '"' or c == '\\') { fputc('\\', f); fputc(c, f); }
+        else if((unsigned char)c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+bool save_trace(const string& filename) {
+    return save_trace(filename, LLONG_MIN, LLONG_MAX);
+}
+
+bool save_trace(const string& filename, long long from, long long to) {
+    auto events = trace_snapshot();
+    events.erase(std::remove_if(events.begin(), events.end(), [from, to](const TraceEvent& event) {
+        return event.time < from or event.time > to; }), events.end());
+    auto names = vector<string>();
+    {
+        std::lock_guard<std::mutex> lock(_trace_mutex);
+        names = _trace_names;
+    }
+    auto f = fopen(filename.c_str(), "w");
+    if(not f) return false;
+    const char* categories[] = { "timing", "apply", "frame" };
+    auto pid = (int)getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for(auto i : range(events.size())) {
+        auto& event = events[i];
+        fprintf(f, "%s\n{\"name\":", i ? "," : "");
+        _write_json_string(f, names[event.name]);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+                categories[event.category], event.phase, event.time / 1000.0, pid, event.thread);
+        if(event.phase == trace_instant) fprintf(f, ",\"s\":\"t\"");
+        if(event.phase == trace_counter or event.value) fprintf(f, ",\"args\":{\"value\":%lld}", event.value);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
+
+map<string, long long> trace_timing_log(TraceCategory category) {
+    auto events = trace_snapshot();
+    auto names = vector<string>();
+    {
+        std::lock_guard<std::mutex> lock(_trace_mutex);
+        names = _trace_names;
+    }
+    auto log = map<string, long long>();
+    for(auto& event : events) {
+        if(event.category != category) continue;
+        auto& name = names[event.name];
+        if(event.phase == trace_begin) log[name + "[start]"] = event.time;
+        else if(event.phase == trace_end) log[name + "[end]"] = event.time;
+        else if(event.phase == trace_counter) log[name] = event.value;
+        else log[name] = event.time;
+    }
+    return log;
+}
+
+void clear_trace() {
+    std::lock_guard<std::mutex> lock(_trace_mutex);
+    for(auto ring : _trace_rings) ring->start.store(ring->head.load());
+}
@@ -0,0 +1,78 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "common.h"
+
+// Tracing: each thread records fixed-size events into its own ring buffer (one writer, no locks),
+// keeping the last trace_ring_size events; names are interned once into ids, so recording an event
+// is a clock read and a store. Spans are a begin and an end event. The rings are read, without
+// stopping the writers, to export a Chrome trace (chrome://tracing, Perfetto) or the timing logs.
+
+const int trace_ring_size = 1 << 16;    // events kept per thread (power of two)
+
+// trace categories (the timing logs save one each; frame marks the stages of the ui loop frames)
+enum TraceCategory : unsigned char { trace_timing = 0, trace_apply = 1, trace_frame = 2 };
+
+// kind of event, as the Chrome trace phase
+enum TracePhase : char { trace_begin = 'B', trace_end = 'E', trace_instant = 'i', trace_counter = 'C' };
+
+// event record (24 bytes)
+struct TraceEvent {
+    long long       time = 0;               // high_resolution_clock nanoseconds since epoch
+    long long       value = 0;              // payload (counter value, size, ...)
+    int             name = 0;               // interned name
+    short           thread = 0;             // thread index (order of the first event)
+    TracePhase      phase = trace_instant;  // begin, end, instant or counter
+    TraceCategory   category = trace_timing;// category
+};
+
+extern std::atomic<bool> trace_enabled;     // events are dropped when false
+
+// interned id of name (thread-safe); hot paths keep the id in a static
+int trace_id(const string& name);
+
+// name of an interned id
+string trace_name(int id);
+
+// current time of the trace clock (high_resolution_clock nanoseconds since epoch)
+long long trace_now();
+
+// records an event in the ring of the calling thread
+void trace_event(int name, TracePhase phase, long long value = 0, TraceCategory category = trace_timing);
+
+// records an event at time, given by trace_now here or in another process (as a timestamp received in a message)
+void trace_event_at(long long time, int name, TracePhase phase, long long value = 0, TraceCategory category = trace_timing);
+
+// new id of an edit followed across processes: random bits of the process and a counter (positive, 62 bits)
+long long trace_edit_id();
+
+// records a span from construction to destruction, so that early returns and exceptions close it
+struct TraceSpan {
+    int             name;
+    TraceCategory   category;
+    TraceSpan(int name, TraceCategory category = trace_timing) : name(name), category(category) { trace_event(name, trace_begin, 0, category); }
+    ~TraceSpan() { trace_event(name, trace_end, 0, category); }
+};
+
+// span of category over the rest of the enclosing scope, named by a string literal interned once
+#define _TRACE_CONCAT(a,b) a##b
+#define _TRACE_SCOPE(name,category,line) static const int _TRACE_CONCAT(_trace_id_,line) = trace_id(name); TraceSpan _TRACE_CONCAT(_trace_span_,line)(_TRACE_CONCAT(_trace_id_,line), category)
+#define trace_scope(name,category) _TRACE_SCOPE(name,category,__LINE__)
+
+// events currently in the rings of all threads, sorted by time
+vector<TraceEvent> trace_snapshot();
+
+// saves the events as Chrome trace json (timestamps in microseconds); returns false on failure
+bool save_trace(const string& filename);
+
+// saves the events with time in [from,to] as save_trace
+bool save_trace(const string& filename, long long from, long long to);
+
+// last time (value for counters) of each event of category, named as the old timing logs:
+// spans as name[start] and name[end]
+map<string, long long> trace_timing_log(TraceCategory category);
+
+// drops the recorded events
+void clear_trace();
+
+#endif
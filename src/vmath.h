@@ -772,5 +772,29 @@ inline range3f rscale(const range3f& a, float b) { return range3f(center(a)-size
 inline range3f make_range3f(std::initializer_list<vec3f> points) { auto bbox = range3f(); for(auto& p : points) bbox = runion(bbox,p); return bbox; }
 inline std::array<vec3f,8> corners(const range3f& a) { std::array<vec3f,8> ret; ret[0] = vec3f(a.min.x,a.min.y,a.min.z); ret[1] = vec3f(a.min.x,a.min.y,a.max.z); ret[2] = vec3f(a.min.x,a.max.y,a.min.z); ret[3] = vec3f(a.min.x,a.max.y,a.max.z); ret[4] = vec3f(a.max.x,a.min.y,a.min.z); ret[5] = vec3f(a.max.x,a.min.y,a.max.z); ret[6] = vec3f(a.max.x,a.max.y,a.min.z); ret[7] = vec3f(a.max.x,a.max.y,a.max.z); return ret; }
 
+// ray epsilon
+const float ray3f_epsilon = 0.0005f;
+
+// 3D Ray
+struct ray3f {
+    vec3f e;        // origin
+    vec3f d;        // direction
+    float tmin;     // min t value
+    float tmax;     // max t value
+
+    // Default constructor
+    ray3f() : e(zero3f), d(z3f), tmin(ray3f_epsilon), tmax(HUGE_VALF) { }
+    // Element-wise constructor
+    ray3f(const vec3f& e, const vec3f& d, float tmin = ray3f_epsilon, float tmax = HUGE_VALF) : e(e), d(d), tmin(tmin), tmax(tmax) { }
+
+    // Eval ray at a specific t
+    vec3f eval(float t) const { return e + d * t; }
+};
+
+// transform a ray by a frame
+inline ray3f transform_ray(const frame3f& f, const ray3f& v) { return ray3f(transform_point(f,v.e), transform_vector(f,v.d), v.tmin, v.tmax); }
+// transform a ray by a frame inverse
+inline ray3f transform_ray_inverse(const frame3f& f, const ray3f& v) { return ray3f(transform_point_inverse(f,v.e), transform_vector_inverse(f,v.d), v.tmin, v.tmax); }
+
 
 #endif
@@ -0,0 +1,358 @@
+#include "serialization.hpp"
+#include "id_reference.h"
+#include "obj_parser.h"
+#include "mesh_cache.h"
+#include "mesh_msg.hpp"
+#include "alloc_track.h"
+#include "common.h"
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <boost/filesystem.hpp>
+
+// benchmarks of the hot paths of editing sessions: MeshDiff construction, apply_mesh_change,
+// apply_change_reverse, mesh_msg encode/decode of meshes and diffs, load_json_scene and
+// load_obj_scene (parsing, and hits of the mesh cache).
+// Fixtures are the cube json scenes of the repo and synthetic quad grids from 1k faces up to -max_faces
+// (10M at most), written as obj files; the edit of every fixture moves 1% of its vertices and
+// replaces 0.1% of its faces, chosen with a fixed seed, so that runs are repeatable.
+// Each benchmark is warmed up once, then timed -reps times; a repetition runs the operation
+// enough times to last -min_time seconds (setup excluded) and records the time per operation.
+// Results can be saved as json and compared with a saved baseline: benchmarks slower by more
+// than -threshold (on the median) are reported and make the exit code 1.
+// With -alloc one more run of each operation (setup excluded) counts its allocations per subsystem
+// (see alloc_track.h): allocations, bytes and peak live bytes, saved with the results and compared
+// with the baseline as the times (on the allocations and bytes of all subsystems).
+// usage: bench [-r reps] [-f max_faces] [-n filter] [-a] [-j results.json] [-c baseline.json] [scenes_dir]
+
+using namespace std;
+
+double time_passed(long long from, long long to){
+    return (to - from) / (double)1000000000;
+}
+
+long long get_clock(){
+    std::chrono::high_resolution_clock::time_point time = std::chrono::high_resolution_clock::now();
+    return time.time_since_epoch().count();
+}
+
+// scene and edit data of a benchmark
+struct Fixture {
+    string      name;                   // fixture name
+    string      filename;               // file the scene is loaded from
+    bool        obj = false;            // whether filename is an obj
+    Scene*      scene = nullptr;        // loaded scene
+    Mesh*       mesh = nullptr;         // first mesh of the scene
+    Mesh*       edited = nullptr;       // mesh after the edit
+    MeshDiff*   diff = nullptr;         // differences from mesh to edited
+    int         faces = 0;              // faces of mesh
+};
+
+// statistics of a benchmark, times in seconds per operation
+struct BenchResult {
+    string  name;                       // benchmark name
+    string  fixture;                    // fixture name
+    int     items = 0;                  // faces of the fixture
+    int     reps = 0;                   // timed repetitions
+    int     iterations = 0;             // operations per repetition
+    double  min = 0;                    // fastest repetition
+    double  median = 0;                 // median repetition
+    double  mean = 0;                   // mean of the repetitions
+    double  stddev = 0;                 // standard deviation of the repetitions
+    vector<AllocStats> alloc;           // allocations of an operation by tag (peak over the live bytes before it), if counted
+};
+
+bool count_allocations = false;         // whether benchmarks count the allocations of an operation
+
+// runs setup (untimed) and run (timed) once per operation
+BenchResult bench(const string& name, const Fixture& fixture, int reps, double min_time,
+                  const function<void()>& setup, const function<void()>& run){
+    auto result = BenchResult();
+    result.name = name;
+    result.fixture = fixture.name;
+    result.items = fixture.faces;
+    result.reps = reps;
+    auto timed = [&](int iterations){
+        auto elapsed = 0ll;
+        for (auto i = 0; i < iterations; i ++){
+            setup();
+            auto from = get_clock();
+            run();
+            elapsed += get_clock() - from;
+        }
+        return elapsed / 1e9 / iterations;
+    };
+    // the warm up picks the operations per repetition
+    auto warmup = timed(1);
+    result.iterations = max(1, min(1000, (int)ceil(min_time / max(warmup, 1e-9))));
+    auto times = vector<double>();
+    for (auto r = 0; r < reps; r ++) times.push_back(timed(result.iterations));
+    sort(times.begin(), times.end());
+    result.min = times.front();
+    result.median = (reps % 2) ? times[reps/2] : (times[reps/2-1] + times[reps/2]) / 2;
+    for (auto t : times) result.mean += t / reps;
+    for (auto t : times) result.stddev += (t - result.mean) * (t - result.mean) / reps;
+    result.stddev = sqrt(result.stddev);
+    message("%-24s %-16s %10d %12.6f %12.6f %8.2f%% %12.2f\n", name.c_str(), fixture.name.c_str(), fixture.faces,
+            result.min * 1e3, result.median * 1e3, 100 * result.stddev / result.mean, fixture.faces / result.median / 1e6);
+    if (count_allocations){
+        setup();
+        alloc_reset();
+        auto live = vector<long long>();
+        for (auto tag : range(alloc_tag_count)) live.push_back(alloc_stats((AllocTag)tag).live);
+        alloc_track_enabled = true;
+        run();
+        alloc_track_enabled = false;
+        auto line = string();
+        for (auto tag : range(alloc_tag_count)){
+            auto stats = alloc_stats((AllocTag)tag);
+            stats.peak -= live[tag];
+            result.alloc.push_back(stats);
+            if (stats.allocations) line += tostring(" %s %lld (%.1f KB, peak %.1f KB)", alloc_tag_name((AllocTag)tag),
+                                                    stats.allocations, stats.bytes / 1024.0, stats.peak / 1024.0);
+        }
+        message("%24s%s\n", "alloc:", line.empty() ? " none" : line.c_str());
+    }
+    return result;
+}
+
+// writes a square grid of about faces quads as an obj mesh
+void save_grid_obj(const string& filename, int faces){
+    auto side = max(1, (int)round(sqrt((double)faces)));
+    auto f = fopen(filename.c_str(), "w");
+    error_if_not(f, "cannot write %s\n", filename.c_str());
+    fprintf(f, "o 1\n");
+    for (auto j : range(side+1))
+        for (auto i : range(side+1))
+            fprintf(f, "v %g %g %g\n", i / (float)side, 0.01f * sin(i * 0.5f) * cos(j * 0.5f), j / (float)side);
+    for (auto j : range(side))
+        for (auto i : range(side)){
+            auto v = j * (side+1) + i + 1;
+            fprintf(f, "f %d %d %d %d\n", v, v + side + 1, v + side + 2, v + 1);
+        }
+    fclose(f);
+}
+
+// edit of mesh: 1% of the vertices moved, 0.1% of the faces replaced by new ones on the same vertices
+Mesh* make_edit(Mesh* mesh){
+    auto edited = new Mesh(*mesh);
+    edited->_version = mesh->_version + 1;
+    auto rng = minstd_rand(0);
+    auto bbox = range3f();
+    for (auto& p : mesh->pos) bbox = runion(bbox, p);
+    auto offset = length(size(bbox)) * 0.01f;
+    for (auto& v : edited->vertices)
+        if (rng() % 100 == 0) edited->pos[v.second.first] += vec3f(0, offset, 0);
+    auto next_id = timestamp_t(1);
+    for (auto& f : mesh->triangle) next_id = max(next_id, f.first + 1);
+    for (auto& f : mesh->quad) next_id = max(next_id, f.first + 1);
+    auto replaced = vector<timestamp_t>();
+    for (auto& f : mesh->quad) if (rng() % 1000 == 0) replaced.push_back(f.first);
+    for (auto id : replaced){
+        auto face = edited->quad[id];
+        edited->quad.erase(id);
+        auto& ids = get<1>(face);
+        edited->quad.emplace(next_id++, make_tuple(-1, vec4id(ids.second, ids.third, ids.fourth, ids.first), get<2>(face)));
+    }
+    replaced.clear();
+    for (auto& f : mesh->triangle) if (rng() % 1000 == 0) replaced.push_back(f.first);
+    for (auto id : replaced){
+        auto face = edited->triangle[id];
+        edited->triangle.erase(id);
+        auto& ids = get<1>(face);
+        edited->triangle.emplace(next_id++, make_tuple(-1, vec3id(ids.second, ids.third, ids.first), get<2>(face)));
+    }
+    return edited;
+}
+
+Scene* load_fixture_scene(const Fixture& fixture){
+    return fixture.obj ? load_obj_scene(fixture.filename) : load_json_scene(fixture.filename);
+}
+
+// releases the mesh data of a loaded scene, the bulk of its memory (the scene is not deleted,
+// since the references of its ids_map would delete its objects more than once)
+void release_scene(Scene* scene){
+    for (auto mesh : scene->meshes){
+        mesh->vertices.clear();
+        mesh->triangle.clear();
+        mesh->quad.clear();
+        mesh->edge.clear();
+        vector<vec3f>().swap(mesh->pos);
+        vector<vec3f>().swap(mesh->norm);
+        vector<timestamp_t>().swap(mesh->normal_ids);
+        vector<vec2f>().swap(mesh->texcoord);
+        vector<vec3i>().swap(mesh->triangle_index);
+        vector<vec4i>().swap(mesh->quad_index);
+        vector<vec2i>().swap(mesh->edge_index);
+    }
+}
+
+bool load_fixture(Fixture& fixture){
+    mesh_cache_enabled = false;
+    fixture.scene = load_fixture_scene(fixture);
+    if (fixture.scene->meshes.empty()) return false;
+    fixture.mesh = fixture.scene->meshes[0];
+    fixture.faces = fixture.mesh->triangle.size() + fixture.mesh->quad.size();
+    fixture.edited = make_edit(fixture.mesh);
+    fixture.diff = new MeshDiff(fixture.mesh, fixture.edited);
+    return true;
+}
+
+// times all benchmarks on fixture
+void bench_fixture(Fixture& fixture, int reps, double min_time, const string& filter, vector<BenchResult>& results){
+    auto add = [&](const string& name, const function<void()>& setup, const function<void()>& run){
+        if (name.find(filter) != string::npos) results.push_back(bench(name, fixture, reps, min_time, setup, run));
+    };
+    auto none = [](){};
+    auto work = new Mesh(*fixture.mesh);
+    auto scene = new Scene();
+    scene->meshes.push_back(work);
+    // a fresh copy of the fixture mesh (the copy owns its material)
+    auto reset_work = [&](){
+        delete work->mat;
+        delete work;
+        work = new Mesh(*fixture.mesh);
+        scene->meshes[0] = work;
+    };
+
+    add("meshdiff", none, [&](){ delete new MeshDiff(fixture.mesh, fixture.edited); });
+    add("apply_mesh_change", reset_work, [&](){ apply_mesh_change(work, fixture.diff, 0); });
+    auto scenediff = new SceneDiff();
+    scenediff->meshes.push_back(fixture.diff);
+    add("apply_change_reverse", reset_work, [&](){ apply_change_reverse(scene, scenediff, 0); });
+
+    auto diff_msg = mesh_msg(fixture.diff);
+    add("msg_encode_meshdiff", none, [&](){ mesh_msg(fixture.diff); });
+    add("msg_decode_meshdiff", none, [&](){ delete diff_msg.as_meshdiff(); });
+    auto mesh_msg_ = mesh_msg(fixture.mesh);
+    add("msg_encode_mesh", none, [&](){ mesh_msg(fixture.mesh); });
+    add("msg_decode_mesh", none, [&](){ delete mesh_msg_.as_mesh(); });
+
+    auto load = fixture.obj ? string("load_obj_scene") : string("load_json_scene");
+    add(load, [](){ mesh_cache_enabled = false; }, [&](){ release_scene(load_fixture_scene(fixture)); });
+    mesh_cache_enabled = true;
+    release_scene(load_fixture_scene(fixture));  // fill the cache entry
+    add(load + "_cached", [](){ mesh_cache_enabled = true; }, [&](){ release_scene(load_fixture_scene(fixture)); });
+    mesh_cache_enabled = false;
+}
+
+void save_results(const string& filename, const vector<BenchResult>& results){
+    auto f = fopen(filename.c_str(), "w");
+    error_if_not(f, "cannot write %s\n", filename.c_str());
+    fprintf(f, "{\"threads\":%d,\"benchmarks\":[", parallel_threads());
+    for (auto i : range(results.size())){
+        auto& r = results[i];
+        fprintf(f, "%s\n{\"name\":\"%s\",\"fixture\":\"%s\",\"items\":%d,\"reps\":%d,\"iterations\":%d,"
+                "\"min\":%.9e,\"median\":%.9e,\"mean\":%.9e,\"stddev\":%.9e", i ? "," : "",
+                r.name.c_str(), r.fixture.c_str(), r.items, r.reps, r.iterations, r.min, r.median, r.mean, r.stddev);
+        if (not r.alloc.empty()){
+            fprintf(f, ",\"alloc\":{");
+            for (auto tag : range(r.alloc.size()))
+                fprintf(f, "%s\"%s\":{\"allocations\":%lld,\"bytes\":%lld,\"peak\":%lld}", tag ? "," : "",
+                        alloc_tag_name((AllocTag)tag), r.alloc[tag].allocations, r.alloc[tag].bytes, r.alloc[tag].peak);
+            fprintf(f, "}");
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+// compares the medians with the baseline; returns the number of regressions
+int compare_results(const string& filename, const vector<BenchResult>& results, double threshold){
+    auto json = load_json(filename);
+    auto baseline = map<string, double>();
+    auto baseline_alloc = map<string, pair<long long,long long>>();    // allocations and bytes of all tags
+    for (auto& b : json.object_element("benchmarks").as_array_ref()){
+        auto median = b.object_element("median");
+        auto key = b.object_element("name").as_string() + "/" + b.object_element("fixture").as_string();
+        baseline[key] = median.is_id() ? (double)median.as_id() : median.as_double();
+        if (not b.object_contains("alloc")) continue;
+        auto& totals = baseline_alloc[key];
+        for (auto& tag : b.object_element("alloc").as_object_ref()){
+            totals.first += tag.second.object_element("allocations").as_id();
+            totals.second += tag.second.object_element("bytes").as_id();
+        }
+    }
+    message("\ncompared with <%s> (threshold %.0f%%):\n", filename.c_str(), threshold * 100);
+    auto regressions = 0;
+    for (auto& r : results){
+        auto key = r.name + "/" + r.fixture;
+        if (not baseline.count(key)) { message("%-42s %12s\n", key.c_str(), "new"); continue; }
+        auto ratio = r.median / baseline[key];
+        auto verdict = "";
+        if (ratio > 1 + threshold) { verdict = "slower"; regressions ++; }
+        else if (ratio < 1 / (1 + threshold)) verdict = "faster";
+        message("%-42s %12.6f -> %12.6f ms %7.2fx %s\n", key.c_str(), baseline[key] * 1e3, r.median * 1e3, ratio, verdict);
+        if (r.alloc.empty() or not baseline_alloc.count(key)) continue;
+        auto allocations = 0ll, bytes = 0ll;
+        for (auto& stats : r.alloc) { allocations += stats.allocations; bytes += stats.bytes; }
+        auto& old = baseline_alloc[key];
+        auto more = (allocations > old.first * (1 + threshold)) or (bytes > old.second * (1 + threshold));
+        if (more) regressions ++;
+        message("%-42s %12lld -> %12lld allocs, %lld -> %lld bytes %s\n", "", old.first, allocations, old.second, bytes,
+                more ? "more" : "");
+    }
+    message("%d regressions\n", regressions);
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+                              { "bench", "benchmark diff, apply, serialization and parsing",
+                                  {  {"reps", "r", "timed repetitions", typeid(int), true, jsonvalue(10) },
+                                     {"max_faces", "f", "faces of the largest synthetic grid (up to 10M)", typeid(int), true, jsonvalue(1000000) },
+                                     {"min_time", "t", "minimum seconds of a repetition", typeid(double), true, jsonvalue(0.01) },
+                                     {"filter", "n", "run only benchmarks whose name contains this", typeid(string), true, jsonvalue("") },
+                                     {"json", "j", "save results as json", typeid(string), true, jsonvalue("") },
+                                     {"compare", "c", "compare with results saved as json", typeid(string), true, jsonvalue("") },
+                                     {"alloc", "a", "count the allocations of an operation", typeid(bool), true, jsonvalue(false) },
+                                     {"threshold", "x", "regression threshold on the median (fraction)", typeid(double), true, jsonvalue(0.1) }  },
+                                  {  {"scenes_dir", "", "directory of the json scenes", typeid(string), true, jsonvalue("../scenes/")}  }
+                              });
+    auto reps = max(1, args.object_element("reps").as_int());
+    auto max_faces = min(10000000, args.object_element("max_faces").as_int());
+    auto min_time = args.object_element("min_time").as_double();
+    auto filter = args.object_element("filter").as_string();
+    count_allocations = args.object_element("alloc").as_bool();
+    auto scenes_dir = args.object_element("scenes_dir").as_string();
+    if (scenes_dir.back() != '/') scenes_dir += "/";
+
+    auto fixtures = vector<Fixture>();
+    for (auto name : { "cube_red", "cube_green", "cube_blue" }){
+        auto fixture = Fixture();
+        fixture.name = name;
+        fixture.filename = scenes_dir + name + ".json";
+        if (boost::filesystem::exists(fixture.filename)) fixtures.push_back(fixture);
+        else message("skipping missing scene <%s>\n", fixture.filename.c_str());
+    }
+    auto grid_dir = (boost::filesystem::temp_directory_path() / "dist_scene_bench").string() + "/";
+    boost::filesystem::create_directories(grid_dir);
+    for (auto faces = 1000; faces <= max_faces; faces *= 10){
+        auto fixture = Fixture();
+        fixture.name = "grid_" + ((faces < 1000000) ? to_string(faces / 1000) + "k" : to_string(faces / 1000000) + "M");
+        fixture.filename = grid_dir + fixture.name + ".obj";
+        fixture.obj = true;
+        if (not boost::filesystem::exists(fixture.filename)) save_grid_obj(fixture.filename, faces);
+        fixtures.push_back(fixture);
+    }
+
+    message("threads: %d - reps: %d - min time: %gs\n", parallel_threads(), reps, min_time);
+    message("%-24s %-16s %10s %12s %12s %9s %12s\n", "benchmark", "fixture", "faces", "min (ms)", "median (ms)", "stddev", "Mfaces/s");
+    auto results = vector<BenchResult>();
+    for (auto& fixture : fixtures){
+        if (not load_fixture(fixture)) { message("skipping <%s>: no meshes\n", fixture.filename.c_str()); continue; }
+        bench_fixture(fixture, reps, min_time, filter, results);
+    }
+
+    if (args.object_element("json").as_string() != "") {
+        save_results(args.object_element("json").as_string(), results);
+        message("saved <%s>\n", args.object_element("json").as_string().c_str());
+    }
+    if (args.object_element("compare").as_string() != "")
+        return compare_results(args.object_element("compare").as_string(), results, args.object_element("threshold").as_double()) ? 1 : 0;
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "serialization.hpp"
+#include "id_reference.h"
+#include "obj_parser.h"
+#include "intersect.h"
+#include "common.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+
+// times the bvh of the first mesh of a scene: build, refit after a local edit applied as a
+// MeshDiff, and random ray queries; a sample of the queries is checked against brute force
+// usage: bvh_bench [scene.json|mesh.obj] [rays]
+
+using namespace std;
+
+double time_passed(long long from, long long to){
+    return (to - from) / (double)1000000000;
+}
+
+long long get_clock(){
+    std::chrono::high_resolution_clock::time_point time = std::chrono::high_resolution_clock::now();
+    return time.time_since_epoch().count();
+}
+
+// closest hit testing every face
+bool intersect_brute_force(Mesh* mesh, const ray3f& world_ray, float& t){
+    auto ray = transform_ray_inverse(mesh->frame, world_ray);
+    auto hit = false;
+    t = ray.tmax;
+    auto test = [&](const vec3f& v0, const vec3f& v1, const vec3f& v2){
+        auto e1 = v1 - v0, e2 = v2 - v0, p = cross(ray.d, e2);
+        auto det = dot(e1, p);
+        if (det == 0) return;
+        auto s = ray.e - v0, q = cross(s, e1);
+        auto u = dot(s, p) / det, v = dot(ray.d, q) / det, tt = dot(e2, q) / det;
+        if (u < 0 or v < 0 or u + v > 1 or tt < ray.tmin or tt > t) return;
+        t = tt;
+        hit = true;
+    };
+    for (auto& f : mesh->triangle){
+        auto& v = mesh->triangle_index[get<0>(f.second)];
+        test(mesh->pos[v.x], mesh->pos[v.y], mesh->pos[v.z]);
+    }
+    for (auto& f : mesh->quad){
+        auto& v = mesh->quad_index[get<0>(f.second)];
+        test(mesh->pos[v.x], mesh->pos[v.y], mesh->pos[v.z]);
+        test(mesh->pos[v.x], mesh->pos[v.z], mesh->pos[v.w]);
+    }
+    return hit;
+}
+
+// rays from a sphere around the mesh towards random points of its bounding box
+vector<ray3f> random_rays(Mesh* mesh, int count, minstd_rand& rng){
+    auto bbox = range3f();
+    for (auto& v : mesh->vertices) bbox = runion(bbox, transform_point(mesh->frame, mesh->pos[v.second.first]));
+    auto c = center(bbox);
+    auto r = length(size(bbox));
+    auto uniform = uniform_real_distribution<float>(0, 1);
+    auto rays = vector<ray3f>();
+    for (auto n = 0; n < count; n ++){
+        auto target = bbox.min + size(bbox) * vec3f(uniform(rng), uniform(rng), uniform(rng));
+        auto dir = normalize(vec3f(uniform(rng)-0.5f, uniform(rng)-0.5f, uniform(rng)-0.5f));
+        rays.push_back(ray3f(c + dir * r, normalize(target - (c + dir * r))));
+    }
+    return rays;
+}
+
+// traces rays in parallel, returns the number of hits
+int trace(Mesh* mesh, const vector<ray3f>& rays, vector<float>& ts){
+    ts.assign(rays.size(), -1);
+    parallel_for(rays.size(), [&](int i){
+        auto intersection = intersection3f();
+        if (intersect_mesh(mesh, rays[i], intersection)) ts[i] = intersection.ray_t;
+    }, 256);
+    auto hits = 0;
+    for (auto t : ts) if (t >= 0) hits++;
+    return hits;
+}
+
+// compares a sample of the traced rays with brute force
+void check(Mesh* mesh, const vector<ray3f>& rays, const vector<float>& ts, int samples){
+    auto count = min((int)rays.size(), samples);
+    auto mismatch = vector<int>(count, 0);
+    parallel_for(count, [&](int i){
+        auto t = 0.0f;
+        auto hit = intersect_brute_force(mesh, rays[i], t);
+        mismatch[i] = hit != (ts[i] >= 0) or (hit and fabs(t - ts[i]) > 1e-4f * max(1.0f, t));
+    });
+    auto errors = 0;
+    for (auto m : mismatch) errors += m;
+    message("\tchecked %d rays against brute force: %d mismatches\n", count, errors);
+}
+
+int main(int argc, char** argv) {
+    auto filename = string((argc > 1) ? argv[1] : "../scenes/fat_v0.obj");
+    auto nrays = (argc > 2) ? atoi(argv[2]) : 1000000;
+    message("threads: %d - leaf size: %d - rebuild threshold: %g\n", parallel_threads(), bvh_leaf_size, bvh_rebuild_threshold);
+    message("parsing <%s>...\n", filename.c_str());
+    auto scene = (filename.substr(filename.size()-4) == ".obj") ? load_obj_scene(filename) : load_json_scene(filename);
+    error_if_not(not scene->meshes.empty(), "no meshes in %s\n", filename.c_str());
+    auto mesh = scene->meshes[0];
+    message("%d vertices, %d triangles, %d quads\n", mesh->vertices.size(), mesh->triangle.size(), mesh->quad.size());
+    
+    auto rng = minstd_rand(0);
+    auto rays = random_rays(mesh, nrays, rng);
+    auto ts = vector<float>();
+    
+    auto from = get_clock();
+    make_bvh(mesh);
+    auto to = get_clock();
+    message("\nbuild %.4fs - %d nodes - sah cost %.2f\n", time_passed(from, to), mesh->bvh->nodes.size(), mesh->bvh->build_cost);
+    
+    from = get_clock();
+    auto hits = trace(mesh, rays, ts);
+    to = get_clock();
+    message("trace %.4fs - %.2f Mrays/s - %d hits\n", time_passed(from, to), rays.size() / time_passed(from, to) / 1e6, hits);
+    check(mesh, rays, ts, 200);
+    
+    // local edit: push the vertices closest to a random one along a random direction
+    auto ids = vector<timestamp_t>();
+    for (auto& v : mesh->vertices) ids.push_back(v.first);
+    auto center_pos = mesh->pos[mesh->vertices[ids[rng() % ids.size()]].first];
+    sort(ids.begin(), ids.end(), [&](timestamp_t a, timestamp_t b){
+        return dist(mesh->pos[mesh->vertices[a].first], center_pos) < dist(mesh->pos[mesh->vertices[b].first], center_pos);
+    });
+    auto r = length(size(mesh->bvh->nodes[0].bbox));
+    for (auto edited : { 100, 1000, 10000 }){
+        auto meshdiff = new MeshDiff();
+        meshdiff->_id_ = mesh->_id_;
+        meshdiff->_version = mesh->_version + 1;
+        for (auto i = 0; i < edited and i < ids.size(); i++)
+            meshdiff->update_vertex[ids[i]] = mesh->pos[mesh->vertices[ids[i]].first] + vec3f(0, r * 0.01f, 0);
+        auto build_cost = mesh->bvh->build_cost;
+        from = get_clock();
+        apply_mesh_change(mesh, meshdiff, 0);
+        to = get_clock();
+        auto rebuilt = mesh->bvh->build_cost != build_cost;
+        message("\nedit %d vertices: apply_mesh_change with refit %.4fs%s\n", meshdiff->update_vertex.size(), time_passed(from, to), rebuilt ? " (rebuilt)" : "");
+        trace(mesh, rays, ts);
+        check(mesh, rays, ts, 200);
+        delete meshdiff;
+    }
+    
+    from = get_clock();
+    make_bvh(mesh);
+    to = get_clock();
+    message("\nrebuild %.4fs\n", time_passed(from, to));
+    return 0;
+}
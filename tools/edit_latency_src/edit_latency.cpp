@@ -0,0 +1,146 @@
+#include "json.h"
+#include "common.h"
+#include <iostream>
+#include <cmath>
+#include <climits>
+
+// per-edit latency from the Chrome traces of a session (../log/*_trace_v*.json of the server and
+// the clients): the edit.* events, valued with the edit id carried in the mesh_msg trace extension,
+// are joined across processes and each (edit, receiver) pair is broken down into stages.
+// The clock offset of each client to the server is estimated from the one-way delays of the
+// messages in both directions (edit.upstream_sent to edit.recv), assuming equal minimum delays;
+// with messages in one direction only the minimum delay is taken as zero.
+// usage: edit_latency server_trace.json client_trace.json [client_trace.json ...]
+
+using namespace std;
+
+// edit.* events of a process: name -> edit id -> time (ns, the last one if repeated)
+struct ProcessTrace {
+    string                                  filename;
+    map<string, map<long long, long long>>  events;
+    long long                               offset = 0;     // clock of this process - clock of the server
+
+    bool has(const string& name, long long id) const {
+        auto it = events.find(name);
+        return it != events.end() and it->second.count(id);
+    }
+    long long at(const string& name, long long id) const { return events.at(name).at(id); }
+};
+
+// stages of an edit, in order (the last spans all of them)
+const vector<string> stages = { "serialize", "send", "server fan-out", "to receiver", "deserialize", "apply", "first frame", "total" };
+
+ProcessTrace load_trace(const string& filename){
+    auto trace = ProcessTrace();
+    trace.filename = filename;
+    auto json = load_json(filename);
+    for (auto& event : json.object_element("traceEvents").as_array_ref()){
+        auto name = event.object_element("name").as_string();
+        if (name.compare(0, 5, "edit.") or not event.object_contains("args")) continue;
+        auto& ts = event.object_element("ts");
+        auto time = ts.is_id() ? (long long)ts.as_id() * 1000 : llround(ts.as_double() * 1000);
+        auto id = (long long)event.object_element("args").object_element("value").as_id();
+        auto& times = trace.events[name];
+        times[id] = times.count(id) ? max(times[id], time) : time;
+    }
+    return trace;
+}
+
+// minimum one-way delay (receiver clock - sender clock) of the messages received by receiver,
+// only of the edits made by sender_filter if given
+long long min_delay(const ProcessTrace& receiver, const ProcessTrace* sender_filter){
+    auto delay = LLONG_MAX;
+    if (not receiver.events.count("edit.recv") or not receiver.events.count("edit.upstream_sent")) return delay;
+    for (auto& recv : receiver.events.at("edit.recv")){
+        if (not receiver.has("edit.upstream_sent", recv.first)) continue;
+        if (sender_filter and not sender_filter->has("edit.origin", recv.first)) continue;
+        delay = min(delay, recv.second - receiver.at("edit.upstream_sent", recv.first));
+    }
+    return delay;
+}
+
+// estimates the clock offset of client to server
+long long clock_offset(const ProcessTrace& client, const ProcessTrace& server){
+    auto to_server = min_delay(server, &client);        // delay - offset
+    auto from_server = min_delay(client, nullptr);      // delay + offset
+    if (to_server != LLONG_MAX and from_server != LLONG_MAX) return (from_server - to_server) / 2;
+    if (to_server != LLONG_MAX) return -to_server;
+    if (from_server != LLONG_MAX) return from_server;
+    return 0;
+}
+
+// value at fraction p of sorted samples (nearest rank)
+double percentile(const vector<double>& sorted, double p){
+    if (sorted.empty()) return 0;
+    auto rank = (int)ceil(p * sorted.size()) - 1;
+    return sorted[max(0, min(rank, (int)sorted.size() - 1))];
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3){
+        message("usage: edit_latency server_trace.json client_trace.json [client_trace.json ...]\n");
+        return 1;
+    }
+
+    // the server is the process relaying edits
+    auto traces = vector<ProcessTrace>();
+    for (auto i : range(1, argc)) traces.push_back(load_trace(argv[i]));
+    auto server = -1;
+    for (auto i : range(traces.size())){
+        if (not traces[i].events.count("edit.server_sent")) continue;
+        error_if_not(server < 0, "more than one server trace: %s and %s\n", traces[server].filename.c_str(), traces[i].filename.c_str());
+        server = i;
+    }
+    error_if_not(server >= 0, "no server trace (no edit.server_sent events)\n");
+    auto& s = traces[server];
+
+    message("clock offsets to the server (%s):\n", s.filename.c_str());
+    for (auto i : range(traces.size())){
+        if (i == server) continue;
+        traces[i].offset = clock_offset(traces[i], s);
+        message("\t%s: %+.3f ms\n", traces[i].filename.c_str(), traces[i].offset / 1e6);
+    }
+
+    // stage durations in ms of each (edit, receiver), times moved to the server clock
+    auto samples = vector<vector<double>>(stages.size());
+    auto edits = 0, incomplete = 0;
+    for (auto& sender : traces){
+        if (&sender == &s or not sender.events.count("edit.origin")) continue;
+        for (auto& origin : sender.events.at("edit.origin")){
+            auto id = origin.first;
+            edits ++;
+            if (not sender.has("edit.serialized", id) or not s.has("edit.recv", id)){ incomplete ++; continue; }
+            auto serialized = sender.at("edit.serialized", id) - sender.offset;
+            auto server_recv = s.at("edit.recv", id);
+            for (auto& receiver : traces){
+                if (&receiver == &s or &receiver == &sender or not receiver.has("edit.recv", id)) continue;
+                auto complete = true;
+                for (auto name : { "edit.upstream_sent", "edit.deserialized", "edit.applied", "edit.shown" })
+                    complete = complete and receiver.has(name, id);
+                if (not complete){ incomplete ++; continue; }
+                auto times = vector<long long>{
+                    origin.second - sender.offset, serialized, server_recv,
+                    receiver.at("edit.upstream_sent", id),
+                    receiver.at("edit.recv", id) - receiver.offset,
+                    receiver.at("edit.deserialized", id) - receiver.offset,
+                    receiver.at("edit.applied", id) - receiver.offset,
+                    receiver.at("edit.shown", id) - receiver.offset };
+                for (auto k : range(times.size() - 1)) samples[k].push_back((times[k+1] - times[k]) / 1e6);
+                samples.back().push_back((times.back() - times.front()) / 1e6);
+            }
+        }
+    }
+
+    message("%d edits, %d deliveries, %d incomplete\n", edits, (int)samples[0].size(), incomplete);
+    message("%-16s %12s %12s %12s %12s\n", "stage (ms)", "mean", "p50", "p99", "max");
+    for (auto k : range(stages.size())){
+        auto& values = samples[k];
+        sort(values.begin(), values.end());
+        auto mean = 0.0;
+        for (auto v : values) mean += v;
+        if (not values.empty()) mean /= values.size();
+        message("%-16s %12.3f %12.3f %12.3f %12.3f\n", stages[k].c_str(), mean, percentile(values, 0.5), percentile(values, 0.99),
+                values.empty() ? 0.0 : values.back());
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include "serialization.hpp"
+#include "id_reference.h"
+#include "mesh_msg.hpp"
+#include "event_log.h"
+#include "common.h"
+#include <iostream>
+#include <cmath>
+#include <ctime>
+
+// reads the event log of a server (see event_log.h): checks the records of its segments, lists
+// them with -list and summarizes them by type (records, bytes, messages recorded without their
+// bytes, server starts). With -scene the recorded edits between -from and -to (sequences) are
+// replayed on the scene as the server applied them, timing the decoding and applying of each;
+// the times are reported as p50/p99/max in ms by type, so that recorded sessions can be used as
+// benchmarks. Restores are replayed only when the version they restore was replayed too.
+// usage: event_replay [-l] [-s scene.json] [-f from] [-t to] [log_dir]
+
+using namespace std;
+
+// records and times of a type of event
+struct TypeStats {
+    long long           records = 0;
+    long long           bytes = 0;          // bytes of the messages
+    long long           omitted = 0;        // messages recorded without their bytes
+    long long           replayed = 0;
+    vector<long long>   decode;             // ns
+    vector<long long>   apply;              // ns
+};
+
+long long get_clock(){
+    std::chrono::high_resolution_clock::time_point time = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+// wall clock time of a record as text
+string format_time(long long time){
+    auto seconds = (time_t)(time / 1000000000);
+    char text[64];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+    return tostring("%s.%03lld", text, (time / 1000000) % 1000);
+}
+
+// value at fraction p of sorted values (nearest rank), in ms
+double percentile_ms(const vector<long long>& sorted, double p){
+    if (sorted.empty()) return 0;
+    auto rank = (int)ceil(p * sorted.size()) - 1;
+    return sorted[max(0, min(rank, (int)sorted.size() - 1))] / 1e6;
+}
+
+// message of the bytes of a record
+void load_message(mesh_msg& msg, const EventRecord& record, const char* payload){
+    memcpy(msg[0], payload, mesh_msg::header_length + mesh_msg::type_length);
+    error_if_not(msg.decode_header(), "invalid message in record %lld\n", (long long)record.sequence);
+    error_if_not(mesh_msg::header_length + mesh_msg::type_length + msg.body_length() == record.message_length,
+                 "wrong message length in record %lld\n", (long long)record.sequence);
+    memcpy(msg[mesh_msg::header_length + mesh_msg::type_length], payload + mesh_msg::header_length + mesh_msg::type_length, msg.body_length());
+}
+
+// replays the message of a record on scene as the server applied it; false if its type is not replayed
+bool replay(Scene* scene, const EventRecord& record, const char* payload, set<long long>& versions, TypeStats& stats){
+    if (record.message_length < mesh_msg::header_length + mesh_msg::type_length) return false;
+    auto msg = mesh_msg();
+    load_message(msg, record, payload);
+    auto decode_start = get_clock();
+    switch (record.type) {
+        case mesh_msg::Operation_type:
+        {
+            auto tokens = msg.as_message();
+            if (tokens.empty() or tokens[0] != "restore_version" or not versions.count(record.version)) return false;
+            stats.decode.push_back(get_clock() - decode_start);
+            auto apply_start = get_clock();
+            restore_to_version(scene, record.version);
+            stats.apply.push_back(get_clock() - apply_start);
+        }
+            break;
+        case mesh_msg::Mesh_type:
+        {
+            auto mesh = msg.as_mesh();
+            stats.decode.push_back(get_clock() - decode_start);
+            auto apply_start = get_clock();
+            swap_mesh(mesh, scene, true);
+            stats.apply.push_back(get_clock() - apply_start);
+        }
+            break;
+        case mesh_msg::SceneDiff_type:
+        {
+            auto scenediff = msg.as_scenediff();
+            stats.decode.push_back(get_clock() - decode_start);
+            auto apply_start = get_clock();
+            apply_change_reverse(scene, scenediff, scenediff->_label);
+            stats.apply.push_back(get_clock() - apply_start);
+        }
+            break;
+        case mesh_msg::MeshDiff_type:
+        {
+            auto meshdiff = msg.as_meshdiff();
+            stats.decode.push_back(get_clock() - decode_start);
+            auto apply_start = get_clock();
+            apply_mesh_change(scene->meshes[0], meshdiff, record.version);
+            stats.apply.push_back(get_clock() - apply_start);
+        }
+            break;
+        default:
+            return false;
+    }
+    versions.insert(record.version);
+    stats.replayed ++;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+                              { "event_replay", "check, list and replay the event log of a server",
+                                  {  {"list", "l", "list the records", typeid(bool), true, jsonvalue(false) },
+                                     {"scene", "s", "scene to replay the edits on", typeid(string), true, jsonvalue("") },
+                                     {"from", "f", "first record replayed", typeid(int), true, jsonvalue(0) },
+                                     {"to", "t", "last record replayed (0 for all)", typeid(int), true, jsonvalue(0) }  },
+                                  {  {"log_dir", "", "directory of the event log", typeid(string), true, jsonvalue("../log/events")}  }
+                              });
+    auto list = args.object_element("list").as_bool();
+    auto scene_filename = args.object_element("scene").as_string();
+    auto from = (long long)args.object_element("from").as_int();
+    auto to = (long long)args.object_element("to").as_int();
+    auto log_dir = args.object_element("log_dir").as_string();
+
+    auto scene = (Scene*)nullptr;
+    if (scene_filename != "") scene = load_json_scene(scene_filename);
+
+    auto stats = map<int,TypeStats>();
+    auto versions = set<long long>();
+    auto first_time = 0ll, last_time = 0ll, skipped = 0ll;
+    if (list) message("%8s %-23s %-12s %8s %20s %20s %s\n", "record", "time", "type", "bytes", "version", "edit", "segment:offset");
+    auto records = read_event_log(log_dir, [&](const EventRecord& record, const char* payload, int segment, long long offset){
+        if (not first_time) first_time = record.time;
+        last_time = record.time;
+        auto& type = stats[record.type];
+        type.records ++;
+        type.bytes += record.message_length;
+        if (record.flags & event_omitted) type.omitted ++;
+        if (list) message("%8lld %-23s %-12s %8u %20lld %20lld %d:%lld%s\n", (long long)record.sequence, format_time(record.time).c_str(),
+                          event_type_name(record.type), record.message_length, (long long)record.version, (long long)record.edit_id,
+                          segment, offset, (record.flags & event_omitted) ? " (omitted)" : "");
+        if (not scene or record.sequence < from or (to and record.sequence > to)) return;
+        if (not (record.flags & event_payload) or not replay(scene, record, payload, versions, type)) skipped ++;
+    });
+    error_if_not(records, "no records in %s\n", log_dir.c_str());
+
+    message("%lld records from %s to %s\n", records, format_time(first_time).c_str(), format_time(last_time).c_str());
+    message("%-12s %8s %12s %8s %8s %10s %10s %10s %10s %10s %10s\n", "type", "records", "bytes", "omitted", "replayed",
+            "dec p50", "dec p99", "dec max", "app p50", "app p99", "app max");
+    for (auto& type : stats){
+        auto& s = type.second;
+        sort(s.decode.begin(), s.decode.end());
+        sort(s.apply.begin(), s.apply.end());
+        message("%-12s %8lld %12lld %8lld %8lld %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", event_type_name(type.first),
+                s.records, s.bytes, s.omitted, s.replayed, percentile_ms(s.decode, 0.5), percentile_ms(s.decode, 0.99),
+                percentile_ms(s.decode, 1), percentile_ms(s.apply, 0.5), percentile_ms(s.apply, 0.99), percentile_ms(s.apply, 1));
+    }
+    if (scene) message("%lld records not replayed (other types, omitted bytes or out of range)\n", skipped);
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include "serialization.hpp"
+#include "id_reference.h"
+#include "obj_parser.h"
+#include "client.hpp"
+#include "common.h"
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <mutex>
+#include <unistd.h>
+
+// load generator for editor_server: spawns simulated clients that connect with editor_client,
+// without windows, and send edits of the scene at a fixed rate each. Edits are SceneDiffs
+// (camera, light and the vertices of the first mesh) or MeshDiffs, moving -vertices vertices;
+// each client cycles through a pool of edits prepared before the run. Messages carry the
+// mesh_msg trace extension, so receivers measure the latency from the edit to its arrival and,
+// since all clients share one clock with a local server, the part spent until the server sent it.
+// Receivers deserialize what they get, unless -skip_decode. Every second the sent and received
+// messages and the resident memory of this process and of the server (-server_pid) are printed.
+// usage: load_gen [-c clients] [-r rate] [-d seconds] [-k scene|mesh] [-v vertices] [-p server_pid]
+//                 [scene.json|mesh.obj] [host] [port]
+
+using namespace std;
+
+double time_passed(long long from, long long to){
+    return (to - from) / (double)1000000000;
+}
+
+// resident memory of a process in MB (0 if unknown)
+double resident_mb(int pid){
+    auto command = "ps -o rss= -p " + to_string(pid);
+    auto pipe = popen(command.c_str(), "r");
+    if (not pipe) return 0;
+    auto kb = 0ll;
+    if (fscanf(pipe, "%lld", &kb) != 1) kb = 0;
+    pclose(pipe);
+    return kb / 1024.0;
+}
+
+// a simulated client: connection, edits to send and what it received
+struct SimClient {
+    int                         id = 0;
+    editor_client*              client = nullptr;
+    vector<SceneDiff*>          scene_edits;        // edits sent as SceneDiff
+    vector<MeshDiff*>           mesh_edits;         // edits sent as MeshDiff
+    std::atomic<long long>      sent {0};           // edits sent
+    // touched only by the io thread of the client
+    long long                   received = 0;       // messages received
+    long long                   received_bytes = 0; // bytes received
+    long long                   decode_errors = 0;  // messages that could not be deserialized
+    vector<long long>           latency;            // edit origin to arrival (ns)
+    vector<long long>           server_latency;     // edit origin to the server sending it (ns)
+    vector<long long>           decode_time;        // deserialization (ns)
+};
+
+// edits of the first mesh of scene moving count random vertices, and of the camera and first light
+void make_edits(Scene* scene, int count, int pool, minstd_rand& rng, SimClient& sim){
+    auto mesh = scene->meshes[0];
+    auto ids = vector<timestamp_t>();
+    for (auto& v : mesh->vertices) ids.push_back(v.first);
+    auto uniform = uniform_real_distribution<float>(-0.01f, 0.01f);
+    for (auto e : range(pool)){
+        auto meshdiff = new MeshDiff();
+        meshdiff->_id_ = mesh->_id_;
+        meshdiff->_version = mesh->_version + 1 + e;
+        for (auto n = min(count, (int)ids.size()); n > 0; n --){
+            auto id = ids[rng() % ids.size()];
+            meshdiff->update_vertex[id] = mesh->pos[mesh->vertices[id].first] + vec3f(uniform(rng), uniform(rng), uniform(rng));
+        }
+        sim.mesh_edits.push_back(meshdiff);
+        // all the fields of camera and light diffs are set (unset ones are nan)
+        auto scenediff = new SceneDiff();
+        auto cameradiff = new CameraDiff();
+        cameradiff->frame = scene->camera->frame;
+        cameradiff->frame.o += vec3f(uniform(rng), uniform(rng), uniform(rng));
+        cameradiff->width = scene->camera->width;
+        cameradiff->height = scene->camera->height;
+        cameradiff->dist = scene->camera->dist;
+        cameradiff->focus = scene->camera->focus;
+        cameradiff->_id_ = scene->camera->_id_;
+        cameradiff->_version = scene->camera->_version + 1 + e;
+        scenediff->cameras.push_back(cameradiff);
+        if (not scene->lights.empty()){
+            auto light = scene->lights[0];
+            auto lightdiff = new LightDiff();
+            lightdiff->frame = light->frame;
+            lightdiff->frame.o += vec3f(uniform(rng), uniform(rng), uniform(rng));
+            lightdiff->intensity = light->intensity;
+            lightdiff->_id_ = light->_id_;
+            lightdiff->_version = light->_version + 1 + e;
+            scenediff->lights.push_back(lightdiff);
+        }
+        scenediff->meshes.push_back(meshdiff);
+        sim.scene_edits.push_back(scenediff);
+    }
+}
+
+// handles a message received by sim (io thread)
+void receive(SimClient& sim, const mesh_msg& msg, bool decode){
+    auto now = trace_now();
+    sim.received ++;
+    sim.received_bytes += msg.length();
+    if (msg.traced()){
+        sim.latency.push_back(now - msg.origin_time());
+        sim.server_latency.push_back(msg.sent_time() - msg.origin_time());
+    }
+    if (not decode) return;
+    auto from = trace_now();
+    try {
+        if (msg.type() == mesh_msg::SceneDiff_type) delete msg.as_scenediff();
+        else if (msg.type() == mesh_msg::MeshDiff_type) delete msg.as_meshdiff();
+        sim.decode_time.push_back(trace_now() - from);
+    } catch (std::exception&) {
+        sim.decode_errors ++;
+    }
+}
+
+// value at fraction p of sorted samples (nearest rank), in ms
+double percentile_ms(const vector<long long>& sorted, double p){
+    if (sorted.empty()) return 0;
+    auto rank = (int)ceil(p * sorted.size()) - 1;
+    return sorted[max(0, min(rank, (int)sorted.size() - 1))] / 1e6;
+}
+
+void print_distribution(const string& name, vector<long long> samples){
+    sort(samples.begin(), samples.end());
+    auto mean = 0.0;
+    for (auto s : samples) mean += s / 1e6;
+    if (not samples.empty()) mean /= samples.size();
+    message("%-20s %10d %10.3f %10.3f %10.3f %10.3f %10.3f\n", name.c_str(), (int)samples.size(), mean,
+            percentile_ms(samples, 0.5), percentile_ms(samples, 0.9), percentile_ms(samples, 0.99), percentile_ms(samples, 1));
+}
+
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+                              { "load_gen", "replay edits of simulated clients against editor_server",
+                                  {  {"clients", "c", "simulated clients", typeid(int), true, jsonvalue(8) },
+                                     {"rate", "r", "edits per second of each client", typeid(double), true, jsonvalue(10.0) },
+                                     {"duration", "d", "seconds of sending", typeid(double), true, jsonvalue(10.0) },
+                                     {"kind", "k", "edits sent: scene (SceneDiff) or mesh (MeshDiff)", typeid(string), true, jsonvalue("scene") },
+                                     {"vertices", "v", "vertices moved by each edit", typeid(int), true, jsonvalue(100) },
+                                     {"pool", "e", "distinct edits of each client", typeid(int), true, jsonvalue(16) },
+                                     {"threads", "t", "io threads (0 for one per core)", typeid(int), true, jsonvalue(0) },
+                                     {"server_pid", "p", "pid of the server, to sample its memory", typeid(int), true, jsonvalue(0) },
+                                     {"skip_decode", "s", "do not deserialize received messages", typeid(bool), true, jsonvalue(false) }  },
+                                  {  {"scene_filename", "", "scene loaded by the server", typeid(string), true, jsonvalue("../scenes/shuttleply_v0.json")},
+                                     {"host", "", "server host", typeid(string), true, jsonvalue("localhost")},
+                                     {"port", "", "server port", typeid(string), true, jsonvalue("3311")}  }
+                              });
+    auto nclients = max(1, args.object_element("clients").as_int());
+    auto rate = args.object_element("rate").as_double();
+    auto duration = args.object_element("duration").as_double();
+    auto mesh_only = args.object_element("kind").as_string() == "mesh";
+    auto vertices = args.object_element("vertices").as_int();
+    auto pool = max(1, args.object_element("pool").as_int());
+    auto server_pid = args.object_element("server_pid").as_int();
+    auto decode = not args.object_element("skip_decode").as_bool();
+    auto nthreads = args.object_element("threads").as_int();
+    if (nthreads <= 0) nthreads = parallel_threads();
+    nthreads = min(nthreads, nclients);
+
+    auto filename = args.object_element("scene_filename").as_string();
+    message("parsing <%s>...\n", filename.c_str());
+    auto scene = (filename.size() > 4 and filename.substr(filename.size()-4) == ".obj") ? load_obj_scene(filename) : load_json_scene(filename);
+    error_if_not(not scene->meshes.empty(), "no meshes in %s\n", filename.c_str());
+
+    // clients are spread over io services run by one thread each, so that the handlers
+    // of a client never run concurrently
+    auto services = vector<boost::asio::io_service*>();
+    auto works = vector<boost::asio::io_service::work*>();
+    for (auto t = 0; t < nthreads; t ++){
+        services.push_back(new boost::asio::io_service());
+        works.push_back(new boost::asio::io_service::work(*services.back()));
+    }
+    auto rng = minstd_rand(0);
+    auto sims = vector<SimClient*>();
+    for (auto i : range(nclients)){
+        auto sim = new SimClient();
+        sim->id = i;
+        make_edits(scene, vertices, pool, rng, *sim);
+        auto& service = *services[i % nthreads];
+        tcp::resolver resolver(service);
+        auto endpoint_iterator = resolver.resolve({ args.object_element("host").as_string(), args.object_element("port").as_string() });
+        sim->client = new editor_client(service, endpoint_iterator);
+        sim->client->set_receive_handler([sim, decode](const mesh_msg& msg){ receive(*sim, msg, decode); });
+        sims.push_back(sim);
+    }
+    auto io_threads = vector<std::thread>();
+    for (auto service : services) io_threads.push_back(std::thread([service](){ service->run(); }));
+
+    // wait for the connections
+    auto wait_from = trace_now();
+    auto connected = 0;
+    while (time_passed(wait_from, trace_now()) < 5){
+        connected = 0;
+        for (auto sim : sims) connected += sim->client->connected();
+        if (connected == nclients) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    error_if_not(connected == nclients, "%d of %d clients connected\n", connected, nclients);
+    message("%d clients on %d io threads, %g %s edits/s each moving %d vertices, for %gs\n",
+            nclients, nthreads, rate, mesh_only ? "MeshDiff" : "SceneDiff", vertices, duration);
+
+    // each client sends at its own fixed rate, the schedule does not drift with late sends
+    std::atomic<bool> sending(true);
+    auto start = std::chrono::steady_clock::now();
+    auto period = std::chrono::nanoseconds((long long)(1e9 / max(rate, 1e-3)));
+    auto senders = vector<std::thread>();
+    for (auto sim : sims){
+        senders.push_back(std::thread([sim, &sending, start, period, mesh_only, nclients](){
+            // clients are staggered over the first period
+            auto next = start + period * sim->id / nclients;
+            for (auto e = 0ll; sending; e ++){
+                std::this_thread::sleep_until(next);
+                if (not sending) break;
+                auto edit_id = trace_edit_id();
+                if (mesh_only) sim->client->write(sim->mesh_edits[e % sim->mesh_edits.size()], edit_id, trace_now());
+                else sim->client->write(sim->scene_edits[e % sim->scene_edits.size()], edit_id, trace_now());
+                sim->sent ++;
+                next += period;
+            }
+        }));
+    }
+
+    // progress every second; after the sending, up to 5s more wait for the deliveries in flight
+    message("%6s %10s %10s %12s %12s\n", "time", "sent/s", "recv/s", "rss (MB)", "server (MB)");
+    auto last_sent = 0ll, last_received = 0ll;
+    auto max_rss = 0.0, max_server_rss = 0.0;
+    auto sending_time = duration;
+    auto total_received = [&](){
+        // the io threads write the counters: a racy read is fine for progress
+        auto received = 0ll;
+        for (auto sim : sims) received += ((volatile long long&)sim->received);
+        return received;
+    };
+    for (auto second = 1; ; second ++){
+        std::this_thread::sleep_until(start + std::chrono::seconds(second));
+        if (second >= duration and sending){
+            sending = false;
+            for (auto& sender : senders) sender.join();
+            sending_time = time_passed(0, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+        auto sent = 0ll;
+        for (auto sim : sims) sent += sim->sent;
+        auto received = total_received();
+        auto rss = resident_mb(getpid());
+        auto server_rss = server_pid ? resident_mb(server_pid) : 0.0;
+        max_rss = max(max_rss, rss);
+        max_server_rss = max(max_server_rss, server_rss);
+        message("%6d %10lld %10lld %12.1f %12.1f\n", second, sent - last_sent, received - last_received, rss, server_rss);
+        auto drained = not sending and (received >= sent * (nclients - 1) or received == last_received);
+        last_sent = sent;
+        last_received = received;
+        if (drained or second >= duration + 5) break;
+    }
+    for (auto sim : sims) sim->client->close();
+    for (auto work : works) delete work;
+    for (auto service : services) service->stop();
+    for (auto& thread : io_threads) thread.join();
+
+    // summary
+    auto sent = 0ll, received = 0ll, bytes = 0ll, errors = 0ll;
+    auto latency = vector<long long>(), server_latency = vector<long long>(), decode_time = vector<long long>();
+    for (auto sim : sims){
+        sent += sim->sent;
+        received += sim->received;
+        bytes += sim->received_bytes;
+        errors += sim->decode_errors;
+        latency.insert(latency.end(), sim->latency.begin(), sim->latency.end());
+        server_latency.insert(server_latency.end(), sim->server_latency.begin(), sim->server_latency.end());
+        decode_time.insert(decode_time.end(), sim->decode_time.begin(), sim->decode_time.end());
+    }
+    auto expected = sent * (nclients - 1);
+    message("\nsent %lld edits, received %lld of %lld deliveries (%.2f%%)%s\n", sent, received, expected,
+            expected ? 100.0 * received / expected : 100.0, errors ? tostring(", %lld not deserialized", errors).c_str() : "");
+    message("server throughput over %.1fs of sending: %.1f messages/s in, %.1f deliveries/s out, %.2f MB/s out\n",
+            sending_time, sent / sending_time, received / sending_time, bytes / sending_time / (1024 * 1024));
+    message("memory: load_gen max %.1f MB%s\n", max_rss, server_pid ? tostring(", server max %.1f MB", max_server_rss).c_str() : "");
+    message("\n%-20s %10s %10s %10s %10s %10s %10s\n", "latency (ms)", "count", "mean", "p50", "p90", "p99", "max");
+    print_distribution("edit to server sent", server_latency);
+    print_distribution("edit to arrival", latency);
+    if (decode) print_distribution("deserialize", decode_time);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "serialization.hpp"
+#include "id_reference.h"
+#include "obj_parser.h"
+#include "common.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+// compares the ordered diff with the spatial hash matching on consecutive versions of the
+// test meshes, reporting time and size of each diff
+// usage: mesh_match [epsilon]
+
+using namespace std;
+
+double time_passed(long long from, long long to){
+    return (to - from) / (double)1000000000;
+}
+
+long long get_clock(){
+    std::chrono::high_resolution_clock::time_point time = std::chrono::high_resolution_clock::now();
+    return time.time_since_epoch().count();
+}
+
+size_t diff_size(MeshDiff* diff){
+    return diff->add_vertex.size() + diff->update_vertex.size() + diff->remove_vertex.size() +
+           diff->add_triangle.size() + diff->remove_triangle.size() + diff->add_quad.size() + diff->remove_quad.size();
+}
+
+void print_diff(const char* name, MeshDiff* diff, double seconds){
+    message("\t%-16s %8.4fs - add_v %d upd_v %d rem_v %d add_f %d rem_f %d\n", name, seconds,
+            (int)diff->add_vertex.size(), (int)diff->update_vertex.size(), (int)diff->remove_vertex.size(),
+            (int)(diff->add_triangle.size() + diff->add_quad.size()), (int)(diff->remove_triangle.size() + diff->remove_quad.size()));
+}
+
+// loads the versions of a mesh that exist on disk
+vector<Scene*> load_versions(const string& prefix, const string& ext, int count){
+    auto scenes = vector<Scene*>();
+    for (auto i : range(count)){
+        auto filename = prefix + to_string(i) + ext;
+        if (not ifstream(filename)) continue;
+        message("parsing <%s>...\n", filename.c_str());
+        scenes.push_back(ext == ".obj" ? load_obj_scene(filename) : load_json_scene(filename));
+    }
+    return scenes;
+}
+
+void compare(const vector<Scene*>& scenes, float epsilon){
+    for (auto i = 1; i < scenes.size(); i++){
+        auto first = scenes[i-1]->meshes[0], second = scenes[i]->meshes[0];
+        message("\n[v%dtov%d] %d -> %d vertices\n", i-1, i, (int)first->vertices.size(), (int)second->vertices.size());
+        
+        auto from = get_clock();
+        auto ordered = meshdiff_assume_ordered(first, second);
+        auto to = get_clock();
+        print_diff("assume_ordered", ordered, time_passed(from, to));
+        
+        from = get_clock();
+        auto spatial = meshdiff_spatial_match(first, second, epsilon);
+        to = get_clock();
+        print_diff("spatial_match", spatial, time_passed(from, to));
+        message("\tsize ratio %.3f\n", diff_size(spatial) / (double)max(diff_size(ordered), (size_t)1));
+        
+        delete ordered;
+        delete spatial;
+    }
+}
+
+int main(int argc, char** argv) {
+    auto epsilon = (argc > 1) ? (float)atof(argv[1]) : 1e-5f;
+    message("threads: %d - epsilon: %g\n", parallel_threads(), epsilon);
+    
+    compare(load_versions("../scenes/fat_v", ".obj", 5), epsilon);
+    compare(load_versions("../scenes/shuttleply_v", ".json", 6), epsilon);
+    
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "serialization.hpp"
+#include "id_reference.h"
+#include "obj_parser.h"
+#include "pathtrace.h"
+#include "common.h"
+#include <iostream>
+#include <chrono>
+
+// renders a scene with the CPU path tracer, without an OpenGL context (render nodes)
+// usage: render [-r resolution] [-s samples] [-d depth] scene.json|mesh.obj [image.png]
+
+using namespace std;
+
+double time_passed(long long from, long long to){
+    return (to - from) / (double)1000000000;
+}
+
+long long get_clock(){
+    std::chrono::high_resolution_clock::time_point time = std::chrono::high_resolution_clock::now();
+    return time.time_since_epoch().count();
+}
+
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+                              { "render", "path trace a scene to png",
+                                  {  {"resolution", "r", "image resolution", typeid(int), true, jsonvalue() },
+                                     {"samples", "s", "samples per pixel in each direction", typeid(int), true, jsonvalue() },
+                                     {"depth", "d", "maximum path depth", typeid(int), true, jsonvalue() }  },
+                                  {  {"scene_filename", "", "scene filename", typeid(string), false, jsonvalue("scene.json")},
+                                     {"image_filename", "", "image filename", typeid(string), true, jsonvalue("")}  }
+                              });
+    auto scene_filename = args.object_element("scene_filename").as_string();
+    auto image_filename = (args.object_element("image_filename").as_string() != "") ?
+        args.object_element("image_filename").as_string() :
+        scene_filename.substr(0,scene_filename.rfind('.'))+".png";
+    
+    message("parsing <%s>...\n", scene_filename.c_str());
+    auto obj = scene_filename.size() > 4 and scene_filename.substr(scene_filename.size()-4) == ".obj";
+    auto scene = obj ? load_obj_scene(scene_filename) : load_json_scene(scene_filename);
+    if(not args.object_element("resolution").is_null()) {
+        scene->image_height = args.object_element("resolution").as_int();
+        scene->image_width = scene->camera->width * scene->image_height / scene->camera->height;
+    }
+    if(not args.object_element("samples").is_null()) scene->image_samples = args.object_element("samples").as_int();
+    if(not args.object_element("depth").is_null()) scene->path_max_depth = args.object_element("depth").as_int();
+    
+    message("rendering %dx%d, %d samples, depth %d on %d threads...\n", scene->image_width, scene->image_height,
+            scene->image_samples*scene->image_samples, scene->path_max_depth, parallel_threads());
+    auto from = get_clock();
+    auto image = pathtrace(scene);
+    auto to = get_clock();
+    message("rendered in %.3fs\n", time_passed(from, to));
+    
+    write_png(image_filename, image, true);
+    message("saved <%s>\n", image_filename.c_str());
+    return 0;
+}
@@ -0,0 +1,433 @@
+#include "serialization.hpp"
+#include "id_reference.h"
+#include "common.h"
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/filesystem.hpp>
+
+// synthetic scenes and edit streams for scaling studies: writes a scene (camera, light, material
+// and one mesh of about -faces faces) and -edits SceneDiffs editing it, all determined by -seed.
+// Meshes are lattices of vertices: a grid, a sphere (open at the poles) or a scan (a grid displaced
+// by smooth noise and jitter, with holes); each cell is a quad or, with probability -tri, two
+// triangles. Ids are timestamp-like (a base derived from the seed plus a counter), so vertex and
+// face ids look like the ones the editor makes and grow along the stream.
+// Edits, drawn by the weights of -mix, are sculpt (vertices within -radius cells of a center
+// moved along the normal with a smooth falloff), cut (a row of cells split by a new edge loop:
+// faces removed, vertices and faces added), material (the coefficients of the material changed)
+// and camera (the camera orbits the mesh). With probability -locality an edit stays close to the
+// previous one, otherwise it jumps anywhere on the mesh.
+// Every field of the diffs is set (unchanged ones to their current value), since text archives
+// cannot restore nan. The output directory has scene.json, edit_0000... (text archives of
+// SceneDiff, for apply_change in order) and edits.json (kind and size of each edit).
+// usage: scene_gen [-s grid|sphere|scan] [-f faces] [-t tri] [-e edits] [-m mix] [-r radius]
+//                  [-l locality] [-x seed] [out_dir]
+
+using namespace std;
+
+// random numbers computed from the bits of the engine, as the std distributions differ
+// across standard libraries and the output must be the same everywhere
+struct Random {
+    mt19937_64     engine;
+
+    Random(unsigned long long seed) : engine(seed) { }
+
+    // uniform in [0,1)
+    double uniform() { return (engine() >> 11) * (1.0 / 9007199254740992.0); }
+    // uniform in [a,b)
+    double uniform(double a, double b) { return a + (b - a) * uniform(); }
+    // uniform in [0,n)
+    int integer(int n) { return (int)(uniform() * n); }
+    // standard normal (Box-Muller)
+    double normal() { return sqrt(-2 * log(1 - uniform())) * cos(2 * pif * uniform()); }
+};
+
+// kind of the faces of a cell
+enum { cell_hole = 0, cell_quad, cell_triangles, cell_cut };
+
+// a lattice of vertices rows x cols; cell (i,j) has vertices (i,j), (i+1,j), (i+1,j+1), (i,j+1)
+// (columns wrap around on spheres); elements are kept as ids, positions and cell kinds, without
+// the maps of Mesh, to reach tens of millions of faces
+struct Lattice {
+    string                  shape;
+    int                     rows = 0, cols = 0;         // vertices
+    int                     cell_rows = 0, cell_cols = 0;
+    bool                    wrap = false;               // last column connects to the first
+    timestamp_t             vertex_base = 0;            // id of vertex (i,j) is vertex_base + i*cols + j
+    timestamp_t             face_base = 0;              // ids of the faces of cell c are face_base + 2c (+1)
+    vector<vec3f>           pos;
+    vector<unsigned char>   cells;                      // kind of each cell
+    map<int, vector<timestamp_t>>   cut_faces;          // faces of the cells split by cuts
+};
+
+int vertex_index(const Lattice& lattice, int i, int j) { return i * lattice.cols + (lattice.wrap ? j % lattice.cols : j); }
+timestamp_t vertex_id(const Lattice& lattice, int i, int j) { return lattice.vertex_base + vertex_index(lattice, i, j); }
+int cell_index(const Lattice& lattice, int i, int j) { return i * lattice.cell_cols + j; }
+
+// faces of a cell: [vertex ids] (3 or 4) by face id
+map<timestamp_t, vector<timestamp_t>> cell_faces(const Lattice& lattice, int i, int j) {
+    auto faces = map<timestamp_t, vector<timestamp_t>>();
+    auto c = cell_index(lattice, i, j);
+    auto a = vertex_id(lattice, i, j), b = vertex_id(lattice, i+1, j), cc = vertex_id(lattice, i+1, j+1), d = vertex_id(lattice, i, j+1);
+    auto id = lattice.face_base + 2 * (timestamp_t)c;
+    if (lattice.cells[c] == cell_quad) faces[id] = { a, b, cc, d };
+    if (lattice.cells[c] == cell_triangles) { faces[id] = { a, b, cc }; faces[id + 1] = { a, cc, d }; }
+    return faces;
+}
+
+// outward direction of the surface at vertex (i,j), used to sculpt
+vec3f lattice_normal(const Lattice& lattice, int i, int j) {
+    if (lattice.shape == "sphere") return normalize(lattice.pos[vertex_index(lattice, i, j)]);
+    return y3f;
+}
+
+// smooth noise of the scans: a sum of waves of random directions and phases
+float scan_height(const vector<vec4f>& waves, float x, float z) {
+    auto h = 0.0f;
+    for (auto& w : waves) h += w.w * sin(w.x * x + w.y * z + w.z);
+    return h;
+}
+
+// lattice of about faces faces of shape
+Lattice make_lattice(const string& shape, long long faces, double tri, Random& random, timestamp_t& next_id) {
+    auto lattice = Lattice();
+    lattice.shape = shape;
+    auto cells = max(1.0, faces / (1 + tri));
+    if (shape == "sphere") {
+        lattice.cell_rows = max(2, (int)round(sqrt(cells / 2)));
+        lattice.cell_cols = max(3, (int)round(cells / lattice.cell_rows));
+        lattice.rows = lattice.cell_rows + 1;
+        lattice.cols = lattice.cell_cols;
+        lattice.wrap = true;
+    } else {
+        error_if_not(shape == "grid" or shape == "scan", "unknown shape %s\n", shape.c_str());
+        lattice.cell_rows = lattice.cell_cols = max(1, (int)round(sqrt(cells)));
+        lattice.rows = lattice.cell_rows + 1;
+        lattice.cols = lattice.cell_cols + 1;
+    }
+    auto nvertices = (long long)lattice.rows * lattice.cols;
+    auto ncells = (long long)lattice.cell_rows * lattice.cell_cols;
+    error_if_not(2 * ncells < INT_MAX and nvertices < INT_MAX, "too many faces: %lld\n", faces);
+    lattice.vertex_base = next_id;
+    next_id += nvertices;
+    lattice.face_base = next_id;
+    next_id += 2 * ncells;
+
+    auto waves = vector<vec4f>();
+    if (shape == "scan") {
+        for (auto k : range(8)) {
+            auto frequency = 2 * pif * (1 + k) * random.uniform(0.5, 1.5);
+            auto angle = random.uniform(0, 2 * pif);
+            waves.push_back(vec4f(frequency * cos(angle), frequency * sin(angle), random.uniform(0, 2 * pif), 0.15f / (1 + k)));
+        }
+    }
+    lattice.pos.resize(nvertices);
+    for (auto i : range(lattice.rows)) {
+        for (auto j : range(lattice.cols)) {
+            auto& p = lattice.pos[vertex_index(lattice, i, j)];
+            if (shape == "sphere") {
+                // rings from just below the north pole to just above the south pole
+                auto theta = pif * (i + 0.5f) / lattice.rows, phi = 2 * pif * j / lattice.cols;
+                p = vec3f(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+            } else {
+                p = vec3f(-1 + 2.0f * j / lattice.cell_cols, 0, -1 + 2.0f * i / lattice.cell_rows);
+                if (shape == "scan") p.y = scan_height(waves, p.x, p.z) + 0.1f * random.normal() / lattice.cell_cols;
+            }
+        }
+    }
+    lattice.cells.resize(ncells);
+    for (auto& cell : lattice.cells) cell = (random.uniform() < tri) ? cell_triangles : cell_quad;
+    // scans miss a few patches of the surface (about 2% of the cells)
+    if (shape == "scan") {
+        auto holes = 4 + random.integer(8);
+        for (auto hole = 0; hole < holes; hole ++) {
+            auto radius = sqrt(0.02 * ncells / (holes * pif)) * random.uniform(0.5, 1.5);
+            auto ci = random.integer(lattice.cell_rows), cj = random.integer(lattice.cell_cols);
+            for (auto i : range(max(0, ci - (int)radius), min(lattice.cell_rows, ci + (int)radius + 1)))
+                for (auto j : range(max(0, cj - (int)radius), min(lattice.cell_cols, cj + (int)radius + 1)))
+                    if ((i-ci)*(i-ci) + (j-cj)*(j-cj) <= radius * radius) lattice.cells[cell_index(lattice, i, j)] = cell_hole;
+        }
+    }
+    return lattice;
+}
+
+// number as json, with a decimal point when integral since load_json reads those as ids
+string json_number(float v) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9g", v);
+    if (not strpbrk(buffer, ".en")) strcat(buffer, ".0");
+    return buffer;
+}
+
+string json_vec(const vec3f& v) {
+    return "[" + json_number(v.x) + "," + json_number(v.y) + "," + json_number(v.z) + "]";
+}
+
+// writes the scene with the mesh of lattice inline (streamed, as it can take gigabytes)
+void save_scene_json(const string& filename, const Lattice& lattice, const Camera* camera, const Light* light, const Material* material, timestamp_t mesh_id) {
+    auto f = fopen(filename.c_str(), "w");
+    error_if_not(f, "cannot write %s\n", filename.c_str());
+    fprintf(f, "[\n {\n    \"camera\" : { \"_id_\" : %llu, \"frame_o\" : %s, \"frame_x\" : %s, \"frame_y\" : %s, \"frame_z\" : %s, "
+            "\"width\" : %s, \"height\" : %s, \"dist\" : %s, \"focus\" : %s }\n },\n", camera->_id_,
+            json_vec(camera->frame.o).c_str(), json_vec(camera->frame.x).c_str(), json_vec(camera->frame.y).c_str(), json_vec(camera->frame.z).c_str(),
+            json_number(camera->width).c_str(), json_number(camera->height).c_str(), json_number(camera->dist).c_str(), json_number(camera->focus).c_str());
+    fprintf(f, " {\n    \"light\" : { \"_id_\" : %llu, \"frame_o\" : %s, \"intensity\" : %s }\n },\n", light->_id_,
+            json_vec(light->frame.o).c_str(), json_vec(light->intensity).c_str());
+    fprintf(f, " {\n    \"material\" : { \"_id_\" : %llu, \"kd\" : %s, \"ks\" : %s, \"n\" : %s }\n },\n", material->_id_,
+            json_vec(material->kd).c_str(), json_vec(material->ks).c_str(), json_number(material->n).c_str());
+    fprintf(f, " {\n    \"mesh\" : {\n        \"_id_\" : %llu,\n        \"n_vertex\" : %d,\n        \"vertex\" : [\n", mesh_id, (int)lattice.pos.size());
+    for (auto v : range((int)lattice.pos.size())) {
+        fprintf(f, "            { \"_id_\" : %llu, \"pos\" : %s }%s\n", lattice.vertex_base + v, json_vec(lattice.pos[v]).c_str(),
+                (v + 1 < (int)lattice.pos.size()) ? "," : "");
+    }
+    for (auto kind : { 3, 4 }) {
+        fprintf(f, "        ],\n        \"%s\" : [\n", (kind == 3) ? "triangle" : "quad");
+        auto first = true;
+        for (auto i : range(lattice.cell_rows)) {
+            for (auto j : range(lattice.cell_cols)) {
+                for (auto& face : cell_faces(lattice, i, j)) {
+                    if ((int)face.second.size() != kind) continue;
+                    fprintf(f, "%s            { \"_id_\" : %llu, \"ver_ids\" : [", first ? "" : ",\n", face.first);
+                    for (auto k : range(kind)) fprintf(f, "%s%llu", k ? "," : "", face.second[k]);
+                    fprintf(f, "] }");
+                    first = false;
+                }
+            }
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, "        ],\n        \"material\" : %llu\n    }\n }\n]\n", material->_id_);
+    fclose(f);
+}
+
+// a mesh diff of mesh_id changing nothing yet
+MeshDiff* make_meshdiff(timestamp_t mesh_id, int version) {
+    auto meshdiff = new MeshDiff();
+    meshdiff->frame = identity_frame3f;
+    meshdiff->_id_ = mesh_id;
+    meshdiff->_version = version;
+    return meshdiff;
+}
+
+// center of the next brush: near the previous one with probability locality, anywhere otherwise
+void next_center(const Lattice& lattice, Random& random, double locality, int radius, vec2i& center) {
+    if (random.uniform() < locality) {
+        center.x = clamp(center.x + random.integer(4 * radius + 1) - 2 * radius, 0, lattice.rows - 1);
+        center.y = center.y + random.integer(4 * radius + 1) - 2 * radius;
+        center.y = lattice.wrap ? (center.y + lattice.cols) % lattice.cols : clamp(center.y, 0, lattice.cols - 1);
+    } else {
+        center.x = random.integer(lattice.rows);
+        center.y = random.integer(lattice.cols);
+    }
+}
+
+// moves the vertices within radius cells of center along the normal
+void sculpt(Lattice& lattice, const vec2i& center, int radius, Random& random, MeshDiff* meshdiff) {
+    auto cell_size = 2.0f / lattice.cell_cols;
+    auto strength = (float)random.uniform(-0.5, 0.5) * radius * cell_size;
+    for (auto i : range(max(0, center.x - radius), min(lattice.rows, center.x + radius + 1))) {
+        for (auto dj : range(-radius, radius + 1)) {
+            auto j = center.y + dj;
+            if (lattice.wrap) j = (j + lattice.cols) % lattice.cols;
+            else if (j < 0 or j >= lattice.cols) continue;
+            auto d = sqrt((float)((i - center.x) * (i - center.x) + dj * dj)) / max(1, radius);
+            if (d > 1) continue;
+            auto falloff = (1 - d * d) * (1 - d * d);
+            auto& p = lattice.pos[vertex_index(lattice, i, j)];
+            p += lattice_normal(lattice, i, j) * (strength * falloff);
+            meshdiff->update_vertex[vertex_id(lattice, i, j)] = p;
+        }
+    }
+}
+
+// splits the cells of the row of center in a span of 2*radius cells with a new edge loop through
+// the middle of the cells: their faces are replaced by two per face, over new vertices
+void cut(Lattice& lattice, const vec2i& center, int radius, timestamp_t& next_id, MeshDiff* meshdiff) {
+    auto i = min(center.x, lattice.cell_rows - 1);
+    auto midpoints = map<int, timestamp_t>();   // new vertex on the edge (i,j)-(i+1,j) by j
+    auto midpoint = [&](int j) {
+        if (lattice.wrap) j = j % lattice.cols;
+        if (not midpoints.count(j)) {
+            midpoints[j] = next_id ++;
+            meshdiff->add_vertex[midpoints[j]] = (lattice.pos[vertex_index(lattice, i, j)] + lattice.pos[vertex_index(lattice, i+1, j)]) / 2;
+        }
+        return midpoints[j];
+    };
+    for (auto j : range(center.y - radius, center.y + radius)) {
+        if (lattice.wrap) j = (j + lattice.cell_cols) % lattice.cell_cols;
+        else if (j < 0 or j >= lattice.cell_cols) continue;
+        auto c = cell_index(lattice, i, j);
+        auto kind = lattice.cells[c];
+        if (kind == cell_hole or kind == cell_cut) continue;
+        for (auto& face : cell_faces(lattice, i, j)) {
+            if (face.second.size() == 3) meshdiff->remove_triangle.push_back(face.first);
+            else meshdiff->remove_quad.push_back(face.first);
+        }
+        auto a = vertex_id(lattice, i, j), b = vertex_id(lattice, i+1, j), cc = vertex_id(lattice, i+1, j+1), d = vertex_id(lattice, i, j+1);
+        auto ma = midpoint(j), md = midpoint(j + 1);
+        auto& faces = lattice.cut_faces[c];
+        for (auto& quad : vector<vec4id>{ vec4id(a, ma, md, d), vec4id(ma, b, cc, md) }) {
+            if (kind == cell_quad) {
+                faces.push_back(next_id);
+                meshdiff->add_quad[next_id ++] = quad;
+            } else {
+                faces.push_back(next_id);
+                meshdiff->add_triangle[next_id ++] = vec3id(quad.first, quad.second, quad.third);
+                faces.push_back(next_id);
+                meshdiff->add_triangle[next_id ++] = vec3id(quad.first, quad.third, quad.fourth);
+            }
+        }
+        lattice.cells[c] = cell_cut;
+    }
+}
+
+// kind of edit drawn by weights (name:weight, comma separated)
+string draw_kind(const vector<pair<string,double>>& mix, Random& random) {
+    auto total = 0.0;
+    for (auto& kind : mix) total += kind.second;
+    auto r = random.uniform() * total;
+    for (auto& kind : mix) {
+        if (r < kind.second) return kind.first;
+        r -= kind.second;
+    }
+    return mix.back().first;
+}
+
+vector<pair<string,double>> parse_mix(const string& text) {
+    auto mix = vector<pair<string,double>>();
+    auto stream = stringstream(text);
+    auto item = string();
+    while (getline(stream, item, ',')) {
+        auto colon = item.find(':');
+        error_if_not(colon != string::npos, "bad mix %s: expected kind:weight\n", item.c_str());
+        auto kind = item.substr(0, colon);
+        error_if_not(kind == "sculpt" or kind == "cut" or kind == "material" or kind == "camera", "unknown edit %s\n", kind.c_str());
+        mix.push_back(make_pair(kind, stod(item.substr(colon + 1))));
+    }
+    error_if_not(not mix.empty(), "empty mix\n");
+    return mix;
+}
+
+void save_scenediff(const SceneDiff& m, const string& filename){
+    // make an archive
+    std::ofstream ofs(filename);
+    boost::archive::text_oarchive oa(ofs);
+    oa << m;
+}
+
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+                              { "scene_gen", "synthetic scenes and edit streams from a seed",
+                                  {  {"shape", "s", "mesh: grid, sphere or scan", typeid(string), true, jsonvalue("grid") },
+                                     {"faces", "f", "faces of the mesh (about)", typeid(int), true, jsonvalue(10000) },
+                                     {"tri", "t", "fraction of the cells split in triangles", typeid(double), true, jsonvalue(0.0) },
+                                     {"edits", "e", "edits of the stream", typeid(int), true, jsonvalue(100) },
+                                     {"mix", "m", "weights of the edits (sculpt, cut, material, camera)", typeid(string), true, jsonvalue("sculpt:70,cut:10,material:10,camera:10") },
+                                     {"radius", "r", "radius of sculpts and half span of cuts, in cells", typeid(int), true, jsonvalue(8) },
+                                     {"locality", "l", "probability that an edit is close to the previous one", typeid(double), true, jsonvalue(0.8) },
+                                     {"seed", "x", "seed of the generator", typeid(int), true, jsonvalue(1) }  },
+                                  {  {"out_dir", "", "output directory", typeid(string), true, jsonvalue("../scenes/gen/")}  }
+                              });
+    auto shape = args.object_element("shape").as_string();
+    auto faces = max(1, args.object_element("faces").as_int());
+    auto tri = min(1.0, max(0.0, args.object_element("tri").as_double()));
+    auto nedits = max(0, args.object_element("edits").as_int());
+    auto mix = parse_mix(args.object_element("mix").as_string());
+    auto radius = max(1, args.object_element("radius").as_int());
+    auto locality = args.object_element("locality").as_double();
+    auto seed = (unsigned long long)args.object_element("seed").as_int();
+    auto out_dir = args.object_element("out_dir").as_string();
+    if (not out_dir.empty() and out_dir.back() != '/') out_dir += "/";
+    boost::filesystem::create_directories(out_dir);
+
+    auto random = Random(seed);
+    // timestamps of 2014 (seconds * 1e7 + microseconds), one second apart per seed
+    auto next_id = (timestamp_t)14100000000000000ull + (seed % 100000000) * 10000000ull;
+
+    auto camera_id = next_id ++, light_id = next_id ++, material_id = next_id ++, mesh_id = next_id ++;
+    auto lattice = make_lattice(shape, faces, tri, random, next_id);
+    auto camera = lookat_camera(vec3f(0, 2.5f, 3.5f), zero3f, y3f, 1, 1, 1, camera_id, 0);
+    auto light = new Light();
+    light->_id_ = light_id;
+    light->frame.o = vec3f(2, 6, 5);
+    light->intensity = vec3f(15, 15, 15);
+    auto material = new Material();
+    material->_id_ = material_id;
+    material->kd = vec3f(0.7f, 0.7f, 0.7f);
+    material->ks = vec3f(0.2f, 0.2f, 0.2f);
+    material->n = 50;
+    save_scene_json(out_dir + "scene.json", lattice, camera, light, material, mesh_id);
+    message("%s: %s of %d vertices, %d cells (%.0f%% triangles), ids from %llu\n", (out_dir + "scene.json").c_str(), shape.c_str(),
+            (int)lattice.pos.size(), (int)lattice.cells.size(), tri * 100, lattice.vertex_base);
+
+    auto manifest = fopen((out_dir + "edits.json").c_str(), "w");
+    error_if_not(manifest, "cannot write %sedits.json\n", out_dir.c_str());
+    fprintf(manifest, "[");
+    auto mesh_version = 0, camera_version = 0, material_version = 0;
+    auto center = vec2i(lattice.rows / 2, lattice.cols / 2);
+    auto orbit = atan2(camera->frame.o.z, camera->frame.o.x);
+    auto counts = map<string,int>();
+    for (auto e : range(nedits)) {
+        auto kind = draw_kind(mix, random);
+        counts[kind] ++;
+        auto scenediff = SceneDiff();
+        scenediff._label = next_id ++;
+        auto filename = tostring("edit_%04d", e);
+        fprintf(manifest, "%s\n{\"file\":\"%s\",\"kind\":\"%s\"", e ? "," : "", filename.c_str(), kind.c_str());
+        if (kind == "sculpt" or kind == "cut") {
+            next_center(lattice, random, locality, radius, center);
+            auto meshdiff = make_meshdiff(mesh_id, ++ mesh_version);
+            if (kind == "sculpt") sculpt(lattice, center, radius, random, meshdiff);
+            else cut(lattice, center, radius, next_id, meshdiff);
+            fprintf(manifest, ",\"update_vertex\":%d,\"add_vertex\":%d,\"add_face\":%d,\"remove_face\":%d",
+                    (int)meshdiff->update_vertex.size(), (int)meshdiff->add_vertex.size(),
+                    (int)(meshdiff->add_triangle.size() + meshdiff->add_quad.size()),
+                    (int)(meshdiff->remove_triangle.size() + meshdiff->remove_quad.size()));
+            scenediff.meshes.push_back(meshdiff);
+        }
+        if (kind == "material") {
+            // one draw per statement, since the order of evaluation of arguments is unspecified
+            for (auto c : range(3)) material->kd[c] = clamp(material->kd[c] + (float)random.uniform(-0.1, 0.1), 0.0f, 1.0f);
+            auto specular = (float)random.uniform(-0.05, 0.05);
+            material->ks = clamp(material->ks + vec3f(specular, specular, specular), 0.0f, 1.0f);
+            material->n = clamp(material->n * (float)random.uniform(0.8, 1.25), 1.0f, 1000.0f);
+            auto matdiff = new MaterialDiff();
+            matdiff->ke = material->ke;
+            matdiff->kd = material->kd;
+            matdiff->ks = material->ks;
+            matdiff->n = material->n;
+            matdiff->kr = material->kr;
+            matdiff->_id_ = material_id;
+            matdiff->_version = ++ material_version;
+            scenediff.materials.push_back(matdiff);
+        }
+        if (kind == "camera") {
+            // a step of an orbit around the y axis at constant height and distance
+            orbit += (float)random.uniform(0.02, 0.1);
+            auto from = camera->frame.o;
+            auto distance = length(vec3f(from.x, 0, from.z));
+            camera->frame = lookat_frame(vec3f(distance * cos(orbit), from.y, distance * sin(orbit)), zero3f, y3f, true);
+            auto cameradiff = new CameraDiff();
+            cameradiff->frame = camera->frame;
+            cameradiff->width = camera->width;
+            cameradiff->height = camera->height;
+            cameradiff->dist = camera->dist;
+            cameradiff->focus = camera->focus;
+            cameradiff->_id_ = camera_id;
+            cameradiff->_version = ++ camera_version;
+            scenediff.cameras.push_back(cameradiff);
+        }
+        fprintf(manifest, "}");
+        save_scenediff(scenediff, out_dir + filename);
+        for (auto m : scenediff.meshes) delete m;
+        for (auto m : scenediff.materials) delete m;
+        for (auto c : scenediff.cameras) delete c;
+    }
+    fprintf(manifest, "\n]\n");
+    fclose(manifest);
+    auto summary = string();
+    for (auto& count : counts) summary += tostring(" %s %d", count.first.c_str(), count.second);
+    message("%s: %d edits:%s\n", (out_dir + "edits.json").c_str(), nedits, summary.c_str());
+}
@@ -0,0 +1,109 @@
+#include "scene_distributed.h"
+#include "animation.h"
+#include "common.h"
+#include <iostream>
+#include <chrono>
+#include <climits>
+
+// times linear blend skinning on a synthetic tube bent by a chain of bones and reports
+// vertices per second on one core (reference and block kernels) and on all worker threads;
+// the block kernel is checked against the reference
+// usage: skin_bench [vertices] [bones] [frames]
+
+using namespace std;
+
+double time_passed(long long from, long long to){
+    return (to - from) / (double)1000000000;
+}
+
+long long get_clock(){
+    std::chrono::high_resolution_clock::time_point time = std::chrono::high_resolution_clock::now();
+    return time.time_since_epoch().count();
+}
+
+// tube along x made of rings of 64 vertices, each vertex weighted on the two closest bones
+Mesh* make_tube(int vertices, int bones, int frames){
+    auto mesh = new Mesh();
+    auto skinning = new MeshSkinning();
+    auto rings = max(vertices / 64, 2);
+    for (auto r : range(rings)){
+        auto x = r / (float)(rings - 1);
+        auto b = min((int)(x * bones), bones - 1);
+        auto t = x * bones - b;
+        for (auto i : range(64)){
+            auto a = 2 * pif * i / 64;
+            auto n = vec3f(0, cos(a), sin(a));
+            skinning->rest_pos.push_back(vec3f(x, 0, 0) + n * 0.05f);
+            skinning->rest_norm.push_back(n);
+            if (t < 0.5f and b > 0){
+                skinning->bone_ids.push_back(vec4i(b, b-1, -1, -1));
+                skinning->bone_weights.push_back(vec4f(0.5f + t, 0.5f - t, 0, 0));
+            } else if (t >= 0.5f and b < bones - 1){
+                skinning->bone_ids.push_back(vec4i(b, b+1, -1, -1));
+                skinning->bone_weights.push_back(vec4f(1.5f - t, t - 0.5f, 0, 0));
+            } else {
+                skinning->bone_ids.push_back(vec4i(b, -1, -1, -1));
+                skinning->bone_weights.push_back(vec4f(1, 0, 0, 0));
+            }
+        }
+    }
+    // each bone bends the chain around z at its root, more at every frame
+    skinning->bone_xforms.resize(bones);
+    for (auto f : range(frames)){
+        auto m = mat4f();
+        for (auto b : range(bones)){
+            auto root = vec3f(b / (float)bones, 0, 0);
+            m = m * translation_matrix(root) * rotation_matrix(0.3f * f / frames, z3f) * translation_matrix(-root);
+            skinning->bone_xforms[b].push_back(m);
+        }
+    }
+    mesh->pos = skinning->rest_pos;
+    mesh->norm = skinning->rest_norm;
+    mesh->skinning = skinning;
+    return mesh;
+}
+
+// seconds per frame skinning all frames with skin
+double run(Mesh* mesh, int frames, void (*skin)(Mesh*, int)){
+    auto from = get_clock();
+    for (auto f : range(frames)){
+        skin(mesh, f);
+        mesh->dirty.clear();
+    }
+    return time_passed(from, get_clock()) / frames;
+}
+
+int main(int argc, char** argv) {
+    auto vertices = (argc > 1) ? atoi(argv[1]) : 1000000;
+    auto bones = (argc > 2) ? atoi(argv[2]) : 32;
+    auto frames = (argc > 3) ? atoi(argv[3]) : 30;
+#if defined(__AVX2__)
+    auto kernel = "avx2";
+#elif defined(__ARM_NEON)
+    auto kernel = "neon";
+#else
+    auto kernel = "scalar";
+#endif
+    auto mesh = make_tube(vertices, bones, frames);
+    message("%d vertices, %d bones, %d frames - %s kernel, %d threads\n", mesh->pos.size(), bones, frames, kernel, parallel_threads());
+    
+    auto reference = run(mesh, frames, skin_mesh_reference);
+    message("reference  %.4fs/frame - %.2f Mvertices/s per core\n", reference, mesh->pos.size() / reference / 1e6);
+    auto expected_pos = mesh->pos;
+    auto expected_norm = mesh->norm;
+    
+    auto grain = skinning_grain;
+    skinning_grain = INT_MAX;
+    auto single = run(mesh, frames, skin_mesh);
+    message("blocks     %.4fs/frame - %.2f Mvertices/s per core (%.1fx)\n", single, mesh->pos.size() / single / 1e6, reference / single);
+    skinning_grain = grain;
+    auto parallel = run(mesh, frames, skin_mesh);
+    message("threaded   %.4fs/frame - %.2f Mvertices/s (%.2f per thread) - %.1f fps\n", parallel, mesh->pos.size() / parallel / 1e6,
+            mesh->pos.size() / parallel / 1e6 / parallel_threads(), 1 / parallel);
+    
+    auto error = 0.0f;
+    for (auto i : range(mesh->pos.size()))
+        error = max(error, max(dist(mesh->pos[i], expected_pos[i]), dist(mesh->norm[i], expected_norm[i])));
+    message("max difference from the reference: %g\n", error);
+    return 0;
+}
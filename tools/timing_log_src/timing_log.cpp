@@ -6,129 +6,264 @@
 //  Copyright (c) 2014 Gabriele Palozzi. All rights reserved.
 //
 
+#include "json.h"
+#include "common.h"
 #include <iostream>
 #include <fstream>
 #include <chrono>
+#include <cmath>
 #include <map>
 #include <string>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/serialization/map.hpp>
+#include <boost/filesystem.hpp>
+
+// distributions of the stage timings of many sessions: reads every timing log (boost archives
+// saved by save_timing and save_timing_apply, one sample per stage) and Chrome trace (saved by
+// save_trace, every span) under a directory. A stage is the role of the process (the file name
+// up to _timing or _trace: server, receiver, apply, client, ...) and the span name; each sample
+// keeps the mesh version of its file (the name after the last _v) and the size of the last
+// message received before it (mesh_size). Stages are reported as min/p50/p90/p99/max in ms,
+// grouped by version and/or message size class (powers of two in KB) with -group.
+// With -compare the samples of a baseline directory are compared stage by stage (and group):
+// a stage is a regression when the Mann-Whitney U test rejects equal distributions at -alpha
+// and its median is slower by more than -threshold; regressions make the exit code 1.
+// usage: timing_log [-g none|version|size|version,size] [-n filter] [-c baseline_dir] [-a alpha] [-x threshold] [log_dir]
 
 using namespace std;
 
+// a timing sample
+struct Sample {
+    double      time = 0;       // duration in seconds
+    string      version;        // mesh version of the file
+    long long   size = -1;      // size of the last message received before the sample (-1 if unknown)
+};
+
+// samples of a set of sessions by stage (role/name)
+typedef map<string, vector<Sample>> Run;
+
 void restore_timelog(map<string,long long> &m, const string& filename)
 {
     // open the archive
     std::ifstream ifs(filename);
     boost::archive::text_iarchive ia(ifs);
-    
+
     // restore the schedule from the archive
     ia >> m;
 }
 
-void print_timelog(map<string,long long> &m){
-    for (auto record : m)
-        cout << '\t' << record.first << " - " << record.second << endl;
-}
-
 double time_passed(long long from, long long to){
     return (to - from) / (double)1000000000;
 }
 
-double to_kb(long long size){
-    return size / (double)1024;
+bool ends_with(const string& s, const string& suffix){
+    return s.size() >= suffix.size() and s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// adds the samples of a timing log: one per stage with [start] and [end]
+void load_timing_log(Run& run, const string& filename, const string& role, const string& version){
+    auto log = map<string,long long>();
+    try { restore_timelog(log, filename); }
+    catch (std::exception& e) { message("skipping <%s>: %s\n", filename.c_str(), e.what()); return; }
+    auto size = log.count("mesh_size") ? log["mesh_size"] : -1;
+    for (auto& entry : log){
+        if (not ends_with(entry.first, "[start]")) continue;
+        auto name = entry.first.substr(0, entry.first.size() - 7);
+        auto end = log.find(name + "[end]");
+        if (end == log.end() or end->second < entry.second) continue;
+        auto sample = Sample();
+        sample.time = time_passed(entry.second, end->second);
+        sample.version = version;
+        sample.size = size;
+        run[role + "/" + name].push_back(sample);
+    }
+}
+
+// adds the samples of a Chrome trace: one per span
+void load_trace(Run& run, const string& filename, const string& role, const string& version){
+    auto json = load_json(filename);
+    // open spans by process, thread and name: start times and message sizes
+    auto open = map<string, vector<pair<double,long long>>>();
+    auto size = -1ll;
+    for (auto& event : json.object_element("traceEvents").as_array_ref()){
+        auto name = event.object_element("name").as_string();
+        auto phase = event.object_element("ph").as_string();
+        auto& ts = event.object_element("ts");
+        auto time = (ts.is_id() ? (double)ts.as_id() : ts.as_double()) / 1e6;
+        if (phase == "C" and name == "mesh_size"){
+            size = event.object_element("args").object_element("value").as_id();
+            continue;
+        }
+        if (phase != "B" and phase != "E") continue;
+        auto key = tostring("%lld/%lld/", event.object_element("pid").as_id(), event.object_element("tid").as_id()) + name;
+        auto& spans = open[key];
+        if (phase == "B") { spans.push_back(make_pair(time, size)); continue; }
+        if (spans.empty()) continue;
+        auto sample = Sample();
+        sample.time = time - spans.back().first;
+        sample.version = version;
+        sample.size = spans.back().second;
+        spans.pop_back();
+        run[role + "/" + name].push_back(sample);
+    }
+}
+
+// adds the samples of the logs under path (a file or a directory, recursively)
+void load_run(Run& run, const string& path){
+    namespace fs = boost::filesystem;
+    auto files = vector<string>();
+    if (fs::is_directory(path)){
+        for (auto it = fs::recursive_directory_iterator(path); it != fs::recursive_directory_iterator(); ++ it)
+            if (fs::is_regular_file(it->path())) files.push_back(it->path().string());
+    }
+    else if (fs::exists(path)) files.push_back(path);
+    error_if_not(not files.empty(), "no logs in %s\n", path.c_str());
+    sort(files.begin(), files.end());
+    auto loaded = 0;
+    for (auto& filename : files){
+        auto name = fs::path(filename).filename().string();
+        auto json = ends_with(name, ".json");
+        if (json) name = name.substr(0, name.size() - 5);
+        auto kind = name.find(json ? "_trace" : "_timing");
+        if (kind == string::npos) continue;
+        auto role = name.substr(0, kind);
+        auto v = name.rfind("_v");
+        auto version = (v == string::npos or v < kind) ? string("-") : name.substr(v + 2);
+        if (json) load_trace(run, filename, role, version);
+        else load_timing_log(run, filename, role, version);
+        loaded ++;
+    }
+    message("%s: %d logs, %d stages\n", path.c_str(), loaded, (int)run.size());
+}
+
+// size class of a message size: powers of two in KB
+string size_class(long long size){
+    if (size < 0) return "size ?";
+    if (size < 1024) return "<1KB";
+    auto kb = 1ll;
+    while (kb * 2 * 1024 <= size) kb *= 2;
+    return tostring("%lld-%lldKB", kb, kb * 2);
 }
 
-void print_session_log(){
-    //  timelogs filenames
-    string server_filename = "../log/server_timing_v35";
-    string sender_filename = "../log/sender_timing_v35";
-    string receiver_filename = "../log/receiver_timing_v35";
-    
-    // timelogs structurs (map)
-    map<string,long long> server_log;
-    map<string,long long> sender_log;
-    map<string,long long> receiver_log;
-    
-    // restore log in map
-    restore_timelog(server_log, server_filename);
-    restore_timelog(sender_log, sender_filename);
-    restore_timelog(receiver_log, receiver_filename);
-    
-    cout << "server log:" << endl;
-    print_timelog(server_log);
-    cout << "sender log:" << endl;
-    print_timelog(sender_log);
-    cout << "receiver log:" << endl;
-    print_timelog(receiver_log);
-    
-    cout << "\nserver local stats:" << endl;
-    cout << "-\tserver parsing: " << time_passed(server_log["parse_scene[start]"], server_log["parse_scene[end]"]) << " s" << endl;
-    cout << "-\tserver recive_mesh: " << time_passed(server_log["recive_mesh[start]"], server_log["recive_mesh[end]"]) << " s" << endl;
-    cout << "-\tserver send all: " << time_passed(server_log["send_all[start]"], server_log["send_all[end]"]) << " s" << endl;
-    cout << "\t-\tserver send_client_1: " << time_passed(server_log["send_client_1[start]"], server_log["send_client_1[end]"]) << " s" << endl;
-    cout << "-\tserver deserialize_from_msg: " << time_passed(server_log["deserialize_from_msg[start]"], server_log["deserialize_from_msg[end]"]) << " s" << endl;
-    cout << "-\tserver apply_diff: " << time_passed(server_log["apply_diff[start]"], server_log["apply_diff[end]"]) << " s" << endl;
-    
-    cout << "\nsender local stats:" << endl;
-    cout << "-\tsender parsing: " << time_passed(sender_log["parse_scene[start]"], sender_log["parse_scene[end]"]) << " s" << endl;
-    cout << "-\tsender deserialize_mesh: " << time_passed(sender_log["deserialize_mesh[start]"], sender_log["deserialize_mesh[end]"]) << " s" << endl;
-    cout << "-\tsender apply_diff: " << time_passed(sender_log["apply_diff[start]"], sender_log["apply_diff[end]"]) << " s" << endl;
-    cout << "-\tsender send_mesh: " << time_passed(sender_log["send_mesh[start]"], sender_log["send_mesh[end]"]) << " s" << endl;
-    
-    cout << "\nreceiver local stats:" << endl;
-    cout << "-\treceiver parsing: " << time_passed(receiver_log["parse_scene[start]"], receiver_log["parse_scene[end]"]) << " s" << endl;
-    cout << "-\treceiver recive_mesh: " << time_passed(receiver_log["recive_mesh[start]"], receiver_log["recive_mesh[end]"]) << " s" << endl;
-    cout << "-\treceiver deserialize_from_msg: " << time_passed(receiver_log["deserialize_from_msg[start]"], receiver_log["deserialize_from_msg[end]"]) << " s" << endl;
-    cout << "-\treceiver apply_diff: " << time_passed(receiver_log["apply_diff[start]"], receiver_log["apply_diff[end]"]) << " s" << endl;
-    
-    cout << "\nglobal stats:" << endl;
-    cout << "\tsend -> receive: " << time_passed(sender_log["send_mesh[start]"], receiver_log["recive_mesh[end]"]) << " s" << endl;
-    cout << "\tsender -> server: " << time_passed(sender_log["send_mesh[start]"], server_log["recive_mesh[end]"]) << " s" << endl;
-    cout << "\tserver -> receiver: " << time_passed(server_log["send_client_1[start]"], receiver_log["recive_mesh[end]"]) << " s" << endl;
-    cout << "\tsender_live -> receiver_live: " << time_passed(sender_log["apply_diff[end]"], receiver_log["apply_diff[end]"]) << " s" << endl;
-    cout << "\tmessage size: " << to_kb(sender_log["mesh_size"]) << " kb" << endl;
+// group of a sample
+string group_of(const Sample& sample, bool by_version, bool by_size){
+    auto group = string();
+    if (by_version) group += "v" + sample.version;
+    if (by_size) group += (group.empty() ? "" : " ") + size_class(sample.size);
+    return group.empty() ? "all" : group;
 }
 
-void print_apply_log(const string& filename){
-    // timelogs structurs (map)
-    map<string,long long> app_log;
-    
-    // restore log in map
-    restore_timelog(app_log, filename);
-    
-    cout << "server log:" << endl;
-    print_timelog(app_log);
-    
-    cout << "\ntiming:" << endl;
-    cout << "-\t save_history: " << time_passed(app_log["save_history[start]"], app_log["save_history[end]"]) << " s" << endl;
-    cout << "-\t add_vertex: " << time_passed(app_log["add_vertex[start]"], app_log["add_vertex[end]"]) << " s" << endl;
-    cout << "-\t update_vertex: " << time_passed(app_log["update_vertex[start]"], app_log["update_vertex[end]"]) << " s" << endl;
-    cout << "-\t delete_vertex: " << time_passed(app_log["delete_vertex[start]"], app_log["delete_vertex[end]"]) << " s" << endl;
-    cout << "-\t remove_edges: " << time_passed(app_log["remove_edges[start]"], app_log["remove_edges[end]"]) << " s" << endl;
-    cout << "-\t remove_triangle: " << time_passed(app_log["remove_triangle[start]"], app_log["remove_triangle[end]"]) << " s" << endl;
-    cout << "-\t remove_quad: " << time_passed(app_log["remove_quad[start]"], app_log["remove_quad[end]"]) << " s" << endl;
-    cout << "-\t add_edge: " << time_passed(app_log["add_edge[start]"], app_log["add_edge[end]"]) << " s" << endl;
-    cout << "-\t add_triangle: " << time_passed(app_log["add_triangle[start]"], app_log["add_triangle[end]"]) << " s" << endl;
-    cout << "-\t add_quad: " << time_passed(app_log["add_quad[start]"], app_log["add_quad[end]"]) << " s" << endl;
-    cout << "-\t indexing_vertex: " << time_passed(app_log["indexing_vertex[start]"], app_log["indexing_vertex[end]"]) << " s" << endl;
-    cout << "-\t indexing_triangle: " << time_passed(app_log["indexing_triangle[start]"], app_log["indexing_triangle[end]"]) << " s" << endl;
-    cout << "-\t indexing_quad: " << time_passed(app_log["indexing_quad[start]"], app_log["indexing_quad[end]"]) << " s" << endl;
-    cout << "-\t indexing_edge: " << time_passed(app_log["indexing_edge[start]"], app_log["indexing_edge[end]"]) << " s" << endl;
-    cout << "\n-\t indexing: " << time_passed(app_log["indexing[start]"], app_log["indexing[end]"]) << " s" << endl;
-    cout << "\n-\t apply_diff: " << time_passed(app_log["apply_diff[start]"], app_log["apply_diff[end]"]) << " s" << endl;
+// times of the samples of each group, sorted
+map<string, vector<double>> group_times(const vector<Sample>& samples, bool by_version, bool by_size){
+    auto groups = map<string, vector<double>>();
+    for (auto& sample : samples) groups[group_of(sample, by_version, by_size)].push_back(sample.time);
+    for (auto& group : groups) sort(group.second.begin(), group.second.end());
+    return groups;
+}
+
+// value at fraction p of sorted values (nearest rank)
+double percentile(const vector<double>& sorted, double p){
+    if (sorted.empty()) return 0;
+    auto rank = (int)ceil(p * sorted.size()) - 1;
+    return sorted[max(0, min(rank, (int)sorted.size() - 1))];
+}
 
+// two-sided p-value of the Mann-Whitney U test that a and b come from the same distribution
+// (normal approximation with tie and continuity corrections)
+double mann_whitney_p(const vector<double>& a, const vector<double>& b){
+    auto values = vector<pair<double,int>>();
+    for (auto v : a) values.push_back(make_pair(v, 0));
+    for (auto v : b) values.push_back(make_pair(v, 1));
+    sort(values.begin(), values.end());
+    double n = values.size(), na = a.size(), nb = b.size();
+    auto rank_a = 0.0, ties = 0.0;
+    for (auto i = 0; i < (int)values.size(); ){
+        auto j = i;
+        while (j < (int)values.size() and values[j].first == values[i].first) j ++;
+        auto rank = (i + 1 + j) / 2.0;      // average rank of the tied values
+        for (auto k : range(i, j)) if (values[k].second == 0) rank_a += rank;
+        double t = j - i;
+        ties += t * t * t - t;
+        i = j;
+    }
+    auto u = rank_a - na * (na + 1) / 2;
+    auto mean = na * nb / 2;
+    auto variance = na * nb / 12 * ((n + 1) - ties / (n * (n - 1)));
+    if (variance <= 0) return 1;
+    auto z = (fabs(u - mean) - 0.5) / sqrt(variance);
+    return erfc(max(z, 0.0) / sqrt(2.0));
+}
+
+void print_stats_header(){
+    message("%-40s %-18s %8s %10s %10s %10s %10s %10s\n", "stage (ms)", "group", "samples", "min", "p50", "p90", "p99", "max");
+}
+
+void print_stats(const string& stage, const string& group, const vector<double>& times){
+    message("%-40s %-18s %8d %10.3f %10.3f %10.3f %10.3f %10.3f\n", stage.c_str(), group.c_str(), (int)times.size(),
+            times.front() * 1e3, percentile(times, 0.5) * 1e3, percentile(times, 0.9) * 1e3,
+            percentile(times, 0.99) * 1e3, times.back() * 1e3);
+}
 
+// compares run with baseline stage by stage and group; returns the number of regressions
+int compare_runs(const Run& baseline, const Run& run, const string& filter, bool by_version, bool by_size, double alpha, double threshold){
+    message("\n%-40s %-18s %8s %8s %10s %10s %8s %10s\n", "stage (ms)", "group", "base n", "n", "base p50", "p50", "ratio", "p-value");
+    auto regressions = 0;
+    for (auto& stage : run){
+        if (stage.first.find(filter) == string::npos or not baseline.count(stage.first)) continue;
+        auto base_groups = group_times(baseline.at(stage.first), by_version, by_size);
+        for (auto& group : group_times(stage.second, by_version, by_size)){
+            if (not base_groups.count(group.first)) continue;
+            auto& base = base_groups[group.first];
+            auto& times = group.second;
+            auto base_p50 = percentile(base, 0.5), p50 = percentile(times, 0.5);
+            auto ratio = (base_p50 > 0) ? p50 / base_p50 : 1.0;
+            auto verdict = "";
+            auto p = 1.0;
+            // below 5 samples a side the test cannot reject at the usual levels
+            if (base.size() < 5 or times.size() < 5) verdict = "few samples";
+            else {
+                p = mann_whitney_p(base, times);
+                if (p < alpha and ratio > 1 + threshold) { verdict = "REGRESSION"; regressions ++; }
+                else if (p < alpha and ratio < 1 / (1 + threshold)) verdict = "faster";
+            }
+            message("%-40s %-18s %8d %8d %10.3f %10.3f %7.2fx %10.2g %s\n", stage.first.c_str(), group.first.c_str(),
+                    (int)base.size(), (int)times.size(), base_p50 * 1e3, p50 * 1e3, ratio, p, verdict);
+        }
+    }
+    for (auto& stage : baseline)
+        if (stage.first.find(filter) != string::npos and not run.count(stage.first))
+            message("%-40s missing from the run\n", stage.first.c_str());
+    message("%d regressions (alpha %g, threshold %.0f%%)\n", regressions, alpha, threshold * 100);
+    return regressions;
 }
 
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+                              { "timing_log", "distributions of the stage timings of many sessions",
+                                  {  {"group", "g", "group samples by: none, version, size or version,size", typeid(string), true, jsonvalue("none") },
+                                     {"filter", "n", "only stages whose name contains this", typeid(string), true, jsonvalue("") },
+                                     {"compare", "c", "directory of the baseline logs", typeid(string), true, jsonvalue("") },
+                                     {"alpha", "a", "significance level of the comparison", typeid(double), true, jsonvalue(0.01) },
+                                     {"threshold", "x", "slowdown of the median to report (fraction)", typeid(double), true, jsonvalue(0.05) }  },
+                                  {  {"log_dir", "", "directory (or file) of the timing logs and traces", typeid(string), true, jsonvalue("../log/")}  }
+                              });
+    auto group = args.object_element("group").as_string();
+    auto by_version = group.find("version") != string::npos;
+    auto by_size = group.find("size") != string::npos;
+    auto filter = args.object_element("filter").as_string();
 
-int main(int argc, const char * argv[]) {
-    print_apply_log("../log/apply_timing_v03");
-    cout << "\n----------------------\n";
-    print_apply_log("../log/apply_timing_v05");
-    cout << "\n----------------------\n";
-    print_apply_log("../log/apply_timing_v35");
+    auto run = Run();
+    load_run(run, args.object_element("log_dir").as_string());
+    print_stats_header();
+    for (auto& stage : run){
+        if (stage.first.find(filter) == string::npos) continue;
+        for (auto& times : group_times(stage.second, by_version, by_size)) print_stats(stage.first, times.first, times.second);
+    }
 
-    return 0;
+    if (args.object_element("compare").as_string() == "") return 0;
+    auto baseline = Run();
+    load_run(baseline, args.object_element("compare").as_string());
+    return compare_runs(baseline, run, filter, by_version, by_size,
+                        args.object_element("alpha").as_double(), args.object_element("threshold").as_double()) ? 1 : 0;
 }